@@ -100,7 +100,8 @@ typedef enum {
 
 typedef enum {
     OR_OPTIONS_NONE = 0x00000000,
-    OR_OPTIONS_DONT_DECOMPRESS = 0x00000001 /**< don't decompress */
+    OR_OPTIONS_DONT_DECOMPRESS = 0x00000001, /**< don't decompress */
+    OR_OPTIONS_RECORD_INDEX = 0x00000002 /**< record the decode index */
 
 } or_options;
 
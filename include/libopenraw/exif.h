@@ -157,6 +157,7 @@ typedef	enum {
 	DNG_TAG_CAMERA_CALIBRATION2              = 0xc624,
 	DNG_TAG_REDUCTION_MATRIX1                = 0xc625,
 	DNG_TAG_REDUCTION_MATRIX2                = 0xc626,
+	DNG_TAG_PRIVATE_DATA                     = 0xc634,
 	DNG_TAG_CALIBRATION_ILLUMINANT1          = 0xc65a,
 	DNG_TAG_CALIBRATION_ILLUMINANT2          = 0xc65b,
 
@@ -176,11 +177,22 @@ typedef	enum {
 	RW2_TAG_JPEG_FROM_RAW = 0x002e,
 	RW2_TAG_STRIP_OFFSETS = 0x0118,
 	
+	/* ARW tags */
+	ARW_TAG_TONE_CURVE = 0x7010, /**< in the encrypted SR2SubIFD */
+	ARW_TAG_SR2_SUBIFD_OFFSET = 0x7200, /**< in the SR2Private IFD */
+	ARW_TAG_SR2_SUBIFD_LENGTH = 0x7201,
+	ARW_TAG_SR2_SUBIFD_KEY = 0x7221,
+
 	/* Canon MakerNote tags */
+	MNOTE_CANON_FIRMWARE = 0x0007,
+	MNOTE_CANON_MODEL_ID = 0x0010,
 	MNOTE_CANON_SENSORINFO = 0x00e0,
 	
 	/* Nikon MakerNote tags */
 	MNOTE_NIKON_NEFDECODETABLE2 = 0x96,
+
+	/* Pentax MakerNote tags */
+	MNOTE_PENTAX_HUFFMANTABLE = 0x220,
 	
 	_EXIF_TAG_LAST
 } ExifTag;
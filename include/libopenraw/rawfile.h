@@ -73,6 +73,47 @@ or_error
 or_rawfile_get_rawdata(ORRawFileRef rawfile, ORRawDataRef rawdata, 
 						   uint32_t options);
 
+/** Get the RAW data for a region of the frame.
+ * @param rawfile the raw file.
+ * @param rawdata the raw data to put the region into.
+ * @param options the option bits. OR_OPTIONS_DONT_DECOMPRESS is invalid.
+ * @param x the left of the region.
+ * @param y the top of the region.
+ * @param width the width of the region.
+ * @param height the height of the region.
+ * @return the error code. OR_ERROR_INVALID_PARAM if the region is
+ * not within the frame.
+ * The raw data only hold the region. Tiled DNG only decompress the
+ * tiles that intersect it.
+ */
+or_error
+or_rawfile_get_rawdata_region(ORRawFileRef rawfile, ORRawDataRef rawdata,
+                              uint32_t options, uint32_t x, uint32_t y,
+                              uint32_t width, uint32_t height);
+
+/** Get the decode index, recorded when getting the RAW data with
+ * OR_OPTIONS_RECORD_INDEX. It can be saved along the file to
+ * decode it faster the next time.
+ * @param rawfile the raw file.
+ * @param size where to return the size of the index.
+ * @return the index data, owned by the raw file and valid until the
+ * next call. NULL if there is none.
+ */
+const uint8_t *
+or_rawfile_get_decode_index(ORRawFileRef rawfile, uint32_t *size);
+
+/** Set a decode index saved for the file. Getting the RAW data then
+ * decompresses in parallel, and a region only where needed.
+ * @param rawfile the raw file.
+ * @param index the index data.
+ * @param size the size of the index data.
+ * @return the error code. OR_ERROR_INVALID_PARAM if the data isn't
+ * an index.
+ */
+or_error
+or_rawfile_set_decode_index(ORRawFileRef rawfile, const uint8_t *index,
+                            uint32_t size);
+
 /** Get the rendered image from the raw file 
  * @param rawfile the raw file.
  * @param rawdata the preallocated bitmap data.
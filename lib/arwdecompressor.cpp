@@ -0,0 +1,386 @@
+/*
+ * libopenraw - arwdecompressor.cpp
+ *
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "rawdata.hpp"
+#include "endianutils.hpp"
+#include "parallel.hpp"
+#include "arwdecompressor.hpp"
+
+/* The SIMD kernels, selected at runtime on x86. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ARW_HAVE_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON) \
+    && !defined(__ARM_BIG_ENDIAN)
+#define ARW_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace OpenRaw {
+namespace Internals {
+
+/* A block codes 16 pixels of a colour in 128 bits, little endian:
+   the max and min values on 11 bits, their index on 4 bits, then
+   the 14 deltas to the min on 7 bits. */
+#define ARW_BLOCK_SIZE 16
+#define ARW_BLOCK_PIXELS 16
+#define ARW_BLOCK_DELTAS 14
+#define ARW_VALUE_MAX 0x7ff
+
+namespace {
+
+/** The header of a block. */
+struct ArwBlock
+{
+    explicit ArwBlock(const uint8_t *dp)
+        {
+            uint32_t val = (uint32_t)EL32(dp);
+            max = val & ARW_VALUE_MAX;
+            min = (val >> 11) & ARW_VALUE_MAX;
+            imax = (val >> 22) & 0x0f;
+            imin = (val >> 26) & 0x0f;
+            // the deltas are scaled to cover max - min, that can be
+            // negative.
+            for (sh = 0; sh < 4 && (0x80 << sh) <= (int)max - (int)min;
+                 sh++) {
+            }
+        }
+
+    unsigned max;
+    unsigned min;
+    unsigned imax;
+    unsigned imin;
+    unsigned sh;
+};
+
+/** The value of the delta k of the block.
+ * @param next the byte after the block: when imax == imin there are
+ * 15 deltas, and the last one is past the block.
+ */
+inline uint16_t arwValue(const uint8_t *dp, unsigned k,
+                         const ArwBlock & block, uint8_t next)
+{
+    unsigned bit = 30 + 7 * k;
+    unsigned byte = bit >> 3;
+    unsigned v = byte < ARW_BLOCK_SIZE ? dp[byte] : next;
+    if (byte + 1 < ARW_BLOCK_SIZE) {
+        v |= dp[byte + 1] << 8;
+    }
+    else if (byte + 1 == ARW_BLOCK_SIZE) {
+        v |= next << 8;
+    }
+    v = (((v >> (bit & 7)) & 0x7f) << block.sh) + block.min;
+    return std::min(v, (unsigned)ARW_VALUE_MAX);
+}
+
+/** Compute the ARW_BLOCK_DELTAS values of the deltas of each block,
+ * to the first values of ARW_BLOCK_PIXELS per block in values.
+ * @return the number of blocks done.
+ */
+typedef size_t (*ArwKernel)(const uint8_t *src, size_t blocks,
+                            uint16_t *values);
+
+size_t arw_values_none(const uint8_t *, size_t, uint16_t *)
+{
+    return 0;
+}
+
+#if ARW_HAVE_X86
+
+/* Each 16-bits word gets the 2 bytes holding its delta. */
+#define ARW_SHUFFLE_LO 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 9, 10
+#define ARW_SHUFFLE_HI 10, 11, 11, 12, 12, 13, 13, 14, 14, 15, 15, -1, \
+        -1, -1, -1, -1
+/* Multiplying by 1 << (7 - shift) puts the delta at bit 7: the shift
+   of each delta in its word is 6, 5, ... 0, 7 then again. */
+#define ARW_MUL_LO 2, 4, 8, 16, 32, 64, 128, 1
+#define ARW_MUL_HI 2, 4, 8, 16, 32, 64, 0, 0
+
+__attribute__((target("ssse3")))
+inline __m128i arw_deltas_ssse3(__m128i v, __m128i shuffle, __m128i mul)
+{
+    v = _mm_mullo_epi16(_mm_shuffle_epi8(v, shuffle), mul);
+    return _mm_and_si128(_mm_srli_epi16(v, 7), _mm_set1_epi16(0x7f));
+}
+
+__attribute__((target("ssse3")))
+size_t arw_values_ssse3(const uint8_t *src, size_t blocks,
+                        uint16_t *values)
+{
+    const __m128i shuffle_lo = _mm_setr_epi8(ARW_SHUFFLE_LO);
+    const __m128i shuffle_hi = _mm_setr_epi8(ARW_SHUFFLE_HI);
+    const __m128i mul_lo = _mm_setr_epi16(ARW_MUL_LO);
+    const __m128i mul_hi = _mm_setr_epi16(ARW_MUL_HI);
+    const __m128i value_max = _mm_set1_epi16(ARW_VALUE_MAX);
+    for (size_t b = 0; b < blocks; b++) {
+        const uint8_t *dp = src + b * ARW_BLOCK_SIZE;
+        ArwBlock block(dp);
+        __m128i v = _mm_loadu_si128((const __m128i*)dp);
+        __m128i sh = _mm_cvtsi32_si128(block.sh);
+        __m128i min = _mm_set1_epi16(block.min);
+        __m128i lo = arw_deltas_ssse3(v, shuffle_lo, mul_lo);
+        __m128i hi = arw_deltas_ssse3(v, shuffle_hi, mul_hi);
+        lo = _mm_min_epi16(_mm_add_epi16(_mm_sll_epi16(lo, sh), min),
+                           value_max);
+        hi = _mm_min_epi16(_mm_add_epi16(_mm_sll_epi16(hi, sh), min),
+                           value_max);
+        uint16_t *dest = values + b * ARW_BLOCK_PIXELS;
+        _mm_storeu_si128((__m128i*)dest, lo);
+        _mm_storeu_si128((__m128i*)(dest + 8), hi);
+    }
+    return blocks;
+}
+
+/* Two blocks at a time, one per lane. */
+__attribute__((target("avx2")))
+size_t arw_values_avx2(const uint8_t *src, size_t blocks,
+                       uint16_t *values)
+{
+    const __m256i shuffle_lo = _mm256_setr_epi8(ARW_SHUFFLE_LO,
+                                                ARW_SHUFFLE_LO);
+    const __m256i shuffle_hi = _mm256_setr_epi8(ARW_SHUFFLE_HI,
+                                                ARW_SHUFFLE_HI);
+    const __m256i mul_lo = _mm256_setr_epi16(ARW_MUL_LO, ARW_MUL_LO);
+    const __m256i mul_hi = _mm256_setr_epi16(ARW_MUL_HI, ARW_MUL_HI);
+    const __m256i mask = _mm256_set1_epi16(0x7f);
+    const __m256i value_max = _mm256_set1_epi16(ARW_VALUE_MAX);
+    size_t b = 0;
+    for (; b + 2 <= blocks; b += 2) {
+        const uint8_t *dp = src + b * ARW_BLOCK_SIZE;
+        ArwBlock block0(dp);
+        ArwBlock block1(dp + ARW_BLOCK_SIZE);
+        __m256i v = _mm256_loadu_si256((const __m256i*)dp);
+        __m256i scale = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_set1_epi16(1 << block0.sh)),
+            _mm_set1_epi16(1 << block1.sh), 1);
+        __m256i min = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_set1_epi16(block0.min)),
+            _mm_set1_epi16(block1.min), 1);
+        __m256i lo = _mm256_mullo_epi16(_mm256_shuffle_epi8(v, shuffle_lo),
+                                        mul_lo);
+        __m256i hi = _mm256_mullo_epi16(_mm256_shuffle_epi8(v, shuffle_hi),
+                                        mul_hi);
+        lo = _mm256_and_si256(_mm256_srli_epi16(lo, 7), mask);
+        hi = _mm256_and_si256(_mm256_srli_epi16(hi, 7), mask);
+        lo = _mm256_min_epi16(_mm256_add_epi16(_mm256_mullo_epi16(lo, scale),
+                                               min), value_max);
+        hi = _mm256_min_epi16(_mm256_add_epi16(_mm256_mullo_epi16(hi, scale),
+                                               min), value_max);
+        uint16_t *dest = values + b * ARW_BLOCK_PIXELS;
+        _mm256_storeu_si256((__m256i*)dest,
+                            _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i*)(dest + ARW_BLOCK_PIXELS),
+                            _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    return b + arw_values_ssse3(src + b * ARW_BLOCK_SIZE, blocks - b,
+                                values + b * ARW_BLOCK_PIXELS);
+}
+
+#elif ARW_HAVE_NEON
+
+size_t arw_values_neon(const uint8_t *src, size_t blocks,
+                       uint16_t *values)
+{
+    // the indices past 15 give 0.
+    static const uint8_t shuffle[2][16] = {
+        { 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 9, 10 },
+        { 10, 11, 11, 12, 12, 13, 13, 14, 14, 15, 15, 0xff,
+          0xff, 0xff, 0xff, 0xff }
+    };
+    static const int16_t shift[2][8] = {
+        { -6, -5, -4, -3, -2, -1, 0, -7 },
+        { -6, -5, -4, -3, -2, -1, 0, 0 }
+    };
+    const uint8x16_t index_lo = vld1q_u8(shuffle[0]);
+    const uint8x16_t index_hi = vld1q_u8(shuffle[1]);
+    const int16x8_t shift_lo = vld1q_s16(shift[0]);
+    const int16x8_t shift_hi = vld1q_s16(shift[1]);
+    const uint16x8_t mask = vdupq_n_u16(0x7f);
+    const uint16x8_t value_max = vdupq_n_u16(ARW_VALUE_MAX);
+    for (size_t b = 0; b < blocks; b++) {
+        const uint8_t *dp = src + b * ARW_BLOCK_SIZE;
+        ArwBlock block(dp);
+        uint8x16_t v = vld1q_u8(dp);
+        int16x8_t sh = vdupq_n_s16(block.sh);
+        uint16x8_t min = vdupq_n_u16(block.min);
+        uint16x8_t lo = vandq_u16(
+            vshlq_u16(vreinterpretq_u16_u8(vqtbl1q_u8(v, index_lo)),
+                      shift_lo), mask);
+        uint16x8_t hi = vandq_u16(
+            vshlq_u16(vreinterpretq_u16_u8(vqtbl1q_u8(v, index_hi)),
+                      shift_hi), mask);
+        uint16_t *dest = values + b * ARW_BLOCK_PIXELS;
+        vst1q_u16(dest, vminq_u16(vaddq_u16(vshlq_u16(lo, sh), min),
+                                  value_max));
+        vst1q_u16(dest + 8, vminq_u16(vaddq_u16(vshlq_u16(hi, sh), min),
+                                      value_max));
+    }
+    return blocks;
+}
+
+#endif
+
+/* Select the kernel for the CPU we run on. */
+ArwKernel select_kernel()
+{
+#if ARW_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &arw_values_avx2;
+    }
+    else if (__builtin_cpu_supports("ssse3")) {
+        return &arw_values_ssse3;
+    }
+#elif ARW_HAVE_NEON
+    return &arw_values_neon;
+#endif
+    return &arw_values_none;
+}
+
+ArwKernel kernel()
+{
+    static const ArwKernel k = select_kernel();
+    return k;
+}
+
+/** Decode a row of w bytes to w pixels. The blocks alternate between
+ * the even and the odd pixels of 32.
+ * @param values the storage for the values of the blocks.
+ */
+void decodeRow(const uint8_t *src, uint32_t w, const uint16_t *curve,
+               std::vector<uint16_t> & values, uint16_t *out)
+{
+    size_t blocks = 0;
+    for (int col = 0; col < (int)w - 30; blocks++) {
+        col += 2 * ARW_BLOCK_PIXELS;
+        col -= (col & 1) ? 1 : 31;
+    }
+    values.resize(blocks * ARW_BLOCK_PIXELS);
+    size_t done = kernel()(src, blocks, values.data());
+
+    for (size_t b = 0; b < blocks; b++) {
+        const uint8_t *dp = src + b * ARW_BLOCK_SIZE;
+        ArwBlock block(dp);
+        uint8_t next = (b + 1) * ARW_BLOCK_SIZE < w ? dp[ARW_BLOCK_SIZE] : 0;
+        uint16_t *v = values.data() + b * ARW_BLOCK_PIXELS;
+        if (b >= done || block.imax == block.imin) {
+            for (unsigned k = 0; k < ARW_BLOCK_DELTAS + 1; k++) {
+                v[k] = arwValue(dp, k, block, next);
+            }
+        }
+        uint16_t *dest = out + (b & ~1) * ARW_BLOCK_PIXELS + (b & 1);
+        for (unsigned i = 0, k = 0; i < ARW_BLOCK_PIXELS; i++) {
+            unsigned value;
+            if (i == block.imax) {
+                value = block.max;
+            }
+            else if (i == block.imin) {
+                value = block.min;
+            }
+            else {
+                value = v[k++];
+            }
+            dest[i * 2] = curve[value];
+        }
+    }
+}
+
+}
+
+ArwDecompressor::ArwDecompressor(const uint8_t *buffer, size_t size,
+                                 RawContainer * container,
+                                 uint32_t w, uint32_t h,
+                                 const uint16_t *tone_curve)
+    : Decompressor(NULL, container)
+    , m_buffer(buffer)
+    , m_size(size)
+    , m_h(h)
+    , m_w(w)
+    , m_curve(ARW_VALUE_MAX + 1)
+{
+    // the curve is linear by parts, the slope doubling at each
+    // of the 4 points of the tone curve.
+    unsigned points[6] = { 0, 0, 0, 0, 0, 4095 };
+    if (tone_curve) {
+        for (int i = 0; i < 4; i++) {
+            points[i + 1] = (tone_curve[i] >> 2) & 0xfff;
+        }
+    }
+    std::vector<uint16_t> curve(4096);
+    for (size_t i = 0; i < curve.size(); i++) {
+        curve[i] = i;
+    }
+    for (int i = 0; i < 5; i++) {
+        for (unsigned j = points[i] + 1; j <= points[i + 1]; j++) {
+            curve[j] = curve[j - 1] + (1 << i);
+        }
+    }
+    // the 11 bits values index every other entry.
+    for (size_t i = 0; i < m_curve.size(); i++) {
+        m_curve[i] = curve[i << 1] >> 2;
+    }
+}
+
+RawData *ArwDecompressor::decompress(RawData *in)
+{
+    RawData *output;
+    if (in) {
+        output = in;
+    } else {
+        output = new RawData;
+    }
+
+    uint16_t *out = (uint16_t*)output->allocData((size_t)m_w * m_h * 2);
+    memset(out, 0, (size_t)m_w * m_h * 2);
+    // the rows that are complete.
+    const uint32_t rows = m_w ? std::min<size_t>(m_h, m_size / m_w) : 0;
+    parallelFor(rows, [&] (size_t row) {
+            std::vector<uint16_t> values;
+            decodeRow(m_buffer + row * m_w, m_w, m_curve.data(), values,
+                      out + row * m_w);
+        });
+
+    uint16_t white = *std::max_element(m_curve.begin(), m_curve.end());
+    uint16_t bpc = 12;
+    while ((white >> bpc) != 0) {
+        bpc++;
+    }
+    output->setBpc(bpc);
+    output->setWhiteLevel(white);
+
+    return output;
+}
+
+}
+}
+/*
+  Local Variables:
+  mode:c++
+  c-file-style:"stroustrup"
+  c-file-offsets:((innamespace . 0))
+  indent-tabs-mode:nil
+  fill-column:80
+  End:
+*/
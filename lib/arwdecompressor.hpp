@@ -0,0 +1,69 @@
+/* -*- Mode: C++ -*- */
+/*
+ * libopenraw - arwdecompressor.hpp
+ *
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef OR_INTERNALS_ARWDECOMPRESSOR_H_
+#define OR_INTERNALS_ARWDECOMPRESSOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "decompressor.hpp"
+
+namespace OpenRaw {
+
+class RawData;
+
+namespace Internals {
+
+class RawContainer;
+
+/** Decompress the Sony ARW2 data: each row is in blocks of 16 bytes,
+ * coding 16 pixels of a colour as the max, the min and 7-bit
+ * deltas. The values then go through the tone curve.
+ * The rows are decoded in parallel.
+ */
+class ArwDecompressor
+  : public Decompressor
+{
+public:
+  /** @param tone_curve the 4 values of the SonyToneCurve tag, or
+   * NULL for the default curve.
+   */
+  ArwDecompressor(const uint8_t *buffer, size_t size,
+                  RawContainer * container, uint32_t w, uint32_t h,
+                  const uint16_t *tone_curve);
+  virtual RawData *decompress(RawData *in = NULL) override;
+private:
+  const uint8_t *m_buffer;
+  size_t m_size;
+
+  uint32_t m_h;
+  uint32_t m_w;
+  /** the output value of each 11 bits value */
+  std::vector<uint16_t> m_curve;
+};
+
+}
+}
+#endif
@@ -19,9 +19,20 @@
  */
 
 
+#include <string.h>
+
+#include <vector>
+
 #include <libopenraw/cameraids.h>
 
+#include "rawdata.hpp"
+#include "trace.hpp"
+#include "ifd.hpp"
+#include "ifdentry.hpp"
 #include "ifdfilecontainer.hpp"
+#include "endianutils.hpp"
+#include "arwdecompressor.hpp"
+#include "unpack.hpp"
 #include "arwfile.hpp"
 #include "rawfile_private.hpp"
 
@@ -194,12 +205,186 @@ IfdDir::Ref  ArwFile::_locateMainIfd()
 {
     if(isA100())
     {
-        // TODO implement for A100
-        return OR_ERROR_NOT_FOUND;
+        return _getA100RawData(data);
     }
     return TiffEpFile::_getRawData(data, options);
 }
 
+::or_error ArwFile::_getA100RawData(RawData & data)
+{
+    const IfdDir::Ref & _cfaIfd = cfaIfd();
+    uint32_t x = 0;
+    uint32_t y = 0;
+    uint32_t offset = 0;
+    uint32_t byte_length = 0;
+    if(!_cfaIfd
+       || !_cfaIfd->getIntegerValue(IFD::EXIF_TAG_IMAGE_WIDTH, x)
+       || !_cfaIfd->getIntegerValue(IFD::EXIF_TAG_IMAGE_LENGTH, y)
+       || !_cfaIfd->getIntegerValue(IFD::EXIF_TAG_STRIP_OFFSETS, offset)
+       || !_cfaIfd->getIntegerValue(IFD::EXIF_TAG_STRIP_BYTE_COUNTS,
+                                    byte_length)) {
+        Trace(ERROR) << "A100 raw data not found\n";
+        return OR_ERROR_NOT_FOUND;
+    }
+    // 12 bits samples packed from the MSB. Less data is the Huffman
+    // coded ARW1, that we don't decode.
+    Unpack unpack(x, IFD::COMPRESS_NONE, 12);
+    size_t stored_size = unpack.block_size() * y;
+    if(y == 0 || byte_length < stored_size) {
+        Trace(ERROR) << "A100 data isn't 12 bits packed\n";
+        return OR_ERROR_INVALID_FORMAT;
+    }
+    std::vector<uint16_t> stored((size_t)x * y);
+    size_t fetched = 0;
+    ::or_error ret = unpack.unpack_strip(m_container, offset, stored_size,
+                                         (uint8_t*)stored.data(),
+                                         stored.size() * 2, fetched);
+    if(ret != OR_ERROR_NONE) {
+        return ret;
+    }
+    if(fetched < stored_size) {
+        Trace(WARNING) << "Size mismatch for data: ignoring.\n";
+    }
+
+    // the even rows are stored first, then the odd rows.
+    uint16_t *out = (uint16_t*)data.allocData(stored.size() * 2);
+    uint32_t half = (y + 1) / 2;
+    for(uint32_t row = 0; row < y; row++) {
+        uint32_t stored_row = (row & 1) ? half + row / 2 : row / 2;
+        memcpy(out + (size_t)row * x, stored.data() + (size_t)stored_row * x,
+               x * 2);
+    }
+    data.setDataType(OR_DATA_TYPE_RAW);
+    data.setCompression(IFD::COMPRESS_NONE);
+    data.setCfaPatternType(_getCfaPatternFromDir(_cfaIfd));
+    data.setBpc(12);
+    data.setWhiteLevel((1 << 12) - 1);
+    data.setDimensions(x, y);
+    return OR_ERROR_NONE;
+}
+
+namespace {
+
+/** Decrypt the data in place, as 32-bits big endian words XORed with
+ * a pad generated from the key.
+ */
+void sonyDecrypt(uint8_t *data, size_t words, uint32_t key)
+{
+    uint32_t pad[128];
+    unsigned p;
+    for(p = 0; p < 4; p++) {
+        pad[p] = key = key * 48828125 + 1;
+    }
+    pad[3] = pad[3] << 1 | (pad[0] ^ pad[2]) >> 31;
+    for(p = 4; p < 127; p++) {
+        pad[p] = (pad[p - 4] ^ pad[p - 2]) << 1
+            | (pad[p - 3] ^ pad[p - 1]) >> 31;
+    }
+    for(size_t i = 0; i < words; i++, data += 4) {
+        p++;
+        pad[(p - 1) & 127] = pad[p & 127] ^ pad[(p + 64) & 127];
+        uint32_t v = (uint32_t)BE32(data) ^ pad[(p - 1) & 127];
+        data[0] = v >> 24;
+        data[1] = v >> 16;
+        data[2] = v >> 8;
+        data[3] = v;
+    }
+}
+
+}
+
+bool ArwFile::_getToneCurve(uint16_t curve[4])
+{
+    const IfdDir::Ref & _mainIfd = mainIfd();
+    IfdEntry::Ref e;
+    if(_mainIfd) {
+        e = _mainIfd->getEntry(IFD::DNG_TAG_PRIVATE_DATA);
+    }
+    if(!e) {
+        return false;
+    }
+    // the private data points to the SR2Private IFD, that locates
+    // the SR2SubIFD.
+    IfdDir::Ref sr2(new IfdDir(e->offset(), *m_container));
+    if(!sr2->load()) {
+        return false;
+    }
+    uint32_t offset = 0;
+    uint32_t length = 0;
+    IfdEntry::Ref key = sr2->getEntry(IFD::ARW_TAG_SR2_SUBIFD_KEY);
+    if(!key || !sr2->getIntegerValue(IFD::ARW_TAG_SR2_SUBIFD_OFFSET, offset)
+       || !sr2->getIntegerValue(IFD::ARW_TAG_SR2_SUBIFD_LENGTH, length)) {
+        return false;
+    }
+    std::vector<uint8_t> buf(length & ~3);
+    if(buf.size() < 2
+       || m_container->fetchData(buf.data(), offset, buf.size())
+       < buf.size()) {
+        return false;
+    }
+    sonyDecrypt(buf.data(), buf.size() / 4, key->offset());
+
+    // the offsets of the decrypted IFD are in the file.
+    bool big_endian = m_container->endian() == RawContainer::ENDIAN_BIG;
+    auto get16 = [big_endian] (const uint8_t *p) -> uint16_t {
+        return big_endian ? BE16(p) : EL16(p);
+    };
+    uint16_t num_entries = get16(buf.data());
+    for(size_t i = 0; i < num_entries; i++) {
+        size_t pos = 2 + i * 12;
+        if(pos + 12 > buf.size()) {
+            break;
+        }
+        const uint8_t *entry = buf.data() + pos;
+        if(get16(entry) != IFD::ARW_TAG_TONE_CURVE
+           || get16(entry + 2) != IFD::EXIF_FORMAT_SHORT) {
+            continue;
+        }
+        uint32_t value = big_endian ? BE32(entry + 8) : EL32(entry + 8);
+        if(value < offset || value - offset + 8 > buf.size()) {
+            return false;
+        }
+        for(int c = 0; c < 4; c++) {
+            curve[c] = get16(buf.data() + value - offset + c * 2);
+        }
+        return true;
+    }
+    return false;
+}
+
+::or_error ArwFile::_decompressIfNeeded(RawData & data, uint32_t options)
+{
+    // ARW2 has 8 bits per pixel. The Huffman coded ARW1 is left as is:
+    // it is one stream coding the columns from the bottom, so it can't
+    // be split in rows, and only a few early models write it.
+    uint16_t bpc = 0;
+    uint32_t x = data.width();
+    uint32_t y = data.height();
+    if((options & OR_OPTIONS_DONT_DECOMPRESS)
+       || data.compression() != ARW_RAW_COMPRESSION
+       || !cfaIfd()->getValue(IFD::EXIF_TAG_BITS_PER_SAMPLE, bpc)
+       || bpc != 8 || data.size() < (size_t)x * y) {
+        return OR_ERROR_NONE;
+    }
+    uint16_t tone_curve[4];
+    bool has_curve = _getToneCurve(tone_curve);
+    if(!has_curve) {
+        Trace(DEBUG1) << "No tone curve, using the default\n";
+    }
+    ArwDecompressor decomp((const uint8_t*)data.data(), data.size(),
+                           m_container, x, y,
+                           has_curve ? tone_curve : nullptr);
+    RawData *dData = decomp.decompress(nullptr);
+    if (dData) {
+        dData->setCfaPatternType(data.cfaPattern()->patternType());
+        data.swap(*dData);
+        data.setDataType(OR_DATA_TYPE_RAW);
+        data.setDimensions(x, y);
+        delete dData;
+    }
+    return OR_ERROR_NONE;
+}
+
 }
 }
 /*
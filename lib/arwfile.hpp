@@ -58,7 +58,15 @@ protected:
     virtual IfdDir::Ref  _locateMainIfd() override;
 
     virtual ::or_error _getRawData(RawData & data, uint32_t options) override;
+    virtual ::or_error _decompressIfNeeded(RawData&, uint32_t) override;
 private:
+    /** Get the A100 raw data: 12 bits packed, in two fields. */
+    ::or_error _getA100RawData(RawData & data);
+    /** Get the SonyToneCurve from the encrypted SR2SubIFD.
+     * @retval curve the 4 values of the curve.
+     * @return false if not found.
+     */
+    bool _getToneCurve(uint16_t curve[4]);
     // first version of ARW. Different from the rest.
     bool isA100()
         {
@@ -19,73 +19,37 @@
  * <http://www.gnu.org/licenses/>.
  */
 
-#include <assert.h>
-#include <algorithm>
 #include "bititerator.hpp"
 
 namespace OpenRaw {
 namespace Internals {
 
 BitIterator::BitIterator(const uint8_t * const p, size_t size)
-    : m_p(p)
+    : m_start(p)
+    , m_p(p)
     , m_size(size)
+    , m_padding(0)
     , m_bitBuffer(0)
     , m_bitsOnBuffer(0)
 
 {
 }
 
-void BitIterator::load(size_t numBits)
+void BitIterator::loadSlow()
 {
-    size_t numBytes = (numBits + 7) / 8;
-
-    //align the bits on the right
-    m_bitBuffer >>= (32 - m_bitsOnBuffer);
-
-    m_bitsOnBuffer += 8 * numBytes;
-
-    //load the new bits from the right
-    for (size_t i = 0; i < numBytes && m_size > 0; ++i) {
-        m_bitBuffer = (m_bitBuffer << 8) | *m_p;
-        ++m_p;
-        m_size--;
-    }
-
-    //align the bits on the left
-    m_bitBuffer = m_bitBuffer << (32 - m_bitsOnBuffer);
-}
-
-uint32_t BitIterator::get(size_t n)
-{
-	uint32_t ret = peek(n);
-
-	skip(n);
-
-	return ret;
-}
-
-uint32_t BitIterator::peek(size_t n)
-{
-	assert(n <= 25);
-	
-	if (n == 0)
-		return 0;
-	
-	if (n > m_bitsOnBuffer)
-		load(n - m_bitsOnBuffer);
-	
-	assert(n <= m_bitsOnBuffer);
-	
-	return m_bitBuffer >> (32 - n);
-}
-
-void BitIterator::skip(size_t n)
-{
-	size_t num_bits = std::min(n, m_bitsOnBuffer);
-	m_bitsOnBuffer -= num_bits;
-	m_bitBuffer <<= num_bits;
+	// the last bytes, one at a time.
+	while (m_bitsOnBuffer <= 56 && m_size > 0) {
+		m_bitBuffer |= (uint64_t)*m_p << (56 - m_bitsOnBuffer);
+		m_bitsOnBuffer += 8;
+		++m_p;
+		m_size--;
+	}
+	if (m_size == 0) {
+		// pad with 0.
+		m_padding += 64 - m_bitsOnBuffer;
+		m_bitsOnBuffer = 64;
+	}
 }
 
-	
 }
 }
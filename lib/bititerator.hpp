@@ -22,25 +22,84 @@
 #ifndef OR_INTERNAL_BITITERATOR_H_
 #define OR_INTERNAL_BITITERATOR_H_
 
+#include <assert.h>
 #include <stdint.h>
 #include <stddef.h>
 
 namespace OpenRaw {
 namespace Internals {
 
+/** Read a big endian bitstream, MSB first.
+ * The bits are held in a 64-bit buffer, aligned on the left, that is
+ * loaded 8 bytes at once. Past the end of the data, the bits are 0.
+ */
 class BitIterator {
-    const uint8_t* m_p;
-    size_t m_size;
+	const uint8_t* const m_start;
+	const uint8_t* m_p;
+	size_t m_size;
+	/** The 0 bits loaded past the end. */
+	uint64_t m_padding;
 
-    uint32_t m_bitBuffer;
-    size_t m_bitsOnBuffer;
-    void load(size_t numBits);
+	uint64_t m_bitBuffer;
+	size_t m_bitsOnBuffer;
+	void load()
+		{
+			if (m_size < 8) {
+				loadSlow();
+				return;
+			}
+			uint64_t v = ((uint64_t)m_p[0] << 56)
+				| ((uint64_t)m_p[1] << 48)
+				| ((uint64_t)m_p[2] << 40)
+				| ((uint64_t)m_p[3] << 32)
+				| ((uint64_t)m_p[4] << 24)
+				| ((uint64_t)m_p[5] << 16)
+				| ((uint64_t)m_p[6] << 8)
+				| (uint64_t)m_p[7];
+			// only the whole bytes that fit.
+			size_t numBytes = (64 - m_bitsOnBuffer) / 8;
+			v &= ~(uint64_t)0 << (64 - numBytes * 8);
+			m_bitBuffer |= v >> m_bitsOnBuffer;
+			m_bitsOnBuffer += numBytes * 8;
+			m_p += numBytes;
+			m_size -= numBytes;
+		}
+	void loadSlow();
 
 public:
-    BitIterator(const uint8_t *p, size_t s);
-    uint32_t get(size_t);
-    uint32_t peek(size_t);
-    void skip(size_t);
+	BitIterator(const uint8_t *p, size_t s);
+	uint32_t get(size_t n)
+		{
+			uint32_t ret = peek(n);
+			skip(n);
+			return ret;
+		}
+	/** peek up to 32 bits */
+	uint32_t peek(size_t n)
+		{
+			assert(n <= 32);
+			if (n == 0) {
+				return 0;
+			}
+			if (n > m_bitsOnBuffer) {
+				load();
+			}
+			return m_bitBuffer >> (64 - n);
+		}
+	void skip(size_t n)
+		{
+			assert(n <= 32);
+			if (n > m_bitsOnBuffer) {
+				n = m_bitsOnBuffer;
+			}
+			m_bitsOnBuffer -= n;
+			m_bitBuffer <<= n;
+		}
+	/** The number of bits read, including the 0 past the end. */
+	uint64_t bitPos() const
+		{
+			return (uint64_t)(m_p - m_start) * 8 + m_padding - m_bitsOnBuffer;
+		}
 };
 
 }
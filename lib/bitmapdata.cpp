@@ -120,6 +120,9 @@ void BitmapData::setDataType(BitmapData::DataType _type)
 void *BitmapData::allocData(const size_t s)
 {
     Trace(DEBUG1) << "allocate s=" << s << " data =" << d->data << "\n";
+    if (d->data) {
+        free(d->data);
+    }
     d->data = calloc(s, 1);
     Trace(DEBUG1) << " data =" << d->data << "\n";
     d->data_size = s;
@@ -127,6 +127,39 @@ or_error or_rawfile_get_rawdata(ORRawFileRef rawfile, ORRawDataRef rawdata,
     return prawfile->getRawData(*reinterpret_cast<RawData *>(rawdata), options);
 }
 
+or_error or_rawfile_get_rawdata_region(ORRawFileRef rawfile,
+                                       ORRawDataRef rawdata,
+                                       uint32_t options,
+                                       uint32_t x, uint32_t y,
+                                       uint32_t width, uint32_t height)
+{
+    RawFile *prawfile = reinterpret_cast<RawFile *>(rawfile);
+    CHECK_PTR(rawfile, OR_ERROR_NOTAREF);
+    CHECK_PTR(rawdata, OR_ERROR_NOTAREF);
+    return prawfile->getRawData(*reinterpret_cast<RawData *>(rawdata),
+                                options, x, y, width, height);
+}
+
+const uint8_t *or_rawfile_get_decode_index(ORRawFileRef rawfile,
+                                           uint32_t *size)
+{
+    RawFile *prawfile = reinterpret_cast<RawFile *>(rawfile);
+    CHECK_PTR(rawfile, NULL);
+    CHECK_PTR(size, NULL);
+    const std::vector<uint8_t> & index = prawfile->getDecodeIndex();
+    *size = index.size();
+    return index.empty() ? NULL : index.data();
+}
+
+or_error or_rawfile_set_decode_index(ORRawFileRef rawfile,
+                                     const uint8_t *index, uint32_t size)
+{
+    RawFile *prawfile = reinterpret_cast<RawFile *>(rawfile);
+    CHECK_PTR(rawfile, OR_ERROR_NOTAREF);
+    CHECK_PTR(index, OR_ERROR_INVALID_PARAM);
+    return prawfile->setDecodeIndex(index, size);
+}
+
 or_error or_rawfile_get_rendered_image(ORRawFileRef rawfile,
                                        ORBitmapDataRef bitmapdata,
                                        uint32_t options)
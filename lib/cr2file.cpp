@@ -32,13 +32,15 @@
 #include "rawfile.hpp"
 #include "cfapattern.hpp"
 #include "trace.hpp"
-#include "io/memstream.hpp"
+#include "io/prefetchstream.hpp"
 #include "ifdfilecontainer.hpp"
 #include "ifdentry.hpp"
 #include "makernotedir.hpp"
 #include "cr2file.hpp"
+#include "decodeindex.hpp"
 #include "jfifcontainer.hpp"
 #include "ljpegdecompressor.hpp"
+#include "srawinterpolator.hpp"
 #include "rawfile_private.hpp"
 
 using namespace Debug;
@@ -336,6 +338,40 @@ IfdDir::Ref Cr2File::_locateMainIfd()
 }
 
 ::or_error Cr2File::_getRawData(RawData &data, uint32_t options)
+{
+    return _getCfaData(data, options, 0, 0, 0, 0);
+}
+
+RawData *Cr2File::_interpolateSRaw(RawData *frame, uint32_t h, uint32_t v,
+                                   uint32_t model_id,
+                                   const std::string & firmware,
+                                   uint32_t x, uint32_t y,
+                                   uint32_t width, uint32_t height)
+{
+    Trace(DEBUG1) << "sRAW sampling " << h << "x" << v << " model id "
+                  << model_id << "\n";
+
+    SRawInterpolator interpolator(model_id, firmware, h, v);
+    RawData *rgb = new RawData;
+    if (!interpolator.interpolate(*frame, x, y, width, height, *rgb)) {
+        Trace(DEBUG1) << "Invalid sRAW frame or region\n";
+        delete rgb;
+        rgb = NULL;
+    }
+    delete frame;
+    return rgb;
+}
+
+::or_error Cr2File::_getRawDataRegion(RawData &data, uint32_t options,
+                                      uint32_t x, uint32_t y,
+                                      uint32_t width, uint32_t height)
+{
+    return _getCfaData(data, options, x, y, width, height);
+}
+
+::or_error Cr2File::_getCfaData(RawData &data, uint32_t options,
+                                uint32_t x, uint32_t y,
+                                uint32_t width, uint32_t height)
 {
     ::or_error ret = OR_ERROR_NONE;
     const IfdDir::Ref &_cfaIfd = cfaIfd();
@@ -368,37 +404,57 @@ IfdDir::Ref Cr2File::_locateMainIfd()
 
     const IfdDir::Ref &_exifIfd = exifIfd();
     if (_exifIfd) {
-        uint16_t x, y;
-        x = 0;
-        y = 0;
-        got_it = _exifIfd->getValue(IFD::EXIF_TAG_PIXEL_X_DIMENSION, x);
+        uint16_t dim_x, dim_y;
+        dim_x = 0;
+        dim_y = 0;
+        got_it = _exifIfd->getValue(IFD::EXIF_TAG_PIXEL_X_DIMENSION, dim_x);
         if (!got_it) {
             Trace(DEBUG1) << "X not found\n";
             return OR_ERROR_NOT_FOUND;
         }
-        got_it = _exifIfd->getValue(IFD::EXIF_TAG_PIXEL_Y_DIMENSION, y);
+        got_it = _exifIfd->getValue(IFD::EXIF_TAG_PIXEL_Y_DIMENSION, dim_y);
         if (!got_it) {
             Trace(DEBUG1) << "Y not found\n";
             return OR_ERROR_NOT_FOUND;
         }
 
-        void *p = data.allocData(byte_length);
-        size_t real_size = m_container->fetchData(p, offset, byte_length);
-        if (real_size < byte_length) {
-            Trace(WARNING) << "Size mismatch for data: ignoring.\n";
-        }
         // they are not all RGGB.
         // but I don't seem to see where this is encoded.
         //
         data.setCfaPatternType(OR_CFA_PATTERN_RGGB);
         data.setDataType(OR_DATA_TYPE_COMPRESSED_RAW);
-        data.setDimensions(x, y);
+        data.setDimensions(dim_x, dim_y);
 
         Trace(DEBUG1) << "In size is " << data.width() << "x" << data.height()
                       << "\n";
-        // decompress if we need
+        // The data is only loaded if it isn't decompressed. The
+        // decompressor loads the scan itself when it decodes it in
+        // parallel, or from the decode index.
+        DecodeIndex & index = _decodeIndex();
+        bool recordIndex = (options & OR_OPTIONS_RECORD_INDEX) != 0;
+        bool sraw = false;
+        if (options & OR_OPTIONS_DONT_DECOMPRESS) {
+            void *p = data.allocData(byte_length);
+            size_t real_size = m_container->fetchData(p, offset, byte_length);
+            if (real_size < byte_length) {
+                Trace(WARNING) << "Size mismatch for data: ignoring.\n";
+            }
+        }
         if ((options & OR_OPTIONS_DONT_DECOMPRESS) == 0) {
-            IO::Stream::Ptr s(new IO::MemStream(data.data(), data.size()));
+            // the sRAW conversion depends on the camera, and its
+            // firmware. They are read before the data is read ahead
+            // from the same file.
+            uint32_t model_id = 0;
+            std::string firmware;
+            const MakerNoteDir::Ref &_makerNoteIfd = makerNoteIfd();
+            if (_makerNoteIfd) {
+                _makerNoteIfd->getValue(IFD::MNOTE_CANON_MODEL_ID, model_id);
+                _makerNoteIfd->getValue(IFD::MNOTE_CANON_FIRMWARE, firmware);
+            }
+            // decompress while the data is read ahead: the compressed
+            // data is never loaded at once.
+            IO::Stream::Ptr s(new IO::PrefetchStream(m_container->file(),
+                                                     offset, byte_length));
             s->open(); // TODO check success
             std::unique_ptr<JfifContainer> jfif(new JfifContainer(s, 0));
             LJpegDecompressor decomp(s.get(), jfif.get());
@@ -407,27 +463,55 @@ IfdDir::Ref Cr2File::_locateMainIfd()
             if (slices.size() > 1) {
                 decomp.setSlices(slices);
             }
+            if (width) {
+                decomp.setRegion(x, y, width, height);
+            }
+            if (recordIndex || !index.empty()) {
+                decomp.setDecodeIndex(&index, recordIndex);
+            }
             RawData *dData = decomp.decompress();
+            sraw = dData && decomp.hSampling() * decomp.vSampling() > 1;
+            if (sraw) {
+                // the sRAW and mRAW luma and chroma go to RGB.
+                dData = _interpolateSRaw(dData, decomp.hSampling(),
+                                         decomp.vSampling(),
+                                         model_id, firmware,
+                                         x, y, width, height);
+                if (!dData) {
+                    return OR_ERROR_INVALID_PARAM;
+                }
+            }
+            if (width && dData
+                && (dData->width() != width || dData->height() != height)) {
+                Trace(DEBUG1) << "Region out of the frame\n";
+                delete dData;
+                return OR_ERROR_INVALID_PARAM;
+            }
             if (dData != NULL) {
                 Trace(DEBUG1) << "Out size is " << dData->width() << "x"
                               << dData->height() << "\n";
                 // must re-set the cfaPattern
-                dData->setCfaPatternType(data.cfaPattern()->patternType());
+                if (!sraw) {
+                    dData->setCfaPatternType(data.cfaPattern()->patternType());
+                }
                 data.swap(*dData);
                 delete dData;
             }
         }
 
-        // get the sensor info
+        // get the sensor info. The RGB of the sRAW is all visible.
         std::vector<uint16_t> sensorInfo;
         const IfdDir::Ref &_makerNoteIfd = makerNoteIfd();
         e = _makerNoteIfd->getEntry(IFD::MNOTE_CANON_SENSORINFO);
-        if (e) {
+        if (e && !sraw) {
             e->getArray(sensorInfo);
             uint32_t w = sensorInfo[7] - sensorInfo[5];
             uint32_t h = sensorInfo[8] - sensorInfo[6];
             data.setRoi(sensorInfo[5], sensorInfo[6], w, h);
         }
+        if (width && !sraw) {
+            _setRegionRoi(data, x, y, width, height);
+        }
     } else {
         Trace(ERROR) << "unable to find ExifIFD\n";
         ret = OR_ERROR_NOT_FOUND;
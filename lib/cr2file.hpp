@@ -24,6 +24,8 @@
 
 #include <stdint.h>
 
+#include <string>
+
 #include <libopenraw/consts.h>
 
 #include "rawfile.hpp"
@@ -52,6 +54,28 @@ protected:
     virtual IfdDir::Ref  _locateMainIfd() override;
 private:
     virtual ::or_error _getRawData(RawData & data, uint32_t options) override;
+    virtual ::or_error _getRawDataRegion(RawData & data, uint32_t options,
+                                         uint32_t x, uint32_t y,
+                                         uint32_t width,
+                                         uint32_t height) override;
+    /** get the RAW data, only the region x, y, width x height
+     * if width isn't 0. */
+    ::or_error _getCfaData(RawData & data, uint32_t options,
+                           uint32_t x, uint32_t y,
+                           uint32_t width, uint32_t height);
+    /** Convert the decoded sRAW frame to RGB, only the region
+     * x, y, width x height if width isn't 0.
+     * @param frame the decoded frame. It is deleted.
+     * @param h, v the luma sampling.
+     * @param model_id, firmware from the MakerNote, read before
+     * decompressing as the file may be read ahead while it is.
+     * @return the RGB data, or NULL.
+     */
+    RawData *_interpolateSRaw(RawData *frame, uint32_t h, uint32_t v,
+                              uint32_t model_id,
+                              const std::string & firmware,
+                              uint32_t x, uint32_t y,
+                              uint32_t width, uint32_t height);
 
     static const IfdFile::camera_ids_t s_def[];
 };
@@ -31,6 +31,9 @@
 #include <fcntl.h>
 #include <string.h>
 
+#include <algorithm>
+#include <vector>
+
 #include <libopenraw/consts.h>
 #include <libopenraw/debug.h>
 
@@ -38,7 +41,12 @@
 #include "crwdecompressor.hpp"
 #include "exception.hpp"
 #include "trace.hpp"
+#include "unpack.hpp"
+#include "speculative.hpp"
+#include "parallel.hpp"
+#include "decodeindex.hpp"
 #include "io/stream.hpp"
+#include "io/memstream.hpp"
 
 namespace OpenRaw {	namespace Internals {
 
@@ -48,7 +56,7 @@ CrwDecompressor::CrwDecompressor(IO::Stream * stream,
       m_table(0),
       m_height(0), m_width(0),
       m_free(0), m_leaf(0),
-      m_bitbuf(0), m_vbits(0)
+      m_index(NULL), m_recordIndex(false)
 {
 }
 
@@ -203,144 +211,436 @@ void CrwDecompressor::init_tables(uint32_t table_idx)
     memset(m_second_decode, 0, sizeof(m_second_decode));
     make_decoder(m_first_decode,  first_tree[table_idx], 0);
     make_decoder(m_second_decode, second_tree[table_idx], 0);
+    make_lookup(m_first_lookup, m_first_decode);
+    make_lookup(m_second_lookup, m_second_decode);
 }
 
 /*
-  getbits(-1) initializes the buffer
-  getbits(n) where 0 <= n <= 25 returns an n-bit integer
+  Read the bitstream, MSB first, from memory. Each 0xff byte is
+  always followed by a 00 that is skipped. Past the end of the data,
+  the bits are 0.
 */
-uint32_t CrwDecompressor::getbits(IO::Stream * s, int nbits)
+class CrwDecompressor::BitReader
 {
-    uint32_t ret = 0;
-    uint8_t c;
-		
-    if (nbits == 0) 
-        return 0;
-    if (nbits == -1)
-        ret = m_bitbuf = m_vbits = 0;
-    else {
-        ret = m_bitbuf << (32 - m_vbits) >> (32 - nbits);
-        m_vbits -= nbits;
-    }
-    while (m_vbits < 25) {
-        try {
-            c = s->readByte();
-            m_bitbuf = (m_bitbuf << 8) + c;
-            if (c == 0xff) 
-                s->readByte();	/* always extra 00 after ff */
-            m_vbits += 8;
+public:
+    BitReader(const uint8_t *p, size_t size)
+        : m_start(p), m_p(p), m_end(p + size), m_buffer(0), m_bits(0)
+        , m_skipped(0), m_padding(0)
+        {
         }
-        catch(const Internals::IOException &)
+
+    /* peek 1 to 32 bits */
+    uint32_t peek(int nbits)
         {
-            break;
+            if (nbits > m_bits) {
+                fill();
+            }
+            return m_buffer >> (64 - nbits);
+        }
+    void skip(int nbits)
+        {
+            m_buffer <<= nbits;
+            m_bits -= nbits;
+        }
+    uint32_t get(int nbits)
+        {
+            if (nbits == 0) {
+                return 0;
+            }
+            uint32_t ret = peek(nbits);
+            skip(nbits);
+            return ret;
+        }
+    /* the number of bits read, without the skipped bytes, including
+       the 0 past the end */
+    uint64_t bitPos() const
+        {
+            return (uint64_t)(m_p - m_start - m_skipped) * 8 + m_padding
+                - m_bits;
+        }
+
+private:
+    void fill()
+        {
+            if (m_end - m_p >= 8) {
+                uint64_t v = 0;
+                for (int i = 0; i < 8; i++) {
+                    v = (v << 8) | m_p[i];
+                }
+                // without a 0xff, load all the whole bytes that fit.
+                uint64_t ff = ~v;
+                ff = (ff - 0x0101010101010101ULL) & ~ff
+                    & 0x8080808080808080ULL;
+                if (ff == 0) {
+                    int bytes = (64 - m_bits) / 8;
+                    m_buffer |= (v & (~0ULL << (64 - bytes * 8))) >> m_bits;
+                    m_bits += bytes * 8;
+                    m_p += bytes;
+                    return;
+                }
+            }
+            while (m_bits <= 56) {
+                if (m_p >= m_end) {
+                    m_padding += 64 - m_bits;
+                    m_bits = 64;
+                    break;
+                }
+                uint8_t c = *m_p++;
+                m_buffer |= (uint64_t)c << (56 - m_bits);
+                m_bits += 8;
+                if (c == 0xff) {
+                    m_p++;
+                    m_skipped++;
+                }
+            }
+        }
+
+    const uint8_t *m_start;
+    const uint8_t *m_p;
+    const uint8_t *m_end;
+    uint64_t m_buffer;
+    int m_bits;
+    size_t m_skipped;
+    uint64_t m_padding;
+};
+
+/*
+  the maximum code length decoded with a single lookup.
+*/
+#define CRW_LOOKUP_BITS 12
+
+/*
+  Build the lookup of the codes of a decode tree, by walking it for
+  each value of the next bits. The longer codes are marked 0 and
+  decoded by walking the tree.
+*/
+void CrwDecompressor::make_lookup(lookup_t &lookup, const decode_t *tree)
+{
+    lookup.tree = tree;
+    lookup.bits = CRW_LOOKUP_BITS;
+    lookup.codes.assign(1 << lookup.bits, 0);
+    for (uint32_t code = 0; code < lookup.codes.size(); code++) {
+        const decode_t *dindex = tree;
+        unsigned int len = 0;
+        while (dindex->branch[0] && len < lookup.bits) {
+            dindex = dindex->branch[(code >> (lookup.bits - 1 - len)) & 1];
+            len++;
+        }
+        if (!dindex->branch[0]) {
+            lookup.codes[code] = (dindex->leaf << 5) | len;
         }
     }
-    return ret;
+}
+
+/*
+  Decode the next leaf. The codes are at most 16 bits.
+*/
+inline int CrwDecompressor::decode(BitReader &bits, const lookup_t &lookup)
+{
+    uint16_t entry = lookup.codes[bits.peek(lookup.bits)];
+    if (entry) {
+        bits.skip(entry & 0x1f);
+        return entry >> 5;
+    }
+    uint32_t code = bits.peek(16);
+    const decode_t *dindex = lookup.tree;
+    int len = 0;
+    while (dindex->branch[0] && len < 16) {
+        dindex = dindex->branch[(code >> (15 - len)) & 1];
+        len++;
+    }
+    bits.skip(len);
+    return dindex->leaf;
+}
+
+/*
+  Decode the differences of a block of 64 pixels. The first one is
+  relative to the first of the block before.
+*/
+void CrwDecompressor::decodeBlock(BitReader &bits, int16_t *diffs) const
+{
+    memset(diffs, 0, 64 * sizeof(int16_t));
+    const lookup_t *lookup = &m_first_lookup;
+    for (int i = 0; i < 64; i++) {
+
+        int leaf = decode(bits, *lookup);
+        lookup = &m_second_lookup;
+
+        if (leaf == 0 && i)
+            break;
+        if (leaf == 0xff)
+            continue;
+        i  += leaf >> 4;
+        int len = leaf & 15;
+        if (len == 0)
+            continue;
+        int diff = bits.get(len);
+        if ((diff & (1 << (len-1))) == 0)
+            diff -= (1 << len) - 1;
+        if (i < 64)
+            diffs[i] = diff;
+    }
 }
 
 namespace {
 
 static
-int canon_has_lowbits(IO::Stream * s)
+int canon_has_lowbits(const uint8_t *data, size_t size)
 {
-    uint8_t test[0x4000 - 26];
     int ret=1;
-    uint32_t i;
-		
-    s->seek (0, SEEK_SET);
-    s->read (test, sizeof(test));
-    for (i=514; i < sizeof(test) - 1; i++)
-        if (test[i] == 0xff) {
-            if (test[i+1]) 
+    size_t i;
+
+    size = std::min(size, (size_t)0x4000 - 26);
+    for (i=514; i + 1 < size; i++)
+        if (data[i] == 0xff) {
+            if (data[i+1])
                 return 1;
             ret=0;
         }
     return ret;
 }
 
+/*
+  Add up the differences of the block at the pixel column: the first
+  one to the first of the block before, the others to the pixel two
+  on the left, from 512 at the start of a row. The state is that
+  first value, and the last of each colour.
+*/
+static
+void put_block(const int16_t *diffs, int state[3], uint32_t column,
+               uint32_t pixels, uint32_t width, uint16_t *out)
+{
+    state[0] += diffs[0];
+    // the image may not end on a whole block.
+    uint32_t count = std::min(pixels - column, 64U);
+    for (uint32_t i = 0; i < count; i++) {
+        if ((column + i) % width == 0)
+            state[1] = state[2] = 512;
+        out[column + i] = ( state[1 + (i & 1)] += i ? diffs[i] : state[0] );
+    }
+}
+
+}
+
+void CrwDecompressor::setDecodeIndex(DecodeIndex *index, bool record)
+{
+    m_index = index;
+    m_recordIndex = record;
+}
+
+/*
+  The block of the checkpoint of a row: the first block that starts
+  in the row, or after.
+*/
+uint32_t CrwDecompressor::checkpointBlock(uint32_t row) const
+{
+    return ((uint64_t)row * m_width + 63) / 64;
+}
+
+/*
+  Decode the blocks [startBlock, endBlock). If recording, add a
+  checkpoint to the index every interval rows, with the state of
+  put_block(). The data is where the bits start: the offset of a
+  checkpoint is found past the skipped bytes.
+*/
+void CrwDecompressor::decodeBlocks(const uint8_t *data, size_t size,
+                                   BitReader &bits, uint32_t startBlock,
+                                   uint32_t endBlock, int state[3],
+                                   uint16_t *out, bool record)
+{
+    const uint32_t pixels = m_width * m_height;
+    const uint32_t interval = record ? m_index->interval() : 0;
+    uint32_t nextRow = interval;
+    // the offset of the byte read next, and its position in the
+    // bytes read.
+    size_t offset = 0;
+    uint64_t bytes = 0;
+    int16_t diffs[64];
+    for (uint32_t block = startBlock; block < endBlock; block++) {
+        if (interval && nextRow < m_height
+            && checkpointBlock(nextRow) == block) {
+            uint64_t pos = bits.bitPos();
+            for (; bytes < pos / 8 && offset < size; bytes++) {
+                offset += data[offset] == 0xff ? 2 : 1;
+            }
+            // not past the end of the data.
+            if (offset < size) {
+                DecodeIndex::Checkpoint checkpoint;
+                checkpoint.row = nextRow;
+                checkpoint.offset = offset;
+                checkpoint.bit = pos % 8;
+                for (int i = 0; i < 3; i++) {
+                    checkpoint.state.push_back(state[i]);
+                }
+                m_index->add(std::move(checkpoint));
+            }
+            // the narrow images have rows without a block.
+            while (nextRow < m_height && checkpointBlock(nextRow) <= block) {
+                nextRow += interval;
+            }
+        }
+        decodeBlock(bits, diffs);
+        put_block(diffs, state, block * 64, pixels, m_width, out);
+    }
+}
+
+/*
+  Decode the bands of blocks between the checkpoints of the index, in
+  parallel. The values of the state are kept modulo 16 bits, like the
+  pixels.
+*/
+bool CrwDecompressor::decompressIndexed(const uint8_t *data, size_t size,
+                                        uint16_t *out)
+{
+    const std::vector<DecodeIndex::Checkpoint> &checkpoints
+        = m_index->checkpoints();
+    const uint32_t blocks = (m_width * m_height + 63) / 64;
+    uint32_t lastBlock = 0;
+    for (const auto & checkpoint : checkpoints) {
+        if (checkpoint.state.size() != 3 || checkpoint.offset >= size
+            || checkpoint.bit >= 8 || checkpoint.row >= m_height
+            || checkpointBlock(checkpoint.row) <= lastBlock
+            || checkpointBlock(checkpoint.row) >= blocks) {
+            Debug::Trace(DEBUG1) << "Decode index doesn't fit the data\n";
+            return false;
+        }
+        lastBlock = checkpointBlock(checkpoint.row);
+    }
+
+    parallelFor(checkpoints.size() + 1, [&](size_t i) {
+            uint32_t startBlock = i ? checkpointBlock(checkpoints[i - 1].row)
+                : 0;
+            uint32_t endBlock = i < checkpoints.size()
+                ? checkpointBlock(checkpoints[i].row) : blocks;
+            int state[3] = { 0, 0, 0 };
+            size_t offset = 0;
+            if (i) {
+                const DecodeIndex::Checkpoint &checkpoint = checkpoints[i - 1];
+                for (int j = 0; j < 3; j++) {
+                    state[j] = (int16_t)checkpoint.state[j];
+                }
+                offset = checkpoint.offset;
+            }
+            BitReader bits(data + offset, size - offset);
+            if (i) {
+                bits.get(checkpoints[i - 1].bit);
+            }
+            decodeBlocks(data, size, bits, startBlock, endBlock, state, out,
+                         false);
+        });
+    return true;
 }
 
 
 //	int oldmain(int argc, char **argv)
 RawData *CrwDecompressor::decompress(RawData *in)
 {
-    decode_t *decode, *dindex;
-    int i, j, leaf, len, diff, diffbuf[64], r, save;
-    int carry = 0, base[2] = {0, 0};
-    uint32_t  column = 0;
-    uint16_t outbuf[64];
-    uint8_t c;
+    // the decoder reads from memory.
+    std::vector<uint8_t> buffer;
+    const uint8_t *data;
+    off_t size = m_stream->filesize();
+    if (size < 0) {
+        Debug::Trace(ERROR) << "Can't get the CRW data size\n";
+        return NULL;
+    }
+    IO::MemStream *memStream = dynamic_cast<IO::MemStream*>(m_stream);
+    if (memStream) {
+        data = static_cast<const uint8_t*>(memStream->data());
+    }
+    else {
+        buffer.resize(size);
+        m_stream->seek(0, SEEK_SET);
+        if (m_stream->read(buffer.data(), size) != size) {
+            Debug::Trace(ERROR) << "Can't read the CRW data\n";
+            return NULL;
+        }
+        data = buffer.data();
+    }
 
     RawData *bitmap = in ? in : new RawData();
 
+    int lowbits = canon_has_lowbits(data, size);
+    Debug::Trace(DEBUG2) << "lowbits = " << lowbits
+                         << " height = " << m_height
+                         << " width = " << m_width
+                         << "\n";
+
     bitmap->setDataType(OR_DATA_TYPE_RAW);
-    // we know the 10-bits are hardcoded in the CRW
-    bitmap->setBpc(10);
-    bitmap->setWhiteLevel((1 << 10) - 1);
-    uint8_t *rawbuf = (uint8_t*)bitmap->allocData(m_width
-                                                  * sizeof(uint16_t)
-                                                  * m_height);
+    // we know the 10-bits are hardcoded in the CRW, 12 with the low bits.
+    uint16_t bpc = lowbits ? 12 : 10;
+    bitmap->setBpc(bpc);
+    bitmap->setWhiteLevel((1 << bpc) - 1);
+    uint16_t *rawbuf = (uint16_t*)bitmap->allocData(m_width
+                                                    * sizeof(uint16_t)
+                                                    * m_height);
     bitmap->setDimensions(m_width,
                           m_height);
+    const uint32_t pixels = m_width * m_height;
 
     init_tables(m_table);
 
-    int lowbits = canon_has_lowbits(m_stream);
-    Debug::Trace(DEBUG2) << "lowbits = " << lowbits
-                         << " height = " << m_height
-                         << " width = " << m_width
-                         << "\n";
-    m_stream->seek(514 + lowbits*m_height*m_width/4, SEEK_SET);
-    getbits(m_stream, -1);			/* Prime the bit buffer */
-
-    while (column < m_width * m_height) {
-        memset(diffbuf,0,sizeof(diffbuf));
-        decode = m_first_decode;
-        for (i=0; i < 64; i++ ) {
-
-            for (dindex=decode; dindex->branch[0]; )
-                dindex = dindex->branch[getbits(m_stream, 1)];
-            leaf = dindex->leaf;
-            decode = m_second_decode;
-
-            if (leaf == 0 && i)
-                break;
-            if (leaf == 0xff)
-                continue;
-            i  += leaf >> 4;
-            len = leaf & 15;
-            if (len == 0)
-                continue;
-            diff = getbits(m_stream, len);
-            if ((diff & (1 << (len-1))) == 0)
-                diff -= (1 << len) - 1;
-            if (i < 64)
-                diffbuf[i] = diff;
-        }
-        diffbuf[0] += carry;
-        carry = diffbuf[0];
-        for (i=0; i < 64; i++ ) {
-            if (column++ % m_width == 0)
-                base[0] = base[1] = 512;
-            outbuf[i] = ( base[i & 1] += diffbuf[i] );
+    size_t offset = std::min((size_t)size,
+                             514 + (size_t)lowbits * pixels / 4);
+    const uint8_t *bitstream = data + offset;
+    const size_t length = size - offset;
+    const uint32_t blocks = (pixels + 63) / 64;
+    bool decoded = false;
+    if (m_index) {
+        DecodeIndex::Scan scan;
+        scan.offset = offset;
+        scan.size = length;
+        scan.hash = DecodeIndex::hash(bitstream, length);
+        decoded = m_index->matches(scan, m_width, m_height)
+            && decompressIndexed(bitstream, length, rawbuf);
+        // recording is done serially.
+        if (!decoded && m_recordIndex) {
+            m_index->reset(scan, m_width, m_height);
+            BitReader bits(bitstream, length);
+            int state[3] = { 0, 0, 0 };
+            decodeBlocks(bitstream, length, bits, 0, blocks, state, rawbuf,
+                         true);
+            decoded = true;
         }
-        if (lowbits) {
-            save = m_stream->seek(0, SEEK_CUR);
-            m_stream->seek((column-64)/4, SEEK_SET);
-            for (i=j=0; j < 64/4; j++ ) {
-                c = m_stream->readByte();
-                for (r = 0; r < 8; r += 2) {
-                    // outbuf is 64, so we must check for it to not
-                    // overflow (read out of bounds)
-                    uint16_t next = i < 63 ? outbuf[i+1] : 0;
-                    outbuf[i] = (next << 2) + ((c >> r) & 3);
-                    i++;
+    }
+
+    // the blocks are decoded on several threads if the data is large
+    // enough, then the differences are added up in order.
+    if (!decoded) {
+        int state[3] = { 0, 0, 0 };
+        uint32_t block = 0;
+        decoded = decodeSpeculative<BitReader, int16_t>(
+            bitstream, length, true, blocks,
+            [] (const uint8_t *p, size_t len) {
+                return BitReader(p, len);
+            },
+            [this] (BitReader &bits, std::vector<int16_t> &values) {
+                size_t n = values.size();
+                values.resize(n + 64);
+                decodeBlock(bits, values.data() + n);
+            },
+            [&] (const int16_t *values, size_t count) {
+                for (size_t n = 0; n < count; n++, block++) {
+                    put_block(values + n * 64, state, block * 64, pixels,
+                              m_width, rawbuf);
                 }
-            }
-            m_stream->seek(save, SEEK_SET);
+            });
+    }
+    if (!decoded) {
+        BitReader bits(bitstream, length);
+        int state[3] = { 0, 0, 0 };
+        decodeBlocks(bitstream, length, bits, 0, blocks, state, rawbuf,
+                     false);
+    }
+
+    if (lowbits) {
+        // the low bits are at the start of the data, in pixel order,
+        // 4 pixels per byte. The pixels past the whole bytes get 0.
+        uint16_t *out = (uint16_t*)bitmap->data();
+        size_t bytes = std::min((size_t)pixels / 4, (size_t)size);
+        merge_lowbits2(out, data, bytes);
+        for (size_t n = bytes * 4; n < pixels; n++) {
+            out[n] <<= 2;
         }
-        memcpy(rawbuf, outbuf, 2 * 64);
-        rawbuf += 2 * 64;
     }
     return bitmap;
 }
@@ -25,6 +25,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <vector>
+
 #include "decompressor.hpp"
 
 namespace OpenRaw {
@@ -38,6 +40,7 @@ class Stream;
 namespace Internals {
 
 class RawContainer;
+class DecodeIndex;
 
 class CrwDecompressor : public Decompressor {
 public:
@@ -57,15 +60,37 @@ public:
         m_height = y;
         m_width = x;
     }
+    /** Set the index of checkpoints in the data.
+     * @param index the index. If it was recorded for this data, the
+     * blocks are decoded in bands from the checkpoints, in parallel.
+     * @param record whether to record the index otherwise.
+     */
+    void setDecodeIndex(DecodeIndex *index, bool record);
 
 private:
+    class BitReader;
     struct decode_t {
         decode_t *branch[2];
         int leaf;
     };
+    /** The codes of a decode tree, for a lookup of the next bits:
+     * the leaf << 5 | the code length, or 0 if the code is longer.
+     */
+    struct lookup_t {
+        const decode_t *tree;
+        unsigned int bits;
+        std::vector<uint16_t> codes;
+    };
 
-    uint32_t getbits(IO::Stream *s, int nbits);
     void make_decoder(decode_t *dest, const uint8_t *source, int level);
+    static void make_lookup(lookup_t &lookup, const decode_t *tree);
+    static int decode(BitReader &bits, const lookup_t &lookup);
+    void decodeBlock(BitReader &bits, int16_t *diffs) const;
+    uint32_t checkpointBlock(uint32_t row) const;
+    void decodeBlocks(const uint8_t *data, size_t size, BitReader &bits,
+                      uint32_t startBlock, uint32_t endBlock, int state[3],
+                      uint16_t *out, bool record);
+    bool decompressIndexed(const uint8_t *data, size_t size, uint16_t *out);
     void init_tables(uint32_t table_idx);
 
     uint32_t m_table;
@@ -73,12 +98,14 @@ private:
 
     decode_t m_first_decode[32];
     decode_t m_second_decode[512];
+    lookup_t m_first_lookup;
+    lookup_t m_second_lookup;
     // for make_decoder
     decode_t *m_free; /* Next unused node */
     int m_leaf;       /* no. of leaves already added */
-    // for getbits
-    uint32_t m_bitbuf;
-    int m_vbits;
+
+    DecodeIndex *m_index;
+    bool m_recordIndex;
 };
 }
 }
@@ -41,6 +41,7 @@
 #include "ciffcontainer.hpp"
 #include "jfifcontainer.hpp"
 #include "crwdecompressor.hpp"
+#include "decodeindex.hpp"
 #include "rawfile_private.hpp"
 
 using namespace Debug;
@@ -243,6 +244,11 @@ RawContainer* CRWFile::getContainer() const
 
             decomp.setOutputDimensions(cfa_x, cfa_y);
             decomp.setDecoderTable(decoderTable);
+            DecodeIndex & index = _decodeIndex();
+            bool recordIndex = (options & OR_OPTIONS_RECORD_INDEX) != 0;
+            if (recordIndex || !index.empty()) {
+                decomp.setDecodeIndex(&index, recordIndex);
+            }
             RawData *dData = decomp.decompress();
             if (dData != NULL) {
                 Trace(DEBUG1) << "Out size is " << dData->width()
@@ -0,0 +1,238 @@
+/*
+ * libopenraw - decodeindex.cpp
+ *
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include <algorithm>
+#include <iterator>
+
+#include "decodeindex.hpp"
+
+namespace OpenRaw {
+namespace Internals {
+
+/*
+ * The serialized index is little endian:
+ *  - the magic "ORDI" and the version (u32)
+ *  - the interval, the data offset (u64), size (u64) and hash,
+ *    the samples per row and the number of rows
+ *  - the number of checkpoints, then for each: the row,
+ *    the offset (u64), the bit (u8), the number of predictors
+ *    and the predictors (u16)
+ * Unless specified, values are u32.
+ */
+static const uint8_t INDEX_MAGIC[4] = { 'O', 'R', 'D', 'I' };
+#define INDEX_VERSION 2
+
+const uint32_t DecodeIndex::DEFAULT_INTERVAL;
+const size_t DecodeIndex::HASHED_BYTES;
+
+namespace {
+
+void put(std::vector<uint8_t> &out, uint64_t v, int bytes)
+{
+    for (int i = 0; i < bytes; i++) {
+        out.push_back(v & 0xff);
+        v >>= 8;
+    }
+}
+
+/** Read little endian values, keeping track of the data left. */
+class IndexReader
+{
+public:
+    IndexReader(const uint8_t *data, size_t size)
+        : m_p(data), m_left(size)
+        {
+        }
+    bool get(uint64_t &v, int bytes)
+        {
+            if (m_left < (size_t)bytes) {
+                return false;
+            }
+            v = 0;
+            for (int i = bytes - 1; i >= 0; i--) {
+                v = (v << 8) | m_p[i];
+            }
+            m_p += bytes;
+            m_left -= bytes;
+            return true;
+        }
+    bool get32(uint32_t &v)
+        {
+            uint64_t v64;
+            if (!get(v64, 4)) {
+                return false;
+            }
+            v = v64;
+            return true;
+        }
+    size_t left() const
+        {
+            return m_left;
+        }
+private:
+    const uint8_t *m_p;
+    size_t m_left;
+};
+
+}
+
+uint32_t DecodeIndex::hash(const uint8_t *data, size_t size)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    size = std::min(size, HASHED_BYTES);
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ data[i]) * 16777619u;
+    }
+    return h;
+}
+
+DecodeIndex::DecodeIndex()
+    : m_interval(DEFAULT_INTERVAL),
+      m_scan({ 0, 0, 0 }), m_rowSamples(0), m_rows(0)
+{
+}
+
+void DecodeIndex::setInterval(uint32_t rows)
+{
+    m_interval = rows ? rows : DEFAULT_INTERVAL;
+}
+
+bool DecodeIndex::matches(const Scan & scan, uint32_t rowSamples,
+                          uint32_t rows) const
+{
+    return !empty() && m_scan.offset == scan.offset
+        && m_scan.size == scan.size && m_scan.hash == scan.hash
+        && m_rowSamples == rowSamples && m_rows == rows;
+}
+
+void DecodeIndex::reset(const Scan & scan, uint32_t rowSamples,
+                        uint32_t rows)
+{
+    m_checkpoints.clear();
+    m_scan = scan;
+    m_rowSamples = rowSamples;
+    m_rows = rows;
+}
+
+void DecodeIndex::clear()
+{
+    reset({ 0, 0, 0 }, 0, 0);
+}
+
+void DecodeIndex::add(Checkpoint && checkpoint)
+{
+    m_checkpoints.push_back(std::move(checkpoint));
+}
+
+std::vector<uint8_t> DecodeIndex::serialize() const
+{
+    std::vector<uint8_t> out;
+    std::copy_n(INDEX_MAGIC, sizeof(INDEX_MAGIC), std::back_inserter(out));
+    put(out, INDEX_VERSION, 4);
+    put(out, m_interval, 4);
+    put(out, m_scan.offset, 8);
+    put(out, m_scan.size, 8);
+    put(out, m_scan.hash, 4);
+    put(out, m_rowSamples, 4);
+    put(out, m_rows, 4);
+    put(out, m_checkpoints.size(), 4);
+    for (const auto & checkpoint : m_checkpoints) {
+        put(out, checkpoint.row, 4);
+        put(out, checkpoint.offset, 8);
+        put(out, checkpoint.bit, 1);
+        put(out, checkpoint.state.size(), 4);
+        for (auto v : checkpoint.state) {
+            put(out, v, 2);
+        }
+    }
+    return out;
+}
+
+bool DecodeIndex::deserialize(const uint8_t *data, size_t size)
+{
+    clear();
+    if (!data || size < sizeof(INDEX_MAGIC)
+        || memcmp(data, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0) {
+        return false;
+    }
+    IndexReader reader(data + sizeof(INDEX_MAGIC),
+                       size - sizeof(INDEX_MAGIC));
+    uint32_t version, interval, rowSamples, rows, count;
+    Scan scan;
+    if (!reader.get32(version) || version != INDEX_VERSION
+        || !reader.get32(interval)
+        || !reader.get(scan.offset, 8)
+        || !reader.get(scan.size, 8)
+        || !reader.get32(scan.hash)
+        || !reader.get32(rowSamples)
+        || !reader.get32(rows)
+        || !reader.get32(count)) {
+        return false;
+    }
+
+    std::vector<Checkpoint> checkpoints;
+    for (uint32_t i = 0; i < count; i++) {
+        Checkpoint checkpoint;
+        uint64_t bit;
+        uint32_t n;
+        if (!reader.get32(checkpoint.row)
+            || !reader.get(checkpoint.offset, 8)
+            || !reader.get(bit, 1) || bit > 7
+            || !reader.get32(n) || n > reader.left() / 2) {
+            return false;
+        }
+        // checkpoints are in row order.
+        if (checkpoint.row >= rows || checkpoint.offset >= scan.size
+            || (!checkpoints.empty()
+                && checkpoint.row <= checkpoints.back().row)) {
+            return false;
+        }
+        checkpoint.bit = bit;
+        checkpoint.state.resize(n);
+        for (uint32_t j = 0; j < n; j++) {
+            uint64_t v;
+            if (!reader.get(v, 2)) {
+                return false;
+            }
+            checkpoint.state[j] = v;
+        }
+        checkpoints.push_back(std::move(checkpoint));
+    }
+
+    setInterval(interval);
+    reset(scan, rowSamples, rows);
+    m_checkpoints = std::move(checkpoints);
+    return true;
+}
+
+}
+}
+/*
+  Local Variables:
+  mode:c++
+  c-file-style:"stroustrup"
+  c-file-offsets:((innamespace . 0))
+  indent-tabs-mode:nil
+  fill-column:80
+  End:
+*/
@@ -0,0 +1,130 @@
+/* -*- Mode: C++ -*- */
+/*
+ * libopenraw - decodeindex.hpp
+ *
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OR_INTERNALS_DECODEINDEX_H_
+#define OR_INTERNALS_DECODEINDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace OpenRaw {
+namespace Internals {
+
+/** An index of checkpoints in a compressed bitstream, recorded while
+ * decoding it once. Decoding can resume at any checkpoint, to decode
+ * the rows in bands, in parallel, or only the rows needed.
+ * It can be saved, and loaded back for the same file.
+ */
+class DecodeIndex
+{
+public:
+    /** The default number of rows between checkpoints. */
+    static const uint32_t DEFAULT_INTERVAL = 128;
+
+    /** The decoder state at the start of a row. */
+    struct Checkpoint {
+        uint32_t row;    /**< the row decoded next */
+        uint64_t offset; /**< the byte of the next bit, in the data */
+        uint8_t bit;     /**< the bits of that byte already read */
+        /** the predictors, as needed by the decoder */
+        std::vector<uint16_t> state;
+    };
+
+    /** The number of bytes at the start of a bitstream that
+     * are hashed to identify it. */
+    static const size_t HASHED_BYTES = 256;
+
+    /** What identifies a bitstream, so that an index saved for
+     * another file isn't used. */
+    struct Scan {
+        uint64_t offset; /**< where it starts, in the stream */
+        uint64_t size;   /**< its size in bytes */
+        uint32_t hash;   /**< the hash of its first bytes */
+    };
+
+    /** Hash the first HASHED_BYTES of data, at most size. */
+    static uint32_t hash(const uint8_t *data, size_t size);
+
+    DecodeIndex();
+
+    /** The number of rows between checkpoints when recording. */
+    uint32_t interval() const
+        {
+            return m_interval;
+        }
+    void setInterval(uint32_t rows);
+
+    /** Whether the index holds checkpoints for the bitstream
+     * scan decoding to rows of rowSamples samples.
+     */
+    bool matches(const Scan & scan, uint32_t rowSamples,
+                 uint32_t rows) const;
+    /** Remove the checkpoints, to record them for a bitstream. */
+    void reset(const Scan & scan, uint32_t rowSamples, uint32_t rows);
+    void clear();
+    bool empty() const
+        {
+            return m_checkpoints.empty();
+        }
+
+    /** Add a checkpoint. They must be added in row order. */
+    void add(Checkpoint && checkpoint);
+    const std::vector<Checkpoint> & checkpoints() const
+        {
+            return m_checkpoints;
+        }
+    /** The bitstream the checkpoints are for. */
+    const Scan & scan() const
+        {
+            return m_scan;
+        }
+
+    /** Serialize the index, to be saved. */
+    std::vector<uint8_t> serialize() const;
+    /** Load an index saved with serialize().
+     * @return false if the data isn't a valid index. The index
+     * is then empty.
+     */
+    bool deserialize(const uint8_t *data, size_t size);
+
+private:
+    uint32_t m_interval;
+    Scan m_scan;
+    uint32_t m_rowSamples;
+    uint32_t m_rows;
+    std::vector<Checkpoint> m_checkpoints;
+};
+
+}
+}
+
+#endif
+/*
+  Local Variables:
+  mode:c++
+  c-file-style:"stroustrup"
+  c-file-offsets:((innamespace . 0))
+  indent-tabs-mode:nil
+  fill-column:80
+  End:
+*/
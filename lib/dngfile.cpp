@@ -21,6 +21,8 @@
 
 #include <stddef.h>
 
+#include <algorithm>
+
 #include <string>
 #include <memory>
 
@@ -29,12 +31,15 @@
 
 #include "rawdata.hpp"
 #include "trace.hpp"
+#include "exception.hpp"
+#include "parallel.hpp"
 #include "io/memstream.hpp"
 #include "jfifcontainer.hpp"
 #include "ljpegdecompressor.hpp"
 #include "ifd.hpp"
 #include "ifddir.hpp"
 #include "ifdentry.hpp"
+#include "ifdfilecontainer.hpp"
 #include "dngfile.hpp"
 
 using namespace Debug;
@@ -141,6 +146,29 @@ DngFile::~DngFile()
         Trace(DEBUG1) << "cfaIfd is NULL: not found\n";
         return OR_ERROR_NOT_FOUND;
     }
+
+    // the tiles are loaded and decompressed one by one.
+    if ((options & OR_OPTIONS_DONT_DECOMPRESS) == 0
+        && _isTiledLJpeg(_cfaIfd)) {
+        uint32_t x = 0;
+        uint32_t y = 0;
+        uint16_t spp = 1;
+        if (!_cfaIfd->getIntegerValue(IFD::EXIF_TAG_IMAGE_WIDTH, x)
+            || !_cfaIfd->getIntegerValue(IFD::EXIF_TAG_IMAGE_LENGTH, y)) {
+            Trace(DEBUG1) << "dimensions not found\n";
+            return OR_ERROR_NOT_FOUND;
+        }
+        if (!_cfaIfd->getValue(IFD::EXIF_TAG_SAMPLES_PER_PIXEL, spp)
+            || spp == 0) {
+            spp = 1;
+        }
+        ret = _decompressTiles(data, _cfaIfd, 0, 0, x * spp, y);
+        if (ret == OR_ERROR_NONE) {
+            _setDefaultCrop(data, _cfaIfd, 0, 0);
+        }
+        return ret;
+    }
+
     ret = _getRawDataFromDir(data, _cfaIfd);
 
     if(ret != OR_ERROR_NONE) {
@@ -170,8 +198,42 @@ DngFile::~DngFile()
     else {
         data.setDataType(OR_DATA_TYPE_RAW);
     }
+    _setDefaultCrop(data, _cfaIfd, 0, 0);
+
+    return ret;
+}
+
+::or_error DngFile::_getRawDataRegion(RawData & data, uint32_t options,
+                                      uint32_t x, uint32_t y,
+                                      uint32_t width, uint32_t height)
+{
+    const IfdDir::Ref & _cfaIfd = cfaIfd();
+
+    if (!_cfaIfd || !_isTiledLJpeg(_cfaIfd)) {
+        return TiffEpFile::_getRawDataRegion(data, options,
+                                             x, y, width, height);
+    }
+
+    ::or_error ret = _decompressTiles(data, _cfaIfd, x, y, width, height);
+    if (ret == OR_ERROR_NONE) {
+        _setDefaultCrop(data, _cfaIfd, x, y);
+    }
+    return ret;
+}
+
+bool DngFile::_isTiledLJpeg(const IfdDir::Ref & dir)
+{
+    uint16_t compression = 0;
+    return dir->getValue(IFD::EXIF_TAG_COMPRESSION, compression)
+        && compression == IFD::COMPRESS_LJPEG
+        && dir->getEntry(IFD::TIFF_TAG_TILE_OFFSETS);
+}
+
+void DngFile::_setDefaultCrop(RawData & data, const IfdDir::Ref & dir,
+                              uint32_t x, uint32_t y)
+{
     uint32_t crop_x, crop_y, crop_w, crop_h;
-    IfdEntry::Ref e = _cfaIfd->getEntry(IFD::DNG_TAG_DEFAULT_CROP_ORIGIN);
+    IfdEntry::Ref e = dir->getEntry(IFD::DNG_TAG_DEFAULT_CROP_ORIGIN);
     if(e) {
         crop_x = e->getIntegerArrayItem(0);
         crop_y = e->getIntegerArrayItem(1);
@@ -179,18 +241,153 @@ DngFile::~DngFile()
     else {
         crop_x = crop_y = 0;
     }
-    e = _cfaIfd->getEntry(IFD::DNG_TAG_DEFAULT_CROP_SIZE);
+    e = dir->getEntry(IFD::DNG_TAG_DEFAULT_CROP_SIZE);
     if(e) {
         crop_w = e->getIntegerArrayItem(0);
         crop_h = e->getIntegerArrayItem(1);
     }
     else {
-        crop_w = data.width();
-        crop_h = data.height();
+        crop_w = x + data.width() - crop_x;
+        crop_h = y + data.height() - crop_y;
+    }
+    if (x == 0 && y == 0) {
+        data.setRoi(crop_x, crop_y, crop_w, crop_h);
+        return;
     }
-    data.setRoi(crop_x, crop_y, crop_w, crop_h);
 
-    return ret;
+    // the data is a region at x, y: move the crop in it.
+    uint32_t left = std::max(crop_x, x);
+    uint32_t top = std::max(crop_y, y);
+    uint32_t right = std::min(crop_x + crop_w, x + data.width());
+    uint32_t bottom = std::min(crop_y + crop_h, y + data.height());
+    if (right > left && bottom > top) {
+        data.setRoi(left - x, top - y, right - left, bottom - top);
+    }
+    else {
+        data.setRoi(0, 0, data.width(), data.height());
+    }
+}
+
+::or_error DngFile::_decompressTiles(RawData & data, const IfdDir::Ref & dir,
+                                     uint32_t x, uint32_t y,
+                                     uint32_t width, uint32_t height)
+{
+    uint32_t frameWidth = 0;
+    uint32_t frameHeight = 0;
+    if (!dir->getIntegerValue(IFD::EXIF_TAG_IMAGE_WIDTH, frameWidth)
+        || !dir->getIntegerValue(IFD::EXIF_TAG_IMAGE_LENGTH, frameHeight)) {
+        Trace(ERROR) << "dimensions not found\n";
+        return OR_ERROR_NOT_FOUND;
+    }
+    uint32_t tileWidth = 0;
+    uint32_t tileLength = 0;
+    if (!dir->getIntegerValue(IFD::TIFF_TAG_TILE_WIDTH, tileWidth)
+        || !dir->getIntegerValue(IFD::TIFF_TAG_TILE_LENGTH, tileLength)
+        || tileWidth == 0 || tileLength == 0) {
+        Trace(ERROR) << "tile size not found\n";
+        return OR_ERROR_INVALID_FORMAT;
+    }
+    uint16_t spp = 1;
+    if (!dir->getValue(IFD::EXIF_TAG_SAMPLES_PER_PIXEL, spp) || spp == 0) {
+        spp = 1;
+    }
+    uint16_t bpc = 0;
+    if (!dir->getValue(IFD::EXIF_TAG_BITS_PER_SAMPLE, bpc) || bpc == 0) {
+        bpc = 16;
+    }
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> counts;
+    IfdEntry::Ref e = dir->getEntry(IFD::TIFF_TAG_TILE_OFFSETS);
+    if (e) {
+        e->getArray(offsets);
+    }
+    e = dir->getEntry(IFD::TIFF_TAG_TILE_BYTECOUNTS);
+    if (e) {
+        e->getArray(counts);
+    }
+
+    uint32_t tilesAcross = (frameWidth + tileWidth - 1) / tileWidth;
+    uint32_t tilesDown = (frameHeight + tileLength - 1) / tileLength;
+    size_t numTiles = tilesAcross * tilesDown;
+    if (offsets.size() < numTiles || counts.size() < numTiles) {
+        Trace(ERROR) << "expected " << numTiles << " tiles, found "
+                     << offsets.size() << "\n";
+        return OR_ERROR_INVALID_FORMAT;
+    }
+
+    // from here, in samples.
+    uint32_t stride = frameWidth * spp;
+    uint32_t tileSamples = tileWidth * spp;
+    if (x >= stride || y >= frameHeight
+        || width > stride - x || height > frameHeight - y) {
+        Trace(ERROR) << "region is out of the frame\n";
+        return OR_ERROR_INVALID_PARAM;
+    }
+
+    // only the tiles intersecting the region are loaded.
+    std::vector<uint32_t> tiles;
+    for (uint32_t row = y / tileLength; row <= (y + height - 1) / tileLength;
+         row++) {
+        for (uint32_t col = x / tileSamples;
+             col <= (x + width - 1) / tileSamples; col++) {
+            tiles.push_back(row * tilesAcross + col);
+        }
+    }
+    std::vector<std::vector<uint8_t>> tileData(tiles.size());
+    for (size_t i = 0; i < tiles.size(); i++) {
+        uint32_t t = tiles[i];
+        tileData[i].resize(counts[t]);
+        size_t real_size = m_container->fetchData(tileData[i].data(),
+                                                  offsets[t], counts[t]);
+        if (real_size < counts[t]) {
+            Trace(WARNING) << "Size mismatch for tile " << t
+                           << ": ignoring.\n";
+        }
+    }
+
+    RawData dData;
+    uint16_t *out = (uint16_t*)dData.allocData(width * height
+                                               * sizeof(uint16_t));
+
+    Trace(DEBUG1) << "decompressing " << tiles.size() << " of " << numTiles
+                  << " tiles of " << tileWidth << "x" << tileLength << "\n";
+    try {
+        // the tiles are independent JPEG streams.
+        parallelFor(tiles.size(), [&](size_t i) {
+                uint32_t tileX = (tiles[i] % tilesAcross) * tileSamples;
+                uint32_t tileY = (tiles[i] / tilesAcross) * tileLength;
+                // the part of the tile in the region
+                uint32_t left = std::max(tileX, x);
+                uint32_t top = std::max(tileY, y);
+                uint32_t right = std::min(tileX + tileSamples, x + width);
+                uint32_t bottom = std::min(tileY + tileLength, y + height);
+
+                IO::Stream::Ptr s(
+                    std::make_shared<IO::MemStream>(tileData[i].data(),
+                                                    tileData[i].size()));
+                s->open();
+                std::unique_ptr<JfifContainer> jfif(new JfifContainer(s, 0));
+                LJpegDecompressor decomp(s.get(), jfif.get());
+                decomp.decompressTile(out + (top - y) * width + (left - x),
+                                      width, tileSamples, tileLength,
+                                      left - tileX, top - tileY,
+                                      right - left, bottom - top);
+            });
+    }
+    catch(const std::exception & ex) {
+        Trace(ERROR) << "tile decompression failed: " << ex.what()
+                     << "\n";
+        return OR_ERROR_DECOMPRESSION;
+    }
+
+    dData.setDataType(OR_DATA_TYPE_RAW);
+    dData.setBpc(bpc);
+    dData.setWhiteLevel((1 << bpc) - 1);
+    dData.setDimensions(width, height);
+    dData.setCfaPatternType(_getCfaPatternFromDir(dir));
+    data.swap(dData);
+
+    return OR_ERROR_NONE;
 }
 
 void DngFile::_identifyId()
@@ -54,9 +54,26 @@ public:
     bool isCinema() const;
 protected:
     virtual ::or_error _getRawData(RawData & data, uint32_t options) override;
+    virtual ::or_error _getRawDataRegion(RawData & data, uint32_t options,
+                                         uint32_t x, uint32_t y,
+                                         uint32_t width,
+                                         uint32_t height) override;
     virtual void _identifyId() override;
 
 private:
+    /** Whether the CFA is made of LJPEG tiles. */
+    static bool _isTiledLJpeg(const IfdDir::Ref & dir);
+    /** Set the region of interest from the default crop
+     * @param data the data, a region at x, y of the frame.
+     */
+    static void _setDefaultCrop(RawData & data, const IfdDir::Ref & dir,
+                                uint32_t x, uint32_t y);
+    /** Load and decompress the LJPEG tiles of the CFA that intersect
+     * the region, in samples, into data.
+     */
+    ::or_error _decompressTiles(RawData & data, const IfdDir::Ref & dir,
+                                uint32_t x, uint32_t y,
+                                uint32_t width, uint32_t height);
 
     static const IfdFile::camera_ids_t s_def[];
 };
@@ -0,0 +1,560 @@
+/*
+ * libopenraw - fujidecompressor.cpp
+ *
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <initializer_list>
+#include <vector>
+
+#include "trace.hpp"
+#include "cfapattern.hpp"
+#include "rawdata.hpp"
+#include "bititerator.hpp"
+#include "endianutils.hpp"
+#include "parallel.hpp"
+#include "fujidecompressor.hpp"
+
+namespace OpenRaw {
+namespace Internals {
+
+/* The rows are coded by groups of 6. */
+#define FUJI_GROUP_ROWS 6
+/* The gradient contexts: 9 * 4 + 4 + 1 */
+#define FUJI_GRADIENTS 41
+
+namespace {
+
+/* The lines of a colour in a strip: a group of 6 rows is decoded to
+   the lines 2 and after, predicted from the lines before. */
+enum {
+    R0 = 0, R1, R2, R3, R4,
+    G0, G1, G2, G3, G4, G5, G6, G7,
+    B0, B1, B2, B3, B4,
+    LINES
+};
+
+/** The coding parameters, common to all the strips. */
+struct Params
+{
+    explicit Params(const FujiDecompressor::Header & header)
+        {
+            line_width = header.isXTrans() ? header.block_size * 2 / 3
+                : header.block_size / 2;
+            q_point[0] = 0;
+            q_point[1] = 0x12;
+            q_point[2] = 0x43;
+            q_point[3] = 0x114;
+            q_point[4] = (1 << header.raw_bits) - 1;
+            min_value = 0x40;
+            q_table.resize(2 * q_point[4] + 1);
+            for (int v = -q_point[4]; v <= q_point[4]; v++) {
+                q_table[v + q_point[4]] = quantize(v);
+            }
+            raw_bits = header.raw_bits;
+            total_values = 1 << raw_bits;
+            max_bits = 4 * raw_bits;
+            max_diff = header.raw_bits == 14 ? 256 : 64;
+        }
+
+    /** The quantized gradient of a difference between two values. */
+    int gradient(int diff) const
+        {
+            return q_table[q_point[4] + diff];
+        }
+
+    int line_width;
+    int q_point[5];
+    int min_value;
+    int raw_bits;
+    int total_values;
+    int max_bits;
+    int max_diff;
+    std::vector<int8_t> q_table;
+
+private:
+    int quantize(int v) const
+        {
+            if (v <= -q_point[3]) {
+                return -4;
+            }
+            if (v <= -q_point[2]) {
+                return -3;
+            }
+            if (v <= -q_point[1]) {
+                return -2;
+            }
+            if (v < 0) {
+                return -1;
+            }
+            if (v == 0) {
+                return 0;
+            }
+            if (v < q_point[1]) {
+                return 1;
+            }
+            if (v < q_point[2]) {
+                return 2;
+            }
+            if (v < q_point[3]) {
+                return 3;
+            }
+            return 4;
+        }
+};
+
+/** The adaptive state of a gradient context. */
+struct Gradient
+{
+    int value1;
+    int value2;
+};
+
+/** A pass of the decoding of a group: two lines, the green one and
+ * the red or blue one. On X-Trans, some of the even red or blue
+ * values are interpolated instead of coded.
+ */
+struct Pass
+{
+    int first;
+    int second;
+    int other;
+    /** the gradients contexts */
+    int grads;
+    /** interpolate when pos & 3 is this value, or always if -1. */
+    int interpolate;
+};
+
+const Pass PASSES[] = {
+    { R2, G2, R2, 0, -1 },
+    { G3, B2, B2, 1, -1 },
+    { R3, G4, R3, 2, 0 },
+    { G5, B3, B3, 0, 2 },
+    { R4, G6, R4, 1, 2 },
+    { G7, B4, B4, 2, 0 }
+};
+
+/** Decode a strip. */
+class Strip
+{
+public:
+    Strip(const Params & params, const uint8_t *data, size_t size)
+        : m_params(params)
+        , m_bits(data, size)
+        , m_stride(params.line_width + 2)
+        , m_buffer(LINES * m_stride, 0)
+        , m_errors(0)
+        {
+            for (int i = 0; i < LINES; i++) {
+                m_lines[i] = m_buffer.data() + i * m_stride;
+            }
+            for (int j = 0; j < 3; j++) {
+                for (int i = 0; i < FUJI_GRADIENTS; i++) {
+                    m_gradEven[j][i].value1 = params.max_diff;
+                    m_gradEven[j][i].value2 = 1;
+                    m_gradOdd[j][i] = m_gradEven[j][i];
+                }
+            }
+        }
+
+    /** Decode the next group of rows to the lines. */
+    void decodeGroup(bool xtrans);
+    /** Copy the decoded group to the output, of width pixels.
+     * @param pattern the CFA pattern, of size x size colours.
+     */
+    void copyGroup(uint16_t *out, size_t stride, uint32_t width,
+                   const uint8_t *pattern, unsigned size, bool xtrans);
+    /** Move to the next group. */
+    void nextGroup();
+
+    unsigned errors() const
+        {
+            return m_errors;
+        }
+
+private:
+    /** The number of 0 bits before the next 1, that is skipped.
+     * Stop at max_bits. */
+    int zeroBits()
+        {
+            int count = 0;
+            while (count < m_params.max_bits) {
+                uint32_t v = m_bits.peek(32);
+                if (v) {
+                    int zeros = __builtin_clz(v);
+                    m_bits.skip(zeros + 1);
+                    return count + zeros;
+                }
+                m_bits.skip(32);
+                count += 32;
+            }
+            return count;
+        }
+    /** The line at its first value. */
+    uint16_t *line(int index)
+        {
+            return m_lines[index] + 1;
+        }
+    int decodeCode(Gradient & grad);
+    void decodeEven(uint16_t *line, int pos, Gradient *grads);
+    void decodeOdd(uint16_t *line, int pos, Gradient *grads);
+    void interpolateEven(uint16_t *line, int pos);
+    /** Set the borders of the lines from the previous ones. */
+    void extend(int first, int last);
+
+    const Params & m_params;
+    BitIterator m_bits;
+    const int m_stride;
+    std::vector<uint16_t> m_buffer;
+    uint16_t *m_lines[LINES];
+    Gradient m_gradEven[3][FUJI_GRADIENTS];
+    Gradient m_gradOdd[3][FUJI_GRADIENTS];
+    unsigned m_errors;
+};
+
+int Strip::decodeCode(Gradient & grad)
+{
+    int code;
+    int sample = zeroBits();
+    if (sample < m_params.max_bits - m_params.raw_bits - 1) {
+        int bits = 0;
+        if (grad.value2 < grad.value1) {
+            while (bits <= 12 && (grad.value2 << ++bits) < grad.value1) {
+            }
+        }
+        code = m_bits.get(bits) + (sample << bits);
+    }
+    else {
+        code = m_bits.get(m_params.raw_bits) + 1;
+    }
+    if (code < 0 || code >= m_params.total_values) {
+        m_errors++;
+    }
+    // the sign is in the LSB.
+    if (code & 1) {
+        code = -1 - code / 2;
+    }
+    else {
+        code /= 2;
+    }
+
+    grad.value1 += abs(code);
+    if (grad.value2 == m_params.min_value) {
+        grad.value1 >>= 1;
+        grad.value2 >>= 1;
+    }
+    grad.value2++;
+    return code;
+}
+
+void Strip::interpolateEven(uint16_t *line, int pos)
+{
+    uint16_t *cur = line + pos;
+    int Rb = cur[-m_stride];
+    int Rc = cur[-m_stride - 1];
+    int Rd = cur[-m_stride + 1];
+    int Rf = cur[-2 * m_stride];
+    int diffRcRb = abs(Rc - Rb);
+    int diffRfRb = abs(Rf - Rb);
+    int diffRdRb = abs(Rd - Rb);
+    if (diffRcRb > diffRfRb && diffRcRb > diffRdRb) {
+        *cur = (Rf + Rd + 2 * Rb) >> 2;
+    }
+    else if (diffRdRb > diffRcRb && diffRdRb > diffRfRb) {
+        *cur = (Rf + Rc + 2 * Rb) >> 2;
+    }
+    else {
+        *cur = (Rd + Rc + 2 * Rb) >> 2;
+    }
+}
+
+void Strip::decodeEven(uint16_t *line, int pos, Gradient *grads)
+{
+    uint16_t *cur = line + pos;
+    int Rb = cur[-m_stride];
+    int Rc = cur[-m_stride - 1];
+    int Rd = cur[-m_stride + 1];
+    int Rf = cur[-2 * m_stride];
+    int diffRcRb = abs(Rc - Rb);
+    int diffRfRb = abs(Rf - Rb);
+    int diffRdRb = abs(Rd - Rb);
+    int interp;
+    if (diffRcRb > diffRfRb && diffRcRb > diffRdRb) {
+        interp = Rf + Rd + 2 * Rb;
+    }
+    else if (diffRdRb > diffRcRb && diffRdRb > diffRfRb) {
+        interp = Rf + Rc + 2 * Rb;
+    }
+    else {
+        interp = Rd + Rc + 2 * Rb;
+    }
+
+    int grad = m_params.gradient(Rb - Rf) * 9 + m_params.gradient(Rc - Rb);
+    int code = decodeCode(grads[abs(grad)]);
+    interp >>= 2;
+    interp += grad < 0 ? -code : code;
+    if (interp < 0) {
+        interp += m_params.total_values;
+    }
+    else if (interp > m_params.q_point[4]) {
+        interp -= m_params.total_values;
+    }
+    *cur = interp >= 0 ? std::min(interp, m_params.q_point[4]) : 0;
+}
+
+void Strip::decodeOdd(uint16_t *line, int pos, Gradient *grads)
+{
+    uint16_t *cur = line + pos;
+    int Ra = cur[-1];
+    int Rb = cur[-m_stride];
+    int Rc = cur[-m_stride - 1];
+    int Rd = cur[-m_stride + 1];
+    int Rg = cur[1];
+    int interp;
+    if ((Rb > Rc && Rb > Rd) || (Rb < Rc && Rb < Rd)) {
+        interp = (Rg + Ra + 2 * Rb) >> 2;
+    }
+    else {
+        interp = (Ra + Rg) >> 1;
+    }
+
+    int grad = m_params.gradient(Rb - Rc) * 9 + m_params.gradient(Rc - Ra);
+    int code = decodeCode(grads[abs(grad)]);
+    interp += grad < 0 ? -code : code;
+    if (interp < 0) {
+        interp += m_params.total_values;
+    }
+    else if (interp > m_params.q_point[4]) {
+        interp -= m_params.total_values;
+    }
+    *cur = interp >= 0 ? std::min(interp, m_params.q_point[4]) : 0;
+}
+
+void Strip::extend(int first, int last)
+{
+    const int width = m_params.line_width;
+    for (int i = first; i <= last; i++) {
+        m_lines[i][0] = m_lines[i - 1][1];
+        m_lines[i][width + 1] = m_lines[i - 1][width];
+    }
+}
+
+void Strip::decodeGroup(bool xtrans)
+{
+    const int width = m_params.line_width;
+    for (const Pass & pass : PASSES) {
+        uint16_t *first = line(pass.first);
+        uint16_t *second = line(pass.second);
+        int even = 0;
+        int odd = 1;
+        while (even < width || odd < width) {
+            if (even < width) {
+                for (int index : { pass.first, pass.second }) {
+                    if (xtrans && index == pass.other
+                        && (pass.interpolate < 0
+                            || (even & 3) == pass.interpolate)) {
+                        interpolateEven(line(index), even);
+                    }
+                    else {
+                        decodeEven(line(index), even,
+                                   m_gradEven[pass.grads]);
+                    }
+                }
+                even += 2;
+            }
+            // the odd values lag, to have the even ones around.
+            if (even > 8) {
+                decodeOdd(first, odd, m_gradOdd[pass.grads]);
+                decodeOdd(second, odd, m_gradOdd[pass.grads]);
+                odd += 2;
+            }
+        }
+        if (pass.other < G0) {
+            extend(R2, R4);
+        }
+        extend(G2, G7);
+        if (pass.other >= B0) {
+            extend(B2, B4);
+        }
+    }
+}
+
+void Strip::copyGroup(uint16_t *out, size_t stride, uint32_t width,
+                      const uint8_t *pattern, unsigned size, bool xtrans)
+{
+    for (int row = 0; row < FUJI_GROUP_ROWS; row++, out += stride) {
+        const uint16_t *lines[3] = {
+            line(R2 + (row >> 1)), line(G2 + row), line(B2 + (row >> 1))
+        };
+        const uint8_t *colours = pattern + (row % size) * size;
+        for (uint32_t col = 0; col < width; col++) {
+            const uint16_t *l = lines[colours[col % size]];
+            if (xtrans) {
+                // 3 pixels in 2 values of each line.
+                out[col] = l[(((col * 2 / 3) & ~1) | ((col % 3) & 1))
+                             + ((col % 3) >> 1)];
+            }
+            else {
+                out[col] = l[col >> 1];
+            }
+        }
+    }
+}
+
+void Strip::nextGroup()
+{
+    // the last 2 lines of each colour are the previous ones of the
+    // next group.
+    static const int moves[][2] = {
+        { R0, R3 }, { R1, R4 }, { G0, G6 }, { G1, G7 }, { B0, B3 }, { B1, B4 }
+    };
+    for (auto & move : moves) {
+        std::copy(m_lines[move[1]], m_lines[move[1]] + m_stride,
+                  m_lines[move[0]]);
+    }
+    static const int clears[][2] = {
+        { R2, R4 }, { G2, G7 }, { B2, B4 }
+    };
+    for (auto & clear : clears) {
+        std::fill(m_lines[clear[0]], m_lines[clear[1]] + m_stride, 0);
+        extend(clear[0], clear[0]);
+    }
+}
+
+}
+
+bool FujiDecompressor::readHeader(const uint8_t *data, size_t size,
+                                  Header & header)
+{
+    if (size < HEADER_SIZE || BE16(data) != 0x4953 || data[2] != 1) {
+        return false;
+    }
+    header.raw_type = data[3];
+    header.raw_bits = data[4];
+    header.raw_height = BE16(data + 5);
+    header.raw_rounded_width = BE16(data + 7);
+    header.raw_width = BE16(data + 9);
+    header.block_size = BE16(data + 11);
+    header.blocks_in_row = data[13];
+    header.total_lines = BE16(data + 14);
+
+    if (header.raw_height > 0x3000 || header.raw_height < FUJI_GROUP_ROWS
+        || header.raw_height % FUJI_GROUP_ROWS
+        || header.raw_width > 0x4000 || header.raw_width < 0x300
+        || header.raw_width % 24
+        || header.block_size != 0x300
+        || header.raw_rounded_width > 0x4000
+        || header.raw_rounded_width % header.block_size
+        || header.raw_rounded_width < header.raw_width
+        || header.raw_rounded_width - header.raw_width >= header.block_size
+        || header.blocks_in_row == 0 || header.blocks_in_row > 0x10
+        || header.blocks_in_row
+        != header.raw_rounded_width / header.block_size
+        || header.total_lines == 0 || header.total_lines > 0x800
+        || header.total_lines != header.raw_height / FUJI_GROUP_ROWS
+        || (header.raw_bits != 12 && header.raw_bits != 14)
+        || (header.raw_type != 16 && header.raw_type != 0)) {
+        Debug::Trace(DEBUG1) << "Unsupported compressed RAF header\n";
+        return false;
+    }
+    return true;
+}
+
+RawData *FujiDecompressor::decompress(RawData *in)
+{
+    Header header;
+    if (!readHeader(m_buffer, m_size, header) || !m_pattern) {
+        return nullptr;
+    }
+    const bool xtrans = header.isXTrans();
+    uint16_t count = 0;
+    const uint8_t *pattern = m_pattern->patternPattern(count);
+    const unsigned pattern_size = xtrans ? 6 : 2;
+    if (!pattern || count != pattern_size * pattern_size) {
+        Debug::Trace(ERROR) << "Wrong CFA pattern for the compressed RAF\n";
+        return nullptr;
+    }
+
+    // the sizes of the strips, then the strips aligned on 16 bytes.
+    const size_t blocks = header.blocks_in_row;
+    if (HEADER_SIZE + blocks * 4 > m_size) {
+        return nullptr;
+    }
+    std::vector<size_t> offsets(blocks);
+    std::vector<size_t> sizes(blocks);
+    size_t offset = HEADER_SIZE + ((blocks * 4 + 15) & ~15);
+    for (size_t b = 0; b < blocks; b++) {
+        offsets[b] = std::min(offset, m_size);
+        sizes[b] = (uint32_t)BE32(m_buffer + HEADER_SIZE + b * 4);
+        sizes[b] = std::min(sizes[b], m_size - offsets[b]);
+        offset += (uint32_t)BE32(m_buffer + HEADER_SIZE + b * 4);
+    }
+
+    RawData *output;
+    if (in) {
+        output = in;
+    } else {
+        output = new RawData;
+    }
+
+    const size_t stride = header.raw_width;
+    uint16_t *out = (uint16_t*)output->allocData(stride * header.raw_height
+                                                  * 2);
+    const Params params(header);
+    std::atomic<unsigned> errors(0);
+    parallelFor(blocks, [&] (size_t b) {
+            Strip strip(params, m_buffer + offsets[b], sizes[b]);
+            uint32_t width = (b + 1 == blocks)
+                ? header.raw_width - header.block_size * b
+                : header.block_size;
+            uint16_t *dest = out + b * header.block_size;
+            for (unsigned line = 0; line < header.total_lines; line++) {
+                strip.decodeGroup(xtrans);
+                strip.copyGroup(dest, stride, width, pattern, pattern_size,
+                                xtrans);
+                strip.nextGroup();
+                dest += stride * FUJI_GROUP_ROWS;
+            }
+            errors += strip.errors();
+        });
+    if (errors) {
+        Debug::Trace(WARNING) << errors << " invalid codes in the compressed"
+                              << " RAF\n";
+    }
+
+    output->setBpc(header.raw_bits);
+    output->setWhiteLevel((1 << header.raw_bits) - 1);
+
+    return output;
+}
+
+}
+}
+/*
+  Local Variables:
+  mode:c++
+  c-file-style:"stroustrup"
+  c-file-offsets:((innamespace . 0))
+  indent-tabs-mode:nil
+  fill-column:80
+  End:
+*/
@@ -0,0 +1,94 @@
+/* -*- Mode: C++ -*- */
+/*
+ * libopenraw - fujidecompressor.hpp
+ *
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef OR_INTERNALS_FUJIDECOMPRESSOR_H_
+#define OR_INTERNALS_FUJIDECOMPRESSOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "decompressor.hpp"
+
+namespace OpenRaw {
+
+class CfaPattern;
+class RawData;
+
+namespace Internals {
+
+class RawContainer;
+
+/** Decompress the Fujifilm compressed RAF data, X-Trans or Bayer.
+ * The image is cut in vertical strips, each coded on its own, by
+ * groups of 6 rows. The strips are decoded in parallel.
+ */
+class FujiDecompressor
+  : public Decompressor
+{
+public:
+  /** The 16 bytes header of the compressed data. */
+  struct Header {
+    uint8_t raw_type;
+    uint8_t raw_bits;
+    uint16_t raw_height;
+    uint16_t raw_rounded_width;
+    uint16_t raw_width;
+    uint16_t block_size;
+    uint8_t blocks_in_row;
+    uint16_t total_lines;
+
+    /** Whether the data is for a X-Trans sensor. Bayer otherwise. */
+    bool isXTrans() const
+      {
+        return raw_type == 16;
+      }
+  };
+  /** The size of the header */
+  static const size_t HEADER_SIZE = 16;
+
+  /** Read the header at the start of the data.
+   * @return false if the data isn't compressed or isn't supported.
+   */
+  static bool readHeader(const uint8_t *data, size_t size, Header & header);
+
+  /** @param buffer the data, starting with the header.
+   * @param pattern the CFA pattern of the data: 6x6 for X-Trans,
+   * 2x2 for Bayer.
+   */
+  FujiDecompressor(const uint8_t *buffer, size_t size,
+                   RawContainer * container, const CfaPattern *pattern)
+    : Decompressor(NULL, container)
+    , m_buffer(buffer)
+    , m_size(size)
+    , m_pattern(pattern)
+  {
+  }
+  virtual RawData *decompress(RawData *in = NULL) override;
+private:
+  const uint8_t *m_buffer;
+  size_t m_size;
+  const CfaPattern *m_pattern;
+};
+
+}
+}
+#endif
@@ -19,8 +19,10 @@
  * <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <string>
 #include <iostream>
+#include <utility>
 #include "huffman.hpp"
 #include "bititerator.hpp"
 
@@ -38,8 +40,10 @@ void HuffmanDecoder::printTable_(std::string prefix, unsigned int pos)  const
 	}
 }
 
-HuffmanDecoder::HuffmanDecoder(const HuffmanNode* const p) : m_p(p)
+HuffmanDecoder::HuffmanDecoder(const HuffmanNode* const p)
+	: m_numNodes(0), m_p(p), m_lookupBits(0)
 {
+	buildLookup();
 }
 
 void HuffmanDecoder::printTable() const
@@ -47,7 +51,47 @@ void HuffmanDecoder::printTable() const
 	printTable_("", 0);
 }
 
-unsigned int HuffmanDecoder::decode(BitIterator& i)
+/** the maximum code length decoded by the lookup table */
+#define HUFFMAN_LOOKUP_BITS 12
+
+void HuffmanDecoder::buildLookup()
+{
+	// the depth of the tree, within the lookup.
+	unsigned int depth = 0;
+	std::vector<std::pair<unsigned int, unsigned int>> nodes;
+	nodes.push_back(std::make_pair(0, 0));
+	while (!nodes.empty()) {
+		unsigned int pos = nodes.back().first;
+		unsigned int len = nodes.back().second;
+		nodes.pop_back();
+		if (m_p[pos].isLeaf || len == HUFFMAN_LOOKUP_BITS) {
+			depth = std::max(depth, len);
+			continue;
+		}
+		nodes.push_back(std::make_pair(pos + 1, len + 1));
+		nodes.push_back(std::make_pair(m_p[pos].data, len + 1));
+	}
+	m_lookupBits = std::max(depth, 1U);
+
+	// walk the tree for each value of the next bits.
+	m_lookup.assign(1 << m_lookupBits, 0);
+	for (uint32_t code = 0; code < m_lookup.size(); code++) {
+		unsigned int cur = 0;
+		unsigned int len = 0;
+		while (!m_p[cur].isLeaf && len < m_lookupBits) {
+			if ((code >> (m_lookupBits - 1 - len)) & 1)
+				cur = m_p[cur].data;
+			else
+				cur = cur + 1;
+			len++;
+		}
+		if (m_p[cur].isLeaf && m_p[cur].data < (1U << 27)) {
+			m_lookup[code] = (m_p[cur].data << 5) | len;
+		}
+	}
+}
+
+unsigned int HuffmanDecoder::decodeSlow(BitIterator& i)
 {
 	int cur = 0;
 	while (!m_p[cur].isLeaf) {
@@ -22,27 +22,50 @@
 #ifndef OR_INTERNALS_HUFFMAN_H_
 #define OR_INTERNALS_HUFFMAN_H_
 
+#include <stdint.h>
+
 #include <string>
+#include <vector>
+
+#include "bititerator.hpp"
 
 namespace OpenRaw {
 namespace Internals {
 
-class BitIterator;
-
 struct HuffmanNode {
 	unsigned isLeaf :1;
 	unsigned data :31;
 };
 
+/** Decode the Huffman codes of a tree of HuffmanNode.
+ * The codes up to HUFFMAN_LOOKUP_BITS long are decoded with a single
+ * lookup of the next bits, the longer ones by walking the tree.
+ */
 class HuffmanDecoder {
 	unsigned int m_numNodes;
 	const HuffmanNode * const m_p;
+	/** the bits peeked for the lookup: the longest code, or
+	 * HUFFMAN_LOOKUP_BITS */
+	unsigned int m_lookupBits;
+	/** the leaf data << 5 | the code length, or 0 if the code
+	 * is longer */
+	std::vector<uint32_t> m_lookup;
 
 	void printTable_(std::string, unsigned int) const;
+	void buildLookup();
+	unsigned int decodeSlow(BitIterator& i);
 public:
 	HuffmanDecoder(const HuffmanNode* const);
 	void printTable() const;
-	unsigned int decode(BitIterator& i);
+	unsigned int decode(BitIterator& i)
+		{
+			uint32_t entry = m_lookup[i.peek(m_lookupBits)];
+			if (entry) {
+				i.skip(entry & 0x1f);
+				return entry >> 5;
+			}
+			return decodeSlow(i);
+		}
 };
 
 }
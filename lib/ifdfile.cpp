@@ -38,6 +38,7 @@
 #include "trace.hpp"
 #include "io/stream.hpp"
 #include "io/streamclone.hpp"
+#include "io/memstream.hpp"
 #include "ifd.hpp"
 #include "ifdentry.hpp"
 #include "ifdfile.hpp"
@@ -55,6 +56,11 @@ class MetaValue;
 
 namespace Internals {
 
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define HOST_ENDIAN RawContainer::ENDIAN_BIG
+#else
+#define HOST_ENDIAN RawContainer::ENDIAN_LITTLE
+#endif
 
 IfdFile::IfdFile(const IO::Stream::Ptr &s, Type _type,
                  bool instantiateContainer)
@@ -534,6 +540,20 @@ static ::or_cfa_pattern _getCfaPattern(const IfdDir::Ref & dir)
 }
 
 
+::or_cfa_pattern IfdFile::_getCfaPatternFromDir(const IfdDir::Ref & dir)
+{
+  ::or_cfa_pattern cfa_pattern = _getCfaPattern(dir);
+  if(cfa_pattern == OR_CFA_PATTERN_NONE) {
+    // some file have it in the exif IFD instead.
+    if(!m_exifIfd) {
+      m_exifIfd = _locateExifIfd();
+    }
+    cfa_pattern = _getCfaPattern(m_exifIfd);
+  }
+  return cfa_pattern;
+}
+
+
 ::or_error IfdFile::_getRawDataFromDir(RawData & data, const IfdDir::Ref & dir)
 {
   ::or_error ret = OR_ERROR_NONE;
@@ -545,6 +565,8 @@ static ::or_cfa_pattern _getCfaPattern(const IfdDir::Ref & dir)
   uint32_t x, y;
   x = 0;
   y = 0;
+  std::vector<uint32_t> tile_offsets;
+  std::vector<uint32_t> tile_counts;
 
   if(!dir) {
     Trace(ERROR) << "dir is NULL\n";
@@ -569,28 +591,30 @@ static ::or_cfa_pattern _getCfaPattern(const IfdDir::Ref & dir)
   }
   else {
     // the tile are individual JPEGS....
-    // TODO extract all of them.
+    // they are loaded one after the other, in the tile order.
     IfdEntry::Ref e = dir->getEntry(IFD::TIFF_TAG_TILE_OFFSETS);
     if(!e) {
       Trace(DEBUG1) << "tile offsets empty\n";
       return OR_ERROR_NOT_FOUND;
     }
-    std::vector<uint32_t> offsets;
-    e->getArray(offsets);
-    if(offsets.size() == 0) {
+    e->getArray(tile_offsets);
+    if(tile_offsets.size() == 0) {
       Trace(DEBUG1) << "tile offsets not found\n";
       return OR_ERROR_NOT_FOUND;
     }
-    offset = offsets[0];
+    offset = tile_offsets[0];
     e = dir->getEntry(IFD::TIFF_TAG_TILE_BYTECOUNTS);
     if(!e) {
       Trace(DEBUG1) << "tile byte counts not found\n";
       return OR_ERROR_NOT_FOUND;
     }
-    std::vector<uint32_t> counts;
-    e->getArray(counts);
+    e->getArray(tile_counts);
+    if(tile_counts.size() != tile_offsets.size()) {
+      Trace(DEBUG1) << "tile byte counts don't match the offsets\n";
+      return OR_ERROR_INVALID_FORMAT;
+    }
     Trace(DEBUG1) << "counting tiles\n";
-    byte_length = std::accumulate(counts.cbegin(), counts.cend(), 0);
+    byte_length = std::accumulate(tile_counts.cbegin(), tile_counts.cend(), 0);
   }
   got_it = dir->getIntegerValue(IFD::EXIF_TAG_IMAGE_WIDTH, x);
   if(!got_it) {
@@ -647,17 +671,10 @@ static ::or_cfa_pattern _getCfaPattern(const IfdDir::Ref & dir)
 
   Trace(DEBUG1) << "RAW Compression is " << compression << "\n";
 
-  ::or_cfa_pattern cfa_pattern = _getCfaPattern(dir);
-  if(cfa_pattern == OR_CFA_PATTERN_NONE) {
-    // some file have it in the exif IFD instead.
-    if(!m_exifIfd) {
-      m_exifIfd = _locateExifIfd();
-    }
-    cfa_pattern = _getCfaPattern(m_exifIfd);
-  }
+  ::or_cfa_pattern cfa_pattern = _getCfaPatternFromDir(dir);
 
 
-  if((bpc == 12 || bpc == 14) && (compression == 1)
+  if((bpc == 10 || bpc == 12 || bpc == 14) && (compression == 1)
      && (byte_length == (x * y * 2)))
   {
     Trace(DEBUG1) << "setting bpc from " << bpc
@@ -665,14 +682,39 @@ static ::or_cfa_pattern _getCfaPattern(const IfdDir::Ref & dir)
     bpc = 16;
   }
   if((bpc == 16) || (data_type == OR_DATA_TYPE_COMPRESSED_RAW)) {
-    void *p = data.allocData(byte_length);
-    size_t real_size = m_container->fetchData(p, offset,
-                                              byte_length);
+    uint8_t *p = (uint8_t*)data.allocData(byte_length);
+    size_t real_size = 0;
+    // the 16 bits samples are in the file byte order.
+    bool swap = (data_type == OR_DATA_TYPE_RAW)
+      && (m_container->endian() != HOST_ENDIAN);
+    auto mem = dynamic_cast<IO::MemStream*>(m_container->file().get());
+    if(swap && mem && tile_offsets.empty()
+       && (offset <= (uint64_t)mem->filesize())) {
+      // read straight from the memory, in one pass.
+      real_size = std::min<uint64_t>(byte_length,
+                                     mem->filesize() - offset);
+      copy_swap16(p, (const uint8_t*)mem->data() + offset, real_size);
+      swap = false;
+    }
+    else if(tile_offsets.empty()) {
+      real_size = m_container->fetchData(p, offset, byte_length);
+    }
+    else {
+      for(size_t i = 0; i < tile_offsets.size(); i++) {
+        real_size += m_container->fetchData(p, tile_offsets[i],
+                                            tile_counts[i]);
+        p += tile_counts[i];
+      }
+    }
     if (real_size < byte_length) {
       Trace(WARNING) << "Size mismatch for data: ignoring.\n";
     }
+    if(swap) {
+      uint8_t *raw = (uint8_t*)data.data();
+      copy_swap16(raw, raw, byte_length);
+    }
   }
-  else if((bpc == 12) || (bpc == 8)) {
+  else if((bpc == 8) || (bpc == 10) || (bpc == 12) || (bpc == 14)) {
     ret = _unpackData(bpc, compression, data, x, y, offset, byte_length);
     Trace(DEBUG1) << "unpack result " << ret << "\n";
   }
@@ -698,43 +740,24 @@ static ::or_cfa_pattern _getCfaPattern(const IfdDir::Ref & dir)
 {
   ::or_error ret = OR_ERROR_NONE;
   size_t fetched = 0;
-  uint32_t current_offset = offset;
-  Unpack unpack(x, compression);
-  const size_t blocksize = (bpc == 8 ? x : unpack.block_size());
-  Trace(DEBUG1) << "Block size = " << blocksize << "\n";
+  // the rows may be padded: TIFF only requires them to start on a byte.
+  size_t row_size = 0;
+  if((compression != IFD::COMPRESS_NIKON_PACK) && y
+     && (byte_length % y == 0)
+     && (byte_length / y > ((size_t)x * bpc + 7) / 8)) {
+    row_size = byte_length / y;
+  }
+  // TIFF packs the samples from the MSB.
+  Unpack unpack(x, compression, bpc, true, row_size);
+  Trace(DEBUG1) << "Block size = " << unpack.block_size() << "\n";
   Trace(DEBUG1) << "dimensions (x, y) " << x << ", "
                 << y << "\n";
-  std::unique_ptr<uint8_t[]> block(new uint8_t[blocksize]);
   size_t outsize = x * y * 2;
   uint8_t * outdata = (uint8_t*)data.allocData(outsize);
-  size_t got;
-  Trace(DEBUG1) << "offset of RAW data = " << current_offset << "\n";
-  do {
-    got = m_container->fetchData (block.get(),
-                                  current_offset, blocksize);
-    fetched += got;
-    offset += got;
-    current_offset += got;
-    if(got) {
-      if(bpc == 12) {
-        size_t out;
-        ret = unpack.unpack_be12to16(outdata, outsize,
-                                     block.get(),
-                                     got, out);
-        outdata += out;
-        outsize -= out;
-        if(ret != OR_ERROR_NONE) {
-          break;
-        }
-      }
-      else {
-        // outdata point to uint16_t
-        std::copy(block.get(), block.get()+got,
-                  (uint16_t*)outdata);
-        outdata += (got << 1);
-      }
-    }
-  } while((got != 0) && (fetched < byte_length));
+  Trace(DEBUG1) << "offset of RAW data = " << offset << "\n";
+  ret = unpack.unpack_strip(m_container, offset, byte_length,
+                            outdata, outsize, fetched);
+  Trace(DEBUG1) << "fetched " << fetched << " bytes\n";
 
   return ret;
 }
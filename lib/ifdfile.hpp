@@ -128,6 +128,10 @@ protected:
     const MakerNoteDir::Ref &makerNoteIfd();
 
     virtual ::or_error _getRawData(RawData &data, uint32_t options) override;
+    /** get the CFA pattern for dir, or from the Exif IFD if
+     * dir doesn't have it.
+     */
+    ::or_cfa_pattern _getCfaPatternFromDir(const IfdDir::Ref & dir);
     // call to decrompress if needed from _getRawData()
     virtual ::or_error _decompressIfNeeded(RawData &, uint32_t);
 
@@ -25,6 +25,7 @@
 #include "libopenraw/io.h"
 
 #include "io/stream.hpp"
+#include "io_private.h"
 #include "file.hpp"
 
 namespace OpenRaw {
@@ -65,6 +66,14 @@ namespace OpenRaw {
 			return ::raw_read(m_ioRef, buf, count);
 		}
 
+		int File::readAt(void *buf, size_t count, off_t offset)
+		{
+			if (m_ioRef && !::raw_can_pread(m_ioRef)) {
+				return Stream::readAt(buf, count, offset);
+			}
+			return ::raw_pread(m_ioRef, buf, count, offset);
+		}
+
 		off_t File::filesize()
 		{
 			return ::raw_filesize(m_ioRef);
@@ -53,6 +53,8 @@ public:
     virtual int seek(off_t offset, int whence) override;
     /** read in the file. Semantics are similar to POSIX */
     virtual int read(void *buf, size_t count) override;
+    /** read at an offset, with POSIX pread() */
+    virtual int readAt(void *buf, size_t count, off_t offset) override;
     virtual off_t filesize() override;
     //virtual void *mmap(size_t l, off_t offset) override;
     //virtual int munmap(void *addr, size_t l) override;
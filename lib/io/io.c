@@ -100,6 +100,38 @@ int raw_read(IOFileRef f, void *buf, size_t count)
 	return f->methods->read(f, buf, count);
 }
 
+/** read in the file at an offset
+  @param f the file to read
+  @param buf the buffer to read in
+  @param count the number of byte to read
+  @param offset the offset to read at
+
+  The file position is left unchanged, and the file error
+  isn't set, so it can be called from several threads at once.
+
+  This is not part of the io_methods: only the POSIX methods
+  implement it.
+
+  @return -1 if error, or if the methods can't read at an offset.
+*/
+int raw_pread(IOFileRef f, void *buf, size_t count, off_t offset)
+{
+	CHECK_PTR(f,-1);
+	if(!raw_can_pread(f)) {
+		return -1;
+	}
+	return raw_posix_pread(f, buf, count, offset);
+}
+
+/** whether raw_pread() can read the file
+  @param f the file
+  @return non zero if the file methods can read at an offset.
+*/
+int raw_can_pread(IOFileRef f)
+{
+	return f && f->methods == &posix_io_methods;
+}
+
 off_t raw_filesize(IOFileRef f)
 {
 	CHECK_PTR(f,0);
@@ -22,6 +22,8 @@
 #ifndef OR_INTERNALS_IO_PRIVATE_H_
 #define OR_INTERNALS_IO_PRIVATE_H_
 
+#include <libopenraw/io.h>
+
 /*! private structure that define the file */
 struct _IOFile {
 	/** methods for the file IO  */
@@ -34,6 +36,19 @@ struct _IOFile {
 	int error;
 };
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Read at an offset, without moving the file position. It is
+ * internal, as the public io_methods can't be extended. */
+int raw_pread(IOFileRef f, void *buf, size_t count, off_t offset);
+int raw_can_pread(IOFileRef f);
+
+#ifdef __cplusplus
+}
+#endif
+
 
 
 #endif
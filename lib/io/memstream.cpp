@@ -104,6 +104,21 @@ int MemStream::read(void *buf, size_t count)
   return count;
 }
 
+int MemStream::readAt(void *buf, size_t count, off_t offset)
+{
+  if ((m_ptr == NULL) || (offset < 0)) {
+    return -1;
+  }
+  if ((size_t)offset >= m_size) {
+    return 0;
+  }
+  if (count > m_size - offset) {
+    count = m_size - offset;
+  }
+  memcpy(buf, (unsigned char*)m_ptr + offset, count);
+  return count;
+}
+
 
 off_t MemStream::filesize()
 {
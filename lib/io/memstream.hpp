@@ -48,8 +48,14 @@ public:
   virtual int close() override;
   virtual int seek(off_t offset, int whence) override;
   virtual int read(void *buf, size_t count) override;
+  virtual int readAt(void *buf, size_t count, off_t offset) override;
   virtual off_t filesize() override;
 
+  /** the memory the stream reads from */
+  const void *data() const
+    {
+      return m_ptr;
+    }
 
 private:
   void * m_ptr;
@@ -131,6 +131,32 @@ static int raw_posix_read(IOFileRef f, void *buf, size_t count)
 }
 
 
+/** posix implementation for pread(). Leave f->error alone as
+ * it may be called from several threads. */
+int raw_posix_pread(IOFileRef f, void *buf, size_t count, off_t offset)
+{
+	struct io_data_posix *data = (struct io_data_posix*)f->_private;
+	size_t done = 0;
+
+	/* pread() may return less than asked before the end of file */
+	while (done < count) {
+		ssize_t r = pread(data->fd, (char*)buf + done, count - done,
+				  offset + done);
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (r == 0) {
+			break;
+		}
+		done += r;
+	}
+	return done;
+}
+
+
 static off_t raw_posix_filesize(IOFileRef f)
 {
 	off_t size = -1;
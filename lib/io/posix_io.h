@@ -26,5 +26,9 @@
 
 extern struct io_methods posix_io_methods;
 
+/** read at an offset with pread(), for the posix_io_methods files. */
+extern int raw_posix_pread(IOFileRef f, void *buf, size_t count,
+			   off_t offset);
+
 
 #endif
@@ -0,0 +1,207 @@
+/*
+ * libopenraw - prefetchstream.cpp
+ *
+ * Copyright (C) 2016 Hubert Figuière
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "libopenraw/consts.h"
+
+#include "prefetchstream.hpp"
+
+
+namespace OpenRaw {
+namespace IO {
+
+PrefetchStream::PrefetchStream(const Stream::Ptr &source, off_t offset,
+                               size_t length, size_t blockSize,
+                               size_t numBlocks)
+  : Stream(source->get_path().c_str()),
+    m_source(source), m_offset(offset), m_length(length),
+    m_blocks(std::max<size_t>(numBlocks, 2)),
+    m_readBlock(0), m_readOffset(0), m_filled(0),
+    m_eof(false), m_stop(false), m_pos(0)
+{
+  for (auto & block : m_blocks) {
+    block.data.resize(std::max<size_t>(blockSize, 1));
+    block.len = 0;
+  }
+}
+
+PrefetchStream::~PrefetchStream()
+{
+  close();
+}
+
+
+Stream::Error PrefetchStream::open()
+{
+  if (m_source == NULL) {
+    set_error(OR_ERROR_CLOSED_STREAM);
+    return OR_ERROR_CLOSED_STREAM;
+  }
+  if (!m_thread.joinable()) {
+    m_thread = std::thread(&PrefetchStream::fetch, this);
+  }
+  return OR_ERROR_NONE;
+}
+
+int PrefetchStream::close()
+{
+  if (m_thread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(m_lock);
+      m_stop = true;
+    }
+    m_cond.notify_all();
+    m_thread.join();
+  }
+  m_source = NULL;
+  return 0;
+}
+
+
+void PrefetchStream::fetch()
+{
+  size_t fetched = 0;
+  size_t writeBlock = 0;
+  if (m_source->seek(m_offset, SEEK_SET) != m_offset) {
+    fetched = m_length;
+  }
+  while (fetched < m_length) {
+    Block & block = m_blocks[writeBlock];
+    {
+      std::unique_lock<std::mutex> lock(m_lock);
+      m_cond.wait(lock, [this] {
+          return m_stop || m_filled < m_blocks.size();
+        });
+      if (m_stop) {
+        break;
+      }
+    }
+    // the block is free: read without holding the lock.
+    size_t len = std::min(block.data.size(), m_length - fetched);
+    int r = m_source->read(block.data.data(), len);
+    if (r <= 0) {
+      break;
+    }
+    fetched += r;
+    {
+      std::lock_guard<std::mutex> lock(m_lock);
+      block.len = r;
+      m_filled++;
+    }
+    m_cond.notify_all();
+    writeBlock = (writeBlock + 1) % m_blocks.size();
+  }
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_eof = true;
+  }
+  m_cond.notify_all();
+}
+
+
+int PrefetchStream::seek(off_t offset, int whence)
+{
+  if (m_source == NULL) {
+    set_error(OR_ERROR_CLOSED_STREAM);
+    return -1;
+  }
+  switch (whence) {
+  case SEEK_CUR:
+    offset += m_pos;
+    break;
+  case SEEK_END:
+    offset += m_length;
+    break;
+  default:
+    break;
+  }
+  if (offset < (off_t)m_pos) {
+    // can't go back.
+    set_error(OR_ERROR_INVALID_PARAM);
+    return -1;
+  }
+  uint8_t buf[1024];
+  while ((off_t)m_pos < offset) {
+    size_t n = std::min<off_t>(sizeof(buf), offset - m_pos);
+    if (read(buf, n) <= 0) {
+      break;
+    }
+  }
+  return m_pos;
+}
+
+
+int PrefetchStream::read(void *buf, size_t count)
+{
+  if (m_source == NULL) {
+    set_error(OR_ERROR_CLOSED_STREAM);
+    return -1;
+  }
+  uint8_t *dest = static_cast<uint8_t*>(buf);
+  size_t done = 0;
+  std::unique_lock<std::mutex> lock(m_lock);
+  while (done < count) {
+    m_cond.wait(lock, [this] {
+        return m_filled > 0 || m_eof;
+      });
+    if (m_filled == 0) {
+      break;
+    }
+    Block & block = m_blocks[m_readBlock];
+    size_t n = std::min(count - done, block.len - m_readOffset);
+    memcpy(dest + done, block.data.data() + m_readOffset, n);
+    done += n;
+    m_readOffset += n;
+    if (m_readOffset == block.len) {
+      // give the block back to the reader thread.
+      m_readOffset = 0;
+      m_readBlock = (m_readBlock + 1) % m_blocks.size();
+      m_filled--;
+      m_cond.notify_all();
+    }
+  }
+  m_pos += done;
+  return done;
+}
+
+
+off_t PrefetchStream::filesize()
+{
+  return m_length;
+}
+
+}
+}
+/*
+  Local Variables:
+  mode:c++
+  c-file-style:"stroustrup"
+  c-file-offsets:((innamespace . 0))
+  tab-width:2
+  c-basic-offset:2
+  indent-tabs-mode:nil
+  fill-column:80
+  End:
+*/
@@ -0,0 +1,111 @@
+/* -*- Mode: C++ -*- */
+/*
+ * libopenraw - prefetchstream.hpp
+ *
+ * Copyright (C) 2016 Hubert Figuière
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OR_INTERNALS_IO_PREFETCHSTREAM_H_
+#define OR_INTERNALS_IO_PREFETCHSTREAM_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "stream.hpp"
+
+namespace OpenRaw {
+namespace IO {
+
+/** @brief read ahead stream. A thread reads a range of the
+ * source stream into a ring of blocks, while they are consumed.
+ *
+ * The source must not be used by anybody else until the stream
+ * is closed. Only forward seeks are supported.
+ */
+class PrefetchStream
+  : public Stream
+{
+public:
+  /** default size of a block */
+  static const size_t BLOCK_SIZE = 256 * 1024;
+  /** default number of blocks in the ring */
+  static const size_t NUM_BLOCKS = 4;
+
+  /**
+   * @param source the stream to read from
+   * @param offset where to start reading in source
+   * @param length the length to read
+   */
+  PrefetchStream(const Stream::Ptr &source, off_t offset, size_t length,
+                 size_t blockSize = BLOCK_SIZE,
+                 size_t numBlocks = NUM_BLOCKS);
+  virtual ~PrefetchStream();
+
+  PrefetchStream(const PrefetchStream& f) = delete;
+  PrefetchStream & operator=(const PrefetchStream&) = delete;
+
+  virtual Error open() override;
+  virtual int close() override;
+  virtual int seek(off_t offset, int whence) override;
+  virtual int read(void *buf, size_t count) override;
+  virtual off_t filesize() override;
+
+private:
+  /** the reader thread */
+  void fetch();
+
+  Stream::Ptr m_source;
+  off_t m_offset;
+  size_t m_length;
+
+  struct Block {
+    std::vector<uint8_t> data;
+    size_t len;
+  };
+  std::vector<Block> m_blocks;
+  size_t m_readBlock;   /**< the block being consumed */
+  size_t m_readOffset;  /**< the position in the block being consumed */
+  size_t m_filled;      /**< the number of blocks ready to consume */
+  bool m_eof;           /**< the reader thread is done */
+  bool m_stop;          /**< the reader thread must stop */
+  size_t m_pos;         /**< the position in the stream */
+
+  std::mutex m_lock;
+  std::condition_variable m_cond;
+  std::thread m_thread;
+};
+
+}
+}
+
+#endif
+/*
+  Local Variables:
+  mode:c++
+  c-file-style:"stroustrup"
+  c-file-offsets:((innamespace . 0))
+  tab-width:2
+  c-basic-offset:2
+  indent-tabs-mode:nil
+  fill-column:80
+  End:
+*/
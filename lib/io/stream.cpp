@@ -37,6 +37,18 @@ Stream::~Stream()
 {
 }
 
+int Stream::readAt(void *buf, size_t count, off_t offset)
+{
+  std::lock_guard<std::mutex> lock(m_readAtLock);
+  off_t pos = seek(0, SEEK_CUR);
+  if (pos == -1 || seek(offset, SEEK_SET) == -1) {
+    return -1;
+  }
+  int r = read(buf, count);
+  seek(pos, SEEK_SET);
+  return r;
+}
+
 uint8_t Stream::readByte() noexcept(false)
 {
   uint8_t theByte;
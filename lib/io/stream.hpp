@@ -27,6 +27,7 @@
 #include <stdint.h>
 
 #include <memory>
+#include <mutex>
 #include <string>
 
 #include <libopenraw/consts.h>
@@ -62,6 +63,12 @@ public:
   virtual int seek(off_t offset, int whence) = 0;
   /** read in the file. Semantics are similar to POSIX read() */
   virtual int read(void *buf, size_t count) = 0;
+  /** read count bytes at offset, without moving the position.
+   * Unlike seek() and read(), it can be called from several threads
+   * at once. The default implementation serialises the calls.
+   * @return the number of bytes read, or -1 if error.
+   */
+  virtual int readAt(void *buf, size_t count, off_t offset);
   virtual off_t filesize() = 0;
 //			virtual void *mmap(size_t l, off_t offset) = 0;
 //			virtual int munmap(void *addr, size_t l) = 0;
@@ -93,6 +100,8 @@ private:
   /** the file name (full path) */
   std::string m_fileName;
   Error m_error;
+  /** serialise the default readAt() */
+  std::mutex m_readAtLock;
 };
 
 }
@@ -90,6 +90,16 @@ int StreamClone::read(void *buf, size_t count)
 }
 
 
+int StreamClone::readAt(void *buf, size_t count, off_t offset)
+{
+  if (m_cloned == NULL) {
+    set_error(OR_ERROR_CLOSED_STREAM);
+    return -1;
+  }
+  return m_cloned->readAt(buf, count, offset + m_offset);
+}
+
+
 off_t StreamClone::filesize()
 {
   if (m_cloned == NULL) {
@@ -47,6 +47,7 @@ public:
   virtual int close() override;
   virtual int seek(off_t offset, int whence) override;
   virtual int read(void *buf, size_t count) override;
+  virtual int readAt(void *buf, size_t count, off_t offset) override;
   virtual off_t filesize() override;
 
 private:
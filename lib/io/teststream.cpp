@@ -31,6 +31,7 @@
 #include "stream.hpp"
 #include "file.hpp"
 #include "streamclone.hpp"
+#include "prefetchstream.hpp"
 
 using namespace OpenRaw;
 
@@ -107,9 +108,48 @@ int test_main (int argc, char * argv[])
     c = file->readByte();
     BOOST_CHECK(c == 'Z');
 
+    // read at an offset, without moving
+    new_pos = file->seek(0, SEEK_CUR);
+    r = file->readAt(buf2, 4, 3);
+    BOOST_CHECK(r == 4);
+    BOOST_CHECK(memcmp(buf2, "defg", 4) == 0);
+    r = clone->readAt(buf2, 2, 1);
+    BOOST_CHECK(r == 2);
+    BOOST_CHECK(memcmp(buf2, "de", 2) == 0);
+    BOOST_CHECK(file->seek(0, SEEK_CUR) == new_pos);
+    r = file->readAt(buf2, 10, file_size - 2);
+    BOOST_CHECK(r == 2);
 
     clone->close();
 
+    // prefetch, with blocks smaller than the reads.
+    const off_t prefetch_offset = 3;
+    auto prefetch = new IO::PrefetchStream(file, prefetch_offset, 50, 7, 2);
+    ret = prefetch->open();
+    BOOST_CHECK(ret == 0);
+
+    BOOST_CHECK(prefetch->filesize() == 50);
+
+    char buf3[128];
+    r = prefetch->read(buf3, 10);
+    BOOST_CHECK(r == 10);
+    BOOST_CHECK(memcmp(buf3, buf1 + prefetch_offset, 3) == 0);
+
+    new_pos = prefetch->seek(0, SEEK_CUR);
+    BOOST_CHECK(new_pos == 10);
+
+    // only forward
+    new_pos = prefetch->seek(20, SEEK_SET);
+    BOOST_CHECK(new_pos == 20);
+    new_pos = prefetch->seek(2, SEEK_SET);
+    BOOST_CHECK(new_pos == -1);
+
+    r = prefetch->read(buf3 + 20, 100);
+    BOOST_CHECK(r == 30);
+
+    prefetch->close();
+    delete prefetch;
+
     file->close();
     return 0;
 }
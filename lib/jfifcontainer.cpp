@@ -64,10 +64,29 @@ typedef struct {
 JfifContainer::JfifContainer(const IO::Stream::Ptr &_file, off_t _offset)
   : RawContainer(_file, _offset),
     m_cinfo(), m_jerr(),
+    m_jpegInit(false),
     m_headerLoaded(false),
+    m_dimensionsKnown(false),
+    m_x(0), m_y(0),
     m_ifd(nullptr)
 {
   setEndian(ENDIAN_BIG);
+}
+
+JfifContainer::~JfifContainer()
+{
+  if (m_jpegInit) {
+    JPEG::jpeg_destroy_decompress(&m_cinfo);
+  }
+  delete m_ifd;
+}
+
+
+void JfifContainer::_initJpeg()
+{
+  if (m_jpegInit) {
+    return;
+  }
   /* this is a hack because jpeg_create_decompress is
    * implemented as a Macro
    */
@@ -96,25 +115,31 @@ JfifContainer::JfifContainer(const IO::Stream::Ptr &_file, off_t _offset)
     ((JPEG::j_common_ptr)&m_cinfo,
      JPOOL_PERMANENT,
      BUF_SIZE * sizeof(JPEG::JOCTET));
-}
-
-JfifContainer::~JfifContainer()
-{
-  JPEG::jpeg_destroy_decompress(&m_cinfo);
-  delete m_ifd;
+  m_jpegInit = true;
 }
 
 
 bool JfifContainer::getDimensions(uint32_t &x, uint32_t &y)
 {
-  if(!m_headerLoaded) {
-    if (_loadHeader() == 0) {
-      Trace(DEBUG1) << "load header failed\n";
-      return false;
+  if (!m_dimensionsKnown) {
+    if (_scanDimensions(m_x, m_y)) {
+      m_dimensionsKnown = true;
+    }
+    else {
+      Trace(DEBUG1) << "SOF scan failed, reading JPEG header\n";
+      if(!m_headerLoaded) {
+        if (_loadHeader() == 0) {
+          Trace(DEBUG1) << "load header failed\n";
+          return false;
+        }
+      }
+      m_x = m_cinfo.output_width;
+      m_y = m_cinfo.output_height;
+      m_dimensionsKnown = true;
     }
   }
-  x = m_cinfo.output_width;
-  y = m_cinfo.output_height;
+  x = m_x;
+  y = m_y;
   return true;
 }
 
@@ -151,8 +176,101 @@ bool JfifContainer::getDecompressedData(BitmapData &data)
 }
 
 
+/** size of the chunks read when scanning for the SOF marker */
+#define SCAN_BUF_SIZE 512
+
+bool JfifContainer::_scanDimensions(uint32_t &x, uint32_t &y)
+{
+  uint8_t buf[SCAN_BUF_SIZE];
+  off_t bufPos = 0;  // stream position of buf[0]
+  size_t bufLen = 0;
+  off_t pos = 0;     // stream position of the next marker
+
+  // keep the scan bounded: a real SOF is always close to the start,
+  // past the APPn segments.
+  for (int segments = 0; segments < 64; segments++) {
+    // we need the marker, the segment length and the SOF payload
+    // (precision, height and width) in the buffer.
+    if (pos < bufPos || pos + 9 > bufPos + (off_t)bufLen) {
+      if (m_file->seek(pos, SEEK_SET) != pos) {
+        return false;
+      }
+      int n = m_file->read(buf, SCAN_BUF_SIZE);
+      if (n < 4) {
+        return false;
+      }
+      bufPos = pos;
+      bufLen = n;
+    }
+    const uint8_t *p = buf + (pos - bufPos);
+    size_t avail = bufLen - (pos - bufPos);
+
+    if (pos == 0) {
+      // SOI
+      if (p[0] != 0xff || p[1] != 0xd8) {
+        return false;
+      }
+      pos = 2;
+      continue;
+    }
+    if (p[0] != 0xff) {
+      return false;
+    }
+    uint8_t marker = p[1];
+    if (marker == 0xff) {
+      // fill byte
+      pos++;
+      continue;
+    }
+    switch (marker) {
+    case 0xc0: case 0xc1: case 0xc2: case 0xc3:
+    case 0xc5: case 0xc6: case 0xc7:
+    case 0xc9: case 0xca: case 0xcb:
+    case 0xcd: case 0xce: case 0xcf:
+    {
+      if (avail < 9) {
+        return false;
+      }
+      // length (2), precision (1), height (2), width (2)
+      uint32_t height = (p[5] << 8) | p[6];
+      uint32_t width = (p[7] << 8) | p[8];
+      if (width == 0 || height == 0) {
+        // height can be defined later by DNL.
+        return false;
+      }
+      x = width;
+      y = height;
+      return true;
+    }
+    case 0x01:
+    case 0xd0: case 0xd1: case 0xd2: case 0xd3:
+    case 0xd4: case 0xd5: case 0xd6: case 0xd7:
+      // parameterless
+      pos += 2;
+      break;
+    case 0xd8:
+    case 0xd9:
+    case 0xda:
+      // no SOF before the image data.
+      return false;
+    default:
+    {
+      uint16_t len = (p[2] << 8) | p[3];
+      if (len < 2) {
+        return false;
+      }
+      pos += 2 + len;
+      break;
+    }
+    }
+  }
+  return false;
+}
+
+
 int JfifContainer::_loadHeader()
 {
+  _initJpeg();
 
   m_file->seek(0, SEEK_SET);
 
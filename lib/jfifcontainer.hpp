@@ -54,6 +54,10 @@ public:
   /** destructor */
   virtual ~JfifContainer();
 
+  /** Get the dimensions of the JPEG image.
+   * The SOF marker is located by scanning the stream, and only
+   * if that fails is libjpeg used to read the header.
+   */
   bool getDimensions(uint32_t &x, uint32_t &y);
   bool getDecompressedData(BitmapData &data);
 
@@ -76,12 +80,22 @@ public:
   static void j_error_exit(JPEG::j_common_ptr cinfo);
 
 private:
+  /** Initialize libjpeg. Done lazily as it is only needed to decompress. */
+  void _initJpeg();
   int _loadHeader();
+  /** Scan the JPEG markers for the SOF and read the dimensions from it.
+   * @return false if no usable SOF marker was found.
+   */
+  bool _scanDimensions(uint32_t &x, uint32_t &y);
 
   struct JPEG::jpeg_decompress_struct m_cinfo;
   struct JPEG::jpeg_error_mgr m_jerr;
   jmp_buf m_jpegjmp;
+  bool m_jpegInit;
   bool m_headerLoaded;
+  bool m_dimensionsKnown;
+  uint32_t m_x;
+  uint32_t m_y;
   IfdFileContainer* m_ifd;
 };
 
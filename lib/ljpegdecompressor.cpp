@@ -66,7 +66,10 @@
 #include "rawdata.hpp"
 #include "exception.hpp"
 #include "io/stream.hpp"
+#include "io/memstream.hpp"
 #include "trace.hpp"
+#include "parallel.hpp"
+#include "decodeindex.hpp"
 #include "ljpegdecompressor.hpp"
 #include "ljpegdecompressor_priv.hpp"
 
@@ -87,29 +90,18 @@ LJpegDecompressor::LJpegDecompressor(IO::Stream *stream,
                                      RawContainer *container)
     : Decompressor(stream, container),
       m_slices(),
-      m_mcuROW1(NULL), m_mcuROW2(NULL),
-      m_buf1(NULL), m_buf2(NULL),
-      m_bitsLeft(0),
-      m_getBuffer(0),
-      m_output(0)
+      m_regionX(0), m_regionY(0), m_regionWidth(0), m_regionHeight(0),
+      m_index(NULL), m_recordIndex(false),
+      m_checkpointInterval(0), m_scan({ 0, 0, 0 }),
+      m_spans(), m_rowSpans(),
+      m_outputData(NULL),
+      m_hSampling(1), m_vSampling(1)
 {
 }
 
 
 LJpegDecompressor::~LJpegDecompressor()
 {
-    if(m_mcuROW1) {
-        free(m_mcuROW1);
-    }
-    if(m_mcuROW2) {
-        free(m_mcuROW2);
-    }
-    if(m_buf1) {
-        free(m_buf1);
-    }
-    if(m_buf2) {
-        free(m_buf2);
-    }
 }
 		
 
@@ -122,26 +114,62 @@ void LJpegDecompressor::setSlices(const std::vector<uint16_t> & slices)
     }
     m_slices[n] = slices[2];
 }
+
+void LJpegDecompressor::setRegion(uint32_t x, uint32_t y,
+                                  uint32_t width, uint32_t height)
+{
+    m_regionX = x;
+    m_regionY = y;
+    m_regionWidth = width;
+    m_regionHeight = height;
+}
+
+void LJpegDecompressor::setDecodeIndex(DecodeIndex *index, bool record)
+{
+    m_index = index;
+    m_recordIndex = record;
+}
 		
 
 
 		
-static uint32_t bitMask[] = {  0xffffffff, 0x7fffffff, 
-                               0x3fffffff, 0x1fffffff,
-                               0x0fffffff, 0x07ffffff, 
-                               0x03ffffff, 0x01ffffff,
-                               0x00ffffff, 0x007fffff, 
-                               0x003fffff, 0x001fffff,
-                               0x000fffff, 0x0007ffff, 
-                               0x0003ffff, 0x0001ffff,
-                               0x0000ffff, 0x00007fff, 
-                               0x00003fff, 0x00001fff,
-                               0x00000fff, 0x000007ff, 
-                               0x000003ff, 0x000001ff,
-                               0x000000ff, 0x0000007f, 
-                               0x0000003f, 0x0000001f,
-                               0x0000000f, 0x00000007, 
-                               0x00000003, 0x00000001};
+/*
+ *--------------------------------------------------------------
+ *
+ * HuffExtend --
+ *
+ *	Code and table for Figure F.12: extend sign bit
+ *
+ * Results:
+ *	The extended value.
+ *
+ * Side effects:
+ *	None.
+ *
+ *--------------------------------------------------------------
+ */
+static const int32_t extendTest[16] =	/* entry n is 2**(n-1) */
+{0, 0x0001, 0x0002, 0x0004, 0x0008, 0x0010, 0x0020, 0x0040, 0x0080,
+ 0x0100, 0x0200, 0x0400, 0x0800, 0x1000, 0x2000, 0x4000};
+
+// we can't bitshift -1. So we use 0xffffffff as a value.
+// gcc complain about it otherwise.
+#define EXTEND(n) (int32_t)(0xffffffff << n) + 1
+static const int32_t extendOffset[16] =	/* entry n is (-1 << n) + 1 */
+{
+    0, EXTEND(1), EXTEND(2), EXTEND(3),
+    EXTEND(4), EXTEND(5), EXTEND(6), EXTEND(7),
+    EXTEND(8), EXTEND(9), EXTEND(10), EXTEND(11),
+    EXTEND(12), EXTEND(13), EXTEND(14), EXTEND(15)
+};
+
+inline
+void HuffExtend(int32_t & x, int32_t s) noexcept
+{
+    if ((x) < extendTest[s]) {
+        (x) += extendOffset[s];
+    }
+}
 
 void FixHuffTbl (HuffmanTable *htbl);
 
@@ -236,28 +264,41 @@ FixHuffTbl (HuffmanTable *htbl)
     htbl->maxcode[17] = 0xFFFFFL;
 			
     /*
-     * Build the numbits, value lookup tables.
-     * These table allow us to gather 8 bits from the bits stream,
-     * and immediately lookup the size and value of the huffman codes.
-     * If size is zero, it means that more than 8 bits are in the huffman
-     * code (this happens about 3-4% of the time).
+     * Build the lookup table.
+     * It allows us to gather HUFF_LOOKAHEAD bits from the bit stream,
+     * and immediately lookup the size and value of the huffman code.
+     * When the additional bits fit as well, the extended difference
+     * is also resolved, so most samples are decoded with one lookup.
+     * If the entry is zero, it means that more than HUFF_LOOKAHEAD
+     * bits are in the huffman code.
      */
-    bzero (htbl->numbits, sizeof(htbl->numbits));
+    memset(htbl->lookup, 0, sizeof(htbl->lookup));
     for (p=0; p<lastp; p++) {
         size = huffsize[p];
-        if (size <= 8) {
-            value = htbl->huffval[p];
-            code = huffcode[p];
-            ll = code << (8-size);
-            if (size < 8) {
-                ul = ll | bitMask[24+size];
+        if (size > HUFF_LOOKAHEAD) {
+            continue;
+        }
+        value = htbl->huffval[p];
+        code = huffcode[p];
+        ll = code << (HUFF_LOOKAHEAD-size);
+        ul = ll | ((1 << (HUFF_LOOKAHEAD-size)) - 1);
+        for (i=ll; i<=ul; i++) {
+            int32_t entry;
+            if (value == 16) {
+                /* no additional bits: the difference is 32768 */
+                entry = ((-32768) * 65536) | HUFF_LOOKUP_FULL | size;
+            } else if (size + value <= HUFF_LOOKAHEAD) {
+                int32_t diff = 0;
+                if (value) {
+                    diff = (i >> (HUFF_LOOKAHEAD - size - value))
+                        & ((1 << value) - 1);
+                    HuffExtend(diff, value);
+                }
+                entry = (diff * 65536) | HUFF_LOOKUP_FULL | (size + value);
             } else {
-                ul = ll;
-            }
-            for (i=ll; i<=ul; i++) {
-                htbl->numbits[i] = size;
-                htbl->value[i] = value;
+                entry = (value << 8) | size;
             }
+            htbl->lookup[i] = entry;
         }
     }
 }
@@ -280,33 +321,195 @@ int inputBufferOffset;		/* Offset of current byte */
 
 /*
  * Code for extracting the next N bits from the input stream.
- * (N never exceeds 15 for JPEG data.)
+ * (N never exceeds 16 for JPEG data.)
  * This needs to go as fast as possible!
  *
- * We read source bytes into getBuffer and dole out bits as needed.
- * If getBuffer already contains enough bits, they are fetched in-line
- * by the macros get_bits() and get_bit().  When there aren't enough bits,
- * fillBitBuffer is called; it will attempt to fill getBuffer to the
- * "high water mark", then extract the desired number of bits.  The idea,
- * of course, is to minimize the function-call overhead cost of entering
- * fillBitBuffer.
- * On most machines MIN_GET_BITS should be 25 to allow the full 32-bit width
- * of getBuffer to be used.  (On machines with wider words, an even larger
- * buffer could be used.)  
+ * JpegBitReader reads the entropy coded segment from memory into a
+ * 64-bit buffer, so that one refill gives enough bits to decode a
+ * whole sample: a Huffman code and its additional bits are never
+ * more than 32 bits.
  */
 
-#define BITS_PER_LONG	(8*sizeof(int32_t))
-#define MIN_GET_BITS  (BITS_PER_LONG-7)	   /* max value for long getBuffer */
-		
+#define MAX_SAMPLE_BITS 32  /* max bits for a code and its additional bits */
+
 /*
- * bmask[n] is mask for n rightmost bits
+ *--------------------------------------------------------------
+ *
+ * JpegBitReader::fillSlow --
+ *
+ *	Load up the bit buffer one byte at a time.
+ *	Process any stuffed bytes at this time.
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *	The bit buffer is refilled.
+ *
+ *--------------------------------------------------------------
  */
-static int32_t bmask[] = {0x0000,
-                          0x0001, 0x0003, 0x0007, 0x000F,
-                          0x001F, 0x003F, 0x007F, 0x00FF,
-                          0x01FF, 0x03FF, 0x07FF, 0x0FFF,
-                          0x1FFF, 0x3FFF, 0x7FFF, 0xFFFF};
-		
+void JpegBitReader::fillSlow()
+{
+    uint8_t c;
+
+    while (m_bitsLeft <= 56) {
+        c = 0;
+        if (!m_marker) {
+            if (m_end - m_p < 2 && m_source) {
+                refill();
+            }
+            if (m_p >= m_end) {
+                /*
+                 * Truncated data without an EOI marker.
+                 */
+                m_marker = true;
+            } else {
+                c = *m_p;
+                /*
+                 * If it's 0xFF, check and discard stuffed zero byte
+                 */
+                if (c == 0xFF) {
+                    if (m_p + 1 < m_end && m_p[1] == 0) {
+                        m_p += 2;
+                    } else {
+                        /*
+                         * Oops, it's actually a marker indicating end of
+                         * compressed data. Stay on it for nextMarker(),
+                         * and stuff zeroes into the data stream, since
+                         * this occurs when we are on the last samples
+                         * of the Huffman segment.
+                         */
+                        m_marker = true;
+                        c = 0;
+                    }
+                } else {
+                    m_p++;
+                }
+            }
+        }
+        /*
+         * OK, load c into the buffer
+         */
+        m_buffer = (m_buffer << 8) | c;
+        m_bitsLeft += 8;
+        m_loaded += 8;
+    }
+}
+
+
+/*
+ *--------------------------------------------------------------
+ *
+ * JpegBitReader::nextMarker --
+ *
+ *	Find the next JPEG marker, throwing away the bits left.
+ *
+ * Results:
+ *	The marker found, 0 if the data ended first.
+ *
+ * Side effects:
+ *	The reader is positioned past the marker.
+ *
+ *--------------------------------------------------------------
+ */
+int32_t JpegBitReader::nextMarker()
+{
+    int32_t c = 0;
+
+    m_loaded -= m_bitsLeft;
+    m_buffer = 0;
+    m_bitsLeft = 0;
+    m_marker = false;
+
+    do {
+        /* skip any non-FF bytes */
+        while (more() && *m_p != 0xFF) {
+            m_p++;
+        }
+        /* skip any duplicate FFs */
+        while (more() && *m_p == 0xFF) {
+            m_p++;
+        }
+        if (!more()) {
+            return 0;
+        }
+        c = *m_p++;
+    } while (c == 0);		/* repeat if it was a stuffed FF/00 */
+
+    return c;
+}
+
+/* the size of the chunks read from a stream */
+#define SCAN_CHUNK_SIZE (64 * 1024)
+/*
+ * The bytes kept before the current position when reading the next
+ * chunk: the bits in the buffer come from them. 8 bytes, stuffed.
+ */
+#define SCAN_CHUNK_KEEP 16
+
+void JpegBitReader::reset(IO::Stream *s)
+{
+    m_chunk.resize(SCAN_CHUNK_SIZE);
+    m_p = m_end = m_start = m_chunk.data();
+    m_consumed = 0;
+    m_buffer = 0;
+    m_bitsLeft = 0;
+    m_loaded = 0;
+    m_marker = false;
+    m_source = s;
+}
+
+bool JpegBitReader::refill()
+{
+    if (!m_source) {
+        return false;
+    }
+    /*
+     * keep the bytes left, and the last bytes read for position(),
+     * in front of the next chunk
+     */
+    uint8_t *chunk = m_chunk.data();
+    size_t keep = std::min<size_t>(m_p - chunk, SCAN_CHUNK_KEEP);
+    const uint8_t *from = m_p - keep;
+    size_t left = m_end - from;
+    m_consumed += from - chunk;
+    memmove(chunk, from, left);
+    int r = m_source->read(chunk + left, m_chunk.size() - left);
+    if (r <= 0) {
+        m_source = NULL;
+        r = 0;
+    }
+    m_p = chunk + keep;
+    m_end = chunk + left + r;
+    return r > 0;
+}
+
+bool JpegBitReader::position(uint64_t &offset, uint32_t &bit) const
+{
+    if (m_marker) {
+        /* the buffer is padded */
+        return false;
+    }
+    /*
+     * The bits in the buffer are from the last bytes read: go back
+     * over them, a stuffed 0xFF00 being one byte.
+     */
+    uint32_t bytes = (m_bitsLeft + 7) / 8;
+    const uint8_t *q = m_p;
+    for (uint32_t i = 0; i < bytes; i++) {
+        if (q - m_start >= 2 && q[-1] == 0 && q[-2] == 0xFF) {
+            q -= 2;
+        } else if (q > m_start) {
+            q--;
+        } else {
+            return false;
+        }
+    }
+    offset = m_consumed + (q - m_start);
+    bit = bytes * 8 - m_bitsLeft;
+    return true;
+}
+
 
 /*
  * Lossless JPEG specifies data precision to be from 2 to 16 bits/sample.
@@ -335,139 +538,65 @@ void
 LJpegDecompressor::DecoderStructInit (DecompressInfo *dcPtr)
     noexcept(false)
 {
-    int16_t ci,i;
+    int16_t ci, i, blocks;
     JpegComponentInfo *compPtr;
-    int32_t mcuSize;
+    int32_t hSamp, vSamp;
+
+    if (dcPtr->compsInScan < 1) {
+        throw DecodingException("Error: No scan.\n");
+    }
 
     /*
-     * Check sampling factor validity.
+     * Check sampling factor validity. Only the first component
+     * of an interleaved scan may be subsampled, the Canon sRAW
+     * luma, by 2 at most.
      */
-    for (ci = 0; ci < dcPtr->numComponents; ci++) {
-        compPtr = &dcPtr->compInfo[ci];
+    compPtr = dcPtr->curCompInfo[0];
+    hSamp = compPtr->hSampFactor;
+    vSamp = compPtr->vSampFactor;
+    if (hSamp < 1 || hSamp > 2 || vSamp < 1 || vSamp > 2) {
+        throw DecodingException("Error: Downsampling is not supported.\n");
+    }
+    for (ci = 1; ci < dcPtr->compsInScan; ci++) {
+        compPtr = dcPtr->curCompInfo[ci];
         if ((compPtr->hSampFactor != 1) || (compPtr->vSampFactor != 1)) {
             throw DecodingException("Error: Downsampling is not supported.\n");
         }
     }
+    if (hSamp * vSamp > 1
+        && (dcPtr->compsInScan == 1 || dcPtr->Ss != 1)) {
+        throw DecodingException("Error: Downsampling is not supported.\n");
+    }
 
     /*
      * Prepare array describing MCU composition
      */
     if (dcPtr->compsInScan == 1) {
         dcPtr->MCUmembership[0] = 0;
+        blocks = 1;
     } else {
         if (dcPtr->compsInScan > 4) {
             throw DecodingException("Too many components for interleaved scan");
         }
 
+        blocks = 0;
         for (ci = 0; ci < dcPtr->compsInScan; ci++) {
-            dcPtr->MCUmembership[ci] = ci;
-        }
-    }
-
-    /*
-     * Initialize mucROW1 and mcuROW2 which buffer two rows of
-     * pixels for predictor calculation.
-     */
-
-    if ((m_mcuROW1 = (MCU *)malloc(dcPtr->imageWidth*sizeof(MCU)))==NULL) {
-        throw DecodingException("Not enough memory for mcuROW1\n");
-    }
-    if ((m_mcuROW2 = (MCU *)malloc(dcPtr->imageWidth*sizeof(MCU)))==NULL) {
-        throw DecodingException("Not enough memory for mcuROW2\n");
-    }
-
-    mcuSize=dcPtr->compsInScan * sizeof(ComponentType);
-    if ((m_buf1 = (char *)malloc(dcPtr->imageWidth*mcuSize))==NULL) {
-        throw DecodingException("Not enough memory for buf1\n");
-    }
-    if ((m_buf2 = (char *)malloc(dcPtr->imageWidth*mcuSize))==NULL) {
-        throw DecodingException("Not enough memory for buf2\n");
-    }
-
-    for (i=0;i<dcPtr->imageWidth;i++) {
-        m_mcuROW1[i]=(MCU)(m_buf1+i*mcuSize);
-        m_mcuROW2[i]=(MCU)(m_buf2+i*mcuSize);
-    }
-}
-
-
-/*
- *--------------------------------------------------------------
- *
- * fillBitBuffer --
- *
- *	Load up the bit buffer with at least nbits
- *	Process any stuffed bytes at this time.
- *
- * Results:
- *	None
- *
- * Side effects:
- *	The bitwise global variables are updated.
- *
- *--------------------------------------------------------------
- */
-void
-LJpegDecompressor::fillBitBuffer (IO::Stream * s,uint16_t nbits)
-{
-    uint8_t c, c2;
-			
-    while (m_bitsLeft < MIN_GET_BITS) {
-        c = s->readByte();
-				
-        /*
-         * If it's 0xFF, check and discard stuffed zero byte
-         */
-        if (c == 0xFF) {
-            c2 = s->readByte();
-					
-            if (c2 != 0) {
-						
-                /*
-                 * Oops, it's actually a marker indicating end of
-                 * compressed data.  Better put it back for use later.
-                 */
-                s->seek(-2, SEEK_CUR);
-						
-                /*
-                 * There should be enough bits still left in the data
-                 * segment; if so, just break out of the while loop.
-                 */
-                if (m_bitsLeft >= nbits)
-                    break;
-						
-                /*
-                 * Uh-oh.  Corrupted data: stuff zeroes into the data
-                 * stream, since this sometimes occurs when we are on the
-                 * last show_bits(8) during decoding of the Huffman
-                 * segment.
-                 */
-                c = 0;
+            for (i = 0; i < (ci ? 1 : hSamp * vSamp); i++) {
+                dcPtr->MCUmembership[blocks++] = ci;
             }
         }
-        /*
-         * OK, load c into getBuffer
-         */
-        m_getBuffer = (m_getBuffer << 8) | c;
-        m_bitsLeft += 8;
     }
+    dcPtr->blocksInMCU = blocks;
+    dcPtr->MCUsPerRow = (dcPtr->imageWidth + hSamp - 1) / hSamp;
+    dcPtr->MCURows = (dcPtr->imageHeight + vSamp - 1) / vSamp;
 }
 
 
-
-inline int32_t LJpegDecompressor::QuickPredict(int32_t col, int16_t curComp,
-                                               MCU *curRowBuf, 
-                                               MCU *prevRowBuf,
-                                               int32_t psv)
+inline int32_t LJpegDecompressor::QuickPredict(int32_t left, int32_t upper,
+                                               int32_t diag, int32_t psv)
 {
-    int32_t left,upper,diag,leftcol;
     int32_t predictor;
 
-    leftcol=col-1;
-    upper=prevRowBuf[col][curComp];
-    left=curRowBuf[leftcol][curComp];
-    diag=prevRowBuf[leftcol][curComp];
-	
     /*
      * All predictor are calculated according to psv.
      */
@@ -503,82 +632,158 @@ inline int32_t LJpegDecompressor::QuickPredict(int32_t col, int16_t curComp,
     return predictor;
 }
 
-inline
-int32_t LJpegDecompressor::show_bits8(IO::Stream * s) 
+/*
+ *--------------------------------------------------------------
+ *
+ * ComputeRowSpans --
+ *
+ *      Map the rows of samples, as they are decoded, to the
+ *      output, taking the Canon-style slices into account:
+ *      the output is filled slice by slice, each slice from the
+ *      top to the bottom.
+ *      A row maps to one or more spans of consecutive samples.
+ *      Only the regionWidth x regionHeight samples from x, y in
+ *      the frame are output.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      m_spans and m_rowSpans are computed.
+ *
+ *--------------------------------------------------------------
+ */
+void
+LJpegDecompressor::ComputeRowSpans(uint32_t rowSamples, uint32_t numRows,
+                                   uint32_t width, uint32_t height,
+                                   uint32_t x, uint32_t y,
+                                   uint32_t regionWidth, uint32_t regionHeight)
 {
-    if (m_bitsLeft < 8) {
-        fillBitBuffer(s, 8);
+    std::vector<uint16_t> slices;
+    uint32_t total = 0;
+    for (auto w : m_slices) {
+        total += w;
+    }
+    if (isSliced() && total == width) {
+        slices = m_slices;
+    } else {
+        if (isSliced()) {
+            Trace(WARNING) << "Slices don't match the width. Ignoring.\n";
+        }
+        slices.push_back(width);
     }
-    return (m_getBuffer >> (m_bitsLeft-8)) & 0xff;	
-}
-		
-inline
-void LJpegDecompressor::flush_bits(uint16_t nbits) 
-{
-    m_bitsLeft -= (nbits);
-}
-		
-		
-inline
-int32_t LJpegDecompressor::get_bits(uint16_t nbits) 
-{
-    if (m_bitsLeft < nbits) 
-        fillBitBuffer(m_stream, nbits);
-    return ((m_getBuffer >> (m_bitsLeft -= (nbits)))) & bmask[nbits];
-}
-		
-inline
-int32_t LJpegDecompressor::get_bit() 
-{
-    if (!m_bitsLeft) 
-        fillBitBuffer(m_stream, 1);
-    return (m_getBuffer >> (--m_bitsLeft)) & 1;
-}
 
+    m_spans.clear();
+    m_rowSpans.resize(numRows + 1);
+
+    size_t slice = 0;
+    uint32_t sliceOffset = 0;
+    uint32_t sliceRow = 0;
+    uint32_t sliceCol = 0;
+    for (uint32_t row = 0; row < numRows; row++) {
+        m_rowSpans[row] = m_spans.size();
+
+        uint32_t src = 0;
+        while (src < rowSamples && slice < slices.size()) {
+            uint32_t sliceWidth = slices[slice];
+            uint32_t n = std::min(rowSamples - src, sliceWidth - sliceCol);
+            uint32_t col = sliceOffset + sliceCol;
+            uint32_t start = std::max(col, x);
+            uint32_t end = std::min(col + n, x + regionWidth);
+            if (sliceRow >= y && sliceRow - y < regionHeight && start < end) {
+                uint32_t spanSrc = src + start - col;
+                uint32_t dest = (sliceRow - y) * regionWidth + start - x;
+                if (m_rowSpans[row] < m_spans.size()
+                    && m_spans.back().src + m_spans.back().len == spanSrc
+                    && m_spans.back().dest + m_spans.back().len == dest) {
+                    m_spans.back().len += end - start;
+                } else {
+                    m_spans.push_back(RowSpan{ spanSrc, dest, end - start });
+                }
+            }
+            src += n;
+            sliceCol += n;
+            if (sliceCol == sliceWidth) {
+                sliceCol = 0;
+                sliceRow++;
+                if (sliceRow == height) {
+                    sliceRow = 0;
+                    sliceOffset += sliceWidth;
+                    slice++;
+                }
+            }
+        }
+    }
+    m_rowSpans[numRows] = m_spans.size();
+}
 
-inline
-int32_t LJpegDecompressor::readBits(IO::Stream * s, uint16_t nbits)
+/*
+ *--------------------------------------------------------------
+ *
+ * ComputeTileSpans --
+ *
+ *      Map the rows of samples of a tile to the frame the tile
+ *      is part of, of stride samples per row. Only the width x
+ *      height samples from x, y in the tile are output.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      m_spans and m_rowSpans are computed.
+ *
+ *--------------------------------------------------------------
+ */
+void
+LJpegDecompressor::ComputeTileSpans(uint32_t rowSamples, uint32_t numRows,
+                                    uint32_t stride, uint32_t x, uint32_t y,
+                                    uint32_t width, uint32_t height)
 {
-    if (m_bitsLeft < nbits) {
-        fillBitBuffer(s, nbits);
+    m_spans.clear();
+    m_rowSpans.resize(numRows + 1);
+
+    uint32_t len = x < rowSamples ? std::min(rowSamples - x, width) : 0;
+    for (uint32_t row = 0; row < numRows; row++) {
+        m_rowSpans[row] = m_spans.size();
+        if (row >= y && row - y < height && len) {
+            m_spans.push_back(RowSpan{ x, (row - y) * stride, len });
+        }
     }
-    return ((m_getBuffer >> (m_bitsLeft -= (nbits)))) & bmask[nbits];
+    m_rowSpans[numRows] = m_spans.size();
 }
 
-
-
 /*
  *--------------------------------------------------------------
  *
  * PmPutRow --
  *
- *      Output one row of pixels stored in RowBuf.
+ *      Output one row of samples. The MCUs of a row are
+ *      consecutive in the row buffers.
  *
  * Results:
  *      None
  *
  * Side effects:
- *      One row of pixels are write to file pointed by outFile.
+ *      One row of pixels are written to the output, at its spans.
  *
  *--------------------------------------------------------------
  */
 inline void
-LJpegDecompressor::PmPutRow(MCU* RowBuf, int32_t numComp, int32_t numCol, int32_t Pt)
+LJpegDecompressor::PmPutRow(const ComponentType *samples, int32_t row,
+                            int32_t Pt)
 {
-    // TODO this might be wrong in 8 bits...
-    // original code was using putc which *i think* was a problem for
-    // 16bpp
-    int32_t comp;
-    int32_t col;
-    uint16_t v;
-
-    for (col = 0; col < numCol; col++) {
-        for (comp = 0; comp < numComp; comp++) {
-            v = RowBuf[col][comp]<<Pt;
-            m_output->append(v);
+    for (uint32_t i = m_rowSpans[row]; i < m_rowSpans[row + 1]; i++) {
+        const RowSpan &span = m_spans[i];
+        const ComponentType *src = samples + span.src;
+        uint16_t *dest = m_outputData + span.dest;
+        if (Pt == 0) {
+            memcpy(dest, src, span.len * sizeof(uint16_t));
+        } else {
+            for (uint32_t j = 0; j < span.len; j++) {
+                dest[j] = src[j] << Pt;
+            }
         }
     }
-//			m_output->nextRow();
 }
 
 /*
@@ -587,10 +792,10 @@ LJpegDecompressor::PmPutRow(MCU* RowBuf, int32_t numComp, int32_t numCol, int32_
  * HuffDecode --
  *
  *	Taken from Figure F.16: extract next coded symbol from
- *	input stream.  This should becode a macro.
+ *	input stream, and Section F.2.2.1: decode the difference.
  *
  * Results:
- *	Next coded symbol
+ *	The difference, with the sign extended.
  *
  * Side effects:
  *	Bitstream is parsed.
@@ -598,26 +803,37 @@ LJpegDecompressor::PmPutRow(MCU* RowBuf, int32_t numComp, int32_t numCol, int32_
  *--------------------------------------------------------------
  */
 inline int32_t 
-LJpegDecompressor::HuffDecode(HuffmanTable *htbl)
+LJpegDecompressor::HuffDecode(JpegBitReader &bits, HuffmanTable *htbl)
 {
-    int32_t rv;
+    int32_t s, d;
     int32_t l, temp;
-    int32_t code;
+    int32_t code, entry;
+
+    /*
+     * A single refill is enough for the code and its
+     * additional bits.
+     */
+    bits.ensure(MAX_SAMPLE_BITS);
 	
     /*
-     * If the huffman code is less than 8 bits, we can use the fast
-     * table lookup to get its value.  It's more than 8 bits about
-     * 3-4% of the time.
+     * If the huffman code is no more than HUFF_LOOKAHEAD bits, we
+     * can use the fast table lookup to get its value. Most of the
+     * time the difference is in the table too.
      */
-    code = show_bits8(m_stream);
-    if (htbl->numbits[code]) {
-        flush_bits(htbl->numbits[code]);
-        rv=htbl->value[code];
+    code = bits.peek(HUFF_LOOKAHEAD);
+    entry = htbl->lookup[code];
+    if (entry & HUFF_LOOKUP_FULL) {
+        bits.skip(entry & 0x1f);
+        return entry >> 16;
+    }
+    if (entry) {
+        bits.skip(entry & 0x1f);
+        s = (entry >> 8) & 0x1f;
     }  else {
-        flush_bits(8);
-        l = 8;
+        bits.skip(HUFF_LOOKAHEAD);
+        l = HUFF_LOOKAHEAD;
         while (code > htbl->maxcode[l]) {
-            temp = get_bit();
+            temp = bits.get(1);
             code = (code << 1) | temp;
             l++;
         }
@@ -628,63 +844,32 @@ LJpegDecompressor::HuffDecode(HuffmanTable *htbl)
 		
         if (l > 16) {
             //Trace(WARNING) << "Corrupt JPEG data: bad Huffman code " << l << "\n";
-            rv = 0;		/* fake a zero as the safest result */
-        } else {
-            rv = htbl->huffval[htbl->valptr[l] +
-                               ((int)(code - htbl->mincode[l]))];
+            return 0;		/* fake a zero as the safest result */
+        }
+        s = htbl->huffval[htbl->valptr[l] +
+                          ((int)(code - htbl->mincode[l]))];
+        if (s == 0) {
+            return 0;
+        }
+        if (s == 16) {
+            return -32768;
         }
     }
-    return rv;
+    d = bits.get(s);
+    HuffExtend(d, s);
+    return d;
 }
 
 /*
  *--------------------------------------------------------------
  *
- * HuffExtend --
+ * HuffDecoderInit --
  *
- *	Code and table for Figure F.12: extend sign bit
+ *	Initialize for a Huffman-compressed scan.
+ *	This is invoked after reading the SOS marker.
  *
  * Results:
- *	The extended value.
- *
- * Side effects:
- *	None.
- *
- *--------------------------------------------------------------
- */
-static const int32_t extendTest[16] =	/* entry n is 2**(n-1) */
-{0, 0x0001, 0x0002, 0x0004, 0x0008, 0x0010, 0x0020, 0x0040, 0x0080,
- 0x0100, 0x0200, 0x0400, 0x0800, 0x1000, 0x2000, 0x4000};
-
-// we can't bitshift -1. So we use 0xffffffff as a value.
-// gcc complain about it otherwise.
-#define EXTEND(n) (int32_t)(0xffffffff << n) + 1
-static const int32_t extendOffset[16] =	/* entry n is (-1 << n) + 1 */
-{
-    0, EXTEND(1), EXTEND(2), EXTEND(3),
-    EXTEND(4), EXTEND(5), EXTEND(6), EXTEND(7),
-    EXTEND(8), EXTEND(9), EXTEND(10), EXTEND(11),
-    EXTEND(12), EXTEND(13), EXTEND(14), EXTEND(15)
-};
-
-inline
-void HuffExtend(int32_t & x, int32_t s) noexcept
-{
-    if ((x) < extendTest[s]) {
-        (x) += extendOffset[s];
-    }
-}
-
-/*
- *--------------------------------------------------------------
- *
- * HuffDecoderInit --
- *
- *	Initialize for a Huffman-compressed scan.
- *	This is invoked after reading the SOS marker.
- *
- * Results:
- *	None
+ *	None
  *
  * Side effects:
  *	None.
@@ -698,11 +883,6 @@ LJpegDecompressor::HuffDecoderInit (DecompressInfo *dcPtr)
     int16_t ci;
     JpegComponentInfo *compptr;
 
-    /*
-     * Initialize static variables
-     */
-    m_bitsLeft = 0;
-
     for (ci = 0; ci < dcPtr->compsInScan; ci++) {
         compptr = dcPtr->curCompInfo[ci];
         /*
@@ -723,7 +903,7 @@ LJpegDecompressor::HuffDecoderInit (DecompressInfo *dcPtr)
     /*
      * Initialize restart stuff
      */
-    dcPtr->restartInRows = (dcPtr->restartInterval)/(dcPtr->imageWidth);
+    dcPtr->restartInRows = (dcPtr->restartInterval)/(dcPtr->MCUsPerRow);
     dcPtr->restartRowsToGo = dcPtr->restartInRows;
     dcPtr->nextRestartNum = 0;
 }
@@ -744,136 +924,934 @@ LJpegDecompressor::HuffDecoderInit (DecompressInfo *dcPtr)
  *--------------------------------------------------------------
  */
 void
-LJpegDecompressor::ProcessRestart (DecompressInfo *dcPtr)
+LJpegDecompressor::ProcessRestart (DecompressInfo *dcPtr,
+                                   JpegBitReader &bits)
     noexcept(false)
 {
-    int32_t c, nbytes;
+    int32_t c;
 
     /*
-     * Throw away any unused bits remaining in bit buffer
+     * Throw away any unused bits remaining in bit buffer,
+     * and scan for next JPEG marker
      */
-    nbytes = m_bitsLeft / 8;
-    m_bitsLeft = 0;
+    c = bits.nextMarker();
+
+    if (c != (RST0 + dcPtr->nextRestartNum)) {
+
+        /*
+         * Uh-oh, the restart markers have been messed up too.
+         * Just bail out.
+         */
+        throw DecodingException("Error: Corrupt JPEG data. "
+                                "Aborting decoding...\n");
+    }
 
     /*
-     * Scan for next JPEG marker
+     * Update restart state
      */
-    do {
-        do {			/* skip any non-FF bytes */
-            nbytes++;
-            c = m_stream->readByte();
-        } while (c != 0xFF);
-        do {			/* skip any duplicate FFs */
+    dcPtr->restartRowsToGo = dcPtr->restartInRows;
+    dcPtr->nextRestartNum = (dcPtr->nextRestartNum + 1) & 7;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * FindRestartMarkers --
+ *
+ *	Locate the restart intervals in the entropy coded segment,
+ *	by scanning for the RSTn markers.
+ *
+ * Results:
+ *	true if count intervals were found, in order. starts has
+ *	the start of each interval data.
+ *
+ * Side effects:
+ *	None.
+ *
+ *--------------------------------------------------------------
+ */
+static bool
+FindRestartMarkers(const uint8_t *p, const uint8_t *end, size_t count,
+                   std::vector<const uint8_t*> &starts)
+{
+    int32_t nextRestartNum = 0;
+
+    starts.clear();
+    starts.push_back(p);
+    while (starts.size() < count) {
+        p = static_cast<const uint8_t*>(memchr(p, 0xFF, end - p));
+        if (p == NULL) {
+            return false;
+        }
+        /* skip any duplicate FFs */
+        while (p < end && *p == 0xFF) {
+            p++;
+        }
+        if (p >= end) {
+            return false;
+        }
+        int32_t c = *p++;
+        if (c == 0) {
+            /* stuffed FF/00 */
+            continue;
+        }
+        if (c != RST0 + nextRestartNum) {
+            return false;
+        }
+        starts.push_back(p);
+        nextRestartNum = (nextRestartNum + 1) & 7;
+    }
+    return true;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * DecodeFirstRow --
+ *
+ *	Decode the first raster line of samples at the start of 
+ *      the scan and at the beginning of each restart interval.
+ *	This includes modifying the component value so the real
+ *      value, not the difference is returned.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Bitstream is parsed.
+ *
+ *--------------------------------------------------------------
+ */
+void LJpegDecompressor::DecodeFirstRow(DecompressInfo *dcPtr,
+                                       JpegBitReader &bits,
+                                       ComponentType *curRow)
+{
+    uint16_t curComp,ci;
+    int32_t col,compsInScan,numCOL;
+    JpegComponentInfo *compptr;
+    int32_t Pr,Pt,d;
+    HuffmanTable *dctbl;
+
+    Pr=dcPtr->dataPrecision;
+    Pt=dcPtr->Pt;
+    compsInScan=dcPtr->compsInScan;
+    numCOL=dcPtr->imageWidth;
+
+    /*
+     * the start of the scan or at the beginning of restart interval.
+     */
+    for (curComp = 0; curComp < compsInScan; curComp++) {
+        ci = dcPtr->MCUmembership[curComp];
+        compptr = dcPtr->curCompInfo[ci];
+        dctbl = dcPtr->dcHuffTblPtrs[compptr->dcTblNo];
+
+        /*
+         * Section F.2.2.1: decode the difference
+         */
+        d = HuffDecode (bits, dctbl);
+
+        /* 
+         * Add the predictor to the difference.
+         */
+        curRow[curComp]=d+(1<<(Pr-Pt-1));
+    }
+
+    /*
+     * the rest of the first row
+     */
+    for (col=1; col<numCOL; col++) {
+        ComponentType *mcu = curRow + col * compsInScan;
+        for (curComp = 0; curComp < compsInScan; curComp++) {
+            ci = dcPtr->MCUmembership[curComp];
+            compptr = dcPtr->curCompInfo[ci];
+            dctbl = dcPtr->dcHuffTblPtrs[compptr->dcTblNo];
+
             /*
-             * we don't increment nbytes here since extra FFs are legal
+             * Section F.2.2.1: decode the difference
              */
-            c = m_stream->readByte();
-        } while (c == 0xFF);
-    } while (c == 0);		/* repeat if it was a stuffed FF/00 */
+            d = HuffDecode (bits, dctbl);
 
-    if (c != (RST0 + dcPtr->nextRestartNum)) {
+            /* 
+             * Add the predictor to the difference.
+             */
+            mcu[curComp]=d+mcu[curComp - compsInScan];
+        }
+    }
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * DecodeRow --
+ *
+ *	Decode a raster line of samples, other than the first of
+ *      a restart interval.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Bitstream is parsed.
+ *
+ *--------------------------------------------------------------
+ */
+void LJpegDecompressor::DecodeRow(DecompressInfo *dcPtr,
+                                  JpegBitReader &bits,
+                                  const ComponentType *prevRow,
+                                  ComponentType *curRow)
+{
+    int32_t d,col;
+    int16_t curComp, ci;
+    HuffmanTable *dctbl;
+    JpegComponentInfo *compptr;
+    int32_t predictor;
+    int32_t numCOL,compsInScan,psv;
+
+    numCOL=dcPtr->imageWidth;
+    compsInScan=dcPtr->compsInScan;
+    psv=dcPtr->Ss;
+
+    /*
+     * The upper neighbors are predictors for the first column.
+     */
+    for (curComp = 0; curComp < compsInScan; curComp++) {
+        ci = dcPtr->MCUmembership[curComp];
+        compptr = dcPtr->curCompInfo[ci];
+        dctbl = dcPtr->dcHuffTblPtrs[compptr->dcTblNo];
+
+        /*
+         * Section F.2.2.1: decode the difference
+         */
+        d = HuffDecode (bits, dctbl);
+
+        curRow[curComp]=d+prevRow[curComp];
+    }
+
+    /*
+     * For the rest of the column on this row, predictor
+     * calculations are base on PSV. 
+     */
+    for (col=1; col<numCOL; col++) {
+        ComponentType *mcu = curRow + col * compsInScan;
+        const ComponentType *upper = prevRow + col * compsInScan;
+        for (curComp = 0; curComp < compsInScan; curComp++) {
+            ci = dcPtr->MCUmembership[curComp];
+            compptr = dcPtr->curCompInfo[ci];
+            dctbl = dcPtr->dcHuffTblPtrs[compptr->dcTblNo];
+
+            /*
+             * Section F.2.2.1: decode the difference
+             */
+            d = HuffDecode (bits, dctbl);
+            predictor = QuickPredict(mcu[curComp - compsInScan],
+                                     upper[curComp],
+                                     upper[curComp - compsInScan],
+                                     psv);
+
+            mcu[curComp]=d+predictor;
+        }
+    }
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * Predict --
+ *
+ *	The predictor for a selection value known at compile time.
+ *
+ * Results:
+ *	The predictor.
+ *
+ * Side effects:
+ *	None.
+ *
+ *--------------------------------------------------------------
+ */
+template <int32_t PSV>
+static inline int32_t
+Predict(int32_t left, int32_t upper, int32_t diag)
+{
+    switch (PSV) {
+    case 1:
+        return left;
+    case 2:
+        return upper;
+    case 3:
+        return diag;
+    case 4:
+        return left+upper-diag;
+    case 5:
+        return left+((upper-diag)>>1);
+    case 6:
+        return upper+((left-diag)>>1);
+    case 7:
+        return (left+upper)>>1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * CheckpointStateSize --
+ *
+ *	The number of predictors from the row before needed to
+ *	resume decoding at a row: with the first predictor, only
+ *	the first column is predicted from the row before.
+ *
+ * Results:
+ *	The number of samples.
+ *
+ * Side effects:
+ *	None.
+ *
+ *--------------------------------------------------------------
+ */
+static inline size_t
+CheckpointStateSize(const DecompressInfo *dcPtr)
+{
+    if (dcPtr->Ss == 1) {
+        return dcPtr->compsInScan;
+    }
+    return (size_t)dcPtr->imageWidth * dcPtr->compsInScan;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * DecodeRowsFast --
+ *
+ *      Same as DecodeRows, for a predictor and a number of
+ *      components known at compile time. The Huffman tables
+ *      are looked up once and the predictor is resolved at
+ *      compile time, out of the inner loop.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Bitstream is parsed.
+ *
+ *--------------------------------------------------------------
+ */
+template <int32_t PSV, int16_t COMPS>
+void
+LJpegDecompressor::DecodeRowsFast(DecompressInfo *dcPtr, JpegBitReader &bits,
+                                  int32_t startRow, int32_t endRow,
+                                  ComponentType *rowBuf,
+                                  const ComponentType *state)
+{
+    HuffmanTable *dctbl[COMPS];
+    int32_t numCOL, Pr, Pt, col, row;
+    int16_t curComp;
+    ComponentType *prevRow, *curRow;
+
+    numCOL=dcPtr->imageWidth;
+    Pr=dcPtr->dataPrecision;
+    Pt=dcPtr->Pt;
+
+    for (curComp = 0; curComp < COMPS; curComp++) {
+        JpegComponentInfo *compptr
+            = dcPtr->curCompInfo[dcPtr->MCUmembership[curComp]];
+        dctbl[curComp] = dcPtr->dcHuffTblPtrs[compptr->dcTblNo];
+    }
+
+    prevRow=rowBuf;
+    curRow=rowBuf + numCOL * COMPS;
+
+    if (state) {
+        /*
+         * Resume from a checkpoint: the predictors of the row
+         * before are known.
+         */
+        std::copy(state, state + CheckpointStateSize(dcPtr), prevRow);
+        row=startRow;
+    }
+    else {
+        /*
+         * At the start of the scan or at the beginning of restart
+         * interval, predict from the middle value, then from
+         * the left.
+         */
+        for (curComp = 0; curComp < COMPS; curComp++) {
+            curRow[curComp] = HuffDecode(bits, dctbl[curComp])
+                + (1<<(Pr-Pt-1));
+        }
+        for (col=1; col<numCOL; col++) {
+            ComponentType *mcu = curRow + col * COMPS;
+            for (curComp = 0; curComp < COMPS; curComp++) {
+                mcu[curComp] = HuffDecode(bits, dctbl[curComp])
+                    + mcu[curComp - COMPS];
+            }
+        }
+        PmPutRow(curRow,startRow,Pt);
+        std::swap(prevRow,curRow);
+        row=startRow+1;
+    }
+
+    for (; row<endRow; row++) {
+        if (m_checkpointInterval && row % m_checkpointInterval == 0) {
+            SaveCheckpoint(dcPtr, bits, row, prevRow);
+        }
+        /*
+         * The upper neighbors are predictors for the first column.
+         */
+        for (curComp = 0; curComp < COMPS; curComp++) {
+            curRow[curComp] = HuffDecode(bits, dctbl[curComp])
+                + prevRow[curComp];
+        }
+        for (col=1; col<numCOL; col++) {
+            ComponentType *mcu = curRow + col * COMPS;
+            const ComponentType *upper = prevRow + col * COMPS;
+            for (curComp = 0; curComp < COMPS; curComp++) {
+                mcu[curComp] = HuffDecode(bits, dctbl[curComp])
+                    + Predict<PSV>(mcu[curComp - COMPS], upper[curComp],
+                                   upper[curComp - COMPS]);
+            }
+        }
+        PmPutRow(curRow,row,Pt);
+        std::swap(prevRow,curRow);
+    }
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * DecodeRows --
+ *
+ *      Decode the rows from startRow to endRow (excluded), that
+ *      make a restart interval, or the whole scan if there is
+ *      none, and output them.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Bitstream is parsed.
+ *
+ *--------------------------------------------------------------
+ */
+void
+LJpegDecompressor::DecodeRows(DecompressInfo *dcPtr, JpegBitReader &bits,
+                              int32_t startRow, int32_t endRow,
+                              ComponentType *rowBuf,
+                              const ComponentType *state)
+{
+    int32_t row, Pt;
+    ComponentType *prevRow, *curRow;
+
+    /*
+     * Use the specialized loops for the common cases:
+     * Canon CR2 and most DNG use the first predictor.
+     */
+    if (dcPtr->Ss == 1) {
+        switch (dcPtr->compsInScan) {
+        case 1:
+            DecodeRowsFast<1, 1>(dcPtr, bits, startRow, endRow, rowBuf,
+                                 state);
+            return;
+        case 2:
+            DecodeRowsFast<1, 2>(dcPtr, bits, startRow, endRow, rowBuf,
+                                 state);
+            return;
+        case 4:
+            DecodeRowsFast<1, 4>(dcPtr, bits, startRow, endRow, rowBuf,
+                                 state);
+            return;
+        default:
+            break;
+        }
+    }
+
+    Pt=dcPtr->Pt;
+    prevRow=rowBuf;
+    curRow=rowBuf + dcPtr->imageWidth * dcPtr->compsInScan;
+
+    if (state) {
+        /*
+         * Resume from a checkpoint with the predictors saved.
+         */
+        std::copy(state, state + CheckpointStateSize(dcPtr), prevRow);
+        row=startRow;
+    }
+    else {
+        /*
+         * Decode the first row. Output the row and
+         * turn this row into a previous row for later predictor
+         * calculation.
+         */
+        DecodeFirstRow(dcPtr,bits,curRow);
+        PmPutRow(curRow,startRow,Pt);
+        std::swap(prevRow,curRow);
+        row=startRow+1;
+    }
+
+    for (; row<endRow; row++) {
+        if (m_checkpointInterval && row % m_checkpointInterval == 0) {
+            SaveCheckpoint(dcPtr, bits, row, prevRow);
+        }
+        DecodeRow(dcPtr,bits,prevRow,curRow);
+        PmPutRow(curRow,row,Pt);
+        std::swap(prevRow,curRow);
+    }
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * SaveCheckpoint --
+ *
+ *      Add the decoder state at the start of a row to the index:
+ *      the position in the bitstream and the predictors of the
+ *      row before.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      A checkpoint is added, unless past the end of the data.
+ *
+ *--------------------------------------------------------------
+ */
+void
+LJpegDecompressor::SaveCheckpoint(DecompressInfo *dcPtr, JpegBitReader &bits,
+                                  int32_t row, const ComponentType *prevRow)
+{
+    DecodeIndex::Checkpoint checkpoint;
+    uint32_t bit;
+    if (!bits.position(checkpoint.offset, bit)) {
+        return;
+    }
+    checkpoint.row = row;
+    checkpoint.bit = bit;
+    checkpoint.state.assign(prevRow, prevRow + CheckpointStateSize(dcPtr));
+    m_index->add(std::move(checkpoint));
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * DecodeImageIndexed --
+ *
+ *      Decode a scan from the checkpoints of the index, each band
+ *      of rows between two checkpoints on its own. The bands are
+ *      decoded in parallel, and only if they have rows in the
+ *      output.
+ *
+ * Results:
+ *      false if the index doesn't fit the scan.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------
+ */
+bool
+LJpegDecompressor::DecodeImageIndexed(DecompressInfo *dcPtr,
+                                      JpegBitReader &bits)
+{
+    const std::vector<DecodeIndex::Checkpoint> &checkpoints
+        = m_index->checkpoints();
+    int32_t numROW = dcPtr->imageHeight;
+    int32_t rowSamples = dcPtr->imageWidth * dcPtr->compsInScan;
+    size_t stateSize = CheckpointStateSize(dcPtr);
+    const uint8_t *data = bits.pos();
+    size_t len = bits.end() - data;
+
+    for (const auto & checkpoint : checkpoints) {
+        if (checkpoint.state.size() != stateSize || checkpoint.offset >= len
+            || checkpoint.row == 0 || checkpoint.row >= (uint32_t)numROW) {
+            Trace(DEBUG1) << "Decode index doesn't fit the scan\n";
+            return false;
+        }
+    }
+
+    parallelFor(checkpoints.size() + 1, [&](size_t i) {
+            int32_t startRow = i ? checkpoints[i - 1].row : 0;
+            int32_t endRow = i < checkpoints.size()
+                ? checkpoints[i].row : numROW;
+            /* stop after the last row output */
+            while (endRow > startRow
+                   && m_rowSpans[endRow - 1] == m_rowSpans[endRow]) {
+                endRow--;
+            }
+            if (endRow == startRow) {
+                return;
+            }
+
+            JpegBitReader bandBits;
+            std::vector<ComponentType> rowBuf(rowSamples * 2);
+            std::vector<ComponentType> upper;
+            if (i == 0) {
+                bandBits.reset(data, len);
+            }
+            else {
+                const DecodeIndex::Checkpoint &checkpoint = checkpoints[i - 1];
+                bandBits.reset(data + checkpoint.offset,
+                               len - checkpoint.offset);
+                bandBits.get(checkpoint.bit);
+                upper.assign(checkpoint.state.cbegin(),
+                             checkpoint.state.cend());
+            }
+            DecodeRows(dcPtr, bandBits, startRow, endRow, rowBuf.data(),
+                       upper.empty() ? NULL : upper.data());
+        });
+    return true;
+}
+
+/*
+ * The number of symbols whose position is recorded at the start
+ * of a chunk, to find where the previous chunk joins it.
+ */
+#define SPEC_SYNC_SYMBOLS 4096
+/*
+ * The minimum size of a chunk to decode speculatively.
+ */
+#define SPEC_MIN_CHUNK (256 * 1024)
+/*
+ * The largest scan read from a stream that is loaded into memory to
+ * be decoded speculatively. A larger one is decoded as it is read,
+ * so that the compressed data of a full size raw is never held at
+ * once.
+ */
+#define SPEC_MAX_SCAN (8 * 1024 * 1024)
 
-        /*
-         * Uh-oh, the restart markers have been messed up too.
-         * Just bail out.
-         */
-        throw DecodingException("Error: Corrupt JPEG data. "
-                                "Aborting decoding...\n");
+/*
+ * Whether all the components of the scan use the same Huffman
+ * table, as the speculative decoding needs.
+ */
+static bool
+SameHuffmanTables(DecompressInfo *dcPtr)
+{
+    HuffmanTable *dctbl = dcPtr->dcHuffTblPtrs[
+        dcPtr->curCompInfo[dcPtr->MCUmembership[0]]->dcTblNo];
+    for (int16_t curComp = 1; curComp < dcPtr->compsInScan; curComp++) {
+        HuffmanTable *tbl = dcPtr->dcHuffTblPtrs[
+            dcPtr->curCompInfo[dcPtr->MCUmembership[curComp]]->dcTblNo];
+        if (tbl != dctbl
+            && (memcmp(tbl->bits, dctbl->bits, sizeof(tbl->bits)) != 0
+                || memcmp(tbl->huffval, dctbl->huffval,
+                          sizeof(tbl->huffval)) != 0)) {
+            return false;
+        }
     }
-
-    /*
-     * Update restart state
-     */
-    dcPtr->restartRowsToGo = dcPtr->restartInRows;
-    dcPtr->nextRestartNum = (dcPtr->nextRestartNum + 1) & 7;
+    return true;
 }
 
+/*
+ * A chunk of entropy coded segment, decoded speculatively.
+ */
+struct SpeculativeChunk {
+    JpegBitReader bits;
+    uint64_t bitStart;          /* the position of the chunk start */
+    uint64_t bitEnd;            /* the decoding stops at the first
+                                   symbol at or past that position */
+    uint64_t exitPos;           /* the position the decoding stopped */
+    std::vector<ComponentType> diffs; /* the differences decoded */
+    std::vector<uint64_t> syncPos;    /* the positions of the first
+                                         symbols */
+    size_t first;               /* the first valid difference */
+};
+
 /*
  *--------------------------------------------------------------
  *
- * DecodeFirstRow --
- *
- *	Decode the first raster line of samples at the start of 
- *      the scan and at the beginning of each restart interval.
- *	This includes modifying the component value so the real
- *      value, not the difference is returned.
+ * DecodeImageSpeculative --
+ *
+ *      Decode a scan without restart intervals on several
+ *      threads. The entropy coded segment is split in chunks
+ *      decoded in parallel from a guessed start: Huffman codes
+ *      resynchronize quickly, so the decoding of a chunk joins
+ *      the real symbol boundaries after a few symbols. The chunk
+ *      before is then decoded past the chunk start until it
+ *      meets a symbol found by the chunk: all the differences
+ *      of the chunk from there are valid. If it doesn't, the
+ *      chunk before is decoded over it instead.
+ *      The differences don't depend on the predictors, which
+ *      are applied once all of them are known.
+ *      Only done if all the components use the same Huffman
+ *      table, as the decoding state is then only the position.
  *
  * Results:
- *	None.
+ *      false if the scan can't be decoded that way. The bit
+ *      reader is untouched.
  *
  * Side effects:
- *	Bitstream is parsed.
+ *      None.
  *
  *--------------------------------------------------------------
  */
-void LJpegDecompressor::DecodeFirstRow(DecompressInfo *dcPtr,
-                                       MCU *curRowBuf)
+bool
+LJpegDecompressor::DecodeImageSpeculative(DecompressInfo *dcPtr,
+                                          JpegBitReader &bits)
 {
-    uint16_t curComp,ci;
-    int32_t s,col,compsInScan,numCOL;
-    JpegComponentInfo *compptr;
-    int32_t Pr,Pt,d;
+    int32_t compsInScan = dcPtr->compsInScan;
+    int32_t rowSamples = dcPtr->imageWidth * compsInScan;
+    int32_t numROW = dcPtr->imageHeight;
+    size_t totalSamples = (size_t)rowSamples * numROW;
     HuffmanTable *dctbl;
 
-    Pr=dcPtr->dataPrecision;
-    Pt=dcPtr->Pt;
-    compsInScan=dcPtr->compsInScan;
-    numCOL=dcPtr->imageWidth;
+    /*
+     * The decoding state must only be the position.
+     */
+    if (!SameHuffmanTables(dcPtr)) {
+        return false;
+    }
+    dctbl = dcPtr->dcHuffTblPtrs[
+        dcPtr->curCompInfo[dcPtr->MCUmembership[0]]->dcTblNo];
+
+    const uint8_t *start = bits.pos();
+    const uint8_t *end = bits.end();
+    size_t numChunks = std::min<size_t>(parallelWorkers(),
+                                        (end - start) / SPEC_MIN_CHUNK);
+    if (numChunks < 2) {
+        return false;
+    }
 
     /*
-     * the start of the scan or at the beginning of restart interval.
+     * Locate the chunks: their start in the data, and in the
+     * unstuffed bits, up to the marker ending the segment.
      */
-    for (curComp = 0; curComp < compsInScan; curComp++) {
-        ci = dcPtr->MCUmembership[curComp];
-        compptr = dcPtr->curCompInfo[ci];
-        dctbl = dcPtr->dcHuffTblPtrs[compptr->dcTblNo];
+    size_t chunkSize = (end - start) / numChunks;
+    std::vector<const uint8_t*> chunkStart(1, start);
+    std::vector<uint64_t> bitStart(1, 0);
+    const uint8_t *scanEnd = end;
+    const uint8_t *p = start;
+    size_t stuffed = 0;
+    while (p < end) {
+        const uint8_t *ff = static_cast<const uint8_t*>(
+            memchr(p, 0xFF, end - p));
+        if (ff == NULL) {
+            ff = end;
+        }
+        while (chunkStart.size() < numChunks
+               && start + chunkStart.size() * chunkSize <= ff) {
+            const uint8_t *s = start + chunkStart.size() * chunkSize;
+            chunkStart.push_back(s);
+            bitStart.push_back((s - start - stuffed) * 8);
+        }
+        if (ff + 1 >= end) {
+            break;
+        }
+        if (ff[1] != 0) {
+            scanEnd = ff;
+            break;
+        }
+        /* a chunk can't start on a stuffed 0 */
+        while (chunkStart.size() < numChunks
+               && start + chunkStart.size() * chunkSize == ff + 1) {
+            chunkStart.push_back(ff + 2);
+            bitStart.push_back((ff + 1 - start - stuffed) * 8);
+        }
+        stuffed++;
+        p = ff + 2;
+    }
+    numChunks = chunkStart.size();
+    if (numChunks < 2) {
+        return false;
+    }
+    bitStart.push_back((scanEnd - start - stuffed) * 8);
+
+    std::vector<SpeculativeChunk> chunks(numChunks);
+    auto decodeChunk = [&](SpeculativeChunk &chunk, bool record) {
+        while (true) {
+            uint64_t pos = chunk.bitStart + chunk.bits.bitPos();
+            if (pos >= chunk.bitEnd || chunk.diffs.size() >= totalSamples) {
+                chunk.exitPos = pos;
+                break;
+            }
+            if (record && chunk.syncPos.size() < SPEC_SYNC_SYMBOLS) {
+                chunk.syncPos.push_back(pos);
+            }
+            chunk.diffs.push_back(HuffDecode(chunk.bits, dctbl));
+        }
+    };
+
+    parallelFor(numChunks, [&](size_t i) {
+            SpeculativeChunk &chunk = chunks[i];
+            chunk.bits.reset(chunkStart[i], end - chunkStart[i]);
+            chunk.bitStart = bitStart[i];
+            chunk.bitEnd = bitStart[i + 1];
+            chunk.first = 0;
+            chunk.diffs.reserve(totalSamples / numChunks
+                                + totalSamples / numChunks / 8);
+            decodeChunk(chunk, i > 0);
+        });
 
+    /*
+     * Join the chunks. The first one is right from the start.
+     */
+    std::vector<size_t> valid(1, 0);
+    size_t cur = 0;
+    for (size_t i = 1; i < numChunks; i++) {
+        SpeculativeChunk &chunk = chunks[i];
+        SpeculativeChunk &prev = chunks[cur];
         /*
-         * Section F.2.2.1: decode the difference
+         * Decode the chunk before until it meets a symbol of
+         * the chunk.
          */
-        s = HuffDecode (dctbl);
-        if (s) {
-            d = get_bits(s);
-            HuffExtend(d,s);
+        size_t k = std::lower_bound(chunk.syncPos.begin(),
+                                    chunk.syncPos.end(), prev.exitPos)
+            - chunk.syncPos.begin();
+        while (k < chunk.syncPos.size()
+               && chunk.syncPos[k] != prev.exitPos) {
+            if (chunk.syncPos[k] < prev.exitPos) {
+                k++;
+            } else if (prev.diffs.size() < totalSamples) {
+                prev.diffs.push_back(HuffDecode(prev.bits, dctbl));
+                prev.exitPos = prev.bitStart + prev.bits.bitPos();
+            } else {
+                break;
+            }
+        }
+        if (k < chunk.syncPos.size() && chunk.syncPos[k] == prev.exitPos) {
+            chunk.first = k;
+            valid.push_back(i);
+            cur = i;
         } else {
-            d = 0;
+            Trace(DEBUG1) << "chunk " << i << " didn't synchronize\n";
+            prev.bitEnd = bitStart[i + 1];
+            decodeChunk(prev, false);
+            std::vector<ComponentType>().swap(chunk.diffs);
         }
-
-        /* 
-         * Add the predictor to the difference.
-         */
-        curRowBuf[0][curComp]=d+(1<<(Pr-Pt-1));
+    }
+    size_t decoded = 0;
+    for (auto i : valid) {
+        decoded += chunks[i].diffs.size() - chunks[i].first;
+    }
+    if (decoded < totalSamples) {
+        Trace(WARNING) << "Speculative decoding is short of "
+                       << totalSamples - decoded << " samples\n";
+        return false;
     }
 
     /*
-     * the rest of the first row
+     * Apply the predictors, row by row.
      */
-    for (col=1; col<numCOL; col++) {
-        for (curComp = 0; curComp < compsInScan; curComp++) {
-            ci = dcPtr->MCUmembership[curComp];
-            compptr = dcPtr->curCompInfo[ci];
-            dctbl = dcPtr->dcHuffTblPtrs[compptr->dcTblNo];
+    int32_t Pr = dcPtr->dataPrecision;
+    int32_t Pt = dcPtr->Pt;
+    int32_t psv = dcPtr->Ss;
+    std::vector<ComponentType> rowBuf(rowSamples * 3);
+    ComponentType *rowDiffs = rowBuf.data();
+    ComponentType *prevRow = rowDiffs + rowSamples;
+    ComponentType *curRow = prevRow + rowSamples;
+    size_t v = 0;
+    size_t offset = chunks[valid[0]].first;
+    for (int32_t row = 0; row < numROW; row++) {
+        int32_t n = 0;
+        while (n < rowSamples) {
+            const std::vector<ComponentType> &diffs = chunks[valid[v]].diffs;
+            size_t len = std::min<size_t>(rowSamples - n,
+                                          diffs.size() - offset);
+            memcpy(rowDiffs + n, diffs.data() + offset,
+                   len * sizeof(ComponentType));
+            n += len;
+            offset += len;
+            if (offset == diffs.size()) {
+                v++;
+                if (v < valid.size()) {
+                    offset = chunks[valid[v]].first;
+                }
+            }
+        }
 
-            /*
-             * Section F.2.2.1: decode the difference
-             */
-            s = HuffDecode (dctbl);
-            if (s) {
-                d = get_bits(s);
-                HuffExtend(d,s);
+        int32_t col;
+        if (row == 0) {
+            for (col = 0; col < compsInScan; col++) {
+                curRow[col] = rowDiffs[col] + (1<<(Pr-Pt-1));
+            }
+            for (; col < rowSamples; col++) {
+                curRow[col] = rowDiffs[col] + curRow[col - compsInScan];
+            }
+        } else {
+            for (col = 0; col < compsInScan; col++) {
+                curRow[col] = rowDiffs[col] + prevRow[col];
+            }
+            if (psv == 1) {
+                for (; col < rowSamples; col++) {
+                    curRow[col] = rowDiffs[col] + curRow[col - compsInScan];
+                }
             } else {
-                d = 0;
+                for (; col < rowSamples; col++) {
+                    curRow[col] = rowDiffs[col]
+                        + QuickPredict(curRow[col - compsInScan],
+                                       prevRow[col],
+                                       prevRow[col - compsInScan], psv);
+                }
             }
-
-            /* 
-             * Add the predictor to the difference.
-             */
-            curRowBuf[col][curComp]=d+curRowBuf[col-1][curComp];
         }
+        PmPutRow(curRow, row, Pt);
+        std::swap(prevRow, curRow);
+    }
+    return true;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * DecodeSubsampledRows --
+ *
+ *      Decode the rows of MCUs from startRow to endRow, that
+ *      make a restart interval or the whole scan, when the
+ *      first component is subsampled, and output them.
+ *      This is the Canon sRAW: its luma samples are each
+ *      predicted from the one before, the others from the
+ *      same component in the MCU before, or above for the first
+ *      MCU of a row.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Bitstream is parsed.
+ *
+ *--------------------------------------------------------------
+ */
+void
+LJpegDecompressor::DecodeSubsampledRows(DecompressInfo *dcPtr,
+                                        JpegBitReader &bits,
+                                        int32_t startRow, int32_t endRow,
+                                        ComponentType *rowBuf)
+{
+    int32_t row, col, b, d, pred, luma, blocks, lumaBlocks, numMCU;
+    HuffmanTable *dctbl[10];
+    int32_t vpred[10];
+
+    blocks = dcPtr->blocksInMCU;
+    lumaBlocks = blocks - dcPtr->compsInScan + 1;
+    numMCU = dcPtr->MCUsPerRow;
+    for (b = 0; b < blocks; b++) {
+        JpegComponentInfo *compptr
+            = dcPtr->curCompInfo[dcPtr->MCUmembership[b]];
+        dctbl[b] = dcPtr->dcHuffTblPtrs[compptr->dcTblNo];
+        vpred[b] = 1 << (dcPtr->dataPrecision - dcPtr->Pt - 1);
     }
 
-    if (dcPtr->restartInRows) {
-        (dcPtr->restartRowsToGo)--;
+    luma = 0;
+    for (row = startRow; row < endRow; row++) {
+        ComponentType *mcu = rowBuf;
+        for (col = 0; col < numMCU; col++, mcu += blocks) {
+            for (b = 0; b < blocks; b++) {
+                d = HuffDecode (bits, dctbl[b]);
+                if (b < lumaBlocks && (col || b)) {
+                    pred = luma;
+                }
+                else if (col) {
+                    pred = mcu[b - blocks];
+                }
+                else {
+                    pred = vpred[b];
+                    vpred[b] = (ComponentType)(pred + d);
+                }
+                mcu[b] = pred + d;
+                if (b < lumaBlocks) {
+                    luma = mcu[b];
+                }
+            }
+        }
+        PmPutRow(rowBuf, row, dcPtr->Pt);
     }
 }
 
@@ -885,6 +1863,9 @@ void LJpegDecompressor::DecodeFirstRow(DecompressInfo *dcPtr,
  *      Decode the input stream. This includes modifying
  *      the component value so the real value, not the
  *      difference is returned.
+ *      Restart intervals are independent, so when they
+ *      can be located up front in memory, they are decoded
+ *      in parallel.
  *
  * Results:
  *      None.
@@ -895,105 +1876,81 @@ void LJpegDecompressor::DecodeFirstRow(DecompressInfo *dcPtr,
  *--------------------------------------------------------------
  */
 void
-LJpegDecompressor::DecodeImage(DecompressInfo *dcPtr)
+LJpegDecompressor::DecodeImage(DecompressInfo *dcPtr, JpegBitReader &bits)
 {
-    int32_t s,d,col,row;
-    int16_t curComp, ci;
-    HuffmanTable *dctbl;
-    JpegComponentInfo *compptr;
-    int32_t predictor;
-    int32_t numCOL,numROW,compsInScan;
-    MCU *prevRowBuf,*curRowBuf;
-    int32_t imagewidth,Pt,psv;
+    int32_t numROW, intervalRows, numIntervals, rowSamples;
+    bool subsampled;
+
+    numROW=dcPtr->MCURows;
+    rowSamples=dcPtr->MCUsPerRow * dcPtr->blocksInMCU;
+    subsampled = dcPtr->blocksInMCU > dcPtr->compsInScan;
+    intervalRows = dcPtr->restartInRows ? dcPtr->restartInRows : numROW;
+    numIntervals = (numROW + intervalRows - 1) / intervalRows;
+
+    if (numIntervals > 1 && bits.inMemory()) {
+        std::vector<const uint8_t*> starts;
+        if (FindRestartMarkers(bits.pos(), bits.end(), numIntervals,
+                               starts)) {
+            parallelFor(numIntervals, [&](size_t i) {
+                    int32_t startRow = i * intervalRows;
+                    int32_t endRow = std::min(startRow + intervalRows,
+                                              numROW);
+                    JpegBitReader intervalBits;
+                    intervalBits.reset(starts[i], bits.end() - starts[i]);
+                    std::vector<ComponentType> rowBuf(rowSamples * 2);
+                    if (subsampled) {
+                        DecodeSubsampledRows(dcPtr, intervalBits, startRow,
+                                             endRow, rowBuf.data());
+                    }
+                    else {
+                        DecodeRows(dcPtr, intervalBits, startRow, endRow,
+                                   rowBuf.data(), NULL);
+                    }
+                });
+            return;
+        }
+        Trace(DEBUG1) << "Restart markers not found, decoding serially\n";
+    }
 
-    numCOL=imagewidth=dcPtr->imageWidth;
-    numROW=dcPtr->imageHeight;
-    compsInScan=dcPtr->compsInScan;
-    Pt=dcPtr->Pt;
-    psv=dcPtr->Ss;
-    prevRowBuf=m_mcuROW2;
-    curRowBuf=m_mcuROW1;
+    if (numIntervals == 1 && m_index && !subsampled) {
+        if (m_index->matches(m_scan, rowSamples, numROW)
+            && bits.inMemory() && DecodeImageIndexed(dcPtr, bits)) {
+            return;
+        }
+        if (m_recordIndex) {
+            m_index->reset(m_scan, rowSamples, numROW);
+            m_checkpointInterval = m_index->interval();
+        }
+    }
 
     /*
-     * Decode the first row of image. Output the row and
-     * turn this row into a previous row for later predictor
-     * calculation.
-     */  
-    DecodeFirstRow(dcPtr,curRowBuf);
-    PmPutRow(curRowBuf,compsInScan,numCOL,Pt);
-    std::swap(prevRowBuf,curRowBuf);
-
-    for (row=1; row<numROW; row++) {
+     * A single interval can still be decoded in parallel,
+     * speculatively. Not while recording the checkpoints.
+     */
+    if (numIntervals == 1 && !m_checkpointInterval && bits.inMemory()
+        && !subsampled && DecodeImageSpeculative(dcPtr, bits)) {
+        return;
+    }
 
+    std::vector<ComponentType> rowBuf(rowSamples * 2);
+    for (int32_t i = 0; i < numIntervals; i++) {
+        int32_t startRow = i * intervalRows;
+        int32_t endRow = std::min(startRow + intervalRows, numROW);
         /*
          * Account for restart interval, process restart marker if needed.
          */
-        if (dcPtr->restartInRows) {
-            if (dcPtr->restartRowsToGo == 0) {
-                ProcessRestart (dcPtr);
-            
-                /*
-                 * Reset predictors at restart.
-                 */
-                DecodeFirstRow(dcPtr,curRowBuf);
-                PmPutRow(curRowBuf,compsInScan,numCOL,Pt);
-                std::swap(prevRowBuf,curRowBuf);
-                continue;
-            }
-            dcPtr->restartRowsToGo--;
+        if (i > 0) {
+            ProcessRestart (dcPtr, bits);
         }
-
-        /*
-         * The upper neighbors are predictors for the first column.
-         */
-        for (curComp = 0; curComp < compsInScan; curComp++) {
-            ci = dcPtr->MCUmembership[curComp];
-            compptr = dcPtr->curCompInfo[ci];
-            dctbl = dcPtr->dcHuffTblPtrs[compptr->dcTblNo];
-
-            /*
-             * Section F.2.2.1: decode the difference
-             */
-            s = HuffDecode (dctbl);
-            if (s) {
-                d = get_bits(s);
-                HuffExtend(d,s);
-            } else {
-                d = 0;
-            }
-
-            curRowBuf[0][curComp]=d+prevRowBuf[0][curComp];
+        if (subsampled) {
+            DecodeSubsampledRows(dcPtr, bits, startRow, endRow,
+                                 rowBuf.data());
         }
-
-        /*
-         * For the rest of the column on this row, predictor
-         * calculations are base on PSV. 
-         */
-        for (col=1; col<numCOL; col++) {
-            for (curComp = 0; curComp < compsInScan; curComp++) {
-                ci = dcPtr->MCUmembership[curComp];
-                compptr = dcPtr->curCompInfo[ci];
-                dctbl = dcPtr->dcHuffTblPtrs[compptr->dcTblNo];
-
-                /*
-                 * Section F.2.2.1: decode the difference
-                 */
-                s = HuffDecode (dctbl);
-                if (s) {
-                    d = get_bits(s);
-                    HuffExtend(d,s);
-                } else {
-                    d = 0;
-                }
-                predictor = QuickPredict(col,curComp,curRowBuf,prevRowBuf,
-                                         psv);
-
-                curRowBuf[col][curComp]=d+predictor;
-            }
+        else {
+            DecodeRows(dcPtr, bits, startRow, endRow, rowBuf.data(), NULL);
         }
-        PmPutRow(curRowBuf,compsInScan,numCOL,Pt);
-        std::swap(prevRowBuf,curRowBuf);
     }
+    m_checkpointInterval = 0;
 }
 
 
@@ -1534,29 +2491,154 @@ LJpegDecompressor::ReadScanHeader (DecompressInfo *dcPtr)
 }
 
 
+/*
+ *--------------------------------------------------------------
+ *
+ * SetupScanData --
+ *
+ *	Point the bit reader to the entropy coded segment, that
+ *	starts at the current position of the stream.
+ *	If the stream is not in memory, the bit reader reads
+ *	it as it goes, and has read the first chunk.
+ *
+ * Results:
+ *	What identifies the scan data for the decode index: its
+ *	offset, its size to the end of the stream, and the hash
+ *	of its first bytes.
+ *
+ * Side effects:
+ *	None.
+ *
+ *--------------------------------------------------------------
+ */
+static DecodeIndex::Scan
+SetupScanData(IO::Stream *s, JpegBitReader &bits)
+{
+    off_t pos = s->seek(0, SEEK_CUR);
+    off_t size = s->filesize();
+    if (pos < 0 || size < pos) {
+        throw DecodingException("Can't locate the scan data");
+    }
+    DecodeIndex::Scan scan;
+    scan.offset = pos;
+    scan.size = size - pos;
+
+    IO::MemStream *memStream = dynamic_cast<IO::MemStream*>(s);
+    if (memStream) {
+        bits.reset(static_cast<const uint8_t*>(memStream->data()) + pos,
+                   scan.size);
+    }
+    else {
+        // the stream may not seek back: the first bytes are hashed
+        // from the first chunk.
+        bits.reset(s);
+        bits.preload();
+    }
+    scan.hash = DecodeIndex::hash(bits.pos(), bits.end() - bits.pos());
+    return scan;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * LoadScanData --
+ *
+ *	Read the rest of the scan data from the stream the bit
+ *	reader reads, into data, and point the reader to it.
+ *	Nothing must have been decoded yet.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The stream is read to the end.
+ *
+ *--------------------------------------------------------------
+ */
+static void
+LoadScanData(IO::Stream *s, JpegBitReader &bits, uint64_t size,
+             std::vector<uint8_t> &data)
+{
+    data.assign(bits.pos(), bits.end());
+    size_t got = data.size();
+    data.resize(std::max<uint64_t>(size, got));
+    while (got < data.size()) {
+        int r = s->read(data.data() + got, data.size() - got);
+        if (r <= 0) {
+            break;
+        }
+        got += r;
+    }
+    data.resize(got);
+    bits.reset(data.data(), data.size());
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * ScanNeedsMemory --
+ *
+ *	Whether the scan will be decoded from the decode index,
+ *	or in parallel, which need all the scan data in memory.
+ *	Otherwise it can be decoded as it is read. A scan without
+ *	restart intervals is only loaded to be decoded
+ *	speculatively up to SPEC_MAX_SCAN.
+ *
+ * Results:
+ *	true if the scan data must be loaded.
+ *
+ * Side effects:
+ *	None.
+ *
+ *--------------------------------------------------------------
+ */
+bool
+LJpegDecompressor::ScanNeedsMemory(DecompressInfo *dcPtr) const
+{
+    int32_t numROW = dcPtr->MCURows;
+    int32_t rowSamples = dcPtr->MCUsPerRow * dcPtr->blocksInMCU;
+    bool subsampled = dcPtr->blocksInMCU > dcPtr->compsInScan;
+    int32_t intervalRows = dcPtr->restartInRows ? dcPtr->restartInRows
+        : numROW;
+    int32_t numIntervals = (numROW + intervalRows - 1) / intervalRows;
+
+    if (numIntervals == 1 && m_index && !subsampled
+        && m_index->matches(m_scan, rowSamples, numROW)) {
+        return true;
+    }
+    if (parallelWorkers() < 2) {
+        return false;
+    }
+    if (numIntervals > 1) {
+        return true;
+    }
+    // recording the index is done serially.
+    if (subsampled || (m_index && m_recordIndex)) {
+        return false;
+    }
+    return m_scan.size >= 2 * SPEC_MIN_CHUNK && m_scan.size <= SPEC_MAX_SCAN
+        && SameHuffmanTables(dcPtr);
+}
+
+
 RawData *LJpegDecompressor::decompress(RawData *bitmap)
 {
     DecompressInfo dcInfo;
     try {
         ReadFileHeader(&dcInfo); 
         ReadScanHeader (&dcInfo);
+        DecoderStructInit(&dcInfo);
 
         if(bitmap == NULL)
         {
             bitmap = new RawData();
         }
-        m_output = bitmap;
         bitmap->setDataType(OR_DATA_TYPE_RAW);
         uint32_t bpc = dcInfo.dataPrecision;
 
         bitmap->setBpc(bpc);
         bitmap->setWhiteLevel((1 << bpc) - 1);
-        /*uint16_t *dataPtr = (uint16_t*)*/
-        bitmap->allocData(dcInfo.imageWidth
-                          * sizeof(uint16_t) 
-                          * dcInfo.imageHeight
-                          * dcInfo.numComponents);
-				
+
         Trace(DEBUG1) << "dc width = " << dcInfo.imageWidth
                       << " dc height = " << dcInfo.imageHeight
                       << "\n";
@@ -1565,21 +2647,118 @@ RawData *LJpegDecompressor::decompress(RawData *bitmap)
          * @todo check that this is valid with DNG too.
          */ 
         uint32_t width = dcInfo.imageWidth * dcInfo.numComponents;
-        bitmap->setDimensions(width, dcInfo.imageHeight);
-        bitmap->setSlices(m_slices);
-        DecoderStructInit(&dcInfo);
-        HuffDecoderInit(&dcInfo);
-        DecodeImage(&dcInfo);
+        uint32_t height = dcInfo.imageHeight;
+        m_hSampling = dcInfo.curCompInfo[0]->hSampFactor;
+        m_vSampling = dcInfo.curCompInfo[0]->vSampFactor;
+        bool subsampled = dcInfo.blocksInMCU > dcInfo.compsInScan;
+        if (subsampled) {
+            /* the MCUs are output as they are, a row of MCUs per row. */
+            width = dcInfo.MCUsPerRow * dcInfo.blocksInMCU;
+            height = dcInfo.MCURows;
+        }
+        uint32_t x = 0;
+        uint32_t y = 0;
+        uint32_t regionWidth = width;
+        uint32_t regionHeight = height;
+        if (m_regionWidth && m_regionHeight && !subsampled) {
+            x = std::min(m_regionX, width);
+            y = std::min(m_regionY, height);
+            regionWidth = std::min(m_regionWidth, width - x);
+            regionHeight = std::min(m_regionHeight, height - y);
+        }
+        m_outputData = (uint16_t*)bitmap->allocData(regionWidth
+                          * sizeof(uint16_t)
+                          * regionHeight);
+        bitmap->setDimensions(regionWidth, regionHeight);
+        if (regionWidth == width && regionHeight == height) {
+            bitmap->setSlices(m_slices);
+        }
+        ComputeRowSpans(dcInfo.MCUsPerRow * dcInfo.blocksInMCU,
+                        dcInfo.MCURows, width, height,
+                        x, y, regionWidth, regionHeight);
+        DecodeScan(&dcInfo);
         // TODO handle the error properly
     }
     catch(...)
     {
         Trace(ERROR) << "Decompression error\n";
     }
-    m_output = NULL;
+    m_outputData = NULL;
     return bitmap;
 }
 
+
+void LJpegDecompressor::decompressTile(uint16_t *out, uint32_t stride,
+                                       uint32_t tileSamples,
+                                       uint32_t tileRows,
+                                       uint32_t x, uint32_t y,
+                                       uint32_t width, uint32_t height)
+    noexcept(false)
+{
+    DecompressInfo dcInfo;
+
+    ReadFileHeader(&dcInfo);
+    if (!ReadScanHeader(&dcInfo)) {
+        throw DecodingException("No scan in the tile\n");
+    }
+    DecoderStructInit(&dcInfo);
+
+    // the spans are computed in the tile: a frame of another size
+    // would be output with the wrong stride, or not cover it.
+    uint32_t rowSamples = dcInfo.MCUsPerRow * dcInfo.blocksInMCU;
+    if (rowSamples != tileSamples
+        || static_cast<uint32_t>(dcInfo.MCURows) != tileRows) {
+        Trace(ERROR) << "JPEG frame of " << rowSamples << "x"
+                     << dcInfo.MCURows << " samples in a tile of "
+                     << tileSamples << "x" << tileRows << "\n";
+        throw DecodingException("JPEG frame doesn't match the tile\n");
+    }
+
+    m_outputData = out;
+    ComputeTileSpans(rowSamples, dcInfo.MCURows, stride, x, y,
+                     width, height);
+    try {
+        DecodeScan(&dcInfo);
+    }
+    catch(...) {
+        m_outputData = NULL;
+        throw;
+    }
+    m_outputData = NULL;
+}
+
+
+/*
+ *--------------------------------------------------------------
+ *
+ * DecodeScan --
+ *
+ *      Decode the scan whose header was just read, and its
+ *      MCUs set up by DecoderStructInit, into the output, as
+ *      mapped by the row spans.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The stream is read to the end of the scan.
+ *
+ *--------------------------------------------------------------
+ */
+void LJpegDecompressor::DecodeScan(DecompressInfo *dcPtr)
+    noexcept(false)
+{
+    HuffDecoderInit(dcPtr);
+
+    JpegBitReader bits;
+    std::vector<uint8_t> scanData;
+    m_scan = SetupScanData(m_stream, bits);
+    if (!bits.inMemory() && ScanNeedsMemory(dcPtr)) {
+        LoadScanData(m_stream, bits, m_scan.size, scanData);
+    }
+    DecodeImage(dcPtr, bits);
+}
+
 }
 }
 
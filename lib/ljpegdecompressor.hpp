@@ -28,6 +28,7 @@
 
 #include <vector>
 
+#include "decodeindex.hpp"
 #include "decompressor.hpp"
 
 namespace OpenRaw {
@@ -40,9 +41,9 @@ class Stream;
 class RawContainer;
 struct HuffmanTable;
 struct DecompressInfo;
+class JpegBitReader;
 
 typedef int16_t ComponentType;
-typedef ComponentType *MCU;
 
 
 class LJpegDecompressor
@@ -61,6 +62,24 @@ public:
      * @todo use a shared_ptr here, or something
      */
     virtual RawData *decompress(RawData *in = NULL) override;
+    /** decompress a part of a tile into a larger frame.
+     * @param out where the sample x, y of the tile goes.
+     * @param stride the number of samples in a row of the frame.
+     * @param tileSamples the number of samples in a row of the tile.
+     * @param tileRows the number of rows of the tile.
+     * @param x the first sample of a tile row to output.
+     * @param y the first tile row to output.
+     * @param width the number of samples of a tile row to output.
+     * @param height the number of tile rows to output.
+     * Edge tiles are padded beyond the frame, and a region may
+     * only need a part of a tile.
+     * @throw DecodingException on error, or if the JPEG frame isn't
+     * the size of the tile.
+     */
+    void decompressTile(uint16_t *out, uint32_t stride,
+                        uint32_t tileSamples, uint32_t tileRows,
+                        uint32_t x, uint32_t y,
+                        uint32_t width, uint32_t height) noexcept(false);
     /** Set the "slices"
      * @param slices the vector containing the Canon-style slices.
      *
@@ -75,18 +94,32 @@ public:
         {
             return m_slices.size() > 1;
         }
-private:
-
-    /** read the bits
-     * @param s the stream to read from
-     * @param bitCount the number of bit
-     * @return the value
+    /** Only decompress a region of the frame.
+     * The region is clipped to the frame.
      */
-    int32_t readBits(IO::Stream * s, uint16_t bitCount);
-    int32_t show_bits8(IO::Stream * s);
-    void flush_bits(uint16_t nbits);
-    int32_t get_bits(uint16_t nbits);
-    int32_t get_bit();
+    void setRegion(uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+    /** Set the index of checkpoints in the scan.
+     * @param index the index. If it was recorded for this scan,
+     * the decoding resumes from the checkpoints, in parallel,
+     * and only where the output needs it.
+     * @param record whether to record the index otherwise.
+     * Scans with restart intervals need none.
+     */
+    void setDecodeIndex(DecodeIndex *index, bool record);
+    /** The sampling factors of the first component, known once
+     * decompressed. They are more than 1 for the luma of the
+     * Canon sRAW: the output then has a row of MCUs per row, and
+     * the region is ignored.
+     */
+    uint32_t hSampling() const
+        {
+            return m_hSampling;
+        }
+    uint32_t vSampling() const
+        {
+            return m_vSampling;
+        }
+private:
 
 /**
  * Enumerate all the JPEG marker codes
@@ -146,14 +179,42 @@ private:
 
     void DecoderStructInit (DecompressInfo *dcPtr) noexcept(false);
     void HuffDecoderInit (DecompressInfo *dcPtr) noexcept(false);
-    void ProcessRestart (DecompressInfo *dcPtr) noexcept(false);
+    void ProcessRestart (DecompressInfo *dcPtr,
+                         JpegBitReader &bits) noexcept(false);
     void DecodeFirstRow(DecompressInfo *dcPtr,
-                        MCU *curRowBuf);
-    void DecodeImage(DecompressInfo *dcPtr);
-    int32_t QuickPredict(int32_t col, int16_t curComp,
-                         MCU *curRowBuf, MCU *prevRowBuf,
+                        JpegBitReader &bits,
+                        ComponentType *curRow);
+    void DecodeRow(DecompressInfo *dcPtr,
+                   JpegBitReader &bits,
+                   const ComponentType *prevRow,
+                   ComponentType *curRow);
+    void DecodeRows(DecompressInfo *dcPtr, JpegBitReader &bits,
+                    int32_t startRow, int32_t endRow,
+                    ComponentType *rowBuf, const ComponentType *state);
+    void DecodeSubsampledRows(DecompressInfo *dcPtr, JpegBitReader &bits,
+                              int32_t startRow, int32_t endRow,
+                              ComponentType *rowBuf);
+    template <int32_t PSV, int16_t COMPS>
+    void DecodeRowsFast(DecompressInfo *dcPtr, JpegBitReader &bits,
+                        int32_t startRow, int32_t endRow,
+                        ComponentType *rowBuf, const ComponentType *state);
+    void SaveCheckpoint(DecompressInfo *dcPtr, JpegBitReader &bits,
+                        int32_t row, const ComponentType *prevRow);
+    bool DecodeImageIndexed(DecompressInfo *dcPtr, JpegBitReader &bits);
+    bool DecodeImageSpeculative(DecompressInfo *dcPtr, JpegBitReader &bits);
+    void DecodeImage(DecompressInfo *dcPtr, JpegBitReader &bits);
+    int32_t QuickPredict(int32_t left, int32_t upper, int32_t diag,
                          int32_t psv);
-    void PmPutRow(MCU* RowBuf, int32_t numComp, int32_t numCol, int32_t Pt);
+    void ComputeRowSpans(uint32_t rowSamples, uint32_t numRows,
+                         uint32_t width, uint32_t height,
+                         uint32_t x, uint32_t y,
+                         uint32_t regionWidth, uint32_t regionHeight);
+    void ComputeTileSpans(uint32_t rowSamples, uint32_t numRows,
+                          uint32_t stride, uint32_t x, uint32_t y,
+                          uint32_t width, uint32_t height);
+    bool ScanNeedsMemory(DecompressInfo *dcPtr) const;
+    void DecodeScan(DecompressInfo *dcPtr) noexcept(false);
+    void PmPutRow(const ComponentType *samples, int32_t row, int32_t Pt);
     void GetDht (DecompressInfo *dcPtr) noexcept(false);
     void GetDri (DecompressInfo *dcPtr) noexcept(false);
     void GetSof (DecompressInfo *dcPtr) noexcept(false);
@@ -161,18 +222,31 @@ private:
     JpegMarker ProcessTables (DecompressInfo *dcPtr);
     void ReadFileHeader (DecompressInfo *dcPtr) noexcept(false);
     int32_t ReadScanHeader (DecompressInfo *dcPtr);
-    int32_t HuffDecode(HuffmanTable *htbl);
+    int32_t HuffDecode(JpegBitReader &bits, HuffmanTable *htbl);
 
     std::vector<uint16_t> m_slices;
-
-    MCU *m_mcuROW1, *m_mcuROW2;
-    char *m_buf1,*m_buf2;
-
-    /** fill the bit buffer */
-    void fillBitBuffer (IO::Stream * s, uint16_t nbits);
-    uint16_t m_bitsLeft;
-    uint32_t m_getBuffer;
-    RawData *m_output;
+    /** the region to output. Empty for the whole frame. */
+    uint32_t m_regionX, m_regionY, m_regionWidth, m_regionHeight;
+
+    DecodeIndex *m_index;
+    bool m_recordIndex;
+    /** the rows between checkpoints, while recording them. */
+    uint32_t m_checkpointInterval;
+    /** the scan data, to match the decode index. */
+    DecodeIndex::Scan m_scan;
+
+    /** A span of consecutive samples of a decoded row in the output */
+    struct RowSpan {
+        uint32_t src;  /**< the offset in the decoded row */
+        uint32_t dest; /**< the offset in the output */
+        uint32_t len;  /**< the number of samples */
+    };
+    std::vector<RowSpan> m_spans;
+    /** index of the first span of each row in m_spans. One extra
+     * element marks the end. */
+    std::vector<uint32_t> m_rowSpans;
+    uint16_t *m_outputData;
+    uint32_t m_hSampling, m_vSampling;
 
     /** private copy constructor to make sure it is not called */
     LJpegDecompressor(const LJpegDecompressor& f);
@@ -21,12 +21,211 @@
 #ifndef OR_INTERNALS_LJPEGDECOMPRESSOR_PRIV_H
 #define OR_INTERNALS_LJPEGDECOMPRESSOR_PRIV_H
 
+#include <stdint.h>
 #include <string.h>
 
+#include <vector>
 
 
 namespace OpenRaw {
+namespace IO {
+class Stream;
+}
 namespace Internals {
+
+/*
+ * Number of bits peeked from the bit stream to decode a Huffman code
+ * with a single table lookup.
+ */
+#define HUFF_LOOKAHEAD 12
+
+/*
+ * The lookup table entries are packed as follow:
+ *  - bits 0-4: the number of bits to flush from the bit stream.
+ *  - bit 5: set if the entry holds the extended difference (in the
+ *    16 upper bits), ie the code and its additional bits both fit in
+ *    the lookahead.
+ *  - bits 8-12: when bit 5 isn't set, the SSSS category. The additional
+ *    bits still have to be read from the bit stream.
+ * An entry of 0 means the code is longer than HUFF_LOOKAHEAD.
+ */
+#define HUFF_LOOKUP_FULL 0x20
+
+/*
+ * Bit reader for the entropy coded segment, held in memory.
+ *
+ * Bits are doled out from a 64-bit buffer. The refill loads 8 bytes
+ * at once, unless one of them is 0xFF, in which case the stuffed
+ * zero bytes (0xFF00) are removed one byte at a time.
+ * When a marker is found the reader stops there and feeds zeroes,
+ * as it does past the end of the data, so the data is virtually
+ * padded and the decoder never needs to check for the end.
+ * The reader then stays on the marker, for nextMarker().
+ */
+class JpegBitReader
+{
+public:
+	JpegBitReader()
+		: m_p(NULL), m_end(NULL), m_start(NULL),
+		  m_consumed(0),
+		  m_buffer(0), m_bitsLeft(0),
+		  m_loaded(0),
+		  m_marker(false),
+		  m_source(NULL)
+		{
+		}
+	/*
+	 * Reset the reader to read len bytes at p.
+	 */
+	void reset(const uint8_t *p, size_t len)
+		{
+			m_p = p;
+			m_end = p + len;
+			m_start = p;
+			m_consumed = 0;
+			m_buffer = 0;
+			m_bitsLeft = 0;
+			m_loaded = 0;
+			m_marker = false;
+			m_source = NULL;
+			m_chunk.clear();
+		}
+	/*
+	 * Reset the reader to read the stream s to the end, a chunk
+	 * at a time.
+	 */
+	void reset(IO::Stream *s);
+	/*
+	 * Read the first chunk of the stream, so that the data can
+	 * be looked at between pos() and end().
+	 */
+	void preload()
+		{
+			refill();
+		}
+	/*
+	 * Whether all the data is in memory, between pos() and end().
+	 */
+	bool inMemory() const
+		{
+			return m_chunk.empty();
+		}
+	/*
+	 * Make sure there are at least nbits (<= 56) in the buffer.
+	 */
+	void ensure(uint32_t nbits)
+		{
+			if (m_bitsLeft < nbits) {
+				fill();
+			}
+		}
+	/*
+	 * Return the next nbits without removing them. ensure() must
+	 * have been called.
+	 */
+	uint32_t peek(uint32_t nbits) const
+		{
+			return (m_buffer >> (m_bitsLeft - nbits))
+				& ((1U << nbits) - 1);
+		}
+	void skip(uint32_t nbits)
+		{
+			m_bitsLeft -= nbits;
+		}
+	uint32_t get(uint32_t nbits)
+		{
+			ensure(nbits);
+			uint32_t v = peek(nbits);
+			skip(nbits);
+			return v;
+		}
+	/*
+	 * Throw away the bits left and find the next marker.
+	 * Return the marker code, or 0 if there is none.
+	 * The reader resumes after the marker.
+	 */
+	int32_t nextMarker();
+	/*
+	 * The number of bits consumed since the reset, stuffing
+	 * excluded.
+	 */
+	uint64_t bitPos() const
+		{
+			return m_loaded - m_bitsLeft;
+		}
+	/*
+	 * The position of the next bit: the offset of its byte
+	 * since the reset, and the bits of that byte already read.
+	 * Return false past the end of the data.
+	 */
+	bool position(uint64_t &offset, uint32_t &bit) const;
+	/*
+	 * The current position in the data.
+	 */
+	const uint8_t *pos() const
+		{
+			return m_p;
+		}
+	/*
+	 * The end of the data.
+	 */
+	const uint8_t *end() const
+		{
+			return m_end;
+		}
+private:
+	void fill()
+		{
+			if (m_p + 8 > m_end && m_source) {
+				refill();
+			}
+			if (!m_marker && m_p + 8 <= m_end) {
+				uint64_t v = ((uint64_t)m_p[0] << 56)
+					| ((uint64_t)m_p[1] << 48)
+					| ((uint64_t)m_p[2] << 40)
+					| ((uint64_t)m_p[3] << 32)
+					| ((uint64_t)m_p[4] << 24)
+					| ((uint64_t)m_p[5] << 16)
+					| ((uint64_t)m_p[6] << 8)
+					| (uint64_t)m_p[7];
+				/* is there a 0xFF byte? */
+				uint64_t ff = (~v - 0x0101010101010101ULL) & v
+					& 0x8080808080808080ULL;
+				if (!ff) {
+					uint32_t n = (63 - m_bitsLeft) >> 3;
+					m_buffer = (m_buffer << (n * 8)) | (v >> (64 - n * 8));
+					m_bitsLeft += n * 8;
+					m_loaded += n * 8;
+					m_p += n;
+					return;
+				}
+			}
+			fillSlow();
+		}
+	void fillSlow();
+	/*
+	 * Read the next chunk from the stream, after the bytes left.
+	 */
+	bool refill();
+	/*
+	 * Whether there are bytes left, reading the next chunk if needed.
+	 */
+	bool more()
+		{
+			return m_p < m_end || refill();
+		}
+
+	const uint8_t *m_p;
+	const uint8_t *m_end;
+	const uint8_t *m_start;		/* the data at the reset, or the chunk */
+	uint64_t m_consumed;		/* the bytes read before m_start */
+	uint64_t m_buffer;
+	uint32_t m_bitsLeft;
+	uint64_t m_loaded;
+	bool m_marker;
+	IO::Stream *m_source;
+	std::vector<uint8_t> m_chunk;
+};
 		
 /*
 * The following structure stores basic information about one component.
@@ -41,8 +240,9 @@ typedef struct JpegComponentInfo {
 	
 	/*
 	 * Downsampling is not normally used in lossless JPEG, although
-	 * it is permitted by the JPEG standard (DIS). We set all sampling 
-	 * factors to 1 in this program.
+	 * it is permitted by the JPEG standard (DIS). Only the first
+	 * component may have sampling factors other than 1, for the
+	 * luma of the Canon sRAW.
 	 */
 	int16_t hSampFactor;		/* horizontal sampling factor */
 	int16_t vSampFactor;		/* vertical sampling factor   */
@@ -87,8 +287,7 @@ struct HuffmanTable {
 	uint16_t mincode[17];
 	int32_t maxcode[18];
 	int16_t valptr[17];
-	int32_t numbits[256];
-	int32_t value[256];
+	int32_t lookup[1 << HUFF_LOOKAHEAD];
 };
 
 /*
@@ -105,7 +304,8 @@ struct DecompressInfo
 		: imageWidth(0), imageHeight(0),
 			dataPrecision(0), compInfo(NULL),
 			numComponents(0),
-			compsInScan(0),
+			compsInScan(0), blocksInMCU(0),
+			MCUsPerRow(0), MCURows(0),
 			Ss(0), Pt(0),
 			restartInterval(0), restartInRows(0),
 			restartRowsToGo(0), nextRestartNum(0)
@@ -154,6 +354,13 @@ struct DecompressInfo
 	 * curCompInfo array.
 	 */
 	int16_t MCUmembership[10];
+	/*
+	 * The samples in a MCU, more than compsInScan when the first
+	 * component is subsampled, and the MCUs of the scan.
+	 */
+	int16_t blocksInMCU;
+	int32_t MCUsPerRow;
+	int32_t MCURows;
 	
 	/*
 	 * ptrs to Huffman coding tables, or NULL if not defined
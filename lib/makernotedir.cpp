@@ -71,6 +71,18 @@ MakerNoteDir::createMakerNote(off_t offset,
             offset + 8, container, offset + 8, "Olympus");
     }
 
+    // offsets are from the file start.
+    if (memcmp("AOC\0", data, 4) == 0) {
+        return std::make_shared<MakerNoteDir>(
+            offset + 6, container, 0, "Pentax");
+    }
+
+    // offsets are from the MakerNote start.
+    if (memcmp("PENTAX \0", data, 8) == 0) {
+        return std::make_shared<MakerNoteDir>(
+            offset + 10, container, offset, "Pentax");
+    }
+
     if (memcmp("MLT0", data + 10, 4) == 0) {
         return std::make_shared<MakerNoteDir>(
             offset, container, offset, "Minolta");
@@ -259,32 +259,10 @@ void MRWFile::_identifyId()
 	}
 	else {
 		Unpack unpack(x, IFD::COMPRESS_NONE);
-		size_t blocksize = unpack.block_size();
-		std::unique_ptr<uint8_t[]> block(new uint8_t[blocksize]);
-		uint8_t * outdata = (uint8_t*)data.data();
-		size_t outsize = finaldatalen;
-		size_t got;
-		do {
-			Trace(DEBUG2) << "fatchData @offset " << offset << "\n";
-			got = m_container->fetchData (block.get(),
-										  offset, blocksize);
-			fetched += got;
-			offset += got;
-			Trace(DEBUG2) << "got " << got << "\n";
-			if(got) {
-				size_t out;
-                                or_error err = unpack.unpack_be12to16(outdata, outsize,
-									block.get(), got, out);
-				outdata += out;
-				outsize -= out;
-				Trace(DEBUG2) << "unpacked " << out
-							  << " bytes from " << got << "\n";
-                                if(err != OR_ERROR_NONE) {
-                                    ret = err;
-                                    break;
-                                }
-			}
-		} while((got != 0) && (fetched < datalen));
+		Trace(DEBUG2) << "unpack strip @offset " << offset << "\n";
+		ret = unpack.unpack_strip(m_container, offset, datalen,
+					   (uint8_t*)data.data(), finaldatalen,
+					   fetched);
 	}
 	if (fetched < datalen) {
 		Trace(WARNING) << "Fetched only " << fetched <<
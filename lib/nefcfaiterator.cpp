@@ -19,6 +19,8 @@
  * <http://www.gnu.org/licenses/>.
  */
 
+#include <assert.h>
+
 #include "nefcfaiterator.hpp"
 
 namespace OpenRaw {
@@ -59,6 +61,45 @@ uint16_t NefCfaIterator::get()
 	return ret;
 }
 
+void NefCfaIterator::getRow(const uint16_t *curve, uint16_t *out,
+							size_t columns)
+{
+	assert(m_column == 0);
+	assert(columns <= m_columns);
+
+	// the first two columns are predicted from the row above,
+	// the others from the left of the same colour.
+	uint16_t *vpred = m_vpred[m_row & 1];
+	uint16_t hpred[2];
+	size_t col = 0;
+	for (; col < 2 && col < m_columns; col++) {
+		vpred[col] += m_diffs.get();
+		hpred[col] = vpred[col];
+		if (col < columns) {
+			out[col] = curve[hpred[col] & 0x3fff];
+		}
+	}
+	for (; col + 1 < columns; col += 2) {
+		hpred[0] += m_diffs.get();
+		out[col] = curve[hpred[0] & 0x3fff];
+		hpred[1] += m_diffs.get();
+		out[col + 1] = curve[hpred[1] & 0x3fff];
+	}
+	for (; col < columns; col++) {
+		hpred[col & 1] += m_diffs.get();
+		out[col] = curve[hpred[col & 1] & 0x3fff];
+	}
+	// the samples not output.
+	for (; col < m_columns; col++) {
+		hpred[col & 1] += m_diffs.get();
+	}
+	if (m_columns >= 2) {
+		m_hpred[0] = hpred[0];
+		m_hpred[1] = hpred[1];
+	}
+	m_row++;
+}
+
 }
 }
 
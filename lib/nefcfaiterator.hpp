@@ -44,6 +44,14 @@ public:
 	NefCfaIterator (const NefDiffIterator&, size_t, size_t,
 					const uint16_t(*)[2]);
 	uint16_t get();
+	/** Decode the next row, through a curve.
+	 * @param curve the output value for each of the 0x4000
+	 * values decoded.
+	 * @param out where to write the row.
+	 * @param columns the number of samples to write. The samples
+	 * of the row past it are decoded and dropped.
+	 */
+	void getRow(const uint16_t *curve, uint16_t *out, size_t columns);
 };
 
 }
@@ -0,0 +1,242 @@
+/*
+ * libopenraw - nefdecompressor.cpp
+ *
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <libopenraw/consts.h>
+
+#include "rawdata.hpp"
+#include "trace.hpp"
+#include "parallel.hpp"
+#include "nefdiffiterator.hpp"
+#include "nefcfaiterator.hpp"
+#include "speculative.hpp"
+#include "nefdecompressor.hpp"
+
+namespace OpenRaw {
+namespace Internals {
+
+using namespace Debug;
+
+NefDecompressor::NefDecompressor(const uint8_t *buffer, size_t size,
+                                 RawContainer *container,
+                                 const HuffmanNode *huffman,
+                                 const uint16_t vpred[2][2],
+                                 const uint16_t *curve,
+                                 uint32_t w, uint32_t h, uint32_t columns)
+    : Decompressor(NULL, container)
+    , m_buffer(buffer)
+    , m_size(size)
+    , m_huffman(huffman)
+    , m_curve(curve)
+    , m_h(h)
+    , m_w(w)
+    , m_columns(columns)
+    , m_index(NULL)
+    , m_recordIndex(false)
+{
+    memcpy(m_vpred, vpred, sizeof(m_vpred));
+    // the Huffman data is all the strip.
+    m_scan.offset = 0;
+    m_scan.size = size;
+    m_scan.hash = DecodeIndex::hash(buffer, size);
+}
+
+void NefDecompressor::setDecodeIndex(DecodeIndex *index, bool record)
+{
+    m_index = index;
+    m_recordIndex = record;
+}
+
+/* Apply the predictors to the differences of a row, like
+ * NefCfaIterator::getRow(). */
+void NefDecompressor::predictRow(const int16_t *diffs, uint16_t vpred[2],
+                                 uint16_t *out)
+{
+    uint16_t hpred[2];
+    uint32_t col = 0;
+    for (; col < 2 && col < m_w; col++) {
+        vpred[col] += diffs[col];
+        hpred[col] = vpred[col];
+        if (col < m_columns) {
+            out[col] = m_curve[hpred[col] & 0x3fff];
+        }
+    }
+    for (; col < m_columns; col++) {
+        hpred[col & 1] += diffs[col];
+        out[col] = m_curve[hpred[col & 1] & 0x3fff];
+    }
+}
+
+/* Decode the rows [startRow, endRow), adding a checkpoint to the index
+ * every interval rows if recording. The checkpoint state is the
+ * vertical predictors. */
+void NefDecompressor::decodeRows(NefDiffIterator &diffs, uint32_t startRow,
+                                 uint32_t endRow, uint16_t vpred[2][2],
+                                 uint16_t *out, bool record)
+{
+    const uint32_t interval = record ? m_index->interval() : 0;
+    std::vector<int16_t> rowDiffs(m_w);
+    for (uint32_t row = startRow; row < endRow; row++) {
+        uint64_t pos = diffs.bitPos();
+        // not past the end of the data.
+        if (interval && row && row % interval == 0 && pos / 8 < m_size) {
+            DecodeIndex::Checkpoint checkpoint;
+            checkpoint.row = row;
+            checkpoint.offset = pos / 8;
+            checkpoint.bit = pos % 8;
+            checkpoint.state.assign(&vpred[0][0], &vpred[0][0] + 4);
+            m_index->add(std::move(checkpoint));
+        }
+        for (uint32_t col = 0; col < m_w; col++) {
+            rowDiffs[col] = diffs.get();
+        }
+        predictRow(rowDiffs.data(), vpred[row & 1],
+                   out + (size_t)row * m_columns);
+    }
+}
+
+/* Decode the bands of rows between the checkpoints of the index, in
+ * parallel. */
+bool NefDecompressor::decompressIndexed(uint16_t *out)
+{
+    const std::vector<DecodeIndex::Checkpoint> &checkpoints
+        = m_index->checkpoints();
+    uint32_t lastRow = 0;
+    for (const auto & checkpoint : checkpoints) {
+        if (checkpoint.state.size() != 4 || checkpoint.offset >= m_size
+            || checkpoint.bit >= 8 || checkpoint.row <= lastRow
+            || checkpoint.row >= m_h) {
+            Trace(DEBUG1) << "Decode index doesn't fit the data\n";
+            return false;
+        }
+        lastRow = checkpoint.row;
+    }
+
+    parallelFor(checkpoints.size() + 1, [&](size_t i) {
+            uint32_t startRow = i ? checkpoints[i - 1].row : 0;
+            uint32_t endRow = i < checkpoints.size()
+                ? checkpoints[i].row : m_h;
+            uint16_t vpred[2][2];
+            size_t offset = 0;
+            if (i == 0) {
+                memcpy(vpred, m_vpred, sizeof(vpred));
+            }
+            else {
+                const DecodeIndex::Checkpoint &checkpoint = checkpoints[i - 1];
+                std::copy(checkpoint.state.cbegin(), checkpoint.state.cend(),
+                          &vpred[0][0]);
+                offset = checkpoint.offset;
+            }
+            NefDiffIterator diffs(m_huffman, m_buffer + offset,
+                                  m_size - offset);
+            if (i) {
+                diffs.skip(checkpoints[i - 1].bit);
+            }
+            decodeRows(diffs, startRow, endRow, vpred, out, false);
+        });
+    return true;
+}
+
+/* Decode the differences on several threads, then apply the
+ * predictors row by row. */
+bool NefDecompressor::decompressSpeculative(uint16_t *out)
+{
+    uint16_t vpred[2][2];
+    memcpy(vpred, m_vpred, sizeof(vpred));
+    std::vector<int16_t> rowDiffs(m_w);
+    uint32_t row = 0;
+    size_t col = 0;
+    return decodeSpeculative<NefDiffIterator, int16_t>(
+        m_buffer, m_size, false, (size_t)m_w * m_h,
+        [this] (const uint8_t *p, size_t size) {
+            return NefDiffIterator(m_huffman, p, size);
+        },
+        [] (NefDiffIterator &diffs, std::vector<int16_t> &values) {
+            values.push_back(diffs.get());
+        },
+        [&] (const int16_t *values, size_t count) {
+            while (count) {
+                size_t n = std::min<size_t>(count, m_w - col);
+                std::copy(values, values + n, rowDiffs.begin() + col);
+                values += n;
+                count -= n;
+                col += n;
+                if (col == m_w) {
+                    predictRow(rowDiffs.data(), vpred[row & 1],
+                               out + (size_t)row * m_columns);
+                    row++;
+                    col = 0;
+                }
+            }
+        });
+}
+
+RawData *NefDecompressor::decompress(RawData *in)
+{
+    RawData *output;
+    if (in) {
+        output = in;
+    } else {
+        output = new RawData;
+    }
+
+    uint16_t *p = (uint16_t *)output->allocData((size_t)m_columns * m_h * 2);
+    output->setDimensions(m_columns, m_h);
+    output->setDataType(OR_DATA_TYPE_RAW);
+
+    if (m_index) {
+        if (m_index->matches(m_scan, m_w, m_h) && decompressIndexed(p)) {
+            return output;
+        }
+        // recording is done serially.
+        if (m_recordIndex) {
+            m_index->reset(m_scan, m_w, m_h);
+            uint16_t vpred[2][2];
+            memcpy(vpred, m_vpred, sizeof(vpred));
+            NefDiffIterator diffs(m_huffman, m_buffer, m_size);
+            decodeRows(diffs, 0, m_h, vpred, p, true);
+            return output;
+        }
+    }
+    if (!decompressSpeculative(p)) {
+        NefDiffIterator diffs(m_huffman, m_buffer, m_size);
+        NefCfaIterator iter(diffs, m_h, m_w, m_vpred);
+        for (uint32_t i = 0; i < m_h; i++) {
+            iter.getRow(m_curve, p + (size_t)i * m_columns, m_columns);
+        }
+    }
+    return output;
+}
+
+}
+}
+/*
+  Local Variables:
+  mode:c++
+  c-file-style:"stroustrup"
+  c-file-offsets:((innamespace . 0))
+  indent-tabs-mode:nil
+  fill-column:80
+  End:
+*/
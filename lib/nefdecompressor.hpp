@@ -0,0 +1,95 @@
+/*
+ * libopenraw - nefdecompressor.hpp
+ *
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef OR_INTERNALS_NEFDECOMPRESSOR_H_
+#define OR_INTERNALS_NEFDECOMPRESSOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "decompressor.hpp"
+#include "decodeindex.hpp"
+
+namespace OpenRaw {
+
+class RawData;
+
+namespace Internals {
+
+class RawContainer;
+struct HuffmanNode;
+class NefDiffIterator;
+
+/** Decompress the Huffman coded NEF. */
+class NefDecompressor
+  : public Decompressor
+{
+public:
+  /**
+   * @param buffer the Huffman coded data.
+   * @param size the size of the data.
+   * @param container the container.
+   * @param huffman the Huffman tree.
+   * @param vpred the initial vertical predictors.
+   * @param curve the output value for each of the 0x4000 values
+   * decoded.
+   * @param w the number of samples of a row.
+   * @param h the number of rows.
+   * @param columns the number of samples output per row, up to w.
+   */
+  NefDecompressor(const uint8_t *buffer, size_t size,
+                  RawContainer *container, const HuffmanNode *huffman,
+                  const uint16_t vpred[2][2], const uint16_t *curve,
+                  uint32_t w, uint32_t h, uint32_t columns);
+  /** Decompress into columns x h samples. The caller sets the bpc. */
+  virtual RawData *decompress(RawData *in = NULL) override;
+  /** Set the index of checkpoints in the data.
+   * @param index the index. If it was recorded for this data, the
+   * rows are decoded in bands from the checkpoints, in parallel.
+   * @param record whether to record the index otherwise.
+   */
+  void setDecodeIndex(DecodeIndex *index, bool record);
+private:
+  bool decompressSpeculative(uint16_t *out);
+  bool decompressIndexed(uint16_t *out);
+  void decodeRows(NefDiffIterator &diffs, uint32_t startRow,
+                  uint32_t endRow, uint16_t vpred[2][2], uint16_t *out,
+                  bool record);
+  void predictRow(const int16_t *diffs, uint16_t vpred[2], uint16_t *out);
+
+  const uint8_t *m_buffer;
+  size_t m_size;
+  const HuffmanNode *m_huffman;
+  uint16_t m_vpred[2][2];
+  const uint16_t *m_curve;
+
+  uint32_t m_h;
+  uint32_t m_w;
+  uint32_t m_columns;
+
+  DecodeIndex *m_index;
+  bool m_recordIndex;
+  DecodeIndex::Scan m_scan;
+};
+
+}
+}
+#endif
@@ -25,22 +25,6 @@
 namespace OpenRaw {
 namespace Internals {
 
-int NefDiffIterator::get()
-{
-	unsigned int t = m_decoder.decode(m_iter);
-	unsigned int len = t & 15;
-	unsigned int shl = t >> 4;
-
-
-	unsigned int bits = m_iter.get(len - shl);
-
-	int diff = ((bits << 1) + 1) << shl >> 1;
-	if ((diff & (1 << (len-1))) == 0)
-		diff -= (1 << len) - !shl;
-
-	return diff;
-}
-
 // 00              5
 // 010             4
 // 011             3
@@ -42,7 +42,30 @@ class NefDiffIterator {
 	static const HuffmanNode LossLess14Bit[];
 
 	NefDiffIterator (const HuffmanNode* const, const uint8_t *, size_t size);
-	int get();
+	int get()
+		{
+			unsigned int t = m_decoder.decode(m_iter);
+			unsigned int len = t & 15;
+			unsigned int shl = t >> 4;
+
+			unsigned int bits = m_iter.get(len - shl);
+
+			int diff = ((bits << 1) + 1) << shl >> 1;
+			if ((diff & (1 << (len-1))) == 0)
+				diff -= (1 << len) - !shl;
+
+			return diff;
+		}
+	/** Skip n bits, less than 8. To resume at a bit of a byte. */
+	void skip(unsigned int n)
+		{
+			m_iter.get(n);
+		}
+	/** The number of bits read. */
+	uint64_t bitPos() const
+		{
+			return m_iter.bitPos();
+		}
 };
 
 }
@@ -24,8 +24,10 @@
 #include <stdio.h>
 #include <sys/types.h>
 
+#include <algorithm>
 #include <cstdint>
 #include <memory>
+#include <string>
 #include <vector>
 
 #include <libopenraw/cameraids.h>
@@ -38,15 +40,18 @@
 
 
 #include "trace.hpp"
+#include "decodeindex.hpp"
 #include "ifd.hpp"
 #include "ifdfilecontainer.hpp"
 #include "ifdentry.hpp"
 #include "makernotedir.hpp"
 #include "nefdiffiterator.hpp"
-#include "nefcfaiterator.hpp"
+#include "nefdecompressor.hpp"
 #include "neffile.hpp"
+#include "parallel.hpp"
 #include "rawcontainer.hpp"
 #include "rawfile_private.hpp"
+#include "unpack.hpp"
 
 using namespace Debug;
 
@@ -273,7 +278,8 @@ bool NefFile::isCompressed(RawContainer & container, uint32_t offset)
     return false;
 }
 
-::or_error NefFile::_decompressNikonQuantized(RawData & data)
+::or_error NefFile::_decompressNikonQuantized(RawData & data,
+                                              uint32_t options)
 {
     NEFCompressionInfo c;
     if (!_getCompressionCurve(data, c)) {
@@ -286,29 +292,151 @@ bool NefFile::isCompressed(RawContainer & container, uint32_t offset)
     //FIXME: not always true
     const uint32_t columns = raw_columns - 1;
     
-    NefDiffIterator
-        diffs(c.huffman, static_cast<uint8_t*>(data.data()), data.size());
-    NefCfaIterator iter(diffs, rows, raw_columns, c.vpred);
-    
+    if (c.curve.empty()) {
+        Trace(ERROR) << "empty compression curve\n";
+        return OR_ERROR_INVALID_FORMAT;
+    }
+
+    // the curve, shifted to 16 bits, for all the values decoded.
+    // The values past the end of the curve get the last one.
+    std::vector<uint16_t> curve(0x4000);
+    unsigned shift = 16 - data.bpc();
+    for (size_t i = 0; i < curve.size(); i++) {
+        curve[i] = c.curve[std::min(i, c.curve.size() - 1)] << shift;
+    }
+
+    NefDecompressor decomp(static_cast<uint8_t*>(data.data()), data.size(),
+                           m_container, c.huffman, c.vpred, curve.data(),
+                           raw_columns, rows, columns);
+    DecodeIndex & index = _decodeIndex();
+    bool recordIndex = (options & OR_OPTIONS_RECORD_INDEX) != 0;
+    if (recordIndex || !index.empty()) {
+        decomp.setDecodeIndex(&index, recordIndex);
+    }
     RawData newData;
-    uint16_t *p = (uint16_t *) newData.allocData(rows * columns * 2);
-    newData.setDimensions(columns, rows);
-    newData.setDataType(OR_DATA_TYPE_RAW);
+    decomp.decompress(&newData);
     uint16_t bpc = data.bpc();
     newData.setBpc(bpc);
     newData.setWhiteLevel((1 << bpc) - 1);
     newData.setCfaPatternType(data.cfaPattern()->patternType());
-	
-    for (unsigned int i = 0; i < rows; i++) {
-        for (unsigned int j = 0; j < raw_columns; j++) {
-            uint16_t t = iter.get();
-            if (j < columns) {
-                unsigned shift = 16 - data.bpc();
-                p[i * columns + j] =  c.curve[t & 0x3fff] << shift;
+    
+    data.swap(newData);
+    return OR_ERROR_NONE;
+}
+
+NefFile::StripLayout NefFile::_getStripLayout(const RawData & data)
+{
+    // like dcraw, from the size of the strip.
+    const size_t x = data.width();
+    const size_t y = data.height();
+    const size_t size = data.size();
+    if (!x || !y) {
+        return StripLayout::HUFFMAN;
+    }
+    if ((x + 9) / 10 * 16 * y == size) {
+        return StripLayout::NIKON_PACK;
+    }
+    if (x * y * 3 == size * 2) {
+        // the Coolpix P pack in words, but the 4032 wide P7700 and
+        // P7800, that compress.
+        std::string model;
+        const IfdDir::Ref & _mainIfd = mainIfd();
+        if (_mainIfd && _mainIfd->getValue(IFD::EXIF_TAG_MODEL, model)
+            && model.compare(0, 9, "COOLPIX P") == 0 && x != 4032) {
+            return StripLayout::PACKED_12_WORDS;
+        }
+        return StripLayout::PACKED_12;
+    }
+    if (x * y * 3 == size) {
+        return StripLayout::YUV;
+    }
+    if (x * y * 2 == size) {
+        return StripLayout::UNPACKED_16;
+    }
+    return StripLayout::HUFFMAN;
+}
+
+::or_error NefFile::_unpackNikonStrip(RawData & data, StripLayout layout)
+{
+    const uint32_t rows = data.height();
+    const uint32_t columns = data.width();
+    uint8_t *src = static_cast<uint8_t*>(data.data());
+
+    // the samples unpacked from a row, and its size.
+    uint32_t row_samples = columns;
+    size_t row_size;
+    switch (layout) {
+    case StripLayout::NIKON_PACK:
+        row_samples = (columns + 9) / 10 * 10;
+        row_size = row_samples / 10 * 16;
+        break;
+    case StripLayout::UNPACKED_16:
+        row_size = columns * 2;
+        break;
+    default:
+        // the rows must start on a pair of samples.
+        if (columns & 1) {
+            Trace(ERROR) << "Odd width " << columns << " not supported\n";
+            return OR_ERROR_INVALID_FORMAT;
+        }
+        row_size = columns / 2 * 3;
+        break;
+    }
+    if (layout == StripLayout::PACKED_12_WORDS) {
+        // then it is a 12 bits big endian stream.
+        copy_swap32(src, src, data.size());
+    }
+    Unpack unpack(row_samples, layout == StripLayout::NIKON_PACK
+                  ? IFD::COMPRESS_NIKON_PACK : IFD::COMPRESS_NONE, 12);
+
+    RawData newData;
+    uint16_t *p = (uint16_t *) newData.allocData(rows * columns * 2);
+    newData.setDimensions(columns, rows);
+    newData.setDataType(OR_DATA_TYPE_RAW);
+    newData.setBpc(12);
+    newData.setWhiteLevel((1 << 12) - 1);
+    if (layout == StripLayout::PACKED_12_WORDS) {
+        newData.setCfaPatternType(OR_CFA_PATTERN_RGGB);
+    } else {
+        newData.setCfaPatternType(data.cfaPattern()->patternType());
+    }
+
+    // a few bands per worker, so that they stay busy.
+    const size_t band_rows = std::max<size_t>(
+        1, (rows + parallelWorkers() * 4 - 1) / (parallelWorkers() * 4));
+    const size_t bands = (rows + band_rows - 1) / band_rows;
+    std::vector<or_error> errors(bands, OR_ERROR_NONE);
+    parallelFor(bands, [&] (size_t band) {
+            const size_t end = std::min<size_t>(rows, (band + 1) * band_rows);
+            std::vector<uint16_t> padded(row_samples);
+            for (size_t row = band * band_rows; row < end; row++) {
+                const uint8_t *s = src + row * row_size;
+                uint16_t *out = p + row * columns;
+                if (layout == StripLayout::UNPACKED_16) {
+                    for (size_t col = 0; col < columns; col++) {
+                        out[col] = (s[col * 2] << 4) | (s[col * 2 + 1] >> 4);
+                    }
+                    continue;
+                }
+                uint16_t *dest = (row_samples == columns) ? out
+                    : padded.data();
+                size_t outsize = 0;
+                errors[band] = unpack.unpack((uint8_t*)dest, row_samples * 2,
+                                             s, row_size, outsize);
+                if (errors[band] != OR_ERROR_NONE) {
+                    return;
+                }
+                if (dest != out) {
+                    std::copy(dest, dest + columns, out);
+                }
             }
+        });
+    for (auto err : errors) {
+        if (err != OR_ERROR_NONE) {
+            return err;
         }
     }
-    
+
     data.swap(newData);
     return OR_ERROR_NONE;
 }
@@ -321,7 +449,16 @@ bool NefFile::isCompressed(RawContainer & container, uint32_t offset)
        compression == IFD::COMPRESS_NONE) {
         return OR_ERROR_NONE;
     } else if(compression == IFD::COMPRESS_NIKON_QUANTIZED) {
-        return _decompressNikonQuantized(data);
+        StripLayout layout = _getStripLayout(data);
+        switch (layout) {
+        case StripLayout::HUFFMAN:
+            return _decompressNikonQuantized(data, options);
+        case StripLayout::YUV:
+            Trace(ERROR) << "YUV data is not supported\n";
+            return OR_ERROR_INVALID_FORMAT;
+        default:
+            return _unpackNikonStrip(data, layout);
+        }
     } else {
         return OR_ERROR_INVALID_FORMAT;
     }
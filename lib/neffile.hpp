@@ -69,9 +69,29 @@ public:
 
 private:
 
+    /** How the samples of a COMPRESS_NIKON_QUANTIZED strip are
+     *  stored. Many Coolpix, like the NRW, don't compress them: it is
+     *  told by the size of the strip.
+     */
+    enum class StripLayout {
+        HUFFMAN,
+        /** 12 bits big endian, with a padding byte every 15 bytes. */
+        NIKON_PACK,
+        /** 12 bits big endian. */
+        PACKED_12,
+        /** 12 bits from the MSB of little endian 32-bits words. */
+        PACKED_12_WORDS,
+        /** 12 bits in the high bits of big endian 16-bits samples. */
+        UNPACKED_16,
+        /** not CFA. */
+        YUV
+    };
+
     static const IfdFile::camera_ids_t s_def[];
     int _getCompressionCurve(RawData&, NEFCompressionInfo&);
-    ::or_error _decompressNikonQuantized(RawData&);
+    StripLayout _getStripLayout(const RawData&);
+    ::or_error _decompressNikonQuantized(RawData&, uint32_t options);
+    ::or_error _unpackNikonStrip(RawData&, StripLayout);
     virtual ::or_error _decompressIfNeeded(RawData&, uint32_t) override;
 };
 
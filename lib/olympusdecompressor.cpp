@@ -27,156 +27,335 @@
 
 #include "rawdata.hpp"
 #include "olympusdecompressor.hpp"
-#include "bititerator.hpp"
+#include "decodeindex.hpp"
+#include "parallel.hpp"
+#include "trace.hpp"
 
 namespace OpenRaw {
 namespace Internals {
 
-static void decompressOlympus(const uint8_t* buffer, size_t size, uint8_t* data,
-                              uint32_t w, uint32_t h);
+namespace {
 
-// decompression ported from RawSpeed.
-static void decompressOlympus(const uint8_t* buffer, size_t size, uint8_t* data,
-                              uint32_t w, uint32_t h)
+/** The number of leading 0 bits of a 12 bits value, up to 12. */
+struct HighTable
 {
-    int nbits, sign, low, high, i, wo0, n, nw0, wo1, nw1;
-    int acarry0[3], acarry1[3], pred, diff;
-
-    int pitch = w * 2; //(((w * 2/*bpp*/) + 15) / 16) * 16; // TODO make that
-                       //part of the outer datas
-
-    /* Build a table to quickly look up "high" value */
-    char bittable[4096];
-    for (i = 0; i < 4096; i++) {
-        int b = i;
-        for (high = 0; high < 12; high++) {
-            if ((b >> (11 - high)) & 1) {
-                break;
+    uint8_t high[4096];
+
+    HighTable()
+        {
+            for (int i = 0; i < 4096; i++) {
+                int h;
+                for (h = 0; h < 12; h++) {
+                    if ((i >> (11 - h)) & 1) {
+                        break;
+                    }
+                }
+                high[i] = h;
             }
         }
-        bittable[i] = high;
-    }
-    wo0 = nw0 = wo1 = nw1 = 0;
-    buffer += 7;
+};
 
-    BitIterator bits(buffer, size - 7);
+const HighTable s_highTable;
 
-    for (uint32_t y = 0; y < h; y++) {
-        memset(acarry0, 0, sizeof acarry0);
-        memset(acarry1, 0, sizeof acarry1);
-        uint16_t* dest = (uint16_t*)&data[y * pitch];
-        for (uint32_t x = 0; x < w; x++) {
-            //			bits.checkPos();
-            //			bits.fill();
-            i = 2 * (acarry0[2] < 3);
-            for (nbits = 2 + i; (uint16_t)acarry0[0] >> (nbits + i); nbits++) {
-            }
+/** The number of bits of a 16 bits value. */
+inline int bitLength(uint16_t v)
+{
+    return v >> 12 ? 16 - s_highTable.high[v >> 4]
+        : 12 - s_highTable.high[v];
+}
 
-            uint32_t b = bits.peek(15);
-            sign = (b >> 14) * -1;
-            low = (b >> 12) & 3;
-            high = bittable[b & 4095];
-            // Skip bits used above.
-            bits.skip(std::min(12 + 3, high + 1 + 3));
+/** Read the bitstream, MSB first, with a 64-bit buffer.
+ * The bytes are loaded 8 at once, and one by one at the end. Past
+ * the end of the data, the bits are 0.
+ */
+class BitReader
+{
+public:
+    BitReader(const uint8_t *p, size_t size)
+        : m_start(p)
+        , m_p(p)
+        , m_end(p + size)
+        , m_buffer(0)
+        , m_bits(0)
+        , m_padding(0)
+        {
+        }
 
-            if (high == 12) {
-                high = bits.get(16 - nbits) >> 1;
+    /** Have at least 57 bits in the buffer. */
+    void fill()
+        {
+            if (m_bits > 56) {
+                return;
             }
+            if (m_end - m_p < 8) {
+                fillSlow();
+                return;
+            }
+            uint64_t v = ((uint64_t)m_p[0] << 56)
+                | ((uint64_t)m_p[1] << 48)
+                | ((uint64_t)m_p[2] << 40)
+                | ((uint64_t)m_p[3] << 32)
+                | ((uint64_t)m_p[4] << 24)
+                | ((uint64_t)m_p[5] << 16)
+                | ((uint64_t)m_p[6] << 8)
+                | (uint64_t)m_p[7];
+            // the whole bytes that fit.
+            int bytes = (64 - m_bits) / 8;
+            m_buffer |= (v & (~(uint64_t)0 << (64 - bytes * 8))) >> m_bits;
+            m_bits += bytes * 8;
+            m_p += bytes;
+        }
+    /** Peek 1 to 32 bits. */
+    uint32_t peek(int n) const
+        {
+            return m_buffer >> (64 - n);
+        }
+    void skip(int n)
+        {
+            m_buffer <<= n;
+            m_bits -= n;
+        }
+    /** Get 0 to 32 bits. */
+    uint32_t get(int n)
+        {
+            uint32_t v = (m_buffer >> 1) >> (63 - n);
+            skip(n);
+            return v;
+        }
+    /** The number of bits read, including the 0 past the end. */
+    uint64_t bitPos() const
+        {
+            return (uint64_t)(m_p - m_start) * 8 + m_padding - m_bits;
+        }
 
-            acarry0[0] = (high << nbits) | bits.get(nbits);
-            diff = (acarry0[0] ^ sign) + acarry0[1];
-            acarry0[1] = (diff * 3 + acarry0[1]) >> 5;
-            acarry0[2] = acarry0[0] > 16 ? 0 : acarry0[2] + 1;
-
-            if (y < 2 || x < 2) {
-                if (y < 2 && x < 2) {
-                    pred = 0;
-                } else if (y < 2) {
-                    pred = wo0;
-                } else {
-                    pred = dest[-pitch + ((int)x)];
-                    nw0 = pred;
+private:
+    /** Fill byte by byte at the end of the data. */
+    void fillSlow()
+        {
+            while (m_bits <= 56) {
+                uint64_t v = 0;
+                if (m_p < m_end) {
+                    v = *m_p++;
                 }
-                dest[x] = pred + ((diff << 2) | low);
-                // Set predictor
-                wo0 = dest[x];
-            } else {
-                n = dest[-pitch + ((int)x)];
-                if (((wo0 < nw0) & (nw0 < n)) | ((n < nw0) & (nw0 < wo0))) {
-                    if (abs(wo0 - nw0) > 32 || abs(n - nw0) > 32) {
-                        pred = wo0 + n - nw0;
-                    } else {
-                        pred = (wo0 + n) >> 1;
-                    }
-                } else {
-                    pred = abs(wo0 - nw0) > abs(n - nw0) ? wo0 : n;
+                else {
+                    m_padding += 8;
                 }
-
-                dest[x] = pred + ((diff << 2) | low);
-                // Set predictors
-                wo0 = dest[x];
-                nw0 = n;
-            }
-            //      _ASSERTE(0 == dest[x] >> 12) ;
-
-            // ODD PIXELS
-            x += 1;
-            //			bits.checkPos();
-            //			bits.fill();
-            i = 2 * (acarry1[2] < 3);
-            for (nbits = 2 + i; (uint16_t)acarry1[0] >> (nbits + i); nbits++) {
-            }
-            b = bits.peek(15);
-            sign = (b >> 14) * -1;
-            low = (b >> 12) & 3;
-            high = bittable[b & 4095];
-            // Skip bits used above.
-            bits.skip(std::min(12 + 3, high + 1 + 3));
-
-            if (high == 12) {
-                high = bits.get(16 - nbits) >> 1;
+                m_buffer |= v << (56 - m_bits);
+                m_bits += 8;
             }
+        }
 
-            acarry1[0] = (high << nbits) | bits.get(nbits);
-            diff = (acarry1[0] ^ sign) + acarry1[1];
-            acarry1[1] = (diff * 3 + acarry1[1]) >> 5;
-            acarry1[2] = acarry1[0] > 16 ? 0 : acarry1[2] + 1;
-
-            if (y < 2 || x < 2) {
-                if (y < 2 && x < 2) {
-                    pred = 0;
-                } else if (y < 2) {
-                    pred = wo1;
-                } else {
-                    pred = dest[-pitch + ((int)x)];
-                    nw1 = pred;
-                }
-                dest[x] = pred + ((diff << 2) | low);
-                // Set predictor
-                wo1 = dest[x];
-            } else {
-                n = dest[-pitch + ((int)x)];
-                if (((wo1 < nw1) & (nw1 < n)) | ((n < nw1) & (nw1 < wo1))) {
-                    if (abs(wo1 - nw1) > 32 || abs(n - nw1) > 32) {
-                        pred = wo1 + n - nw1;
-                    } else {
-                        pred = (wo1 + n) >> 1;
-                    }
-                } else {
-                    pred = abs(wo1 - nw1) > abs(n - nw1) ? wo1 : n;
-                }
+    const uint8_t *m_start;
+    const uint8_t *m_p;
+    const uint8_t *m_end;
+    uint64_t m_buffer;
+    int m_bits;
+    uint64_t m_padding;
+};
 
-                dest[x] = pred + ((diff << 2) | low);
+/** The decoder state for the even or the odd columns. */
+struct ColumnState
+{
+    int carry[3];
+    int wo; /**< the pixel on the west */
+    int nw; /**< the pixel on the north west */
+};
 
-                // Set predictors
-                wo1 = dest[x];
-                nw1 = n;
-            }
-            //      _ASSERTE(0 == dest[x] >> 12) ;
+/** Decode the next difference, with the low bits. A pixel is at
+ * most 31 bits.
+ */
+inline int decodeDiff(BitReader &bits, ColumnState &state)
+{
+    int *carry = state.carry;
+    int i = 2 * (carry[2] < 3);
+    int nbits = std::max(2 + i, bitLength(carry[0]) - i);
+
+    bits.fill();
+    uint32_t b = bits.peek(15);
+    int sign = -(int)(b >> 14);
+    int low = (b >> 12) & 3;
+    int high = s_highTable.high[b & 4095];
+    // Skip bits used above.
+    bits.skip(std::min(12 + 3, high + 1 + 3));
+
+    if (high == 12) {
+        high = bits.get(16 - nbits) >> 1;
+    }
+
+    carry[0] = (high << nbits) | bits.get(nbits);
+    int diff = (carry[0] ^ sign) + carry[1];
+    carry[1] = (diff * 3 + carry[1]) >> 5;
+    carry[2] = carry[0] > 16 ? 0 : carry[2] + 1;
+
+    return (diff << 2) | low;
+}
+
+/** Predict from the west, the north and the north west pixels. */
+inline int predict(int wo, int n, int nw)
+{
+    int dwo = abs(wo - nw);
+    int dn = abs(n - nw);
+    int gradient = (dwo > 32 || dn > 32) ? wo + n - nw : (wo + n) >> 1;
+    int nearest = dwo > dn ? wo : n;
+    bool between = ((wo < nw) & (nw < n)) | ((n < nw) & (nw < wo));
+    return between ? gradient : nearest;
+}
+
+/** Decode a pixel from the west, the north and the north west. */
+template <class Diff>
+inline void decodePixel(Diff &diff, uint32_t x, ColumnState &s, int n,
+                        uint16_t &out)
+{
+    int pred = predict(s.wo, n, s.nw);
+    out = pred + diff(x, s);
+    s.wo = out;
+    s.nw = n;
+}
+
+/** Decode a row, the difference of the pixel x given by diff(x, s).
+ * The carries are reset by the caller.
+ */
+template <class Diff>
+void decodeRow(Diff diff, uint16_t *dest, uint32_t w, uint32_t y,
+               ColumnState &even, ColumnState &odd)
+{
+    // the same colour is two rows above.
+    const uint16_t* up = dest - 2 * w;
+    uint32_t x = 0;
+
+    if (y < 2) {
+        // from the west only.
+        for (; x < w; x++) {
+            ColumnState &s = (x & 1) ? odd : even;
+            int pred = x < 2 ? 0 : s.wo;
+            dest[x] = pred + diff(x, s);
+            s.wo = dest[x];
+        }
+    }
+    else {
+        // the first two columns, from the north only.
+        for (; x < 2 && x < w; x++) {
+            ColumnState &s = x ? odd : even;
+            int pred = up[x];
+            s.nw = pred;
+            dest[x] = pred + diff(x, s);
+            s.wo = dest[x];
+        }
+        for (; x + 1 < w; x += 2) {
+            decodePixel(diff, x, even, up[x], dest[x]);
+            decodePixel(diff, x + 1, odd, up[x + 1], dest[x + 1]);
+        }
+        if (x < w) {
+            decodePixel(diff, x, even, up[x], dest[x]);
+        }
+    }
+}
+
+}
+
+// decompression ported from RawSpeed.
+// The pixels of a column are predicted from the ones two rows above,
+// and of a row from the ones two columns on the left, with the even
+// and the odd columns decoded with their own state.
+// If recording, a checkpoint is added to the index every interval
+// rows: the carries are reset on each row, so the position is all
+// the state.
+static void decompressOlympus(const uint8_t* buffer, size_t size, uint8_t* data,
+                              uint32_t w, uint32_t h, DecodeIndex *record)
+{
+    BitReader bits(buffer, size);
+    const uint32_t interval = record ? record->interval() : 0;
+
+    ColumnState even, odd;
+    memset(&even, 0, sizeof(even));
+    memset(&odd, 0, sizeof(odd));
+    auto diff = [&bits] (uint32_t, ColumnState &s) {
+        return decodeDiff(bits, s);
+    };
+
+    for (uint32_t y = 0; y < h; y++) {
+        uint64_t pos = bits.bitPos();
+        // not past the end of the data.
+        if (interval && y && y % interval == 0 && pos / 8 < size) {
+            DecodeIndex::Checkpoint checkpoint;
+            checkpoint.row = y;
+            checkpoint.offset = pos / 8;
+            checkpoint.bit = pos % 8;
+            record->add(std::move(checkpoint));
+        }
+        memset(even.carry, 0, sizeof(even.carry));
+        memset(odd.carry, 0, sizeof(odd.carry));
+        decodeRow(diff, (uint16_t*)data + y * w, w, y, even, odd);
+        if (w & 1) {
+            // the pixels come in pairs: skip the last odd one.
+            decodeDiff(bits, odd);
         }
     }
 }
 
+// Decode from the checkpoints of the index: the differences of the
+// bands of rows between them in parallel, then the predictions
+// serially. The differences are kept modulo 16 bits, like the pixels.
+static bool decompressOlympusIndexed(const uint8_t* buffer, size_t size,
+                                     uint8_t* data, uint32_t w, uint32_t h,
+                                     const DecodeIndex &index)
+{
+    const std::vector<DecodeIndex::Checkpoint> &checkpoints
+        = index.checkpoints();
+    uint32_t lastRow = 0;
+    for (const auto & checkpoint : checkpoints) {
+        if (!checkpoint.state.empty() || checkpoint.offset >= size
+            || checkpoint.bit >= 8 || checkpoint.row <= lastRow
+            || checkpoint.row >= h) {
+            Debug::Trace(DEBUG1) << "Decode index doesn't fit the data\n";
+            return false;
+        }
+        lastRow = checkpoint.row;
+    }
+
+    uint16_t *out = (uint16_t*)data;
+    parallelFor(checkpoints.size() + 1, [&](size_t i) {
+            uint32_t startRow = i ? checkpoints[i - 1].row : 0;
+            uint32_t endRow = i < checkpoints.size()
+                ? checkpoints[i].row : h;
+            size_t offset = i ? checkpoints[i - 1].offset : 0;
+            BitReader bits(buffer + offset, size - offset);
+            if (i) {
+                bits.fill();
+                bits.skip(checkpoints[i - 1].bit);
+            }
+            ColumnState even, odd;
+            for (uint32_t y = startRow; y < endRow; y++) {
+                memset(even.carry, 0, sizeof(even.carry));
+                memset(odd.carry, 0, sizeof(odd.carry));
+                uint16_t *dest = out + (size_t)y * w;
+                for (uint32_t x = 0; x < w; x++) {
+                    dest[x] = decodeDiff(bits, (x & 1) ? odd : even);
+                }
+                if (w & 1) {
+                    decodeDiff(bits, odd);
+                }
+            }
+        });
+
+    ColumnState even, odd;
+    memset(&even, 0, sizeof(even));
+    memset(&odd, 0, sizeof(odd));
+    for (uint32_t y = 0; y < h; y++) {
+        uint16_t *dest = out + (size_t)y * w;
+        decodeRow([dest] (uint32_t x, ColumnState &) {
+                return (int)dest[x];
+            }, dest, w, y, even, odd);
+    }
+    return true;
+}
+
+void OlympusDecompressor::setDecodeIndex(DecodeIndex *index, bool record)
+{
+    m_index = index;
+    m_recordIndex = record;
+}
+
 RawData* OlympusDecompressor::decompress(RawData* in)
 {
     RawData* output;
@@ -187,7 +366,29 @@ RawData* OlympusDecompressor::decompress(RawData* in)
     }
 
     output->allocData(m_w * m_h * 2);
-    decompressOlympus(m_buffer, m_size, (uint8_t*)output->data(), m_w, m_h);
+    // the data starts after a 7 bytes header.
+    const uint8_t *buffer = m_buffer + std::min<size_t>(m_size, 7);
+    const size_t size = m_size < 7 ? 0 : m_size - 7;
+    DecodeIndex *record = NULL;
+    bool decoded = false;
+    if (m_index) {
+        DecodeIndex::Scan scan;
+        scan.offset = 7;
+        scan.size = size;
+        scan.hash = DecodeIndex::hash(buffer, size);
+        decoded = m_index->matches(scan, m_w, m_h)
+            && decompressOlympusIndexed(buffer, size,
+                                        (uint8_t*)output->data(), m_w, m_h,
+                                        *m_index);
+        if (!decoded && m_recordIndex) {
+            m_index->reset(scan, m_w, m_h);
+            record = m_index;
+        }
+    }
+    if (!decoded) {
+        decompressOlympus(buffer, size, (uint8_t*)output->data(), m_w, m_h,
+                          record);
+    }
 
     // hardcoded 12bits values
     output->setBpc(12);
@@ -35,6 +35,7 @@ class RawData;
 namespace Internals {
 
 class RawContainer;
+class DecodeIndex;
 
 class OlympusDecompressor
   : public Decompressor
@@ -47,15 +48,26 @@ OlympusDecompressor(const uint8_t *buffer, size_t size,
     , m_size(size)
     , m_h(h)
     , m_w(w)
+    , m_index(NULL)
+    , m_recordIndex(false)
   {
   }
   virtual RawData *decompress(RawData *in = NULL) override;
+  /** Set the index of checkpoints in the data.
+   * @param index the index. If it was recorded for this data, the
+   * rows are decoded in bands from the checkpoints, in parallel.
+   * @param record whether to record the index otherwise.
+   */
+  void setDecodeIndex(DecodeIndex *index, bool record);
 private:
   const uint8_t *m_buffer;
   size_t m_size;
 
   uint32_t m_h;
   uint32_t m_w;
+
+  DecodeIndex *m_index;
+  bool m_recordIndex;
 };
 
 }
@@ -40,6 +40,7 @@
 #include "ifdentry.hpp"
 #include "orfcontainer.hpp"
 #include "olympusdecompressor.hpp"
+#include "decodeindex.hpp"
 #include "rawfile_private.hpp"
 #include "io/streamclone.hpp"
 #include "jfifcontainer.hpp"
@@ -258,6 +259,11 @@ IfdDir::Ref  OrfFile::_locateMainIfd()
             if((options & OR_OPTIONS_DONT_DECOMPRESS) == 0) {
                 OlympusDecompressor decomp((const uint8_t*)data.data(),
                                            data.size(), m_container, x, y);
+                DecodeIndex & index = _decodeIndex();
+                bool recordIndex = (options & OR_OPTIONS_RECORD_INDEX) != 0;
+                if (recordIndex || !index.empty()) {
+                    decomp.setDecodeIndex(&index, recordIndex);
+                }
                 RawData *dData = decomp.decompress(nullptr);
                 if (dData) {
                     dData->setCfaPatternType(data.cfaPattern()->patternType());
@@ -0,0 +1,214 @@
+/*
+ * libopenraw - panasonicdecompressor.cpp
+ *
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "rawdata.hpp"
+#include "parallel.hpp"
+#include "panasonicdecompressor.hpp"
+
+namespace OpenRaw {
+namespace Internals {
+
+/* The data is in blocks, each stored rotated: the first
+   PANA_BLOCK_SPLIT bytes of the block are at the end in the file. */
+#define PANA_BLOCK_SIZE 0x4000
+#define PANA_BLOCK_SPLIT 0x2008
+/* A group of 14 pixels is coded in 128 bits. */
+#define PANA_GROUP_PIXELS 14
+#define PANA_GROUP_BITS 128
+#define PANA_BLOCK_PIXELS \
+    (PANA_BLOCK_SIZE * 8 / PANA_GROUP_BITS * PANA_GROUP_PIXELS)
+
+namespace {
+
+/** Read the bits of the blocks, starting at a block.
+ * In a block, the bytes are read by 16, from the last one of each
+ * 16, and the bits from the MSB.
+ * Past the end of the data, the bits are 0.
+ */
+class PanaBits
+{
+public:
+    PanaBits(const uint8_t *data, size_t size, size_t block)
+        : m_data(data)
+        , m_size(size)
+        , m_next(block * PANA_BLOCK_SIZE)
+        , m_vbits(0)
+        , m_consumed(0)
+        {
+            m_buf[PANA_BLOCK_SIZE] = 0;
+        }
+
+    unsigned get(int nbits)
+        {
+            if (!m_vbits) {
+                load();
+            }
+            m_vbits = (m_vbits - nbits) & 0x1ffff;
+            m_consumed += nbits;
+            unsigned byte = (m_vbits >> 3) ^ 0x3ff0;
+            return ((m_buf[byte] | (m_buf[byte + 1] << 8)) >> (m_vbits & 7))
+                & ((1 << nbits) - 1);
+        }
+    /** The number of bits read. */
+    size_t consumed() const
+        {
+            return m_consumed;
+        }
+
+private:
+    void load()
+        {
+            copy(m_buf + PANA_BLOCK_SPLIT, m_next,
+                 PANA_BLOCK_SIZE - PANA_BLOCK_SPLIT);
+            copy(m_buf, m_next + PANA_BLOCK_SIZE - PANA_BLOCK_SPLIT,
+                 PANA_BLOCK_SPLIT);
+            m_next += PANA_BLOCK_SIZE;
+        }
+    void copy(uint8_t *dest, size_t offset, size_t n)
+        {
+            size_t avail = offset < m_size ? std::min(n, m_size - offset) : 0;
+            if (avail) {
+                memcpy(dest, m_data + offset, avail);
+            }
+            memset(dest + avail, 0, n - avail);
+        }
+
+    const uint8_t *m_data;
+    size_t m_size;
+    size_t m_next;
+    unsigned m_vbits;
+    size_t m_consumed;
+    /** the current block, and a byte read past the end */
+    uint8_t m_buf[PANA_BLOCK_SIZE + 1];
+};
+
+/** Decode the pixels [start, end) of the image, in row order.
+ * @param regular whether to check that each group is 128 bits, and
+ * stop otherwise. start must then be the first pixel of a group.
+ * @return false if regular and a group isn't 128 bits.
+ */
+bool decodePixels(PanaBits & bits, uint16_t *out, uint32_t w,
+                  size_t start, size_t end, bool regular)
+{
+    int sh = 0;
+    int pred[2] = { 0, 0 };
+    unsigned nonz[2] = { 0, 0 };
+    uint32_t col = start % w;
+    for (size_t p = start; p < end; p++) {
+        int i = col % PANA_GROUP_PIXELS;
+        if (i == 0) {
+            if (regular && bits.consumed()
+                != (p - start) / PANA_GROUP_PIXELS * PANA_GROUP_BITS) {
+                return false;
+            }
+            pred[0] = pred[1] = nonz[0] = nonz[1] = 0;
+        }
+        if (i % 3 == 2) {
+            sh = 4 >> (3 - bits.get(2));
+        }
+        int & v = pred[i & 1];
+        if (nonz[i & 1]) {
+            int j = bits.get(8);
+            if (j) {
+                v -= 0x80 << sh;
+                if (v < 0 || sh == 4) {
+                    v &= (1 << sh) - 1;
+                }
+                v += j << sh;
+            }
+        }
+        else if ((nonz[i & 1] = bits.get(8)) || i > 11) {
+            v = nonz[i & 1] << 4 | bits.get(4);
+        }
+        out[p] = v;
+        if (++col == w) {
+            col = 0;
+        }
+    }
+    return !regular || bits.consumed()
+        == (end - start + PANA_GROUP_PIXELS - 1) / PANA_GROUP_PIXELS
+        * PANA_GROUP_BITS;
+}
+
+}
+
+RawData *PanasonicDecompressor::decompress(RawData *in)
+{
+    RawData *output;
+    if (in) {
+        output = in;
+    } else {
+        output = new RawData;
+    }
+
+    const size_t pixels = (size_t)m_w * m_h;
+    uint16_t *out = (uint16_t*)output->allocData(pixels * 2);
+    if (!pixels) {
+        return output;
+    }
+
+    // When the rows are whole groups, and each group is 128 bits,
+    // each block starts with a group at a known pixel.
+    bool regular = (m_w % PANA_GROUP_PIXELS) == 0;
+    if (regular) {
+        const size_t blocks = (pixels + PANA_BLOCK_PIXELS - 1)
+            / PANA_BLOCK_PIXELS;
+        std::atomic<bool> ok(true);
+        parallelFor(blocks, [&] (size_t block) {
+                if (!ok) {
+                    return;
+                }
+                PanaBits bits(m_buffer, m_size, block);
+                size_t start = block * PANA_BLOCK_PIXELS;
+                size_t end = std::min(pixels, start + PANA_BLOCK_PIXELS);
+                if (!decodePixels(bits, out, m_w, start, end, true)) {
+                    ok = false;
+                }
+            });
+        regular = ok;
+    }
+    if (!regular) {
+        PanaBits bits(m_buffer, m_size, 0);
+        decodePixels(bits, out, m_w, 0, pixels, false);
+    }
+
+    // hardcoded 12bits values
+    output->setBpc(12);
+    output->setWhiteLevel((1 << 12) - 1);
+
+    return output;
+}
+
+}
+}
+/*
+  Local Variables:
+  mode:c++
+  c-file-style:"stroustrup"
+  c-file-offsets:((innamespace . 0))
+  indent-tabs-mode:nil
+  fill-column:80
+  End:
+*/
@@ -0,0 +1,68 @@
+/* -*- Mode: C++ -*- */
+/*
+ * libopenraw - panasonicdecompressor.hpp
+ *
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef OR_INTERNALS_PANASONICDECOMPRESSOR_H_
+#define OR_INTERNALS_PANASONICDECOMPRESSOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "decompressor.hpp"
+
+namespace OpenRaw {
+
+class RawData;
+
+namespace Internals {
+
+class RawContainer;
+
+/** Decompress the Panasonic RAW and RW2 data.
+ * The data is in blocks of 0x4000 bytes, that hold groups of 14 pixels
+ * coded in 16 bytes. When the rows are made of whole groups, the blocks
+ * are decoded in parallel.
+ */
+class PanasonicDecompressor
+  : public Decompressor
+{
+public:
+PanasonicDecompressor(const uint8_t *buffer, size_t size,
+                      RawContainer * container, uint32_t w, uint32_t h)
+  : Decompressor(NULL, container)
+    , m_buffer(buffer)
+    , m_size(size)
+    , m_h(h)
+    , m_w(w)
+  {
+  }
+  virtual RawData *decompress(RawData *in = NULL) override;
+private:
+  const uint8_t *m_buffer;
+  size_t m_size;
+
+  uint32_t m_h;
+  uint32_t m_w;
+};
+
+}
+}
+#endif
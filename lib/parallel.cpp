@@ -0,0 +1,134 @@
+/*
+ * libopenraw - parallel.cpp
+ *
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "parallel.hpp"
+
+namespace OpenRaw {
+namespace Internals {
+
+namespace {
+
+/* Whether the thread runs a task of parallelFor(). */
+thread_local bool t_inParallelFor = false;
+
+/* The workers set by setParallelWorkers(), or 0. */
+std::atomic<unsigned> s_workers(0);
+
+/* Mark the thread as running tasks while in scope. */
+class InParallelFor
+{
+public:
+    InParallelFor()
+        : m_was(t_inParallelFor)
+        {
+            t_inParallelFor = true;
+        }
+    ~InParallelFor()
+        {
+            t_inParallelFor = m_was;
+        }
+private:
+    bool m_was;
+};
+
+}
+
+unsigned parallelWorkers()
+{
+    unsigned n = s_workers;
+    if (n == 0) {
+        n = std::thread::hardware_concurrency();
+    }
+    return n ? n : 1;
+}
+
+void setParallelWorkers(unsigned n)
+{
+    s_workers = n;
+}
+
+void parallelFor(size_t count, const std::function<void(size_t)> &fn)
+{
+    size_t workers = std::min<size_t>(parallelWorkers(), count);
+    // a call from a task runs serially: the workers are all busy
+    // already.
+    if (workers <= 1 || t_inParallelFor) {
+        for (size_t i = 0; i < count; i++) {
+            fn(i);
+        }
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    std::exception_ptr error;
+    std::mutex errorLock;
+
+    auto worker = [&] {
+        InParallelFor inParallelFor;
+        size_t i;
+        while (!failed && (i = next++) < count) {
+            try {
+                fn(i);
+            }
+            catch(...) {
+                std::lock_guard<std::mutex> lock(errorLock);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                failed = true;
+            }
+        }
+    };
+
+    // the calling thread is a worker too.
+    std::vector<std::thread> threads;
+    threads.reserve(workers - 1);
+    for (size_t i = 1; i < workers; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto & t : threads) {
+        t.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+}
+}
+/*
+  Local Variables:
+  mode:c++
+  c-file-style:"stroustrup"
+  c-file-offsets:((innamespace . 0))
+  indent-tabs-mode:nil
+  fill-column:80
+  End:
+*/
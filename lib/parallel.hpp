@@ -0,0 +1,65 @@
+/* -*- Mode: C++ -*- */
+/*
+ * libopenraw - parallel.hpp
+ *
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OR_INTERNALS_PARALLEL_H_
+#define OR_INTERNALS_PARALLEL_H_
+
+#include <stddef.h>
+
+#include <functional>
+
+namespace OpenRaw {
+namespace Internals {
+
+/** The number of worker threads to use. At least 1. */
+unsigned parallelWorkers();
+
+/** Set the number of worker threads, whatever the number of cores.
+ * For the tests, to run the parallel decoding on any machine.
+ * @param n the number of workers, or 0 for the number of cores.
+ */
+void setParallelWorkers(unsigned n);
+
+/** Call fn(i) for each i in [0, count), over a set of worker threads.
+ * Each worker picks the next index until all are done, so the
+ * tasks don't need to be of the same size.
+ * If a task throws, the remaining tasks are skipped and the first
+ * exception is rethrown once all the workers are done.
+ * When called from a task, the tasks are run serially on the
+ * calling thread, so nesting doesn't start more threads.
+ * @param count the number of tasks.
+ * @param fn the task function.
+ */
+void parallelFor(size_t count, const std::function<void(size_t)> &fn);
+
+}
+}
+
+#endif
+/*
+  Local Variables:
+  mode:c++
+  c-file-style:"stroustrup"
+  c-file-offsets:((innamespace . 0))
+  indent-tabs-mode:nil
+  fill-column:80
+  End:
+*/
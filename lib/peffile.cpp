@@ -27,6 +27,7 @@
 #include "ifddir.hpp"
 #include "peffile.hpp"
 #include "rawfile_private.hpp"
+#include "makernotedir.hpp"
 
 using namespace Debug;
 
@@ -96,6 +97,7 @@ RawFile *PEFFile::factory(const IO::Stream::Ptr &s)
 
 PEFFile::PEFFile(const IO::Stream::Ptr &s)
     : IfdFile(s, OR_RAWFILE_TYPE_PEF)
+    , m_huffmanTableRead(false)
 {
     _setIdMap(s_def);
     _setMatrices(s_matrices);
@@ -116,6 +118,37 @@ IfdDir::Ref  PEFFile::_locateMainIfd()
     return m_container->setDirectory(0);
 }
 
+const PentaxDecompressor::HuffmanTable & PEFFile::_getHuffmanTable()
+{
+    if(m_huffmanTableRead) {
+        return m_huffmanTable;
+    }
+    m_huffmanTableRead = true;
+    const MakerNoteDir::Ref & mnote = makerNoteIfd();
+    IfdEntry::Ref e;
+    if(mnote) {
+        e = mnote->getEntry(IFD::MNOTE_PENTAX_HUFFMANTABLE);
+    }
+    if(e) {
+        std::vector<uint8_t> buf(e->count());
+        size_t got = m_container->fetchData(buf.data(),
+                                            mnote->getMnoteOffset()
+                                            + e->offset(), buf.size());
+        m_huffmanTable = PentaxDecompressor::makeTable(
+            buf.data(), got,
+            m_container->endian() == RawContainer::ENDIAN_BIG);
+        if(m_huffmanTable.empty()) {
+            // the default table would decode garbage.
+            Trace(ERROR) << "Invalid Huffman table in the MakerNote\n";
+        }
+    }
+    else {
+        Trace(DEBUG1) << "Using the default Huffman table\n";
+        m_huffmanTable = PentaxDecompressor::defaultTable();
+    }
+    return m_huffmanTable;
+}
+
 ::or_error PEFFile::_getRawData(RawData & data, uint32_t options)
 {
     ::or_error err;
@@ -126,7 +159,31 @@ IfdDir::Ref  PEFFile::_locateMainIfd()
         switch(compression) {
         case IFD::COMPRESS_CUSTOM:
             if((options & OR_OPTIONS_DONT_DECOMPRESS) == 0) {
-                // TODO decompress
+                const PentaxDecompressor::HuffmanTable & table
+                    = _getHuffmanTable();
+                if(table.empty()) {
+                    err = OR_ERROR_INVALID_FORMAT;
+                    break;
+                }
+                uint32_t x = data.width();
+                uint32_t y = data.height();
+                uint16_t bpc = 12;
+                _cfaIfd->getValue(IFD::EXIF_TAG_BITS_PER_SAMPLE, bpc);
+                PentaxDecompressor decomp((const uint8_t*)data.data(),
+                                          data.size(), m_container, x, y,
+                                          bpc, table);
+                RawData *dData = decomp.decompress(nullptr);
+                if (dData) {
+                    dData->setCfaPatternType(data.cfaPattern()->patternType());
+                    data.swap(*dData);
+                    data.setDataType(OR_DATA_TYPE_RAW);
+                    data.setDimensions(x, y);
+                    delete dData;
+                }
+                else {
+                    Trace(ERROR) << "PEF decompression failed\n";
+                    err = OR_ERROR_DECOMPRESSION;
+                }
             }
             break;
         default:
@@ -30,6 +30,7 @@
 #include "ifddir.hpp"
 #include "io/stream.hpp"
 #include "ifdfile.hpp"
+#include "pentaxdecompressor.hpp"
 
 namespace OpenRaw {
 
@@ -54,7 +55,15 @@ protected:
 
     virtual ::or_error _getRawData(RawData & data, uint32_t options) override;
 private:
+    /** The Huffman table of the compressed data, read once.
+     * @return an empty table if the MakerNote one is invalid.
+     */
+    const PentaxDecompressor::HuffmanTable & _getHuffmanTable();
+
     static const IfdFile::camera_ids_t s_def[];
+    PentaxDecompressor::HuffmanTable m_huffmanTable;
+    /** Whether m_huffmanTable was read, even if invalid. */
+    bool m_huffmanTableRead;
 };
 
 }
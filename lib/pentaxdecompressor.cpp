@@ -0,0 +1,148 @@
+/*
+ * libopenraw - pentaxdecompressor.cpp
+ *
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include "rawdata.hpp"
+#include "bititerator.hpp"
+#include "endianutils.hpp"
+#include "pentaxdecompressor.hpp"
+
+namespace OpenRaw {
+namespace Internals {
+
+/* The bits peeked to decode a code: the longest code. */
+#define PENTAX_LOOKUP_BITS 12
+
+PentaxDecompressor::HuffmanTable
+PentaxDecompressor::makeTable(const uint8_t *data, size_t size,
+                              bool big_endian)
+{
+    if (size < 2) {
+        return HuffmanTable();
+    }
+    // the number of codes, then after 12 bytes the left aligned
+    // codes (u16) and their lengths (u8).
+    const unsigned depth = ((big_endian ? BE16(data) : EL16(data)) + 12)
+        & 15;
+    if (size < 14 + depth * 3) {
+        return HuffmanTable();
+    }
+    HuffmanTable table(1 << PENTAX_LOOKUP_BITS, 0);
+    for (unsigned c = 0; c < depth; c++) {
+        const uint8_t *p = data + 14 + c * 2;
+        unsigned code = (big_endian ? BE16(p) : EL16(p))
+            & ((1 << PENTAX_LOOKUP_BITS) - 1);
+        unsigned len = data[14 + depth * 2 + c];
+        if (len == 0 || len > PENTAX_LOOKUP_BITS) {
+            return HuffmanTable();
+        }
+        unsigned end = std::min(code + (1 << (PENTAX_LOOKUP_BITS - len)),
+                                1U << PENTAX_LOOKUP_BITS);
+        for (unsigned i = code; i < end; i++) {
+            table[i] = len << 8 | c;
+        }
+    }
+    return table;
+}
+
+PentaxDecompressor::HuffmanTable PentaxDecompressor::defaultTable()
+{
+    // the number of codes of each length from 1, then the values.
+    static const uint8_t pentax_tree[] = {
+        0, 2, 3, 1, 1, 1, 1, 1, 1, 2, 0, 0, 0, 0, 0, 0,
+        3, 4, 2, 5, 1, 6, 0, 7, 8, 9, 10, 11, 12
+    };
+    HuffmanTable table(1 << PENTAX_LOOKUP_BITS, 0);
+    const uint8_t *value = pentax_tree + 16;
+    unsigned code = 0;
+    for (unsigned len = 1; len <= PENTAX_LOOKUP_BITS; len++) {
+        for (unsigned n = 0; n < pentax_tree[len - 1]; n++) {
+            unsigned start = code << (PENTAX_LOOKUP_BITS - len);
+            unsigned end = (code + 1) << (PENTAX_LOOKUP_BITS - len);
+            for (unsigned i = start; i < end; i++) {
+                table[i] = len << 8 | *value;
+            }
+            value++;
+            code++;
+        }
+        code <<= 1;
+    }
+    return table;
+}
+
+RawData *PentaxDecompressor::decompress(RawData *in)
+{
+    if (m_table.size() != (1 << PENTAX_LOOKUP_BITS)) {
+        return nullptr;
+    }
+    RawData *output;
+    if (in) {
+        output = in;
+    } else {
+        output = new RawData;
+    }
+
+    uint16_t *out = (uint16_t*)output->allocData((size_t)m_w * m_h * 2);
+    BitIterator bits(m_buffer, m_size);
+    const uint16_t *table = m_table.data();
+    // the first two pixels of a row are predicted from the row
+    // two rows above, the others from the previous one of the colour.
+    uint16_t vpred[2][2] = { { 0, 0 }, { 0, 0 } };
+    for (uint32_t row = 0; row < m_h; row++) {
+        uint16_t hpred[2] = { 0, 0 };
+        for (uint32_t col = 0; col < m_w; col++) {
+            uint16_t entry = table[bits.peek(PENTAX_LOOKUP_BITS)];
+            bits.skip(entry >> 8);
+            unsigned len = entry & 0xff;
+            int diff = 0;
+            if (len) {
+                diff = bits.get(len);
+                if ((diff & (1 << (len - 1))) == 0) {
+                    diff -= (1 << len) - 1;
+                }
+            }
+            if (col < 2) {
+                hpred[col] = vpred[row & 1][col] += diff;
+            }
+            else {
+                hpred[col & 1] += diff;
+            }
+            *out++ = hpred[col & 1];
+        }
+    }
+
+    output->setBpc(m_bpc);
+    output->setWhiteLevel((1 << m_bpc) - 1);
+
+    return output;
+}
+
+}
+}
+/*
+  Local Variables:
+  mode:c++
+  c-file-style:"stroustrup"
+  c-file-offsets:((innamespace . 0))
+  indent-tabs-mode:nil
+  fill-column:80
+  End:
+*/
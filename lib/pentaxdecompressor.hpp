@@ -0,0 +1,85 @@
+/* -*- Mode: C++ -*- */
+/*
+ * libopenraw - pentaxdecompressor.hpp
+ *
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef OR_INTERNALS_PENTAXDECOMPRESSOR_H_
+#define OR_INTERNALS_PENTAXDECOMPRESSOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "decompressor.hpp"
+
+namespace OpenRaw {
+
+class RawData;
+
+namespace Internals {
+
+class RawContainer;
+
+/** Decompress the Huffman coded PEF data. Each pixel is a difference
+ * with the previous one of the same colour in the row, like in LJPEG.
+ */
+class PentaxDecompressor
+  : public Decompressor
+{
+public:
+  /** The Huffman table, indexed by the next 12 bits: the code
+   * length << 8 | the length of the difference. */
+  typedef std::vector<uint16_t> HuffmanTable;
+
+  /** Build the table from the MakerNote HuffmanTable data.
+   * @return an empty table if the data is invalid.
+   */
+  static HuffmanTable makeTable(const uint8_t *data, size_t size,
+                                bool big_endian);
+  /** The table of the cameras without HuffmanTable. */
+  static HuffmanTable defaultTable();
+
+  PentaxDecompressor(const uint8_t *buffer, size_t size,
+                     RawContainer * container, uint32_t w, uint32_t h,
+                     uint16_t bpc, const HuffmanTable & table)
+    : Decompressor(NULL, container)
+    , m_buffer(buffer)
+    , m_size(size)
+    , m_h(h)
+    , m_w(w)
+    , m_bpc(bpc)
+    , m_table(table)
+  {
+  }
+  virtual RawData *decompress(RawData *in = NULL) override;
+private:
+  const uint8_t *m_buffer;
+  size_t m_size;
+
+  uint32_t m_h;
+  uint32_t m_w;
+  uint16_t m_bpc;
+  const HuffmanTable & m_table;
+};
+
+}
+}
+#endif
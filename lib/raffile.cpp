@@ -42,7 +42,9 @@
 #include "rafmetacontainer.hpp"
 #include "jfifcontainer.hpp"
 #include "unpack.hpp"
+#include "fujidecompressor.hpp"
 #include "trace.hpp"
+#include "exception.hpp"
 #include "io/streamclone.hpp"
 #include "xtranspattern.hpp"
 
@@ -275,7 +277,7 @@ RawContainer *RafFile::getContainer() const
     return m_container;
 }
 
-::or_error RafFile::_getRawData(RawData &data, uint32_t /*options*/)
+::or_error RafFile::_getRawData(RawData &data, uint32_t options)
 {
     ::or_error ret = OR_ERROR_NOT_FOUND;
 
@@ -312,7 +314,7 @@ RawContainer *RafFile::getContainer() const
     case OR_MAKE_FUJIFILM_TYPEID(OR_TYPEID_FUJIFILM_X100T):
     case OR_MAKE_FUJIFILM_TYPEID(OR_TYPEID_FUJIFILM_X20):
     case OR_MAKE_FUJIFILM_TYPEID(OR_TYPEID_FUJIFILM_X30):
-        data.setCfaPattern(XTransPattern::xtransPattern());
+        data.setCfaPattern(_getXTransPattern());
         break;
     default:
         // TODO get the right pattern.
@@ -324,6 +326,43 @@ RawContainer *RafFile::getContainer() const
     size_t fetched = 0;
     off_t offset = m_container->getCfaOffset() + 2048;
 
+    // the lossless compressed data starts with its header.
+    uint8_t header_data[FujiDecompressor::HEADER_SIZE];
+    FujiDecompressor::Header header;
+    if (m_container->fetchData(header_data, offset, sizeof(header_data))
+        == sizeof(header_data)
+        && FujiDecompressor::readHeader(header_data, sizeof(header_data),
+                                        header)) {
+        if (header.isXTrans()) {
+            data.setCfaPattern(_getXTransPattern());
+        } else if (!data.cfaPattern()->is2by2Rgb()) {
+            data.setCfaPatternType(OR_CFA_PATTERN_GBRG);
+        }
+        data.setDataType(OR_DATA_TYPE_COMPRESSED_RAW);
+        data.setCompression(RAF_COMPRESSION);
+        uint8_t *p = (uint8_t *)data.allocData(byte_size);
+        fetched = m_container->fetchData(p, offset, byte_size);
+        if (fetched < byte_size) {
+            Debug::Trace(WARNING) << "Size mismatch for data: expected "
+                                  << byte_size << " got " << fetched << "\n";
+        }
+        if ((options & OR_OPTIONS_DONT_DECOMPRESS) == 0) {
+            FujiDecompressor decomp(p, fetched, m_container,
+                                    data.cfaPattern());
+            RawData *dData = decomp.decompress(nullptr);
+            if (!dData) {
+                Debug::Trace(ERROR) << "RAF decompression failed\n";
+                return OR_ERROR_DECOMPRESSION;
+            }
+            dData->setCfaPattern(data.cfaPattern());
+            data.swap(*dData);
+            data.setDataType(OR_DATA_TYPE_RAW);
+            data.setDimensions(header.raw_width, header.raw_height);
+            delete dData;
+        }
+        return OR_ERROR_NONE;
+    }
+
     uint32_t finaldatalen = 2 * h * w;
     bool is_compressed = byte_size < finaldatalen; //(compressed == 8);
     uint32_t datalen = (is_compressed ? byte_size : finaldatalen);
@@ -337,37 +376,12 @@ RawContainer *RafFile::getContainer() const
 
     if (is_compressed) {
         Unpack unpack(w, IFD::COMPRESS_NONE);
-        size_t blocksize = unpack.block_size();
-        std::unique_ptr<uint8_t[]> block(new uint8_t[blocksize]);
-        uint8_t *outdata = (uint8_t *)data.data();
-        size_t outsize = finaldatalen;
-        size_t got;
-        do {
-            //      Debug::Trace(DEBUG2) << "fatchData @offset " << offset <<
-            //      "\n";
-            got = m_container->fetchData(block.get(), offset, blocksize);
-            fetched += got;
-            offset += got;
-            //      Debug::Trace(DEBUG2) << "got " << got << "\n";
-            if (got) {
-                size_t out;
-                or_error err = unpack.unpack_be12to16(outdata, outsize,
-                                                      block.get(), got, out);
-                outdata += out;
-                outsize -= out;
-                //        Debug::Trace(DEBUG2) << "unpacked " << out
-                //                             << " bytes from " << got << "\n";
-                if (err != OR_ERROR_NONE) {
-                    Debug::Trace(DEBUG2) << "error is " << err << "\n";
-                    ret = err;
-                    break;
-                }
-                //        Debug::Trace(DEBUG2) << "got = " << got
-                //                             << " fetched = " << fetched
-                //                             << " datalen = " << datalen <<
-                //                             "\n";
-            }
-        } while ((got != 0) && (fetched < datalen));
+        ret = unpack.unpack_strip(m_container, offset, datalen,
+                                  (uint8_t *)data.data(), finaldatalen,
+                                  fetched);
+        if (ret != OR_ERROR_NONE) {
+            Debug::Trace(DEBUG2) << "error is " << ret << "\n";
+        }
     } else {
         m_container->fetchData(buf, offset, datalen);
     }
@@ -375,6 +389,33 @@ RawContainer *RafFile::getContainer() const
     return ret;
 }
 
+const CfaPattern *RafFile::_getXTransPattern()
+{
+    RafMetaValue::Ref value
+        = m_container->getMetaContainer()->getValue(RAF_TAG_XTRANS_LAYOUT);
+    if (value) {
+        try {
+            const std::string &layout = value->get().getString(0);
+            if (layout.size() == XTransPattern::SIZE) {
+                // the colours are stored from the last one.
+                uint8_t colours[XTransPattern::SIZE];
+                for (uint16_t i = 0; i < XTransPattern::SIZE; i++) {
+                    colours[i] = layout[XTransPattern::SIZE - 1 - i] & 3;
+                }
+                const XTransPattern *pattern
+                    = XTransPattern::xtransPattern(colours);
+                if (pattern) {
+                    return pattern;
+                }
+            }
+        }
+        catch (const BadTypeException &) {
+        }
+        Debug::Trace(WARNING) << "Invalid X-Trans layout\n";
+    }
+    return XTransPattern::xtransPattern();
+}
+
 MetaValue *RafFile::_getMetaValue(int32_t meta_index)
 {
     if (META_INDEX_MASKOUT(meta_index) == META_NS_EXIF ||
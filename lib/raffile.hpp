@@ -36,6 +36,7 @@
 
 namespace OpenRaw {
 
+class CfaPattern;
 class RawData;
 class MetaValue;
 
@@ -52,6 +53,8 @@ public:
     RafFile(const RafFile &) = delete;
     RafFile &operator=(const RafFile &) = delete;
 
+    enum { RAF_COMPRESSION = 0x12000 };
+
 protected:
     virtual ::or_error _enumThumbnailSizes(std::vector<uint32_t> &list) override;
 
@@ -64,6 +67,9 @@ protected:
     virtual void _identifyId() override;
 
 private:
+    /** The X-Trans pattern of the XTransLayout, or the default one. */
+    const CfaPattern *_getXTransPattern();
+
     IO::Stream::Ptr m_io;      /**< the IO handle */
     RafContainer *m_container; /**< the real container */
     uint32_t m_x;
@@ -90,7 +90,13 @@ void RafMetaContainer::_read()
 			content = (char*)calloc(1, size + 1);
 			content[size] = 0;
 			m_file->read(content, size);
-			v = MetaValue::value_t(std::string(content));
+			if(tag == RAF_TAG_XTRANS_LAYOUT) {
+				// binary: the colours include 0.
+				v = MetaValue::value_t(std::string(content, size));
+			}
+			else {
+				v = MetaValue::value_t(std::string(content));
+			}
 			free(content);
 		}
 
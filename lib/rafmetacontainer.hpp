@@ -43,6 +43,7 @@ enum {
     RAF_TAG_OUTPUT_HEIGHT_WIDTH =
         0x121,                // this is the one dcraw use for the active area
     RAF_TAG_RAW_INFO = 0x130, // some info about the RAW.
+    RAF_TAG_XTRANS_LAYOUT = 0x131, // the X-Trans CFA, reversed.
     _RAF_TAG_LAST
 };
 
@@ -182,6 +182,14 @@ RawContainer::fetchData(void *buf, off_t _offset,
   return s;
 }
 
+size_t
+RawContainer::fetchDataAt(void *buf, off_t _offset,
+                          size_t buf_size)
+{
+  int s = m_file->readAt(buf, buf_size, _offset);
+  return s < 0 ? 0 : s;
+}
+
 
 }
 }
@@ -75,6 +75,12 @@ public:
      * @return the size retrieved, <= buf_size likely equal
      */
     size_t fetchData(void *buf, off_t offset, size_t buf_size);
+    /**
+     * Fetch the data chunk from the file, without moving the
+     * file position. Can be called from several threads at once.
+     * @see fetchData()
+     */
+    size_t fetchDataAt(void *buf, off_t offset, size_t buf_size);
 
 protected:
     RawContainer(const RawContainer &);
@@ -46,6 +46,7 @@ public:
     ExifPhotometricInterpretation photometricInterpretation;
     const CfaPattern* cfa_pattern; // IMMUTABLE
     uint32_t compression;
+    uint32_t samplesPerPixel;
     uint8_t *pos;
     size_t offset;
     size_t row_offset;
@@ -64,6 +65,7 @@ public:
           photometricInterpretation(EV_PI_CFA),
           cfa_pattern(CfaPattern::twoByTwoPattern(OR_CFA_PATTERN_NONE)),
           compression(0),
+          samplesPerPixel(1),
           pos(NULL), offset(0),
           row_offset(0),
           slice(0), sliceWidth(0),
@@ -162,7 +164,14 @@ RawData::~RawData()
             uint16_t *dst = (uint16_t *)bitmapdata.allocData(sizeof(uint16_t) 
                                                              * 3 * _x * _y);
 
-            err = grayscale_to_rgb(src, _x, _y, dst);
+            if (d->samplesPerPixel == 3
+                && size() >= (size_t)3 * _x * _y * sizeof(uint16_t)) {
+                // already RGB, like the Canon sRAW.
+                std::copy(src, src + 3 * _x * _y, dst);
+            }
+            else {
+                err = grayscale_to_rgb(src, _x, _y, dst);
+            }
             bitmapdata.setDimensions(_x, _y);
         }
 
@@ -281,6 +290,16 @@ uint32_t RawData::compression() const
     return d->compression;
 }
 
+void RawData::setSamplesPerPixel(uint32_t spp)
+{
+    d->samplesPerPixel = spp;
+}
+
+uint32_t RawData::samplesPerPixel() const
+{
+    return d->samplesPerPixel;
+}
+
 #if 0
 RawData &RawData::append(uint8_t c)
 {
@@ -96,6 +96,12 @@ public:
     uint32_t compression() const;
     void setCompression(uint32_t c);
 
+    /** The samples of a pixel: 1 for CFA or grayscale, 3 for RGB like
+     * the Canon sRAW. 1 by default.
+     */
+    uint32_t samplesPerPixel() const;
+    void setSamplesPerPixel(uint32_t spp);
+
 
     void setSlices(const std::vector<uint16_t> & slices);
 
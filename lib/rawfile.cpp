@@ -23,6 +23,7 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <algorithm>
 #include <cstring>
 #include <map>
 #include <string>
@@ -62,6 +63,7 @@
 #include "rw2file.hpp"
 #include "raffile.hpp"
 #include "exception.hpp"
+#include "decodeindex.hpp"
 #include "rawfile_private.hpp"
 
 #include "rawfilefactory.hpp"
@@ -150,6 +152,9 @@ public:
     std::map<int32_t, MetaValue*> m_metadata;
     const camera_ids_t *m_cam_ids;
     const Internals::BuiltinColourMatrix* m_matrices;
+    Internals::DecodeIndex m_decodeIndex;
+    /** the decode index, serialized */
+    std::vector<uint8_t> m_decodeIndexData;
 };
 
 
@@ -452,7 +457,105 @@ void RawFile::_addThumbnail(uint32_t size, const Internals::ThumbDesc& desc)
     if (ret != OR_ERROR_NONE) {
         return ret;
     }
+    _copyColourMatrix(rawdata);
 
+    return ret;
+}
+
+::or_error RawFile::getRawData(RawData & rawdata, uint32_t options,
+                               uint32_t x, uint32_t y,
+                               uint32_t width, uint32_t height)
+{
+    Trace(DEBUG1) << "getRawData() region " << x << ", " << y << " "
+                  << width << "x" << height << "\n";
+    if (width == 0 || height == 0
+        || (options & OR_OPTIONS_DONT_DECOMPRESS)) {
+        return OR_ERROR_INVALID_PARAM;
+    }
+    ::or_error ret = _getRawDataRegion(rawdata, options, x, y, width, height);
+    if (ret != OR_ERROR_NONE) {
+        return ret;
+    }
+    _copyColourMatrix(rawdata);
+
+    return ret;
+}
+
+::or_error RawFile::_getRawDataRegion(RawData & data, uint32_t options,
+                                      uint32_t x, uint32_t y,
+                                      uint32_t width, uint32_t height)
+{
+    ::or_error ret = _getRawData(data, options);
+    if (ret != OR_ERROR_NONE) {
+        return ret;
+    }
+    if (data.dataType() != OR_DATA_TYPE_RAW) {
+        Trace(DEBUG1) << "can't crop compressed data\n";
+        return OR_ERROR_INVALID_FORMAT;
+    }
+    uint32_t frame_w = data.width();
+    uint32_t frame_h = data.height();
+    if (x >= frame_w || y >= frame_h
+        || width > frame_w - x || height > frame_h - y
+        || data.size() < (size_t)frame_w * frame_h * sizeof(uint16_t)) {
+        return OR_ERROR_INVALID_PARAM;
+    }
+
+    std::vector<uint16_t> region(width * height);
+    const uint16_t *src = (const uint16_t *)data.data() + y * frame_w + x;
+    for (uint32_t row = 0; row < height; row++) {
+        std::copy(src, src + width, region.begin() + row * width);
+        src += frame_w;
+    }
+    uint16_t *dst = (uint16_t *)data.allocData(region.size()
+                                               * sizeof(uint16_t));
+    std::copy(region.cbegin(), region.cend(), dst);
+
+    _setRegionRoi(data, x, y, width, height);
+    data.setDimensions(width, height);
+
+    return OR_ERROR_NONE;
+}
+
+void RawFile::_setRegionRoi(RawData & data, uint32_t x, uint32_t y,
+                            uint32_t width, uint32_t height)
+{
+    uint32_t roi_x = std::max(data.roi_x(), x);
+    uint32_t roi_y = std::max(data.roi_y(), y);
+    uint32_t roi_r = std::min(data.roi_x() + data.roi_width(), x + width);
+    uint32_t roi_b = std::min(data.roi_y() + data.roi_height(), y + height);
+    if (roi_r > roi_x && roi_b > roi_y) {
+        data.setRoi(roi_x - x, roi_y - y, roi_r - roi_x, roi_b - roi_y);
+    }
+    else {
+        data.setRoi(0, 0, width, height);
+    }
+}
+
+const std::vector<uint8_t> & RawFile::getDecodeIndex()
+{
+    d->m_decodeIndexData = d->m_decodeIndex.serialize();
+    if (d->m_decodeIndex.empty()) {
+        d->m_decodeIndexData.clear();
+    }
+    return d->m_decodeIndexData;
+}
+
+::or_error RawFile::setDecodeIndex(const uint8_t *data, size_t size)
+{
+    if (!d->m_decodeIndex.deserialize(data, size)) {
+        return OR_ERROR_INVALID_PARAM;
+    }
+    return OR_ERROR_NONE;
+}
+
+Internals::DecodeIndex & RawFile::_decodeIndex()
+{
+    return d->m_decodeIndex;
+}
+
+void RawFile::_copyColourMatrix(RawData & rawdata)
+{
     // if the colour matrix isn't copied already, do it now.
     uint32_t matrix_size = 0;
     if (!rawdata.getColourMatrix1(matrix_size) || !matrix_size) {
@@ -463,8 +566,6 @@ void RawFile::_addThumbnail(uint32_t size, const Internals::ThumbDesc& desc)
         }
         delete [] matrix;
     }
-
-    return ret;
 }
 
 ::or_error RawFile::getRenderedImage(BitmapData & bitmapdata, uint32_t options)
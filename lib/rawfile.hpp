@@ -42,6 +42,7 @@ class MetaValue;
 namespace Internals {
 class RawContainer;
 class ThumbDesc;
+class DecodeIndex;
 struct BuiltinColourMatrix;
 }
 
@@ -110,6 +111,37 @@ public:
      */
     ::or_error getRawData(RawData & rawdata, uint32_t options);
 
+    /** Get the RAW data for a region of the frame
+     * @param rawdata the RawData to put the data into
+     * @param options the option bits defined by %or_options
+     * @param x the left of the region
+     * @param y the top of the region
+     * @param width the width of the region
+     * @param height the height of the region
+     * @return the error code
+     * rawdata only holds the region, uncompressed. The CFA pattern
+     * is the one of the frame, use an even x and y to keep it.
+     * Some formats, like tiled DNG, only decompress what the
+     * region needs.
+     */
+    ::or_error getRawData(RawData & rawdata, uint32_t options,
+                          uint32_t x, uint32_t y,
+                          uint32_t width, uint32_t height);
+
+    /** Get the decode index, recorded by getRawData() with
+     * OR_OPTIONS_RECORD_INDEX, to be saved along the file.
+     * @return the index data, empty if there is none.
+     */
+    const std::vector<uint8_t> & getDecodeIndex();
+    /** Set a decode index saved for this file. getRawData() will
+     * then decode in parallel, and a region only where needed.
+     * @param data the index data
+     * @param size the size of data
+     * @return the error code. An index recorded for another file
+     * is only ignored.
+     */
+    ::or_error setDecodeIndex(const uint8_t *data, size_t size);
+
     /** Get the rendered image
      * @param bitmapdata the BitmapData to put the image into
      * @param options the option bits. Pass 0 for now.
@@ -179,6 +211,14 @@ protected:
      */
     virtual ::or_error _getThumbnail(uint32_t size, Thumbnail & thumbnail);
     void _addThumbnail(uint32_t size, const Internals::ThumbDesc& desc);
+    /** copy the colour matrix into the RAW data, unless it is there */
+    void _copyColourMatrix(RawData & rawdata);
+    /** move the region of interest of the data in the region
+     * x, y, width x height of the frame. */
+    static void _setRegionRoi(RawData & data, uint32_t x, uint32_t y,
+                              uint32_t width, uint32_t height);
+    /** the decode index, for the decompressors */
+    Internals::DecodeIndex & _decodeIndex();
 
     /** get the RAW data 
      * @param data the RAW data
@@ -187,6 +227,15 @@ protected:
      * Return the data compressed or uncompressed.
      */
     virtual ::or_error _getRawData(RawData & data, uint32_t options) = 0;
+    /** get the RAW data for a region
+     * @param data the RAW data
+     * @param option the option bits
+     * @return OR_ERROR_NONE if success
+     * The default decompresses the whole frame and crops it.
+     */
+    virtual ::or_error _getRawDataRegion(RawData & data, uint32_t options,
+                                         uint32_t x, uint32_t y,
+                                         uint32_t width, uint32_t height);
 
     /** get the colour matrix.
      * @param index 1 or 2
@@ -33,6 +33,7 @@
 #include "rw2file.hpp"
 #include "rw2container.hpp"
 #include "jfifcontainer.hpp"
+#include "panasonicdecompressor.hpp"
 #include "rawfile_private.hpp"
 
 using namespace Debug;
@@ -236,7 +237,7 @@ uint32_t Rw2File::_getJpegThumbnailOffset(const IfdDir::Ref & dir, uint32_t & le
 }
 
 
-::or_error Rw2File::_getRawData(RawData & data, uint32_t /*options*/)
+::or_error Rw2File::_getRawData(RawData & data, uint32_t options)
 {
 	::or_error ret = OR_ERROR_NONE;
 	const IfdDir::Ref & _cfaIfd = cfaIfd();
@@ -291,6 +292,16 @@ uint32_t Rw2File::_getJpegThumbnailOffset(const IfdDir::Ref & dir, uint32_t & le
 	if (real_size / (x * 8 / 7) == y) {
 		data.setDataType(OR_DATA_TYPE_COMPRESSED_RAW);
 		data.setCompression(PANA_RAW_COMPRESSION);
+		if((options & OR_OPTIONS_DONT_DECOMPRESS) == 0) {
+			PanasonicDecompressor decomp((const uint8_t*)data.data(),
+										 real_size, m_container, x, y);
+			RawData *dData = decomp.decompress(nullptr);
+			if (dData) {
+				data.swap(*dData);
+				data.setDataType(OR_DATA_TYPE_RAW);
+				delete dData;
+			}
+		}
 	}
 	else if (real_size < byte_length) {
 		Trace(WARNING) << "Size mismatch for data: expected " << byte_length
@@ -0,0 +1,223 @@
+/*
+ * libopenraw - speculative.hpp
+ *
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OR_INTERNALS_SPECULATIVE_H_
+#define OR_INTERNALS_SPECULATIVE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <libopenraw/debug.h>
+
+#include "trace.hpp"
+#include "parallel.hpp"
+
+namespace OpenRaw {
+namespace Internals {
+
+/** The minimum size of a chunk to decode speculatively. */
+const size_t SPECULATIVE_MIN_CHUNK = 256 * 1024;
+/** The number of units whose position is recorded at the start of a
+ * chunk, to find where the chunk before joins it. */
+const size_t SPECULATIVE_SYNC_UNITS = 4096;
+
+/** Decode a Huffman coded bitstream on several threads.
+ *
+ * The bitstream is a sequence of units, like a code and its bits,
+ * that are decoded from their position only. It is split in chunks
+ * decoded in parallel from a guessed start: the decoding of a chunk
+ * falls on the unit boundaries after a few units. The chunk before
+ * is then decoded past its end until it meets a unit of the chunk,
+ * from which the chunk is right. If it doesn't, the chunk before is
+ * decoded over it instead. Like the speculative decoding of the
+ * LJPEG scans.
+ *
+ * @param data the bitstream.
+ * @param size the size of the bitstream.
+ * @param stuffed whether the byte after each 0xff is skipped.
+ * @param units the number of units to decode.
+ * @param newReader make the reader of a chunk, a
+ * Reader(const uint8_t *p, size_t size) whose bitPos() is the number of
+ * bits read, without the skipped bytes.
+ * @param decodeUnit decode a unit, void(Reader &, std::vector<T> &),
+ * appending its values to the vector. The same number for each unit.
+ * @param output get the values decoded, in order,
+ * void(const T *values, size_t units).
+ * @return false if the bitstream is too small to be split. Nothing
+ * was output then.
+ */
+template <class Reader, class T, class NewReader, class DecodeUnit,
+          class Output>
+bool decodeSpeculative(const uint8_t *data, size_t size, bool stuffed,
+                       size_t units, NewReader newReader,
+                       DecodeUnit decodeUnit, Output output)
+{
+    size_t numChunks = std::min<size_t>(parallelWorkers(),
+                                        size / SPECULATIVE_MIN_CHUNK);
+    if (numChunks < 2 || units == 0) {
+        return false;
+    }
+
+    /*
+     * The start of the chunks in the data, and their position in the
+     * bits read. A chunk can't start on a skipped byte.
+     */
+    const size_t chunkSize = size / numChunks;
+    std::vector<size_t> chunkStart(1, 0);
+    std::vector<uint64_t> bitStart(1, 0);
+    size_t p = 0;
+    size_t skipped = 0;
+    for (size_t i = 1; i <= numChunks; i++) {
+        size_t start = i < numChunks ? std::max(i * chunkSize, p) : size;
+        while (stuffed && p < start) {
+            const uint8_t *ff = static_cast<const uint8_t *>(
+                memchr(data + p, 0xff, start - p));
+            if (!ff) {
+                break;
+            }
+            p = ff - data + 2;
+            skipped++;
+            if (i < numChunks) {
+                start = std::max(start, p);
+            }
+        }
+        if (start >= size) {
+            // the end of the last chunk.
+            bitStart.push_back((std::max(p, size) - skipped) * 8);
+            break;
+        }
+        chunkStart.push_back(start);
+        bitStart.push_back((start - skipped) * 8);
+    }
+    numChunks = chunkStart.size();
+    if (numChunks < 2) {
+        return false;
+    }
+
+    struct Chunk {
+        std::unique_ptr<Reader> bits;
+        uint64_t bitStart;       // the position of the chunk start
+        uint64_t bitEnd;         // the decoding stops at the first unit
+                                 // at or past that position
+        uint64_t exitPos;        // the position the decoding stopped
+        std::vector<T> values;   // the values decoded
+        size_t count;            // the number of units decoded
+        std::vector<uint64_t> syncPos; // the positions of the first units
+        size_t first;            // the first valid unit
+    };
+    std::vector<Chunk> chunks(numChunks);
+    auto decodeOne = [&](Chunk &chunk) {
+        decodeUnit(*chunk.bits, chunk.values);
+        chunk.count++;
+        chunk.exitPos = chunk.bitStart + chunk.bits->bitPos();
+    };
+    auto decodeChunk = [&](Chunk &chunk, bool record) {
+        while (chunk.exitPos < chunk.bitEnd && chunk.count < units) {
+            if (record && chunk.syncPos.size() < SPECULATIVE_SYNC_UNITS) {
+                chunk.syncPos.push_back(chunk.exitPos);
+            }
+            decodeOne(chunk);
+        }
+    };
+
+    parallelFor(numChunks, [&](size_t i) {
+            Chunk &chunk = chunks[i];
+            chunk.bits.reset(new Reader(newReader(data + chunkStart[i],
+                                                  size - chunkStart[i])));
+            chunk.bitStart = chunk.exitPos = bitStart[i];
+            chunk.bitEnd = bitStart[i + 1];
+            chunk.count = 0;
+            chunk.first = 0;
+            decodeChunk(chunk, i > 0);
+        });
+
+    /*
+     * Join the chunks. The first one is right from the start.
+     */
+    std::vector<size_t> valid(1, 0);
+    size_t cur = 0;
+    for (size_t i = 1; i < numChunks; i++) {
+        Chunk &chunk = chunks[i];
+        Chunk &prev = chunks[cur];
+        // decode the chunk before until it meets a unit of the chunk.
+        size_t k = std::lower_bound(chunk.syncPos.begin(),
+                                    chunk.syncPos.end(), prev.exitPos)
+            - chunk.syncPos.begin();
+        while (k < chunk.syncPos.size()
+               && chunk.syncPos[k] != prev.exitPos) {
+            if (chunk.syncPos[k] < prev.exitPos) {
+                k++;
+            } else if (prev.count < units) {
+                decodeOne(prev);
+            } else {
+                break;
+            }
+        }
+        if (k < chunk.syncPos.size() && chunk.syncPos[k] == prev.exitPos) {
+            chunk.first = k;
+            valid.push_back(i);
+            cur = i;
+        } else {
+            Debug::Trace(DEBUG1) << "chunk " << i << " didn't synchronize\n";
+            prev.bitEnd = bitStart[i + 1];
+            decodeChunk(prev, false);
+            std::vector<T>().swap(chunk.values);
+        }
+    }
+    size_t decoded = 0;
+    for (auto i : valid) {
+        decoded += chunks[i].count - chunks[i].first;
+    }
+    // the units past the end of the data are decoded from the 0 bits
+    // that follow, like the serial decoding does.
+    for (; decoded < units; decoded++) {
+        decodeOne(chunks[cur]);
+    }
+
+    size_t left = units;
+    for (auto i : valid) {
+        Chunk &chunk = chunks[i];
+        const size_t unitSize = chunk.values.size() / chunk.count;
+        size_t n = std::min(chunk.count - chunk.first, left);
+        output(chunk.values.data() + chunk.first * unitSize, n);
+        left -= n;
+        std::vector<T>().swap(chunk.values);
+    }
+    return true;
+}
+
+}
+}
+
+#endif
+/*
+  Local Variables:
+  mode:c++
+  c-file-style:"stroustrup"
+  c-file-offsets:((innamespace . 0))
+  indent-tabs-mode:nil
+  fill-column:80
+  End:
+*/
@@ -0,0 +1,424 @@
+/*
+ * libopenraw - srawinterpolator.cpp
+ *
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <ctype.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <libopenraw/consts.h>
+
+#include "rawdata.hpp"
+#include "parallel.hpp"
+#include "srawinterpolator.hpp"
+
+/* The SIMD kernels, selected at runtime on x86. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SRAW_HAVE_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define SRAW_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace OpenRaw {
+namespace Internals {
+
+/* The chroma is stored with this offset. */
+#define SRAW_CHROMA_ZERO 16384
+
+namespace {
+
+inline uint16_t clip16(int32_t v)
+{
+    return (uint16_t)std::min(std::max(v, 0), 0xffff);
+}
+
+/** Convert a pixel to RGB. */
+inline void srawPixel(int32_t y, int32_t cb, int32_t cr,
+                      const SRawInterpolator::Coefficients & k,
+                      uint16_t *rgb)
+{
+    y += k.luma_offset;
+    cb = cb * k.chroma_mul + k.hue;
+    cr = cr * k.chroma_mul + k.hue;
+    for (int c = 0; c < 3; c++) {
+        rgb[c] = clip16(y + ((k.cb[c] * cb + k.cr[c] * cr) >> k.shift));
+    }
+}
+
+/** Convert the n pixels of the luma and chroma rows to RGB.
+ * @return the number of pixels done.
+ */
+typedef size_t (*SRawKernel)(const int32_t *y, const int32_t *cb,
+                             const int32_t *cr, size_t n,
+                             const SRawInterpolator::Coefficients & k,
+                             uint16_t *rgb);
+
+size_t sraw_rgb_none(const int32_t *, const int32_t *, const int32_t *,
+                     size_t, const SRawInterpolator::Coefficients &,
+                     uint16_t *)
+{
+    return 0;
+}
+
+#if SRAW_HAVE_X86
+
+/* To interleave 8 R, 8 G and 8 B in 3 vectors: the bytes each of
+   them goes to in each vector. */
+const uint8_t s_interleave[3][3][16] = {
+    { { 0, 1, 0x80, 0x80, 0x80, 0x80, 2, 3,
+        0x80, 0x80, 0x80, 0x80, 4, 5, 0x80, 0x80 },
+      { 0x80, 0x80, 0, 1, 0x80, 0x80, 0x80, 0x80,
+        2, 3, 0x80, 0x80, 0x80, 0x80, 4, 5 },
+      { 0x80, 0x80, 0x80, 0x80, 0, 1, 0x80, 0x80,
+        0x80, 0x80, 2, 3, 0x80, 0x80, 0x80, 0x80 } },
+    { { 0x80, 0x80, 6, 7, 0x80, 0x80, 0x80, 0x80,
+        8, 9, 0x80, 0x80, 0x80, 0x80, 10, 11 },
+      { 0x80, 0x80, 0x80, 0x80, 6, 7, 0x80, 0x80,
+        0x80, 0x80, 8, 9, 0x80, 0x80, 0x80, 0x80 },
+      { 4, 5, 0x80, 0x80, 0x80, 0x80, 6, 7,
+        0x80, 0x80, 0x80, 0x80, 8, 9, 0x80, 0x80 } },
+    { { 0x80, 0x80, 0x80, 0x80, 12, 13, 0x80, 0x80,
+        0x80, 0x80, 14, 15, 0x80, 0x80, 0x80, 0x80 },
+      { 10, 11, 0x80, 0x80, 0x80, 0x80, 12, 13,
+        0x80, 0x80, 0x80, 0x80, 14, 15, 0x80, 0x80 },
+      { 0x80, 0x80, 10, 11, 0x80, 0x80, 0x80, 0x80,
+        12, 13, 0x80, 0x80, 0x80, 0x80, 14, 15 } }
+};
+
+__attribute__((target("sse4.1")))
+inline void sraw_store_sse41(__m128i r, __m128i g, __m128i b,
+                             uint16_t *rgb)
+{
+    for (int i = 0; i < 3; i++) {
+        const __m128i *masks = (const __m128i*)s_interleave[i];
+        __m128i v = _mm_or_si128(
+            _mm_or_si128(_mm_shuffle_epi8(r, _mm_loadu_si128(masks)),
+                         _mm_shuffle_epi8(g, _mm_loadu_si128(masks + 1))),
+            _mm_shuffle_epi8(b, _mm_loadu_si128(masks + 2)));
+        _mm_storeu_si128((__m128i*)(rgb + i * 8), v);
+    }
+}
+
+__attribute__((target("sse4.1")))
+size_t sraw_rgb_sse41(const int32_t *y, const int32_t *cb,
+                      const int32_t *cr, size_t n,
+                      const SRawInterpolator::Coefficients & k,
+                      uint16_t *rgb)
+{
+    const __m128i offset = _mm_set1_epi32(k.luma_offset);
+    const __m128i mul = _mm_set1_epi32(k.chroma_mul);
+    const __m128i hue = _mm_set1_epi32(k.hue);
+    const __m128i shift = _mm_cvtsi32_si128(k.shift);
+    __m128i kcb[3], kcr[3];
+    for (int c = 0; c < 3; c++) {
+        kcb[c] = _mm_set1_epi32(k.cb[c]);
+        kcr[c] = _mm_set1_epi32(k.cr[c]);
+    }
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i out[3][2];
+        for (int h = 0; h < 2; h++) {
+            size_t j = i + h * 4;
+            __m128i vy = _mm_add_epi32(
+                _mm_loadu_si128((const __m128i*)(y + j)), offset);
+            __m128i vcb = _mm_add_epi32(
+                _mm_mullo_epi32(_mm_loadu_si128((const __m128i*)(cb + j)),
+                                mul), hue);
+            __m128i vcr = _mm_add_epi32(
+                _mm_mullo_epi32(_mm_loadu_si128((const __m128i*)(cr + j)),
+                                mul), hue);
+            for (int c = 0; c < 3; c++) {
+                __m128i d = _mm_add_epi32(_mm_mullo_epi32(vcb, kcb[c]),
+                                          _mm_mullo_epi32(vcr, kcr[c]));
+                out[c][h] = _mm_add_epi32(vy, _mm_sra_epi32(d, shift));
+            }
+        }
+        sraw_store_sse41(_mm_packus_epi32(out[0][0], out[0][1]),
+                         _mm_packus_epi32(out[1][0], out[1][1]),
+                         _mm_packus_epi32(out[2][0], out[2][1]),
+                         rgb + i * 3);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+size_t sraw_rgb_avx2(const int32_t *y, const int32_t *cb,
+                     const int32_t *cr, size_t n,
+                     const SRawInterpolator::Coefficients & k,
+                     uint16_t *rgb)
+{
+    const __m256i offset = _mm256_set1_epi32(k.luma_offset);
+    const __m256i mul = _mm256_set1_epi32(k.chroma_mul);
+    const __m256i hue = _mm256_set1_epi32(k.hue);
+    const __m128i shift = _mm_cvtsi32_si128(k.shift);
+    __m256i kcb[3], kcr[3];
+    for (int c = 0; c < 3; c++) {
+        kcb[c] = _mm256_set1_epi32(k.cb[c]);
+        kcr[c] = _mm256_set1_epi32(k.cr[c]);
+    }
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i out[3][2];
+        for (int h = 0; h < 2; h++) {
+            size_t j = i + h * 8;
+            __m256i vy = _mm256_add_epi32(
+                _mm256_loadu_si256((const __m256i*)(y + j)), offset);
+            __m256i vcb = _mm256_add_epi32(
+                _mm256_mullo_epi32(
+                    _mm256_loadu_si256((const __m256i*)(cb + j)), mul), hue);
+            __m256i vcr = _mm256_add_epi32(
+                _mm256_mullo_epi32(
+                    _mm256_loadu_si256((const __m256i*)(cr + j)), mul), hue);
+            for (int c = 0; c < 3; c++) {
+                __m256i d = _mm256_add_epi32(
+                    _mm256_mullo_epi32(vcb, kcb[c]),
+                    _mm256_mullo_epi32(vcr, kcr[c]));
+                out[c][h] = _mm256_add_epi32(vy, _mm256_sra_epi32(d, shift));
+            }
+        }
+        // the pack is by lanes: put the 16 values back in order.
+        __m256i v[3];
+        for (int c = 0; c < 3; c++) {
+            v[c] = _mm256_permute4x64_epi64(
+                _mm256_packus_epi32(out[c][0], out[c][1]), 0xd8);
+        }
+        sraw_store_sse41(_mm256_castsi256_si128(v[0]),
+                         _mm256_castsi256_si128(v[1]),
+                         _mm256_castsi256_si128(v[2]), rgb + i * 3);
+        sraw_store_sse41(_mm256_extracti128_si256(v[0], 1),
+                         _mm256_extracti128_si256(v[1], 1),
+                         _mm256_extracti128_si256(v[2], 1),
+                         rgb + i * 3 + 24);
+    }
+    return i + sraw_rgb_sse41(y + i, cb + i, cr + i, n - i, k, rgb + i * 3);
+}
+
+#elif SRAW_HAVE_NEON
+
+size_t sraw_rgb_neon(const int32_t *y, const int32_t *cb,
+                     const int32_t *cr, size_t n,
+                     const SRawInterpolator::Coefficients & k,
+                     uint16_t *rgb)
+{
+    const int32x4_t offset = vdupq_n_s32(k.luma_offset);
+    const int32x4_t mul = vdupq_n_s32(k.chroma_mul);
+    const int32x4_t hue = vdupq_n_s32(k.hue);
+    const int32x4_t shift = vdupq_n_s32(-k.shift);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint16x8x3_t out;
+        uint16x4_t half[3][2];
+        for (int h = 0; h < 2; h++) {
+            size_t j = i + h * 4;
+            int32x4_t vy = vaddq_s32(vld1q_s32(y + j), offset);
+            int32x4_t vcb = vmlaq_s32(hue, vld1q_s32(cb + j), mul);
+            int32x4_t vcr = vmlaq_s32(hue, vld1q_s32(cr + j), mul);
+            for (int c = 0; c < 3; c++) {
+                int32x4_t d = vmlaq_n_s32(vmulq_n_s32(vcb, k.cb[c]),
+                                          vcr, k.cr[c]);
+                half[c][h] = vqmovun_s32(vaddq_s32(vy, vshlq_s32(d, shift)));
+            }
+        }
+        out.val[0] = vcombine_u16(half[0][0], half[0][1]);
+        out.val[1] = vcombine_u16(half[1][0], half[1][1]);
+        out.val[2] = vcombine_u16(half[2][0], half[2][1]);
+        vst3q_u16(rgb + i * 3, out);
+    }
+    return i;
+}
+
+#endif
+
+/* Select the kernel for the CPU we run on. */
+SRawKernel select_kernel()
+{
+#if SRAW_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &sraw_rgb_avx2;
+    }
+    else if (__builtin_cpu_supports("sse4.1")) {
+        return &sraw_rgb_sse41;
+    }
+#elif SRAW_HAVE_NEON
+    return &sraw_rgb_neon;
+#endif
+    return &sraw_rgb_none;
+}
+
+SRawKernel kernel()
+{
+    static const SRawKernel k = select_kernel();
+    return k;
+}
+
+/** Parse the firmware version, like "Firmware Version 1.0.7", as
+ * 1000007.
+ */
+uint32_t firmwareVersion(const std::string & firmware)
+{
+    const char *p = firmware.c_str();
+    while (*p && !isdigit(*p)) {
+        p++;
+    }
+    unsigned v[3] = { 0, 0, 0 };
+    sscanf(p, "%u.%u.%u", v, v + 1, v + 2);
+    return (v[0] * 1000 + v[1]) * 1000 + v[2];
+}
+
+}
+
+SRawInterpolator::SRawInterpolator(uint32_t model_id,
+                                   const std::string & firmware,
+                                   uint32_t h, uint32_t v)
+    : m_h(h)
+    , m_v(v)
+{
+    // from the 5D Mark II to the 60D, the chroma is scaled and its
+    // hue shifted, from the 1D Mark IV differently. It is added to
+    // the luma otherwise, that had an offset before the 5D Mark II.
+    switch (model_id) {
+    case 0x80000218: // 5D Mark II
+    case 0x80000250: // 7D
+    case 0x80000261: // 50D
+    case 0x80000281: // 1D Mark IV
+    case 0x80000287: // 60D
+    {
+        int32_t hue = (h * v) << 2;
+        if (model_id >= 0x80000281
+            || (model_id == 0x80000218
+                && firmwareVersion(firmware) > 1000006)) {
+            hue = (h * v - 1) << 1;
+        }
+        m_coefficients = Coefficients{ 0, 4, hue,
+                                       { 50, -5640, 29040 },
+                                       { 22929, -11751, -101 }, 14 };
+        break;
+    }
+    default:
+        m_coefficients = Coefficients{ model_id < 0x80000218 ? -512 : 0,
+                                       1, 0,
+                                       { 0, -778, 4096 },
+                                       { 4096, -2048, 0 }, 12 };
+        break;
+    }
+}
+
+bool SRawInterpolator::interpolate(const RawData & frame,
+                                   uint32_t x, uint32_t y,
+                                   uint32_t width, uint32_t height,
+                                   RawData & out) const
+{
+    if (m_h != 2 || m_v < 1 || m_v > 2) {
+        return false;
+    }
+    const uint32_t blocks = m_h * m_v + 2;
+    const uint32_t mcus = frame.width() / blocks;
+    const uint32_t mcu_rows = frame.height();
+    const uint32_t frame_w = mcus * m_h;
+    const uint32_t frame_h = mcu_rows * m_v;
+    if (mcus == 0 || mcu_rows == 0
+        || frame.size() < (size_t)frame.width() * mcu_rows * 2) {
+        return false;
+    }
+    if (width == 0) {
+        x = y = 0;
+        width = frame_w;
+        height = frame_h;
+    }
+    if (x >= frame_w || y >= frame_h
+        || width > frame_w - x || height > frame_h - y) {
+        return false;
+    }
+
+    const uint16_t *src = (const uint16_t*)frame.data();
+    const size_t stride = frame.width();
+    uint16_t *dest = (uint16_t*)out.allocData((size_t)width * height * 3
+                                              * sizeof(uint16_t));
+    const SRawKernel k = kernel();
+    parallelFor(height, [&] (size_t i) {
+            const uint32_t row = y + i;
+            const uint16_t *mcu_row = src + (row / m_v) * stride;
+            // on the second row of the mRAW, the chroma is
+            // interpolated with the MCUs below.
+            const uint16_t *below = NULL;
+            if ((row % m_v) && row / m_v + 1 < mcu_rows) {
+                below = mcu_row + stride;
+            }
+            const uint32_t luma = (row % m_v) * m_h;
+            auto chroma = [&] (uint32_t m, uint32_t c) {
+                int32_t value = mcu_row[m * blocks + blocks - 2 + c];
+                if (below) {
+                    value = (value + below[m * blocks + blocks - 2 + c] + 1)
+                        >> 1;
+                }
+                return value - SRAW_CHROMA_ZERO;
+            };
+
+            std::vector<int32_t> yrow(width), cbrow(width), crrow(width);
+            for (uint32_t col = x; col < x + width; col++) {
+                const uint32_t m = col / m_h;
+                yrow[col - x] = mcu_row[m * blocks + luma + col % m_h];
+                int32_t cb = chroma(m, 0);
+                int32_t cr = chroma(m, 1);
+                // the odd columns are between two MCUs.
+                if ((col & 1) && m + 1 < mcus) {
+                    cb = (cb + chroma(m + 1, 0) + 1) >> 1;
+                    cr = (cr + chroma(m + 1, 1) + 1) >> 1;
+                }
+                cbrow[col - x] = cb;
+                crrow[col - x] = cr;
+            }
+
+            uint16_t *rgb = dest + i * width * 3;
+            size_t done = k(yrow.data(), cbrow.data(), crrow.data(), width,
+                            m_coefficients, rgb);
+            for (size_t j = done; j < width; j++) {
+                srawPixel(yrow[j], cbrow[j], crrow[j], m_coefficients,
+                          rgb + j * 3);
+            }
+        });
+
+    out.setDataType(OR_DATA_TYPE_RAW);
+    out.setPhotometricInterpretation(EV_PI_LINEAR_RAW);
+    out.setCfaPatternType(OR_CFA_PATTERN_NONE);
+    out.setSamplesPerPixel(3);
+    out.setDimensions(width, height);
+    out.setBpc(16);
+    // as dcraw does.
+    out.setWhiteLevel(0x3fff);
+
+    return true;
+}
+
+}
+}
+/*
+  Local Variables:
+  mode:c++
+  c-file-style:"stroustrup"
+  c-file-offsets:((innamespace . 0))
+  indent-tabs-mode:nil
+  fill-column:80
+  End:
+*/
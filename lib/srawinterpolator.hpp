@@ -0,0 +1,82 @@
+/* -*- Mode: C++ -*- */
+/*
+ * libopenraw - srawinterpolator.hpp
+ *
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef OR_INTERNALS_SRAWINTERPOLATOR_H_
+#define OR_INTERNALS_SRAWINTERPOLATOR_H_
+
+#include <stdint.h>
+
+#include <string>
+
+namespace OpenRaw {
+
+class RawData;
+
+namespace Internals {
+
+/** Turn the Canon sRAW and mRAW, as decoded by the LJpegDecompressor,
+ * to linear RGB. Each MCU has 2 luma samples, or 2x2 for the mRAW,
+ * then Cb and Cr: the chroma is interpolated to every pixel, then
+ * converted with a formula that depends on the camera.
+ * The rows are done in parallel.
+ */
+class SRawInterpolator
+{
+public:
+  /** The coefficients of the YCbCr to RGB conversion. */
+  struct Coefficients {
+    /** added to the luma */
+    int32_t luma_offset;
+    /** the chroma is multiplied by chroma_mul, then hue is added */
+    int32_t chroma_mul;
+    int32_t hue;
+    /** the contribution of Cb and Cr to R, G and B, in 1 << shift */
+    int32_t cb[3];
+    int32_t cr[3];
+    int32_t shift;
+  };
+
+  /** @param model_id the Canon model ID, from the MakerNote.
+   * @param firmware the firmware version, from the MakerNote.
+   * @param h the horizontal sampling of the luma. Only 2 is supported.
+   * @param v the vertical sampling of the luma, 1 or 2.
+   */
+  SRawInterpolator(uint32_t model_id, const std::string & firmware,
+                   uint32_t h, uint32_t v);
+
+  /** Interpolate the decoded MCUs, a row of MCUs per row.
+   * @param x, y, width, height the region of pixels to output. If
+   * width is 0, the whole frame.
+   * @param out the RGB pixels, 3 samples each.
+   * @return false if the frame or the region is invalid.
+   */
+  bool interpolate(const RawData & frame, uint32_t x, uint32_t y,
+                   uint32_t width, uint32_t height, RawData & out) const;
+private:
+  uint32_t m_h;
+  uint32_t m_v;
+  Coefficients m_coefficients;
+};
+
+}
+}
+#endif
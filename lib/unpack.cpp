@@ -20,20 +20,39 @@
  */
 
 #include <assert.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
 
 #include <libopenraw/consts.h>
 
 #include "unpack.hpp"
 #include "trace.hpp"
 #include "ifd.hpp"
+#include "parallel.hpp"
+#include "rawcontainer.hpp"
+
+/* The SIMD kernels, selected at runtime on x86. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UNPACK_HAVE_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON) \
+  && !defined(__ARM_BIG_ENDIAN)
+#define UNPACK_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
 
 namespace OpenRaw {
 namespace Internals {
 
 using namespace Debug;
 
-Unpack::Unpack(uint32_t w, uint32_t t)
-  : m_w(w), m_type(t)
+Unpack::Unpack(uint32_t w, uint32_t t, uint16_t bpc, bool big_endian,
+               size_t row_size)
+  : m_w(w), m_type(t), m_bpc(bpc), m_big_endian(big_endian),
+    m_row_size(row_size)
 {
 }
 
@@ -44,12 +63,608 @@ size_t Unpack::block_size()
   if(m_type == IFD::COMPRESS_NIKON_PACK) {
     bs = (m_w / 2 * 3) + (m_w / 10);
   }
+  else if(m_row_size) {
+    bs = m_row_size;
+  }
   else {
-    bs = m_w / 2 * 3;
+    bs = ((size_t)m_w * m_bpc + 7) / 8;
   }
   return bs;
 }
 
+bool Unpack::unpacks_pairs() const
+{
+  // an odd row ends in the middle of a byte.
+  return m_type == IFD::COMPRESS_NIKON_PACK
+    || (m_bpc == 12 && m_big_endian && !m_row_size && !(m_w & 1));
+}
+
+size_t Unpack::row_out_size()
+{
+  size_t bs = block_size();
+  if (unpacks_pairs()) {
+    size_t group = (m_type == IFD::COMPRESS_NIKON_PACK) ? 16 : 15;
+    return bs / group * 20 + bs % group / 3 * 4;
+  }
+  return std::min((size_t)m_w, bs * 8 / m_bpc) * 2;
+}
+
+
+namespace {
+
+/* Unpack 3 bytes into 2 samples: the scalar reference. */
+inline void unpack_pair(const uint8_t *src, uint16_t *dest)
+{
+  uint32_t t = (src[0] << 16) | (src[1] << 8) | src[2];
+  dest[0] = t >> 12;
+  dest[1] = t & 0xfff;
+}
+
+/* Unpack count samples of BITS bits, packed from the MSB of each byte
+   when BE, from the LSB otherwise: the scalar reference. It reads
+   (count * BITS + 7) / 8 bytes. */
+template <unsigned BITS, bool BE>
+void unpack_scalar(const uint8_t *src, size_t count, uint16_t *dest)
+{
+  const uint32_t mask = (1 << BITS) - 1;
+  uint32_t acc = 0;
+  unsigned int n = 0;
+  for (size_t i = 0; i < count; i++) {
+    while (n < BITS) {
+      if (BE) {
+        acc = (acc << 8) | *src++;
+      }
+      else {
+        acc |= *src++ << n;
+      }
+      n += 8;
+    }
+    n -= BITS;
+    if (BE) {
+      dest[i] = (acc >> n) & mask;
+    }
+    else {
+      dest[i] = acc & mask;
+      acc >>= BITS;
+    }
+  }
+}
+
+/* A kernel unpacks from the start of src as many samples as it can,
+   and returns the number of bytes consumed. These are whole groups of
+   8 samples, whole pairs of samples in 12 bits, and whole 16 bytes
+   blocks in a Nikon pack. The scalar code unpacks the rest. */
+typedef size_t (*UnpackKernel)(const uint8_t *src, size_t size,
+                               uint16_t *dest);
+
+size_t unpack_none(const uint8_t *, size_t, uint16_t *)
+{
+  return 0;
+}
+
+#if UNPACK_HAVE_X86
+
+/* Each 16-bits word gets the 2 bytes holding its sample, in BE order:
+   4 pairs from the first 12 bytes. */
+#define UNPACK12_SHUFFLE 1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10
+/* the 5th pair of a Nikon pack block, from the bytes 12 to 14. */
+#define UNPACK12_SHUFFLE_LAST 13, 12, 14, 13,                   \
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+
+/* The even samples are the 12 high bits of their word, the odd ones
+   the 12 low bits. */
+__attribute__((target("ssse3")))
+inline __m128i unpack12_ssse3(__m128i v, __m128i shuffle)
+{
+  v = _mm_shuffle_epi8(v, shuffle);
+  __m128i even = _mm_and_si128(_mm_srli_epi16(v, 4),
+                               _mm_set1_epi32(0x0000ffff));
+  __m128i odd = _mm_and_si128(v, _mm_set1_epi32(0x0fff0000));
+  return _mm_or_si128(even, odd);
+}
+
+__attribute__((target("avx2")))
+inline __m256i unpack12_avx2(__m256i v, __m256i shuffle)
+{
+  v = _mm256_shuffle_epi8(v, shuffle);
+  __m256i even = _mm256_and_si256(_mm256_srli_epi16(v, 4),
+                                  _mm256_set1_epi32(0x0000ffff));
+  __m256i odd = _mm256_and_si256(v, _mm256_set1_epi32(0x0fff0000));
+  return _mm256_or_si256(even, odd);
+}
+
+/* 12 bytes to 8 samples, loading 16. */
+__attribute__((target("ssse3")))
+size_t unpack12_plain_ssse3(const uint8_t *src, size_t size,
+                            uint16_t *dest)
+{
+  const __m128i shuffle = _mm_setr_epi8(UNPACK12_SHUFFLE);
+  size_t done = 0;
+  for (; done + 16 <= size; done += 12, dest += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + done));
+    _mm_storeu_si128((__m128i*)dest, unpack12_ssse3(v, shuffle));
+  }
+  return done;
+}
+
+/* A 16 bytes block to 10 samples. */
+__attribute__((target("ssse3")))
+size_t unpack12_nikon_ssse3(const uint8_t *src, size_t size,
+                            uint16_t *dest)
+{
+  const __m128i shuffle = _mm_setr_epi8(UNPACK12_SHUFFLE);
+  const __m128i shuffle_last = _mm_setr_epi8(UNPACK12_SHUFFLE_LAST);
+  size_t done = 0;
+  for (; done + 16 <= size; done += 16, dest += 10) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + done));
+    _mm_storeu_si128((__m128i*)dest, unpack12_ssse3(v, shuffle));
+    int32_t last = _mm_cvtsi128_si32(unpack12_ssse3(v, shuffle_last));
+    memcpy(dest + 8, &last, sizeof(last));
+  }
+  return done;
+}
+
+/* 24 bytes to 16 samples, 12 bytes in each lane, loading 28. */
+__attribute__((target("avx2")))
+size_t unpack12_plain_avx2(const uint8_t *src, size_t size,
+                           uint16_t *dest)
+{
+  const __m256i shuffle = _mm256_setr_epi8(UNPACK12_SHUFFLE,
+                                           UNPACK12_SHUFFLE);
+  size_t done = 0;
+  for (; done + 28 <= size; done += 24, dest += 16) {
+    __m128i lo = _mm_loadu_si128((const __m128i*)(src + done));
+    __m128i hi = _mm_loadu_si128((const __m128i*)(src + done + 12));
+    __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+    _mm256_storeu_si256((__m256i*)dest, unpack12_avx2(v, shuffle));
+  }
+  return done + unpack12_plain_ssse3(src + done, size - done, dest);
+}
+
+/* 2 blocks of 16 bytes to 20 samples, a block in each lane. */
+__attribute__((target("avx2")))
+size_t unpack12_nikon_avx2(const uint8_t *src, size_t size,
+                           uint16_t *dest)
+{
+  const __m256i shuffle = _mm256_setr_epi8(UNPACK12_SHUFFLE,
+                                           UNPACK12_SHUFFLE);
+  const __m256i shuffle_last = _mm256_setr_epi8(UNPACK12_SHUFFLE_LAST,
+                                                UNPACK12_SHUFFLE_LAST);
+  size_t done = 0;
+  for (; done + 32 <= size; done += 32, dest += 20) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(src + done));
+    __m256i first = unpack12_avx2(v, shuffle);
+    __m256i last = unpack12_avx2(v, shuffle_last);
+    int32_t last0 = _mm256_extract_epi32(last, 0);
+    int32_t last1 = _mm256_extract_epi32(last, 4);
+    _mm_storeu_si128((__m128i*)dest, _mm256_castsi256_si128(first));
+    memcpy(dest + 8, &last0, sizeof(last0));
+    _mm_storeu_si128((__m128i*)(dest + 10),
+                     _mm256_extracti128_si256(first, 1));
+    memcpy(dest + 18, &last1, sizeof(last1));
+  }
+  return done + unpack12_nikon_ssse3(src + done, size - done, dest);
+}
+
+
+/* For 8 samples of BITS bits, each 16-bits word gets the 2 bytes
+   holding its sample, and is multiplied to shift the sample to its
+   high bits. The sample must fit in the 2 bytes. */
+template <unsigned BITS, bool BE>
+struct Lanes16 {
+  int8_t shuffle[16];
+  int16_t mul[8];
+
+  Lanes16()
+    {
+      for (unsigned int i = 0; i < 8; i++) {
+        unsigned int k = i * BITS / 8;
+        unsigned int r = i * BITS % 8;
+        shuffle[2 * i] = BE ? k + 1 : k;
+        shuffle[2 * i + 1] = BE ? k : k + 1;
+        mul[i] = BE ? 1 << r : 1 << (16 - BITS - r);
+      }
+    }
+};
+
+/* For 4 samples of BITS bits, each 32-bits word gets the 3 bytes
+   holding its sample, and the shift to its low bits. */
+template <unsigned BITS, bool BE>
+struct Lanes32 {
+  int8_t shuffle[16];
+  int32_t shift[4];
+
+  Lanes32()
+    {
+      for (unsigned int i = 0; i < 4; i++) {
+        unsigned int k = i * BITS / 8;
+        unsigned int r = i * BITS % 8;
+        for (unsigned int j = 0; j < 3; j++) {
+          shuffle[4 * i + j] = BE ? k + 2 - j : k + j;
+        }
+        shuffle[4 * i + 3] = -1;
+        shift[i] = BE ? 24 - r - BITS : r;
+      }
+    }
+};
+
+/* BITS bytes to 8 samples, loading 16. */
+template <unsigned BITS, bool BE>
+__attribute__((target("ssse3")))
+size_t unpack16_ssse3(const uint8_t *src, size_t size, uint16_t *dest)
+{
+  static const Lanes16<BITS, BE> lanes;
+  const __m128i shuffle = _mm_loadu_si128((const __m128i*)lanes.shuffle);
+  const __m128i mul = _mm_loadu_si128((const __m128i*)lanes.mul);
+  size_t done = 0;
+  for (; done + 16 <= size; done += BITS, dest += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + done));
+    v = _mm_mullo_epi16(_mm_shuffle_epi8(v, shuffle), mul);
+    _mm_storeu_si128((__m128i*)dest, _mm_srli_epi16(v, 16 - BITS));
+  }
+  return done;
+}
+
+/* 2 * BITS bytes to 16 samples, BITS bytes in each lane. */
+template <unsigned BITS, bool BE>
+__attribute__((target("avx2")))
+size_t unpack16_avx2(const uint8_t *src, size_t size, uint16_t *dest)
+{
+  static const Lanes16<BITS, BE> lanes;
+  const __m256i shuffle = _mm256_broadcastsi128_si256(
+    _mm_loadu_si128((const __m128i*)lanes.shuffle));
+  const __m256i mul = _mm256_broadcastsi128_si256(
+    _mm_loadu_si128((const __m128i*)lanes.mul));
+  size_t done = 0;
+  for (; done + BITS + 16 <= size; done += 2 * BITS, dest += 16) {
+    __m128i lo = _mm_loadu_si128((const __m128i*)(src + done));
+    __m128i hi = _mm_loadu_si128((const __m128i*)(src + done + BITS));
+    __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+    v = _mm256_mullo_epi16(_mm256_shuffle_epi8(v, shuffle), mul);
+    _mm256_storeu_si256((__m256i*)dest, _mm256_srli_epi16(v, 16 - BITS));
+  }
+  return done + unpack16_ssse3<BITS, BE>(src + done, size - done, dest);
+}
+
+/* 2 * BITS bytes to 16 samples, in 32-bits words: BITS / 2 bytes
+   to 4 samples in each lane of 2 vectors. */
+template <unsigned BITS, bool BE>
+__attribute__((target("avx2")))
+inline __m256i unpack32_lanes_avx2(const uint8_t *src, __m256i shuffle,
+                                   __m256i shift)
+{
+  __m128i lo = _mm_loadu_si128((const __m128i*)src);
+  __m128i hi = _mm_loadu_si128((const __m128i*)(src + BITS / 2));
+  __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+  v = _mm256_srlv_epi32(_mm256_shuffle_epi8(v, shuffle), shift);
+  return _mm256_and_si256(v, _mm256_set1_epi32((1 << BITS) - 1));
+}
+
+template <unsigned BITS, bool BE>
+__attribute__((target("avx2")))
+size_t unpack32_avx2(const uint8_t *src, size_t size, uint16_t *dest)
+{
+  static const Lanes32<BITS, BE> lanes;
+  const __m256i shuffle = _mm256_broadcastsi128_si256(
+    _mm_loadu_si128((const __m128i*)lanes.shuffle));
+  const __m256i shift = _mm256_broadcastsi128_si256(
+    _mm_loadu_si128((const __m128i*)lanes.shift));
+  size_t done = 0;
+  for (; done + BITS * 3 / 2 + 16 <= size; done += 2 * BITS, dest += 16) {
+    __m256i a = unpack32_lanes_avx2<BITS, BE>(src + done, shuffle,
+                                              shift);
+    __m256i b = unpack32_lanes_avx2<BITS, BE>(src + done + BITS, shuffle,
+                                              shift);
+    // the samples 0-3, 8-11 in the first lane, 4-7, 12-15 in the other.
+    __m256i v = _mm256_packus_epi32(a, b);
+    v = _mm256_permute4x64_epi64(v, _MM_SHUFFLE(3, 1, 2, 0));
+    _mm256_storeu_si256((__m256i*)dest, v);
+  }
+  return done;
+}
+
+/* Swap the bytes of 16-bits words: a kernel for copy_swap16(). */
+#define SWAP16_SHUFFLE 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14
+
+__attribute__((target("ssse3")))
+size_t swap16_ssse3(const uint8_t *src, size_t size, uint16_t *dest)
+{
+  const __m128i shuffle = _mm_setr_epi8(SWAP16_SHUFFLE);
+  size_t done = 0;
+  for (; done + 16 <= size; done += 16, dest += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + done));
+    _mm_storeu_si128((__m128i*)dest, _mm_shuffle_epi8(v, shuffle));
+  }
+  return done;
+}
+
+__attribute__((target("avx2")))
+size_t swap16_avx2(const uint8_t *src, size_t size, uint16_t *dest)
+{
+  const __m256i shuffle = _mm256_setr_epi8(SWAP16_SHUFFLE, SWAP16_SHUFFLE);
+  size_t done = 0;
+  for (; done + 64 <= size; done += 64, dest += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(src + done));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(src + done + 32));
+    _mm256_storeu_si256((__m256i*)dest, _mm256_shuffle_epi8(a, shuffle));
+    _mm256_storeu_si256((__m256i*)(dest + 16),
+                        _mm256_shuffle_epi8(b, shuffle));
+  }
+  return done + swap16_ssse3(src + done, size - done, dest);
+}
+
+/* Swap the bytes of 32-bits words: a kernel for copy_swap32(). */
+#define SWAP32_SHUFFLE 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+
+__attribute__((target("ssse3")))
+size_t swap32_ssse3(const uint8_t *src, size_t size, uint16_t *dest)
+{
+  const __m128i shuffle = _mm_setr_epi8(SWAP32_SHUFFLE);
+  size_t done = 0;
+  for (; done + 16 <= size; done += 16, dest += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + done));
+    _mm_storeu_si128((__m128i*)dest, _mm_shuffle_epi8(v, shuffle));
+  }
+  return done;
+}
+
+__attribute__((target("avx2")))
+size_t swap32_avx2(const uint8_t *src, size_t size, uint16_t *dest)
+{
+  const __m256i shuffle = _mm256_setr_epi8(SWAP32_SHUFFLE, SWAP32_SHUFFLE);
+  size_t done = 0;
+  for (; done + 64 <= size; done += 64, dest += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(src + done));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(src + done + 32));
+    _mm256_storeu_si256((__m256i*)dest, _mm256_shuffle_epi8(a, shuffle));
+    _mm256_storeu_si256((__m256i*)(dest + 16),
+                        _mm256_shuffle_epi8(b, shuffle));
+  }
+  return done + swap32_ssse3(src + done, size - done, dest);
+}
+
+/* Merge 2-bits samples as the low bits of the words: a kernel for
+   merge_lowbits2(). Each word gets the byte holding its 2 bits,
+   multiplied to move them to the bits 6 and 7. */
+#define LOWBITS2_SHUFFLE(a, b) a, -1, a, -1, a, -1, a, -1,     \
+    b, -1, b, -1, b, -1, b, -1
+#define LOWBITS2_MUL 64, 16, 4, 1, 64, 16, 4, 1
+
+__attribute__((target("ssse3")))
+inline __m128i merge_lowbits2_ssse3(__m128i words, __m128i v,
+                                    __m128i shuffle, __m128i mul)
+{
+  __m128i low = _mm_mullo_epi16(_mm_shuffle_epi8(v, shuffle), mul);
+  low = _mm_and_si128(_mm_srli_epi16(low, 6), _mm_set1_epi16(3));
+  return _mm_or_si128(_mm_slli_epi16(words, 2), low);
+}
+
+__attribute__((target("avx2")))
+inline __m256i merge_lowbits2_avx2(__m256i words, __m256i v,
+                                   __m256i shuffle, __m256i mul)
+{
+  __m256i low = _mm256_mullo_epi16(_mm256_shuffle_epi8(v, shuffle), mul);
+  low = _mm256_and_si256(_mm256_srli_epi16(low, 6), _mm256_set1_epi16(3));
+  return _mm256_or_si256(_mm256_slli_epi16(words, 2), low);
+}
+
+/* 4 bytes to 16 words. */
+__attribute__((target("ssse3")))
+size_t lowbits2_ssse3(const uint8_t *src, size_t size, uint16_t *dest)
+{
+  const __m128i shuffle0 = _mm_setr_epi8(LOWBITS2_SHUFFLE(0, 1));
+  const __m128i shuffle1 = _mm_setr_epi8(LOWBITS2_SHUFFLE(2, 3));
+  const __m128i mul = _mm_setr_epi16(LOWBITS2_MUL);
+  size_t done = 0;
+  for (; done + 4 <= size; done += 4, dest += 16) {
+    int32_t bytes;
+    memcpy(&bytes, src + done, sizeof(bytes));
+    __m128i v = _mm_cvtsi32_si128(bytes);
+    __m128i a = _mm_loadu_si128((const __m128i*)dest);
+    __m128i b = _mm_loadu_si128((const __m128i*)(dest + 8));
+    _mm_storeu_si128((__m128i*)dest,
+                     merge_lowbits2_ssse3(a, v, shuffle0, mul));
+    _mm_storeu_si128((__m128i*)(dest + 8),
+                     merge_lowbits2_ssse3(b, v, shuffle1, mul));
+  }
+  return done;
+}
+
+/* 8 bytes to 32 words, in both lanes. */
+__attribute__((target("avx2")))
+size_t lowbits2_avx2(const uint8_t *src, size_t size, uint16_t *dest)
+{
+  const __m256i shuffle0 = _mm256_setr_epi8(LOWBITS2_SHUFFLE(0, 1),
+                                            LOWBITS2_SHUFFLE(2, 3));
+  const __m256i shuffle1 = _mm256_setr_epi8(LOWBITS2_SHUFFLE(4, 5),
+                                            LOWBITS2_SHUFFLE(6, 7));
+  const __m256i mul = _mm256_setr_epi16(LOWBITS2_MUL, LOWBITS2_MUL);
+  size_t done = 0;
+  for (; done + 8 <= size; done += 8, dest += 32) {
+    int64_t bytes;
+    memcpy(&bytes, src + done, sizeof(bytes));
+    __m256i v = _mm256_set1_epi64x(bytes);
+    __m256i a = _mm256_loadu_si256((const __m256i*)dest);
+    __m256i b = _mm256_loadu_si256((const __m256i*)(dest + 16));
+    _mm256_storeu_si256((__m256i*)dest,
+                        merge_lowbits2_avx2(a, v, shuffle0, mul));
+    _mm256_storeu_si256((__m256i*)(dest + 16),
+                        merge_lowbits2_avx2(b, v, shuffle1, mul));
+  }
+  return done + lowbits2_ssse3(src + done, size - done, dest);
+}
+
+#elif UNPACK_HAVE_NEON
+
+/* 48 bytes to 32 samples: the 3 bytes of each pair are loaded
+   deinterleaved, and the samples stored interleaved. */
+size_t unpack12_plain_neon(const uint8_t *src, size_t size,
+                           uint16_t *dest)
+{
+  size_t done = 0;
+  for (; done + 48 <= size; done += 48, dest += 32) {
+    uint8x16x3_t b = vld3q_u8(src + done);
+    uint16x8x2_t s;
+    s.val[0] = vorrq_u16(vshll_n_u8(vget_low_u8(b.val[0]), 4),
+                         vmovl_u8(vshr_n_u8(vget_low_u8(b.val[1]), 4)));
+    s.val[1] = vorrq_u16(vshll_n_u8(vand_u8(vget_low_u8(b.val[1]),
+                                            vdup_n_u8(0x0f)), 8),
+                         vmovl_u8(vget_low_u8(b.val[2])));
+    vst2q_u16(dest, s);
+    s.val[0] = vorrq_u16(vshll_n_u8(vget_high_u8(b.val[0]), 4),
+                         vmovl_u8(vshr_n_u8(vget_high_u8(b.val[1]), 4)));
+    s.val[1] = vorrq_u16(vshll_n_u8(vand_u8(vget_high_u8(b.val[1]),
+                                            vdup_n_u8(0x0f)), 8),
+                         vmovl_u8(vget_high_u8(b.val[2])));
+    vst2q_u16(dest + 16, s);
+  }
+  return done;
+}
+
+/* A 16 bytes block to 10 samples: 8 with a table lookup like on x86,
+   the last 2 with the scalar code. */
+size_t unpack12_nikon_neon(const uint8_t *src, size_t size,
+                           uint16_t *dest)
+{
+  static const uint8_t shuffle[16] = {
+    1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10
+  };
+  const uint8x16_t index = vld1q_u8(shuffle);
+  size_t done = 0;
+  for (; done + 16 <= size; done += 16, dest += 10) {
+    uint8x16_t v = vqtbl1q_u8(vld1q_u8(src + done), index);
+    uint32x4_t even = vandq_u32(
+      vreinterpretq_u32_u16(vshrq_n_u16(vreinterpretq_u16_u8(v), 4)),
+      vdupq_n_u32(0x0000ffff));
+    uint32x4_t odd = vandq_u32(vreinterpretq_u32_u8(v),
+                               vdupq_n_u32(0x0fff0000));
+    vst1q_u16(dest, vreinterpretq_u16_u32(vorrq_u32(even, odd)));
+    unpack_pair(src + done + 12, dest + 8);
+  }
+  return done;
+}
+
+size_t swap16_neon(const uint8_t *src, size_t size, uint16_t *dest)
+{
+  size_t done = 0;
+  for (; done + 16 <= size; done += 16, dest += 8) {
+    vst1q_u8((uint8_t*)dest, vrev16q_u8(vld1q_u8(src + done)));
+  }
+  return done;
+}
+
+size_t swap32_neon(const uint8_t *src, size_t size, uint16_t *dest)
+{
+  size_t done = 0;
+  for (; done + 16 <= size; done += 16, dest += 8) {
+    vst1q_u8((uint8_t*)dest, vrev32q_u8(vld1q_u8(src + done)));
+  }
+  return done;
+}
+
+/* 8 bytes to 32 words: each byte is spread over 4 words, shifted
+   right by 0, 2, 4 and 6. */
+size_t lowbits2_neon(const uint8_t *src, size_t size, uint16_t *dest)
+{
+  static const uint8_t spread[4][8] = {
+    { 0, 0, 0, 0, 1, 1, 1, 1 }, { 2, 2, 2, 2, 3, 3, 3, 3 },
+    { 4, 4, 4, 4, 5, 5, 5, 5 }, { 6, 6, 6, 6, 7, 7, 7, 7 }
+  };
+  static const int16_t shifts[8] = { 0, -2, -4, -6, 0, -2, -4, -6 };
+  const int16x8_t shift = vld1q_s16(shifts);
+  const uint16x8_t mask = vdupq_n_u16(3);
+  size_t done = 0;
+  for (; done + 8 <= size; done += 8, dest += 32) {
+    uint8x8_t v = vld1_u8(src + done);
+    for (int i = 0; i < 4; i++) {
+      uint16x8_t low = vmovl_u8(vtbl1_u8(v, vld1_u8(spread[i])));
+      low = vandq_u16(vshlq_u16(low, shift), mask);
+      uint16x8_t words = vld1q_u16(dest + 8 * i);
+      vst1q_u16(dest + 8 * i, vorrq_u16(vshlq_n_u16(words, 2), low));
+    }
+  }
+  return done;
+}
+#endif
+
+struct UnpackKernels {
+  UnpackKernel plain;
+  UnpackKernel nikon;
+  /* for 10, 12 and 14 bits, little and big endian. */
+  UnpackKernel packed[3][2];
+  UnpackKernel swap16;
+  UnpackKernel swap32;
+  UnpackKernel lowbits2;
+};
+
+/* Select the kernels for the CPU we run on. */
+UnpackKernels select_kernels()
+{
+  UnpackKernels k;
+  k.plain = k.nikon = k.swap16 = k.swap32 = k.lowbits2 = &unpack_none;
+  for (auto & bits : k.packed) {
+    bits[0] = bits[1] = &unpack_none;
+  }
+#if UNPACK_HAVE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    k.plain = &unpack12_plain_avx2;
+    k.nikon = &unpack12_nikon_avx2;
+    k.packed[0][0] = &unpack16_avx2<10, false>;
+    k.packed[0][1] = &unpack16_avx2<10, true>;
+    k.packed[1][0] = &unpack16_avx2<12, false>;
+    k.packed[2][0] = &unpack32_avx2<14, false>;
+    k.packed[2][1] = &unpack32_avx2<14, true>;
+    k.swap16 = &swap16_avx2;
+    k.swap32 = &swap32_avx2;
+    k.lowbits2 = &lowbits2_avx2;
+  }
+  else if (__builtin_cpu_supports("ssse3")) {
+    k.plain = &unpack12_plain_ssse3;
+    k.nikon = &unpack12_nikon_ssse3;
+    k.packed[0][0] = &unpack16_ssse3<10, false>;
+    k.packed[0][1] = &unpack16_ssse3<10, true>;
+    k.packed[1][0] = &unpack16_ssse3<12, false>;
+    k.swap16 = &swap16_ssse3;
+    k.swap32 = &swap32_ssse3;
+    k.lowbits2 = &lowbits2_ssse3;
+  }
+#elif UNPACK_HAVE_NEON
+  k.plain = &unpack12_plain_neon;
+  k.nikon = &unpack12_nikon_neon;
+  k.swap16 = &swap16_neon;
+  k.swap32 = &swap32_neon;
+  k.lowbits2 = &lowbits2_neon;
+#endif
+  k.packed[1][1] = k.plain;
+  return k;
+}
+
+const UnpackKernels & kernels()
+{
+  static const UnpackKernels k = select_kernels();
+  return k;
+}
+
+/* Unpack a row of count samples with the kernel, then the scalar
+   code. */
+template <unsigned BITS, bool BE>
+void unpack_row(const uint8_t *src, size_t count, uint16_t *dest)
+{
+  UnpackKernel kernel = kernels().packed[(BITS - 10) / 2][BE];
+  size_t done = kernel(src, (count * BITS + 7) / 8, dest);
+  size_t samples = done * 8 / BITS;
+  unpack_scalar<BITS, BE>(src + done, count - samples, dest + samples);
+}
+
+void unpack_row8(const uint8_t *src, size_t count, uint16_t *dest)
+{
+  for (size_t i = 0; i < count; i++) {
+    dest[i] = src[i];
+  }
+}
+
+}
 
 /** source is in BE byte order
  * the output is always 16-bits values in native (host) byte order.
@@ -65,43 +680,204 @@ or_error Unpack::unpack_be12to16(uint8_t *dest, size_t destsize, const uint8_t *
   size_t rest = size % (15 + pad);
   size_t ret = n * 20 + rest / 3 * 4;
 
-  /* The inner loop advances 10 columns, which corresponds to 15 input
+  /* A group is 10 columns, which corresponds to 15 input
      bytes, 20 output bytes and, in a Nikon pack, one padding byte.*/
   if (pad) {
     assert (size % 16 == 0);
   }
   assert (rest % 3 == 0);
 
-  for (size_t i = 0; i < n + 1; i++) {
-    size_t m = (i == n) ? rest / 3 : 5;
-    if((reinterpret_cast<uint8_t *>(dest16) - dest) + (m * 4) >  destsize) {
+  /* Only unpack the groups that fit. */
+  size_t groups = std::min(n, destsize / 20);
+  if (groups < n || ret > destsize) {
+    err = OR_ERROR_DECOMPRESSION;
+    LOGERR("overflow !\n");
+    rest = 0;
+  }
+  size_t length = groups * (15 + pad) + rest;
+
+  const UnpackKernels & k = kernels();
+  size_t done;
+  if (pad) {
+    done = k.nikon(src, length, dest16);
+    dest16 += done / 16 * 10;
+    for (; done + 16 <= length; done += 16) {
+      for (size_t j = 0; j < 5; j++) {
+        unpack_pair(src + done + j * 3, dest16);
+        dest16 += 2;
+      }
+    }
+  }
+  else {
+    done = k.plain(src, length, dest16);
+    dest16 += done / 3 * 2;
+    for (; done + 3 <= length; done += 3) {
+      unpack_pair(src + done, dest16);
+      dest16 += 2;
+    }
+  }
+
+  out = ret;
+  return err;
+}
+
+or_error Unpack::unpack(uint8_t *dest, size_t destsize, const uint8_t *src,
+                        size_t size, size_t & outsize)
+{
+  if (unpacks_pairs()) {
+    // drop the bytes of an incomplete group at the end.
+    size -= size % ((m_type == IFD::COMPRESS_NIKON_PACK) ? 16 : 3);
+    return unpack_be12to16(dest, destsize, src, size, outsize);
+  }
+
+  void (*unpack_row_fn)(const uint8_t *, size_t, uint16_t *) = nullptr;
+  switch (m_bpc) {
+  case 8:
+    unpack_row_fn = &unpack_row8;
+    break;
+  case 10:
+    unpack_row_fn = m_big_endian ? &unpack_row<10, true>
+      : &unpack_row<10, false>;
+    break;
+  case 12:
+    unpack_row_fn = m_big_endian ? &unpack_row<12, true>
+      : &unpack_row<12, false>;
+    break;
+  case 14:
+    unpack_row_fn = m_big_endian ? &unpack_row<14, true>
+      : &unpack_row<14, false>;
+    break;
+  default:
+    LOGERR("unsupported bpc %u\n", m_bpc);
+    outsize = 0;
+    return OR_ERROR_INVALID_PARAM;
+  }
+
+  or_error err = OR_ERROR_NONE;
+  uint16_t *dest16 = reinterpret_cast<uint16_t *>(dest);
+  const size_t row_size = block_size();
+  if (!row_size) {
+    outsize = 0;
+    return OR_ERROR_INVALID_PARAM;
+  }
+  size_t left = destsize / 2;
+  while (size) {
+    // the last row may be incomplete.
+    size_t length = std::min(size, row_size);
+    size_t count = std::min((size_t)m_w, length * 8 / m_bpc);
+    if (count > left) {
       err = OR_ERROR_DECOMPRESSION;
       LOGERR("overflow !\n");
       break;
     }
-    for(size_t j = 0; j < m; j++) {
-      /* Read 3 bytes */
-      uint32_t t = *src++;
-      t <<= 8;
-      t |= *src++;
-      t <<= 8;
-      t |= *src++;
-
-      /* Write two 16 bit values. */
-      *dest16 = (t & (0xfff << 12)) >> 12;
-      dest16++;
-
-      *dest16 = t & 0xfff;
-      dest16++;
-    }
+    unpack_row_fn(src, count, dest16);
+    dest16 += count;
+    left -= count;
+    src += length;
+    size -= length;
+  }
 
-    src += pad;
+  outsize = reinterpret_cast<uint8_t *>(dest16) - dest;
+  return err;
+}
+
+/* The largest band read at once. */
+#define STRIP_BAND_MAX (8 * 1024 * 1024)
+
+or_error Unpack::unpack_strip(RawContainer *container, off_t offset,
+                              size_t size, uint8_t *dest, size_t destsize,
+                              size_t & fetched)
+{
+  fetched = 0;
+  const size_t row_size = block_size();
+  const size_t row_out = row_out_size();
+  if (!row_size || !row_out) {
+    return OR_ERROR_INVALID_PARAM;
   }
+  // the last row may be incomplete.
+  const size_t rows = (size + row_size - 1) / row_size;
+  // a few bands per worker, so that they stay busy.
+  size_t band_rows = (rows + parallelWorkers() * 4 - 1)
+    / (parallelWorkers() * 4);
+  band_rows = std::max<size_t>(1, std::min(band_rows,
+                                           STRIP_BAND_MAX / row_size));
+  const size_t bands = (rows + band_rows - 1) / band_rows;
 
-  out = ret;
+  std::vector<or_error> errors(bands, OR_ERROR_NONE);
+  std::vector<size_t> got(bands, 0);
+  parallelFor(bands, [&] (size_t band) {
+      size_t row = band * band_rows;
+      size_t start = row * row_size;
+      size_t length = std::min(size - start, band_rows * row_size);
+      size_t out_offset = row * row_out;
+      if (out_offset >= destsize) {
+        LOGERR("overflow !\n");
+        errors[band] = OR_ERROR_DECOMPRESSION;
+        return;
+      }
+      std::unique_ptr<uint8_t[]> block(new uint8_t[length]);
+      got[band] = container->fetchDataAt(block.get(), offset + start,
+                                         length);
+      if (got[band]) {
+        size_t out;
+        errors[band] = unpack(dest + out_offset, destsize - out_offset,
+                              block.get(), got[band], out);
+      }
+    });
+
+  or_error err = OR_ERROR_NONE;
+  for (size_t band = 0; band < bands; band++) {
+    fetched += got[band];
+    if (err == OR_ERROR_NONE) {
+      err = errors[band];
+    }
+  }
   return err;
 }
 
+void copy_swap16(uint8_t *dest, const uint8_t *src, size_t size)
+{
+  size_t done = kernels().swap16(src, size,
+                                 reinterpret_cast<uint16_t*>(dest));
+  for (; done + 2 <= size; done += 2) {
+    uint8_t b = src[done];
+    dest[done] = src[done + 1];
+    dest[done + 1] = b;
+  }
+  if (done < size) {
+    dest[done] = src[done];
+  }
+}
+
+void copy_swap32(uint8_t *dest, const uint8_t *src, size_t size)
+{
+  size_t done = kernels().swap32(src, size,
+                                 reinterpret_cast<uint16_t*>(dest));
+  for (; done + 4 <= size; done += 4) {
+    uint8_t b0 = src[done];
+    uint8_t b1 = src[done + 1];
+    dest[done] = src[done + 3];
+    dest[done + 1] = src[done + 2];
+    dest[done + 2] = b1;
+    dest[done + 3] = b0;
+  }
+  for (; done < size; done++) {
+    dest[done] = src[done];
+  }
+}
+
+void merge_lowbits2(uint16_t *dest, const uint8_t *src, size_t size)
+{
+  size_t done = kernels().lowbits2(src, size, dest);
+  for (dest += done * 4; done < size; done++, dest += 4) {
+    uint8_t c = src[done];
+    dest[0] = (dest[0] << 2) | (c & 3);
+    dest[1] = (dest[1] << 2) | ((c >> 2) & 3);
+    dest[2] = (dest[2] << 2) | ((c >> 4) & 3);
+    dest[3] = (dest[3] << 2) | (c >> 6);
+  }
+}
+
 } }
 /*
   Local Variables:
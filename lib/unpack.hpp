@@ -25,27 +25,104 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/types.h>
 
 #include <libopenraw/consts.h>
 
 namespace OpenRaw {	namespace Internals {
 
-	/** Unpack class. Because we need to maintain a state */
+	class RawContainer;
+
+	/** Unpack class. Because we need to maintain a state
+	 *
+	 * Unpack rows of packed samples of 8, 10, 12 or 14 bits into 16 bits
+	 * values. The bits are packed from the MSB of each byte (big endian),
+	 * like in TIFF, or from the LSB (little endian). Each row starts on
+	 * a byte, and may be padded.
+	 */
 	class Unpack
 	{
 	public:
-		Unpack(uint32_t w, uint32_t t);
+		/** @param w the width, in samples
+		 * @param t the compression. COMPRESS_NIKON_PACK is 12 bits big
+		 * endian with a padding byte every 15 bytes.
+		 * @param bpc the bits per sample.
+		 * @param big_endian whether the bits are packed from the MSB.
+		 * @param row_size the bytes per row, with the padding. 0 if the rows
+		 * aren't padded.
+		 */
+		Unpack(uint32_t w, uint32_t t, uint16_t bpc = 12,
+			   bool big_endian = true, size_t row_size = 0);
 		// noncopyable
 		Unpack(const Unpack&) = delete;
 		Unpack & operator=(const Unpack&) = delete;
 
+		/** Return the size of an image row, in bytes. */
 		size_t block_size();
 		or_error unpack_be12to16(uint8_t *dest, size_t destsize, const uint8_t *src, size_t size, size_t & outsize);
+		/** Unpack rows. The last one may be incomplete.
+		 * @param dest the output, in host byte order.
+		 * @param destsize the size of dest, in bytes.
+		 * @param src the packed rows.
+		 * @param size the size of src.
+		 * @param outsize the bytes written to dest.
+		 */
+		or_error unpack(uint8_t *dest, size_t destsize, const uint8_t *src,
+						size_t size, size_t & outsize);
+		/** Read and unpack a strip of rows. The strip is split in bands
+		 * of rows, each read and unpacked on a worker thread into its
+		 * slice of dest.
+		 * @param container the container to read from.
+		 * @param offset the offset of the strip.
+		 * @param size the size of the strip.
+		 * @param dest the output, in host byte order.
+		 * @param destsize the size of dest, in bytes.
+		 * @param fetched the bytes read.
+		 */
+		or_error unpack_strip(RawContainer *container, off_t offset,
+							  size_t size, uint8_t *dest, size_t destsize,
+							  size_t & fetched);
 	private:
+		/** The bytes unpacked from a complete row. */
+		size_t row_out_size();
+		/** Whether the rows are unpacked as one stream of 12 bits
+		 * pairs: the Nikon pack, and the rows of an even width that
+		 * aren't padded.
+		 */
+		bool unpacks_pairs() const;
+
 		uint32_t m_w;
 		uint32_t m_type;
+		uint16_t m_bpc;
+		bool m_big_endian;
+		size_t m_row_size;
 	};
 
+	/** Copy 16-bits samples, swapping their bytes. To get samples
+	 * in the host byte order from the other one.
+	 * @param dest the output. Can be src, to swap in place.
+	 * @param src the samples.
+	 * @param size the size in bytes. An odd last byte is copied as is.
+	 */
+	void copy_swap16(uint8_t *dest, const uint8_t *src, size_t size);
+
+	/** Copy 32-bits words, swapping their bytes.
+	 * @param dest the output. Can be src, to swap in place.
+	 * @param src the words.
+	 * @param size the size in bytes. The bytes of an incomplete last
+	 * word are copied as is.
+	 */
+	void copy_swap32(uint8_t *dest, const uint8_t *src, size_t size);
+
+	/** Merge 2-bits samples as the low bits of 16-bits samples: each
+	 * sample is shifted left by 2 and gets its 2 bits. They are packed
+	 * 4 per byte, the first in the lowest bits. For the Canon CRW.
+	 * @param dest the samples, 4 for each byte of src.
+	 * @param src the 2-bits samples.
+	 * @param size the size of src in bytes.
+	 */
+	void merge_lowbits2(uint16_t *dest, const uint8_t *src, size_t size);
+
 } }
 
 #endif
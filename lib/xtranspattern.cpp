@@ -22,6 +22,11 @@
 
 #include <libopenraw/consts.h>
 
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <vector>
+
 #include "cfapattern.hpp"
 #include "xtranspattern.hpp"
 
@@ -48,7 +53,13 @@ static const uint8_t XTRANS_PATTERN[] = {
 XTransPattern::XTransPattern()
   : CfaPattern(OR_CFA_PATTERN_NON_RGB22, 6, 6)
 {
-  setPatternPattern(XTRANS_PATTERN, 36);
+  setPatternPattern(XTRANS_PATTERN, SIZE);
+}
+
+XTransPattern::XTransPattern(const uint8_t* layout)
+  : CfaPattern(OR_CFA_PATTERN_NON_RGB22, 6, 6)
+{
+  setPatternPattern(layout, SIZE);
 }
 
 const XTransPattern*
@@ -59,6 +70,30 @@ XTransPattern::xtransPattern()
   return s_pat;
 }
 
+const XTransPattern*
+XTransPattern::xtransPattern(const uint8_t* layout)
+{
+  for (uint16_t i = 0; i < SIZE; i++) {
+    if (layout[i] > BLUE) {
+      return NULL;
+    }
+  }
+  if (std::equal(layout, layout + SIZE, XTRANS_PATTERN)) {
+    return xtransPattern();
+  }
+  // the patterns are few, and kept like the default one.
+  static std::mutex s_lock;
+  static std::map<std::vector<uint8_t>, const XTransPattern*> s_patterns;
+  std::lock_guard<std::mutex> lock(s_lock);
+  std::vector<uint8_t> key(layout, layout + SIZE);
+  auto iter = s_patterns.find(key);
+  if (iter == s_patterns.end()) {
+    iter = s_patterns.insert(
+      std::make_pair(key, new XTransPattern(layout))).first;
+  }
+  return iter->second;
+}
+
 }
 }
 
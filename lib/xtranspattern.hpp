@@ -34,9 +34,18 @@ class XTransPattern
 {
 public:
   static const XTransPattern* xtransPattern();
+  /** The pattern of a layout, like the RAF XTransLayout.
+   * @param layout the 36 colours, left to right, top to bottom.
+   * @return a pattern. Never delete it. NULL if a colour is invalid.
+   */
+  static const XTransPattern* xtransPattern(const uint8_t* layout);
+
+  /** The number of colours of the pattern. */
+  static const uint16_t SIZE = 36;
 
 protected:
   XTransPattern();
+  explicit XTransPattern(const uint8_t* layout);
 };
 
 }
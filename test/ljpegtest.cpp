@@ -24,19 +24,42 @@
 #include <boost/crc.hpp>      // for boost::crc_basic, boost::crc_optimal
 
 #include "rawdata.hpp"
+#include "decodeindex.hpp"
 #include "io/file.hpp"
+#include "io/memstream.hpp"
+#include "io/prefetchstream.hpp"
 #include "rawcontainer.hpp"
 #include "jfifcontainer.hpp"
 #include "ljpegdecompressor.hpp"
 #include "ljpegdecompressor_priv.hpp"
+#include "exception.hpp"
 
 using OpenRaw::RawData;
 using OpenRaw::IO::File;
+using OpenRaw::IO::MemStream;
 
 std::string g_testfile;
 
 using namespace OpenRaw::Internals;
 
+static uint16_t decompressCrc(const OpenRaw::IO::Stream::Ptr & s,
+                              DecodeIndex *index, bool record)
+{
+	s->open();
+	JfifContainer container(s, 0);
+	LJpegDecompressor decompressor(s.get(), &container);
+	if (index) {
+		decompressor.setDecodeIndex(index, record);
+	}
+	RawData *decompData = decompressor.decompress();
+
+	boost::crc_optimal<16, 0x1021, 0xFFFF, 0, false, false>  crc_ccitt2;
+	const uint8_t * data = static_cast<uint8_t *>(decompData->data());
+	crc_ccitt2 = std::for_each( data, data + decompData->size(), crc_ccitt2 );
+	delete decompData;
+	return crc_ccitt2();
+}
+
 int test_main(int argc, char *argv[])
 {
 	if (argc == 1) {
@@ -66,9 +89,85 @@ int test_main(int argc, char *argv[])
 
 	BOOST_CHECK(crc_ccitt2() == 0x20cc);
 
+	uint32_t frameWidth = decompData->width();
+	uint32_t frameHeight = decompData->height();
 	delete decompData;
 	delete container;
 
+	// record a decode index, and decode again from it.
+	s.reset(new File(g_testfile.c_str()));
+	s->open();
+	std::vector<uint8_t> buf(s->filesize());
+	BOOST_CHECK(s->read(buf.data(), buf.size()) == (int)buf.size());
+	s->close();
+
+	DecodeIndex index;
+	index.setInterval(16);
+	OpenRaw::IO::Stream::Ptr m(new MemStream(buf.data(), buf.size()));
+	BOOST_CHECK(decompressCrc(m, &index, true) == 0x20cc);
+	BOOST_CHECK(!index.empty());
+
+	std::vector<uint8_t> saved = index.serialize();
+	DecodeIndex loaded;
+	BOOST_CHECK(loaded.deserialize(saved.data(), saved.size()));
+	BOOST_CHECK(loaded.checkpoints().size() == index.checkpoints().size());
+	BOOST_CHECK(!loaded.deserialize(saved.data(), saved.size() - 1));
+
+	BOOST_CHECK(loaded.deserialize(saved.data(), saved.size()));
+	m.reset(new MemStream(buf.data(), buf.size()));
+	BOOST_CHECK(decompressCrc(m, &loaded, false) == 0x20cc);
+
+	// decoded as it is read, and loaded to use the index.
+	OpenRaw::IO::Stream::Ptr f(new File(g_testfile.c_str()));
+	f->open();
+	m.reset(new OpenRaw::IO::PrefetchStream(f, 0, buf.size()));
+	BOOST_CHECK(decompressCrc(m, NULL, false) == 0x20cc);
+	m.reset(new OpenRaw::IO::PrefetchStream(f, 0, buf.size()));
+	BOOST_CHECK(decompressCrc(m, &loaded, false) == 0x20cc);
+	m.reset();
+
+	// an index for another scan, with another hash, isn't used:
+	// its checkpoints are wrong for this one.
+	std::vector<uint8_t> stale(saved);
+	stale[28] ^= 0xff;
+	stale[48] += 1;
+	BOOST_CHECK(loaded.deserialize(stale.data(), stale.size()));
+	m.reset(new MemStream(buf.data(), buf.size()));
+	BOOST_CHECK(decompressCrc(m, &loaded, false) == 0x20cc);
+
+	// the whole frame as a tile, and as a tile of another size.
+	std::vector<uint16_t> tile(frameWidth * frameHeight);
+	m.reset(new MemStream(buf.data(), buf.size()));
+	m->open();
+	{
+		JfifContainer jfif(m, 0);
+		LJpegDecompressor tileDecomp(m.get(), &jfif);
+		tileDecomp.decompressTile(tile.data(), frameWidth,
+		                          frameWidth, frameHeight,
+		                          0, 0, frameWidth, frameHeight);
+		crc_ccitt2.reset();
+		const uint8_t * tdata = reinterpret_cast<uint8_t *>(tile.data());
+		crc_ccitt2 = std::for_each(tdata, tdata + tile.size() * 2,
+		                           crc_ccitt2);
+		BOOST_CHECK(crc_ccitt2() == 0x20cc);
+	}
+	m.reset(new MemStream(buf.data(), buf.size()));
+	m->open();
+	{
+		JfifContainer jfif(m, 0);
+		LJpegDecompressor tileDecomp(m.get(), &jfif);
+		bool thrown = false;
+		try {
+			tileDecomp.decompressTile(tile.data(), frameWidth,
+			                          frameWidth / 2, frameHeight * 2,
+			                          0, 0, frameWidth / 2, frameHeight);
+		}
+		catch(const DecodingException &) {
+			thrown = true;
+		}
+		BOOST_CHECK(thrown);
+	}
+
 	return 0;
 }
 
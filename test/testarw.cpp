@@ -0,0 +1,175 @@
+/* -*- tab-width:4; indent-tabs-mode:'t c-file-style:"stroustrup" -*- */
+/*
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <boost/test/minimal.hpp>
+
+#include "rawdata.hpp"
+#include "arwdecompressor.hpp"
+
+using OpenRaw::RawData;
+using OpenRaw::Internals::ArwDecompressor;
+
+// The tone curve that makes the curve linear: the output is the
+// 11 bits value divided by 2.
+static const uint16_t linear_curve[4] = { 16380, 16380, 16380, 16380 };
+
+// Set n bits of a little endian block at bit.
+static void put_bits(uint8_t *block, unsigned bit, unsigned n, unsigned v)
+{
+	for (unsigned i = 0; i < n; i++, bit++) {
+		if (v & (1 << i)) {
+			block[bit / 8] |= 1 << (bit % 8);
+		}
+	}
+}
+
+static std::vector<uint16_t> decompress(const std::vector<uint8_t> & data,
+										uint32_t w, uint32_t h,
+										const uint16_t *curve)
+{
+	ArwDecompressor decomp(data.data(), data.size(), NULL, w, h, curve);
+	std::unique_ptr<RawData> raw(decomp.decompress(NULL));
+	const uint16_t *p = static_cast<const uint16_t *>(raw->data());
+	return std::vector<uint16_t>(p, p + w * h);
+}
+
+// The decoding of dcraw, for the same curve.
+static std::vector<uint16_t> reference(const std::vector<uint8_t> & data,
+									   uint32_t w, uint32_t h,
+									   const uint16_t *tone_curve)
+{
+	unsigned points[6] = { 0, 0, 0, 0, 0, 4095 };
+	for (int i = 0; i < 4; i++) {
+		points[i + 1] = (tone_curve[i] >> 2) & 0xfff;
+	}
+	std::vector<unsigned> curve(4096);
+	for (size_t i = 0; i < curve.size(); i++) {
+		curve[i] = i;
+	}
+	for (int i = 0; i < 5; i++) {
+		for (unsigned j = points[i] + 1; j <= points[i + 1]; j++) {
+			curve[j] = (curve[j - 1] + (1 << i)) & 0xffff;
+		}
+	}
+
+	std::vector<uint16_t> out(w * h);
+	std::vector<uint8_t> row(w + 1);
+	for (uint32_t y = 0; y < h; y++) {
+		std::copy(data.begin() + y * w, data.begin() + (y + 1) * w,
+				  row.begin());
+		const uint8_t *dp = row.data();
+		for (int col = 0; col < (int)w - 30; dp += 16) {
+			int val = dp[0] | (dp[1] << 8) | (dp[2] << 16) | (dp[3] << 24);
+			int max = 0x7ff & val;
+			int min = 0x7ff & (val >> 11);
+			int imax = 0x0f & (val >> 22);
+			int imin = 0x0f & (val >> 26);
+			int sh;
+			for (sh = 0; sh < 4 && (0x80 << sh) <= max - min; sh++) {
+			}
+			int pix[16];
+			for (int bit = 30, i = 0; i < 16; i++) {
+				if (i == imax) {
+					pix[i] = max;
+				}
+				else if (i == imin) {
+					pix[i] = min;
+				}
+				else {
+					unsigned v = dp[bit >> 3] | (dp[(bit >> 3) + 1] << 8);
+					pix[i] = (((v >> (bit & 7)) & 0x7f) << sh) + min;
+					if (pix[i] > 0x7ff) {
+						pix[i] = 0x7ff;
+					}
+					bit += 7;
+				}
+			}
+			for (int i = 0; i < 16; i++, col += 2) {
+				out[y * w + col] = curve[pix[i] << 1] >> 2;
+			}
+			col -= (col & 1) ? 1 : 31;
+		}
+	}
+	return out;
+}
+
+int test_block()
+{
+	// 2 blocks: the even pixels of 32, then the odd ones.
+	const uint32_t w = 32;
+	std::vector<uint8_t> data(w);
+	for (int b = 0; b < 2; b++) {
+		uint8_t *block = data.data() + b * 16;
+		put_bits(block, 0, 11, 1000 + b);
+		put_bits(block, 11, 11, 200);
+		put_bits(block, 22, 4, 0);
+		put_bits(block, 26, 4, 15);
+		for (unsigned k = 0; k < 14; k++) {
+			put_bits(block, 30 + 7 * k, 7, k * 9);
+		}
+	}
+	std::vector<uint16_t> out = decompress(data, w, 1, linear_curve);
+	for (int b = 0; b < 2; b++) {
+		// max - min is 800: the deltas are shifted by 3.
+		BOOST_CHECK(out[b] == (1000 + b) / 2);
+		for (unsigned k = 0; k < 14; k++) {
+			BOOST_CHECK(out[(k + 1) * 2 + b] == ((k * 9 << 3) + 200) / 2);
+		}
+		BOOST_CHECK(out[30 + b] == 200 / 2);
+	}
+	return 0;
+}
+
+int test_rows()
+{
+	const uint16_t tone_curve[4] = { 8000, 10400, 12900, 14100 };
+	const uint32_t widths[] = { 32, 64, 160, 4000 };
+	const uint32_t h = 37;
+	for (uint32_t w : widths) {
+		std::vector<uint8_t> data(w * h);
+		uint32_t seed = w;
+		for (size_t i = 0; i < data.size(); i++) {
+			seed = seed * 1103515245 + 12345;
+			data[i] = seed >> 16;
+		}
+		// some blocks with imax == imin, their 15th delta is past
+		// the block.
+		for (size_t i = 0; i + 16 <= data.size(); i += 16 * 5) {
+			unsigned imax = (data[i + 2] >> 6) | ((data[i + 3] & 3) << 2);
+			data[i + 3] = (data[i + 3] & 0xc3) | (imax << 2);
+		}
+		BOOST_CHECK(decompress(data, w, h, tone_curve)
+					== reference(data, w, h, tone_curve));
+		BOOST_CHECK(decompress(data, w, h, linear_curve)
+					== reference(data, w, h, linear_curve));
+	}
+	return 0;
+}
+
+int test_main(int, char *[])
+{
+	test_block();
+	test_rows();
+	return 0;
+}
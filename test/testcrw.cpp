@@ -0,0 +1,401 @@
+/* -*- tab-width:4; indent-tabs-mode:'t c-file-style:"stroustrup" -*- */
+/*
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <boost/test/minimal.hpp>
+
+#include "rawdata.hpp"
+#include "crwdecompressor.hpp"
+#include "io/memstream.hpp"
+#include "parallel.hpp"
+#include "decodeindex.hpp"
+
+#include "testhelpers.hpp"
+
+using OpenRaw::RawData;
+using OpenRaw::IO::MemStream;
+using OpenRaw::Internals::CrwDecompressor;
+using OpenRaw::Internals::DecodeIndex;
+using OpenRaw::Internals::setParallelWorkers;
+
+static Random s_random;
+
+// The decoding of dcraw, a bit at a time, walking the trees.
+static const uint8_t first_tree[3][29] = {
+	{ 0,1,4,2,3,1,2,0,0,0,0,0,0,0,0,0,
+	  0x04,0x03,0x05,0x06,0x02,0x07,0x01,0x08,0x09,0x00,0x0a,0x0b,0xff },
+	{ 0,2,2,3,1,1,1,1,2,0,0,0,0,0,0,0,
+	  0x03,0x02,0x04,0x01,0x05,0x00,0x06,0x07,0x09,0x08,0x0a,0x0b,0xff },
+	{ 0,0,6,3,1,1,2,0,0,0,0,0,0,0,0,0,
+	  0x06,0x05,0x07,0x04,0x08,0x03,0x09,0x02,0x00,0x0a,0x01,0x0b,0xff },
+};
+
+static const uint8_t second_tree[3][180] = {
+	{ 0,2,2,2,1,4,2,1,2,5,1,1,0,0,0,139,
+	  0x03,0x04,0x02,0x05,0x01,0x06,0x07,0x08,
+	  0x12,0x13,0x11,0x14,0x09,0x15,0x22,0x00,0x21,0x16,0x0a,0xf0,
+	  0x23,0x17,0x24,0x31,0x32,0x18,0x19,0x33,0x25,0x41,0x34,0x42,
+	  0x35,0x51,0x36,0x37,0x38,0x29,0x79,0x26,0x1a,0x39,0x56,0x57,
+	  0x28,0x27,0x52,0x55,0x58,0x43,0x76,0x59,0x77,0x54,0x61,0xf9,
+	  0x71,0x78,0x75,0x96,0x97,0x49,0xb7,0x53,0xd7,0x74,0xb6,0x98,
+	  0x47,0x48,0x95,0x69,0x99,0x91,0xfa,0xb8,0x68,0xb5,0xb9,0xd6,
+	  0xf7,0xd8,0x67,0x46,0x45,0x94,0x89,0xf8,0x81,0xd5,0xf6,0xb4,
+	  0x88,0xb1,0x2a,0x44,0x72,0xd9,0x87,0x66,0xd4,0xf5,0x3a,0xa7,
+	  0x73,0xa9,0xa8,0x86,0x62,0xc7,0x65,0xc8,0xc9,0xa1,0xf4,0xd1,
+	  0xe9,0x5a,0x92,0x85,0xa6,0xe7,0x93,0xe8,0xc1,0xc6,0x7a,0x64,
+	  0xe1,0x4a,0x6a,0xe6,0xb3,0xf1,0xd3,0xa5,0x8a,0xb2,0x9a,0xba,
+	  0x84,0xa4,0x63,0xe5,0xc5,0xf3,0xd2,0xc4,0x82,0xaa,0xda,0xe4,
+	  0xf2,0xca,0x83,0xa3,0xa2,0xc3,0xea,0xc2,0xe2,0xe3,0xff,0xff },
+	{ 0,2,2,1,4,1,4,1,3,3,1,0,0,0,0,140,
+	  0x02,0x03,0x01,0x04,0x05,0x12,0x11,0x06,
+	  0x13,0x07,0x08,0x14,0x22,0x09,0x21,0x00,0x23,0x15,0x31,0x32,
+	  0x0a,0x16,0xf0,0x24,0x33,0x41,0x42,0x19,0x17,0x25,0x18,0x51,
+	  0x34,0x43,0x52,0x29,0x35,0x61,0x39,0x71,0x62,0x36,0x53,0x26,
+	  0x38,0x1a,0x37,0x81,0x27,0x91,0x79,0x55,0x45,0x28,0x72,0x59,
+	  0xa1,0xb1,0x44,0x69,0x54,0x58,0xd1,0xfa,0x57,0xe1,0xf1,0xb9,
+	  0x49,0x47,0x63,0x6a,0xf9,0x56,0x46,0xa8,0x2a,0x4a,0x78,0x99,
+	  0x3a,0x75,0x74,0x86,0x65,0xc1,0x76,0xb6,0x96,0xd6,0x89,0x85,
+	  0xc9,0xf5,0x95,0xb4,0xc7,0xf7,0x8a,0x97,0xb8,0x73,0xb7,0xd8,
+	  0xd9,0x87,0xa7,0x7a,0x48,0x82,0x84,0xea,0xf4,0xa6,0xc5,0x5a,
+	  0x94,0xa4,0xc6,0x92,0xc3,0x68,0xb5,0xc8,0xe4,0xe5,0xe6,0xe9,
+	  0xa2,0xa3,0xe3,0xc2,0x66,0x67,0x93,0xaa,0xd4,0xd5,0xe7,0xf8,
+	  0x88,0x9a,0xd7,0x77,0xc4,0x64,0xe2,0x98,0xa5,0xca,0xda,0xe8,
+	  0xf3,0xf6,0xa9,0xb2,0xb3,0xf2,0xd2,0x83,0xba,0xd3,0xff,0xff },
+	{ 0,0,6,2,1,3,3,2,5,1,2,2,8,10,0,117,
+	  0x04,0x05,0x03,0x06,0x02,0x07,0x01,0x08,
+	  0x09,0x12,0x13,0x14,0x11,0x15,0x0a,0x16,0x17,0xf0,0x00,0x22,
+	  0x21,0x18,0x23,0x19,0x24,0x32,0x31,0x25,0x33,0x38,0x37,0x34,
+	  0x35,0x36,0x39,0x79,0x57,0x58,0x59,0x28,0x56,0x78,0x27,0x41,
+	  0x29,0x77,0x26,0x42,0x76,0x99,0x1a,0x55,0x98,0x97,0xf9,0x48,
+	  0x54,0x96,0x89,0x47,0xb7,0x49,0xfa,0x75,0x68,0xb6,0x67,0x69,
+	  0xb9,0xb8,0xd8,0x52,0xd7,0x88,0xb5,0x74,0x51,0x46,0xd9,0xf8,
+	  0x3a,0xd6,0x87,0x45,0x7a,0x95,0xd5,0xf6,0x86,0xb4,0xa9,0x94,
+	  0x53,0x2a,0xa8,0x43,0xf5,0xf7,0xd4,0x66,0xa7,0x5a,0x44,0x8a,
+	  0xc9,0xe8,0xc8,0xe7,0x9a,0x6a,0x73,0x4a,0x61,0xc7,0xf4,0xc6,
+	  0x65,0xe9,0x72,0xe6,0x71,0x91,0x93,0xa6,0xda,0x92,0x85,0x62,
+	  0xf3,0xc5,0xb2,0xa4,0x84,0xba,0x64,0xa5,0xb3,0xd2,0x81,0xe5,
+	  0xd3,0xaa,0xc4,0xca,0xf2,0xb1,0xe4,0xd1,0x83,0x63,0xea,0xc3,
+	  0xe2,0x82,0xf1,0xa3,0xc2,0xa1,0xc1,0xe3,0xa2,0xe1,0xff,0xff }
+};
+
+struct Node
+{
+	Node *branch[2];
+	int leaf;
+};
+
+class Tree
+{
+public:
+	explicit Tree(const uint8_t *source)
+		: m_nodes(512), m_free(0), m_leaf(0)
+		{
+			memset(m_nodes.data(), 0, m_nodes.size() * sizeof(Node));
+			m_free = m_nodes.data();
+			make(m_nodes.data(), source, 0);
+		}
+	const Node *root() const
+		{
+			return m_nodes.data();
+		}
+private:
+	void make(Node *dest, const uint8_t *source, int level)
+		{
+			int i, next;
+			m_free++;
+			for (i = next = 0; i <= m_leaf && next < 16; ) {
+				i += source[next++];
+			}
+			if (i > m_leaf) {
+				if (level < next) {
+					dest->branch[0] = m_free;
+					make(m_free, source, level + 1);
+					dest->branch[1] = m_free;
+					make(m_free, source, level + 1);
+				}
+				else {
+					dest->leaf = source[16 + m_leaf++];
+				}
+			}
+		}
+
+	std::vector<Node> m_nodes;
+	Node *m_free;
+	int m_leaf;
+};
+
+// A bit at a time, the byte after a 0xff skipped.
+class Bits
+{
+public:
+	Bits(const uint8_t *p, size_t size)
+		: m_p(p), m_end(p + size), m_c(0), m_bits(0)
+		{
+		}
+	int get()
+		{
+			if (m_bits == 0) {
+				m_c = m_p < m_end ? *m_p++ : 0;
+				if (m_c == 0xff) {
+					m_p++;
+				}
+				m_bits = 8;
+			}
+			m_bits--;
+			return (m_c >> m_bits) & 1;
+		}
+	int get(int n)
+		{
+			int v = 0;
+			while (n--) {
+				v = (v << 1) | get();
+			}
+			return v;
+		}
+private:
+	const uint8_t *m_p;
+	const uint8_t *m_end;
+	uint8_t m_c;
+	int m_bits;
+};
+
+static bool has_lowbits(const std::vector<uint8_t> & data)
+{
+	bool ret = true;
+	size_t size = std::min(data.size(), (size_t)0x4000 - 26);
+	for (size_t i = 514; i + 1 < size; i++) {
+		if (data[i] == 0xff) {
+			if (data[i + 1]) {
+				return true;
+			}
+			ret = false;
+		}
+	}
+	return ret;
+}
+
+static std::vector<uint16_t> reference(const std::vector<uint8_t> & data,
+									   uint32_t w, uint32_t h, int table)
+{
+	Tree first(first_tree[table]);
+	Tree second(second_tree[table]);
+	const size_t pixels = w * h;
+	bool lowbits = has_lowbits(data);
+	size_t offset = std::min(data.size(), 514 + lowbits * pixels / 4);
+	Bits bits(data.data() + offset, data.size() - offset);
+
+	std::vector<uint16_t> out(pixels);
+	int carry = 0;
+	int base[2] = { 0, 0 };
+	size_t column = 0;
+	while (column < pixels) {
+		int diffbuf[64];
+		memset(diffbuf, 0, sizeof(diffbuf));
+		const Node *tree = first.root();
+		for (int i = 0; i < 64; i++) {
+			const Node *node = tree;
+			while (node->branch[0]) {
+				node = node->branch[bits.get()];
+			}
+			int leaf = node->leaf;
+			tree = second.root();
+			if (leaf == 0 && i) {
+				break;
+			}
+			if (leaf == 0xff) {
+				continue;
+			}
+			i += leaf >> 4;
+			int len = leaf & 15;
+			if (len == 0) {
+				continue;
+			}
+			int diff = bits.get(len);
+			if ((diff & (1 << (len - 1))) == 0) {
+				diff -= (1 << len) - 1;
+			}
+			if (i < 64) {
+				diffbuf[i] = diff;
+			}
+		}
+		diffbuf[0] += carry;
+		carry = diffbuf[0];
+		for (int i = 0; i < 64 && column < pixels; i++) {
+			if (column % w == 0) {
+				base[0] = base[1] = 512;
+			}
+			out[column++] = (base[i & 1] += diffbuf[i]);
+		}
+	}
+
+	if (lowbits) {
+		for (size_t i = 0; i < pixels; i++) {
+			int low = 0;
+			if (i / 4 < pixels / 4 && i / 4 < data.size()) {
+				low = (data[i / 4] >> (2 * (i % 4))) & 3;
+			}
+			out[i] = (out[i] << 2) + low;
+		}
+	}
+	return out;
+}
+
+static std::vector<uint16_t> decompress(std::vector<uint8_t> & data,
+										uint32_t w, uint32_t h, int table,
+										uint16_t & bpc,
+										DecodeIndex *index = NULL,
+										bool record = false)
+{
+	MemStream s(data.data(), data.size());
+	s.open();
+	CrwDecompressor decomp(&s, NULL);
+	decomp.setOutputDimensions(w, h);
+	decomp.setDecoderTable(table);
+	decomp.setDecodeIndex(index, record);
+	std::unique_ptr<RawData> raw(decomp.decompress(NULL));
+	BOOST_CHECK(raw && raw->width() == w && raw->height() == h);
+	if (!raw) {
+		return std::vector<uint16_t>();
+	}
+	bpc = raw->bpc();
+	const uint16_t *p = static_cast<const uint16_t *>(raw->data());
+	return std::vector<uint16_t>(p, p + w * h);
+}
+
+// Random data, with the low bits or not. The decoding doesn't check
+// the codes.
+static std::vector<uint8_t> make_data(size_t size, bool lowbits)
+{
+	std::vector<uint8_t> data(size);
+	for (auto & c : data) {
+		c = s_random.bits(8);
+	}
+	// where the low bits are detected, a 0xff is followed by a 0
+	// only without them.
+	size_t end = std::min(size, (size_t)0x4000 - 26);
+	for (size_t i = 514; i + 1 < end; i++) {
+		if (data[i] == 0xff && !lowbits) {
+			data[i + 1] = 0;
+		}
+	}
+	if (size > 515) {
+		data[514] = 0xff;
+		data[515] = lowbits ? 1 : 0;
+	}
+	return data;
+}
+
+int test_decompress()
+{
+	// the pixels aren't a multiple of the 64 of a block, or of the 4
+	// of a byte of low bits.
+	const uint32_t sizes[][2] = {
+		{ 64, 1 }, { 100, 7 }, { 37, 3 }, { 642, 21 }, { 2, 1 }
+	};
+	for (const auto & size : sizes) {
+		const uint32_t w = size[0];
+		const uint32_t h = size[1];
+		const size_t pixels = w * h;
+		for (bool lowbits : { false, true }) {
+			const size_t start = 514 + (lowbits ? pixels / 4 : 0);
+			// enough data, or the end of the data before the last blocks.
+			for (size_t length : { start + pixels * 2, start + pixels / 8 + 2 }) {
+				for (int table = 0; table < 3; table++) {
+					std::vector<uint8_t> data = make_data(length, lowbits);
+					BOOST_CHECK(has_lowbits(data) == lowbits);
+					uint16_t bpc = 0;
+					std::vector<uint16_t> out = decompress(data, w, h,
+														   table, bpc);
+					BOOST_CHECK(bpc == (lowbits ? 12 : 10));
+					BOOST_CHECK(out == reference(data, w, h, table));
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+// The data large enough to be decoded speculatively on several
+// threads.
+int test_speculative()
+{
+	setParallelWorkers(4);
+	std::vector<uint8_t> data = make_data(1200 * 1024, false);
+	// the end of the data before the last blocks or not.
+	const uint32_t sizes[][2] = { { 4000, 1000 }, { 4000, 5000 } };
+	for (const auto & size : sizes) {
+		const uint32_t w = size[0];
+		const uint32_t h = size[1];
+		for (int table = 0; table < 3; table++) {
+			uint16_t bpc = 0;
+			std::vector<uint16_t> out = decompress(data, w, h, table, bpc);
+			BOOST_CHECK(out == reference(data, w, h, table));
+		}
+	}
+	setParallelWorkers(0);
+	return 0;
+}
+
+// Record a decode index, and decode from it once saved and loaded.
+// The rows don't start on a block, and are narrower than a block.
+int test_index()
+{
+	const uint32_t sizes[][2] = { { 100, 70 }, { 642, 40 }, { 37, 90 } };
+	for (const auto & size : sizes) {
+		const uint32_t w = size[0];
+		const uint32_t h = size[1];
+		const size_t pixels = w * h;
+		for (bool lowbits : { false, true }) {
+			const size_t start = 514 + (lowbits ? pixels / 4 : 0);
+			std::vector<uint8_t> data = make_data(start + pixels / 2, lowbits);
+			std::vector<uint16_t> expected = reference(data, w, h, 1);
+			uint16_t bpc = 0;
+
+			DecodeIndex index;
+			index.setInterval(8);
+			BOOST_CHECK(decompress(data, w, h, 1, bpc, &index, true)
+						== expected);
+			BOOST_CHECK(!index.empty());
+			std::vector<uint8_t> saved = index.serialize();
+			DecodeIndex loaded;
+			BOOST_CHECK(loaded.deserialize(saved.data(), saved.size()));
+			for (unsigned workers : { 1, 4 }) {
+				setParallelWorkers(workers);
+				BOOST_CHECK(decompress(data, w, h, 1, bpc, &loaded, false)
+							== expected);
+			}
+			setParallelWorkers(0);
+		}
+	}
+	return 0;
+}
+
+int test_main(int, char *[])
+{
+	test_decompress();
+	test_speculative();
+	test_index();
+	return 0;
+}
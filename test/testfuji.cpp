@@ -0,0 +1,469 @@
+/* -*- tab-width:4; indent-tabs-mode:'t c-file-style:"stroustrup" -*- */
+/*
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <boost/test/minimal.hpp>
+
+#include "rawdata.hpp"
+#include "cfapattern.hpp"
+#include "xtranspattern.hpp"
+#include "fujidecompressor.hpp"
+
+#include "testhelpers.hpp"
+
+using OpenRaw::CfaPattern;
+using OpenRaw::RawData;
+using OpenRaw::Internals::FujiDecompressor;
+using OpenRaw::Internals::XTransPattern;
+
+// The coding of a strip, that does what the decoding does but
+// chooses the codes to get the values it is given. The values it
+// ends up with are then what the decoding must output.
+
+enum {
+	R0 = 0, R1, R2, R3, R4,
+	G0, G1, G2, G3, G4, G5, G6, G7,
+	B0, B1, B2, B3, B4,
+	LINES
+};
+
+static const struct {
+	int first;
+	int second;
+	int other;
+	int grads;
+	int interpolate;
+} PASSES[] = {
+	{ R2, G2, R2, 0, -1 },
+	{ G3, B2, B2, 1, -1 },
+	{ R3, G4, R3, 2, 0 },
+	{ G5, B3, B3, 0, 2 },
+	{ R4, G6, R4, 1, 2 },
+	{ G7, B4, B4, 2, 0 }
+};
+
+struct Gradient
+{
+	int value1;
+	int value2;
+};
+
+class StripEncoder
+{
+public:
+	StripEncoder(bool xtrans, int bits, int seed)
+		: m_xtrans(xtrans)
+		, m_bits(bits)
+		, m_total(1 << bits)
+		, m_width(xtrans ? 0x300 * 2 / 3 : 0x300 / 2)
+		, m_stride(m_width + 2)
+		, m_buffer(LINES * m_stride, 0)
+		, m_seed(seed)
+		{
+			for (int j = 0; j < 3; j++) {
+				for (int i = 0; i < 41; i++) {
+					m_gradEven[j][i].value1 = bits == 14 ? 256 : 64;
+					m_gradEven[j][i].value2 = 1;
+					m_gradOdd[j][i] = m_gradEven[j][i];
+				}
+			}
+		}
+
+	void encodeGroup();
+	void copyGroup(uint16_t *out, size_t stride, uint32_t width,
+				   const uint8_t *pattern, unsigned size);
+	void nextGroup();
+	std::vector<uint8_t> & data()
+		{
+			return m_writer.data();
+		}
+
+private:
+	uint16_t *line(int index)
+		{
+			return m_buffer.data() + index * m_stride + 1;
+		}
+	// the value to code: smooth, with some noise and jumps.
+	int target(int pos)
+		{
+			m_seed = m_seed * 1103515245 + 12345;
+			unsigned r = m_seed >> 8;
+			if (r % 17 == 0) {
+				return r % m_total;
+			}
+			return (pos * 5 + 300 + r % 40) % m_total;
+		}
+	int gradient(int diff) const
+		{
+			const int q[] = { 0x12, 0x43, 0x114 };
+			int g = diff == 0 ? 0 : 1;
+			for (int i = 0; i < 3; i++) {
+				if (abs(diff) >= q[i]) {
+					g++;
+				}
+			}
+			return diff < 0 ? -g : g;
+		}
+	void encodeCode(Gradient & grad, int code);
+	int code(int value, int interp, int grad);
+	void encodeEven(uint16_t *l, int pos, Gradient *grads);
+	void encodeOdd(uint16_t *l, int pos, Gradient *grads);
+	void interpolateEven(uint16_t *l, int pos);
+	void extend(int first, int last);
+
+	bool m_xtrans;
+	int m_bits;
+	int m_total;
+	int m_width;
+	int m_stride;
+	std::vector<uint16_t> m_buffer;
+	uint32_t m_seed;
+	Gradient m_gradEven[3][41];
+	Gradient m_gradOdd[3][41];
+	BitWriter m_writer;
+};
+
+void StripEncoder::encodeCode(Gradient & grad, int code)
+{
+	// the sign in the LSB.
+	unsigned u = code >= 0 ? code * 2 : -code * 2 - 1;
+	int bits = 0;
+	if (grad.value2 < grad.value1) {
+		while (bits <= 12 && (grad.value2 << ++bits) < grad.value1) {
+		}
+	}
+	const unsigned escape = 4 * m_bits - m_bits - 1;
+	if ((u >> bits) < escape) {
+		m_writer.zeros(u >> bits);
+		m_writer.put(1, 1);
+		m_writer.put(u & ((1 << bits) - 1), bits);
+	}
+	else {
+		m_writer.zeros(escape);
+		m_writer.put(1, 1);
+		m_writer.put(u - 1, m_bits);
+	}
+	grad.value1 += abs(code);
+	if (grad.value2 == 0x40) {
+		grad.value1 >>= 1;
+		grad.value2 >>= 1;
+	}
+	grad.value2++;
+}
+
+// The code to get value from the prediction, as small as possible:
+// the values wrap around.
+int StripEncoder::code(int value, int interp, int grad)
+{
+	int c = value - interp;
+	if (grad < 0) {
+		c = -c;
+	}
+	if (c >= m_total / 2) {
+		c -= m_total;
+	}
+	else if (c < -m_total / 2) {
+		c += m_total;
+	}
+	return c;
+}
+
+void StripEncoder::interpolateEven(uint16_t *l, int pos)
+{
+	uint16_t *cur = l + pos;
+	int Rb = cur[-m_stride];
+	int Rc = cur[-m_stride - 1];
+	int Rd = cur[-m_stride + 1];
+	int Rf = cur[-2 * m_stride];
+	int diffRcRb = abs(Rc - Rb);
+	int diffRfRb = abs(Rf - Rb);
+	int diffRdRb = abs(Rd - Rb);
+	if (diffRcRb > diffRfRb && diffRcRb > diffRdRb) {
+		*cur = (Rf + Rd + 2 * Rb) >> 2;
+	}
+	else if (diffRdRb > diffRcRb && diffRdRb > diffRfRb) {
+		*cur = (Rf + Rc + 2 * Rb) >> 2;
+	}
+	else {
+		*cur = (Rd + Rc + 2 * Rb) >> 2;
+	}
+}
+
+void StripEncoder::encodeEven(uint16_t *l, int pos, Gradient *grads)
+{
+	uint16_t *cur = l + pos;
+	int Rb = cur[-m_stride];
+	int Rc = cur[-m_stride - 1];
+	int Rd = cur[-m_stride + 1];
+	int Rf = cur[-2 * m_stride];
+	int diffRcRb = abs(Rc - Rb);
+	int diffRfRb = abs(Rf - Rb);
+	int diffRdRb = abs(Rd - Rb);
+	int interp;
+	if (diffRcRb > diffRfRb && diffRcRb > diffRdRb) {
+		interp = Rf + Rd + 2 * Rb;
+	}
+	else if (diffRdRb > diffRcRb && diffRdRb > diffRfRb) {
+		interp = Rf + Rc + 2 * Rb;
+	}
+	else {
+		interp = Rd + Rc + 2 * Rb;
+	}
+	int grad = gradient(Rb - Rf) * 9 + gradient(Rc - Rb);
+	int value = target(pos);
+	encodeCode(grads[abs(grad)], code(value, interp >> 2, grad));
+	*cur = value;
+}
+
+void StripEncoder::encodeOdd(uint16_t *l, int pos, Gradient *grads)
+{
+	uint16_t *cur = l + pos;
+	int Ra = cur[-1];
+	int Rb = cur[-m_stride];
+	int Rc = cur[-m_stride - 1];
+	int Rd = cur[-m_stride + 1];
+	int Rg = cur[1];
+	int interp;
+	if ((Rb > Rc && Rb > Rd) || (Rb < Rc && Rb < Rd)) {
+		interp = (Rg + Ra + 2 * Rb) >> 2;
+	}
+	else {
+		interp = (Ra + Rg) >> 1;
+	}
+	int grad = gradient(Rb - Rc) * 9 + gradient(Rc - Ra);
+	int value = target(pos);
+	encodeCode(grads[abs(grad)], code(value, interp, grad));
+	*cur = value;
+}
+
+void StripEncoder::extend(int first, int last)
+{
+	for (int i = first; i <= last; i++) {
+		line(i)[-1] = line(i - 1)[0];
+		line(i)[m_width] = line(i - 1)[m_width - 1];
+	}
+}
+
+void StripEncoder::encodeGroup()
+{
+	for (const auto & pass : PASSES) {
+		int even = 0;
+		int odd = 1;
+		while (even < m_width || odd < m_width) {
+			if (even < m_width) {
+				for (int index : { pass.first, pass.second }) {
+					if (m_xtrans && index == pass.other
+						&& (pass.interpolate < 0
+							|| (even & 3) == pass.interpolate)) {
+						interpolateEven(line(index), even);
+					}
+					else {
+						encodeEven(line(index), even, m_gradEven[pass.grads]);
+					}
+				}
+				even += 2;
+			}
+			if (even > 8) {
+				encodeOdd(line(pass.first), odd, m_gradOdd[pass.grads]);
+				encodeOdd(line(pass.second), odd, m_gradOdd[pass.grads]);
+				odd += 2;
+			}
+		}
+		if (pass.other < G0) {
+			extend(R2, R4);
+		}
+		extend(G2, G7);
+		if (pass.other >= B0) {
+			extend(B2, B4);
+		}
+	}
+}
+
+void StripEncoder::copyGroup(uint16_t *out, size_t stride, uint32_t width,
+							 const uint8_t *pattern, unsigned size)
+{
+	for (int row = 0; row < 6; row++, out += stride) {
+		const uint16_t *lines[3] = {
+			line(R2 + (row >> 1)), line(G2 + row), line(B2 + (row >> 1))
+		};
+		for (uint32_t col = 0; col < width; col++) {
+			const uint16_t *l = lines[pattern[(row % size) * size
+											  + col % size]];
+			if (m_xtrans) {
+				// the columns 0 to 5 are the values 0, 1, 1, 2, 3, 3.
+				out[col] = l[col / 3 * 2 + (col % 3 + 1) / 2];
+			}
+			else {
+				out[col] = l[col / 2];
+			}
+		}
+	}
+}
+
+void StripEncoder::nextGroup()
+{
+	const int moves[][2] = {
+		{ R0, R3 }, { R1, R4 }, { G0, G6 }, { G1, G7 }, { B0, B3 }, { B1, B4 }
+	};
+	for (auto & move : moves) {
+		std::copy(line(move[1]) - 1, line(move[1]) - 1 + m_stride,
+				  line(move[0]) - 1);
+	}
+	const int clears[][2] = {
+		{ R2, R4 }, { G2, G7 }, { B2, B4 }
+	};
+	for (auto & clear : clears) {
+		std::fill(line(clear[0]) - 1, line(clear[1]) - 1 + m_stride, 0);
+		extend(clear[0], clear[0]);
+	}
+}
+
+static void put16(std::vector<uint8_t> & data, size_t pos, unsigned v)
+{
+	data[pos] = v >> 8;
+	data[pos + 1] = v & 0xff;
+}
+
+// Code the strips of a frame, and compute the frame it must decode to.
+static std::vector<uint8_t> encode(bool xtrans, int bits, uint32_t width,
+								   uint32_t height,
+								   const CfaPattern *cfa,
+								   std::vector<uint16_t> & frame)
+{
+	const uint32_t block_size = 0x300;
+	const uint32_t blocks = (width + block_size - 1) / block_size;
+	std::vector<uint8_t> data(FujiDecompressor::HEADER_SIZE
+							  + ((blocks * 4 + 15) & ~15), 0);
+	put16(data, 0, 0x4953);
+	data[2] = 1;
+	data[3] = xtrans ? 16 : 0;
+	data[4] = bits;
+	put16(data, 5, height);
+	put16(data, 7, blocks * block_size);
+	put16(data, 9, width);
+	put16(data, 11, block_size);
+	data[13] = blocks;
+	put16(data, 14, height / 6);
+
+	uint16_t count = 0;
+	const uint8_t *pattern = cfa->patternPattern(count);
+	const unsigned size = xtrans ? 6 : 2;
+	frame.assign(width * height, 0);
+	for (uint32_t b = 0; b < blocks; b++) {
+		StripEncoder strip(xtrans, bits, b + 1);
+		uint32_t strip_width = std::min(block_size, width - b * block_size);
+		for (uint32_t group = 0; group < height / 6; group++) {
+			strip.encodeGroup();
+			strip.copyGroup(frame.data() + group * 6 * width + b * block_size,
+							width, strip_width, pattern, size);
+			strip.nextGroup();
+		}
+		// the strips are aligned on 16 bytes.
+		std::vector<uint8_t> & s = strip.data();
+		s.resize((s.size() + 15) & ~15, 0);
+		uint32_t s_size = s.size();
+		put16(data, FujiDecompressor::HEADER_SIZE + b * 4, s_size >> 16);
+		put16(data, FujiDecompressor::HEADER_SIZE + b * 4 + 2,
+			  s_size & 0xffff);
+		data.insert(data.end(), s.begin(), s.end());
+	}
+	return data;
+}
+
+int test_decompress()
+{
+	const struct {
+		bool xtrans;
+		int bits;
+		uint32_t width;
+	} cases[] = {
+		{ true, 14, 0x300 * 2 - 48 },
+		{ true, 12, 0x300 },
+		{ false, 14, 0x300 * 2 - 24 },
+		{ false, 12, 0x300 * 3 },
+	};
+	const uint32_t height = 18;
+	for (const auto & c : cases) {
+		const CfaPattern *cfa = c.xtrans
+			? static_cast<const CfaPattern*>(XTransPattern::xtransPattern())
+			: CfaPattern::twoByTwoPattern(OR_CFA_PATTERN_RGGB);
+		std::vector<uint16_t> frame;
+		std::vector<uint8_t> data = encode(c.xtrans, c.bits, c.width, height,
+										   cfa, frame);
+
+		FujiDecompressor::Header header;
+		BOOST_CHECK(FujiDecompressor::readHeader(data.data(), data.size(),
+												 header));
+		BOOST_CHECK(header.isXTrans() == c.xtrans);
+
+		FujiDecompressor decomp(data.data(), data.size(), NULL, cfa);
+		std::unique_ptr<RawData> raw(decomp.decompress(NULL));
+		BOOST_CHECK(raw);
+		if (!raw) {
+			continue;
+		}
+		const uint16_t *out = static_cast<const uint16_t *>(raw->data());
+		BOOST_CHECK(std::vector<uint16_t>(out, out + frame.size()) == frame);
+		BOOST_CHECK(raw->bpc() == (uint32_t)c.bits);
+
+		// a pattern of the wrong size isn't decoded.
+		FujiDecompressor wrong(data.data(), data.size(), NULL,
+							   c.xtrans
+							   ? CfaPattern::twoByTwoPattern(OR_CFA_PATTERN_RGGB)
+							   : XTransPattern::xtransPattern());
+		BOOST_CHECK(wrong.decompress(NULL) == NULL);
+	}
+	return 0;
+}
+
+int test_layout()
+{
+	uint16_t count = 0;
+	const uint8_t *colours
+		= XTransPattern::xtransPattern()->patternPattern(count);
+	BOOST_CHECK(count == XTransPattern::SIZE);
+	std::vector<uint8_t> layout(colours, colours + count);
+	BOOST_CHECK(XTransPattern::xtransPattern(layout.data())
+				== XTransPattern::xtransPattern());
+
+	// shifted by a column, like another sensor.
+	std::rotate(layout.begin(), layout.begin() + 1, layout.end());
+	const XTransPattern *shifted = XTransPattern::xtransPattern(layout.data());
+	BOOST_CHECK(shifted && shifted != XTransPattern::xtransPattern());
+	BOOST_CHECK(XTransPattern::xtransPattern(layout.data()) == shifted);
+	const uint8_t *p = shifted->patternPattern(count);
+	BOOST_CHECK(std::equal(layout.begin(), layout.end(), p));
+
+	layout[7] = 3;
+	BOOST_CHECK(XTransPattern::xtransPattern(layout.data()) == NULL);
+	return 0;
+}
+
+int test_main(int, char *[])
+{
+	test_decompress();
+	test_layout();
+	return 0;
+}
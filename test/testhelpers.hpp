@@ -0,0 +1,77 @@
+/* -*- tab-width:4; indent-tabs-mode:'t c-file-style:"stroustrup" -*- */
+/*
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OR_TEST_TESTHELPERS_H_
+#define OR_TEST_TESTHELPERS_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+/** Pseudo random numbers, the same on each run. */
+class Random
+{
+public:
+	explicit Random(uint32_t seed = 1)
+		: m_seed(seed)
+		{
+		}
+	/** n random bits, up to 24. */
+	unsigned bits(unsigned n)
+		{
+			m_seed = m_seed * 1103515245 + 12345;
+			return (m_seed >> 8) & ((1u << n) - 1);
+		}
+private:
+	uint32_t m_seed;
+};
+
+/** Write a bitstream, MSB first, like the decoders read it. */
+class BitWriter
+{
+public:
+	/** Write the n low bits of v, up to 32. */
+	void put(uint32_t v, unsigned n)
+		{
+			for (unsigned i = n; i > 0; i--, m_bit++) {
+				if (m_bit % 8 == 0) {
+					m_data.push_back(0);
+				}
+				if (v & (1u << (i - 1))) {
+					m_data.back() |= 0x80 >> (m_bit % 8);
+				}
+			}
+		}
+	/** Write n 0 bits. */
+	void zeros(unsigned n)
+		{
+			for (unsigned i = 0; i < n; i++) {
+				put(0, 1);
+			}
+		}
+	std::vector<uint8_t> & data()
+		{
+			return m_data;
+		}
+private:
+	std::vector<uint8_t> m_data;
+	unsigned m_bit = 0;
+};
+
+#endif
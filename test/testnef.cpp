@@ -0,0 +1,367 @@
+/* -*- tab-width:4; indent-tabs-mode:'t c-file-style:"stroustrup" -*- */
+/*
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/test/minimal.hpp>
+
+#include <libopenraw/consts.h>
+
+#include "rawfile.hpp"
+#include "rawdata.hpp"
+#include "cfapattern.hpp"
+#include "nefdiffiterator.hpp"
+#include "nefcfaiterator.hpp"
+#include "nefdecompressor.hpp"
+#include "decodeindex.hpp"
+#include "parallel.hpp"
+
+#include "testhelpers.hpp"
+
+using OpenRaw::RawData;
+using OpenRaw::RawFile;
+using OpenRaw::Internals::DecodeIndex;
+using OpenRaw::Internals::HuffmanNode;
+using OpenRaw::Internals::NefCfaIterator;
+using OpenRaw::Internals::NefDecompressor;
+using OpenRaw::Internals::NefDiffIterator;
+using OpenRaw::Internals::setParallelWorkers;
+
+static Random s_random;
+
+// A little endian TIFF with one CFA strip, GBRG.
+static std::vector<uint8_t> make_tiff(const std::string & model,
+									  uint32_t w, uint32_t h, uint16_t bpc,
+									  uint16_t compression,
+									  const std::vector<uint8_t> & strip)
+{
+	std::vector<uint8_t> tiff = { 'I', 'I', 42, 0, 8, 0, 0, 0 };
+	auto put16 = [&tiff] (uint16_t v) {
+		tiff.push_back(v & 0xff);
+		tiff.push_back(v >> 8);
+	};
+	auto put32 = [&put16] (uint32_t v) {
+		put16(v & 0xffff);
+		put16(v >> 16);
+	};
+	auto entry = [&] (uint16_t tag, uint16_t type, uint32_t count,
+					  uint32_t value) {
+		put16(tag);
+		put16(type);
+		put32(count);
+		put32(value);
+	};
+
+	const std::string make = "NIKON CORPORATION";
+	const uint16_t entries = 12;
+	const uint32_t make_offset = 8 + 2 + entries * 12 + 4;
+	const uint32_t model_offset = make_offset + make.size() + 1;
+	const uint32_t strip_offset = (model_offset + model.size() + 1 + 3) & ~3;
+
+	put16(entries);
+	entry(254, 4, 1, 0);                      // NewSubfileType
+	entry(256, 4, 1, w);                      // ImageWidth
+	entry(257, 4, 1, h);                      // ImageLength
+	entry(258, 3, 1, bpc);                    // BitsPerSample
+	entry(259, 3, 1, compression);            // Compression
+	entry(262, 3, 1, 32803);                  // CFA
+	entry(271, 2, make.size() + 1, make_offset);
+	entry(272, 2, model.size() + 1, model_offset);
+	entry(273, 4, 1, strip_offset);           // StripOffsets
+	entry(279, 4, 1, strip.size());           // StripByteCounts
+	entry(33421, 3, 2, 2 | (2 << 16));        // CFARepeatPatternDim
+	entry(33422, 1, 4, 0x01000201);           // CFAPattern
+	put32(0);
+	tiff.insert(tiff.end(), make.begin(), make.end());
+	tiff.push_back(0);
+	tiff.insert(tiff.end(), model.begin(), model.end());
+	tiff.push_back(0);
+	tiff.resize(strip_offset, 0);
+	tiff.insert(tiff.end(), strip.begin(), strip.end());
+	return tiff;
+}
+
+// Decode and check the output. No expected samples for an error.
+static void check(const std::string & model, uint32_t w, uint32_t h,
+				  uint16_t bpc, uint16_t compression,
+				  const std::vector<uint8_t> & strip,
+				  const std::vector<uint16_t> & expected,
+				  or_cfa_pattern pattern = OR_CFA_PATTERN_GBRG)
+{
+	std::vector<uint8_t> tiff = make_tiff(model, w, h, bpc, compression,
+										  strip);
+	std::unique_ptr<RawFile> file(
+		RawFile::newRawFileFromMemory(tiff.data(), tiff.size(),
+									  OR_RAWFILE_TYPE_NEF));
+	BOOST_CHECK(file);
+	if (!file) {
+		return;
+	}
+	RawData raw;
+	or_error err = file->getRawData(raw, OR_OPTIONS_NONE);
+	if (expected.empty()) {
+		BOOST_CHECK(err != OR_ERROR_NONE);
+		return;
+	}
+	BOOST_CHECK(err == OR_ERROR_NONE);
+	if (err != OR_ERROR_NONE) {
+		return;
+	}
+	BOOST_CHECK(raw.width() == w && raw.height() == h);
+	BOOST_CHECK(raw.dataType() == OR_DATA_TYPE_RAW);
+	BOOST_CHECK(raw.size() == expected.size() * 2);
+	BOOST_CHECK(memcmp(raw.data(), expected.data(),
+					   std::min(raw.size(), expected.size() * 2)) == 0);
+	BOOST_CHECK(raw.cfaPattern()->patternType() == pattern);
+}
+
+// The uncompressed NEF: packed from the MSB, the rows padded or not.
+int test_uncompressed()
+{
+	// 16 bytes rows of 40 14-bits samples would be 16-bits samples.
+	const uint32_t widths[] = { 44, 37, 926 };
+	const uint32_t h = 7;
+	for (uint16_t bpc : { 12, 14 }) {
+		for (uint32_t w : widths) {
+			// the rows padded to 16 bytes, or not.
+			for (uint32_t align : { 1, 16 }) {
+				std::vector<uint16_t> expected(w * h);
+				BitWriter bits;
+				for (uint32_t row = 0; row < h; row++) {
+					for (uint32_t col = 0; col < w; col++) {
+						expected[row * w + col] = s_random.bits(bpc);
+						bits.put(expected[row * w + col], bpc);
+					}
+					// the rows start on a byte, at least.
+					const unsigned row_bits = (w * bpc + 8 * align - 1)
+						/ (8 * align) * 8 * align;
+					bits.zeros(row_bits - w * bpc);
+				}
+				check("D700", w, h, bpc, 1, bits.data(), expected);
+			}
+		}
+
+		// 16-bits samples, little endian like the file.
+		const uint32_t w = 64;
+		std::vector<uint16_t> expected(w * h);
+		std::vector<uint8_t> strip;
+		for (auto & sample : expected) {
+			sample = s_random.bits(bpc);
+			strip.push_back(sample & 0xff);
+			strip.push_back(sample >> 8);
+		}
+		check("D700", w, h, bpc, 1, strip, expected);
+	}
+	return 0;
+}
+
+// The COMPRESS_NIKON_QUANTIZED strips of the NRW that aren't
+// compressed, told by their size.
+int test_quantized()
+{
+	const uint16_t NIKON_QUANTIZED = 34713;
+	const uint32_t sizes[][2] = { { 64, 1 }, { 64, 33 }, { 926, 7 } };
+	for (const auto & size : sizes) {
+		const uint32_t w = size[0];
+		const uint32_t h = size[1];
+		std::vector<uint16_t> expected(w * h);
+		for (auto & sample : expected) {
+			sample = s_random.bits(12);
+		}
+
+		// 12 bits big endian.
+		BitWriter bits;
+		for (auto sample : expected) {
+			bits.put(sample, 12);
+		}
+		const std::vector<uint8_t> & packed = bits.data();
+		check("E8400", w, h, 12, NIKON_QUANTIZED, packed, expected);
+
+		// in little endian 32-bits words, for the Coolpix P. They are
+		// RGGB.
+		std::vector<uint8_t> words(packed);
+		for (size_t i = 0; i + 4 <= words.size(); i += 4) {
+			std::reverse(words.begin() + i, words.begin() + i + 4);
+		}
+		check("COOLPIX P7000", w, h, 12, NIKON_QUANTIZED, words, expected,
+			  OR_CFA_PATTERN_RGGB);
+
+		// in the high bits of big endian 16-bits samples.
+		std::vector<uint8_t> unpacked;
+		for (auto sample : expected) {
+			uint16_t v = (sample << 4) | s_random.bits(4);
+			unpacked.push_back(v >> 8);
+			unpacked.push_back(v & 0xff);
+		}
+		check("COOLPIX P7000", w, h, 12, NIKON_QUANTIZED, unpacked,
+			  expected);
+
+		// YUV isn't supported.
+		std::vector<uint8_t> yuv(w * h * 3, 1);
+		check("COOLPIX P7000", w, h, 12, NIKON_QUANTIZED, yuv,
+			  std::vector<uint16_t>());
+	}
+
+	// the rows padded to 10 samples, with a byte every 15.
+	for (uint32_t w : { 40, 35, 3034 }) {
+		const uint32_t h = 5;
+		const uint32_t row_samples = (w + 9) / 10 * 10;
+		std::vector<uint16_t> expected(w * h);
+		// the rows end on a byte.
+		BitWriter bits;
+		for (uint32_t row = 0; row < h; row++) {
+			for (uint32_t col = 0; col < row_samples; col++) {
+				uint16_t v = s_random.bits(12);
+				if (col < w) {
+					expected[row * w + col] = v;
+				}
+				bits.put(v, 12);
+				if (col % 10 == 9) {
+					// not 0, that is the uncompressed D100.
+					bits.put(0x5a, 8);
+				}
+			}
+		}
+		check("COOLPIX P6000", w, h, 12, NIKON_QUANTIZED, bits.data(),
+			  expected);
+	}
+
+	// an odd width can't be unpacked by pairs.
+	const uint32_t w = 63;
+	const uint32_t h = 4;
+	std::vector<uint8_t> odd(w * h * 3 / 2, 0x55);
+	check("E8400", w, h, 12, NIKON_QUANTIZED, odd, std::vector<uint16_t>());
+	return 0;
+}
+
+// The Huffman coded NEF, on one thread or decoded speculatively on
+// several, against the decoding a sample at a time. Any data decodes
+// with the complete trees.
+int test_huffman()
+{
+	const HuffmanNode *trees[] = {
+		NefDiffIterator::Lossy12Bit, NefDiffIterator::Lossy14Bit,
+		NefDiffIterator::LossLess14Bit
+	};
+	const uint16_t vpred[2][2] = { { 0x800, 0x7f0 }, { 0x810, 0x820 } };
+	std::vector<uint16_t> curve(0x4000);
+	for (size_t i = 0; i < curve.size(); i++) {
+		curve[i] = i * 4 + (i >> 10);
+	}
+	std::vector<uint8_t> data(1200 * 1024);
+	for (auto & c : data) {
+		c = s_random.bits(8);
+	}
+
+	// the end of the data before the last rows or not, and too small
+	// to be split.
+	const uint32_t sizes[][2] = { { 1001, 500 }, { 1001, 1700 }, { 3, 10 } };
+	for (const HuffmanNode *tree : trees) {
+		for (const auto & size : sizes) {
+			const uint32_t w = size[0];
+			const uint32_t h = size[1];
+			const uint32_t columns = w - 1;
+			std::vector<uint16_t> expected;
+			NefCfaIterator iter(NefDiffIterator(tree, data.data(),
+												data.size()), h, w, vpred);
+			for (uint32_t row = 0; row < h; row++) {
+				for (uint32_t col = 0; col < w; col++) {
+					uint16_t v = iter.get();
+					if (col < columns) {
+						expected.push_back(curve[v & 0x3fff]);
+					}
+				}
+			}
+
+			for (unsigned workers : { 1, 4 }) {
+				setParallelWorkers(workers);
+				NefDecompressor decomp(data.data(), data.size(), NULL, tree,
+									   vpred, curve.data(), w, h, columns);
+				std::unique_ptr<RawData> raw(decomp.decompress(NULL));
+				BOOST_CHECK(raw->width() == columns && raw->height() == h);
+				const uint16_t *p = static_cast<const uint16_t *>(raw->data());
+				BOOST_CHECK(std::vector<uint16_t>(p, p + columns * h)
+							== expected);
+			}
+		}
+	}
+	setParallelWorkers(0);
+	return 0;
+}
+
+// Record a decode index, and decode from it once saved and loaded.
+int test_index()
+{
+	const HuffmanNode *tree = NefDiffIterator::Lossy14Bit;
+	const uint16_t vpred[2][2] = { { 0x800, 0x7f0 }, { 0x810, 0x820 } };
+	std::vector<uint16_t> curve(0x4000);
+	for (size_t i = 0; i < curve.size(); i++) {
+		curve[i] = i * 4;
+	}
+	std::vector<uint8_t> data(20000);
+	for (auto & c : data) {
+		c = s_random.bits(8);
+	}
+	// the end of the data before the last rows or not.
+	const uint32_t sizes[][2] = { { 101, 90 }, { 101, 300 } };
+	for (const auto & size : sizes) {
+		const uint32_t w = size[0];
+		const uint32_t h = size[1];
+		const uint32_t columns = w - 1;
+		auto decompress = [&] (DecodeIndex *index, bool record) {
+			NefDecompressor decomp(data.data(), data.size(), NULL, tree,
+								   vpred, curve.data(), w, h, columns);
+			decomp.setDecodeIndex(index, record);
+			std::unique_ptr<RawData> raw(decomp.decompress(NULL));
+			const uint16_t *p = static_cast<const uint16_t *>(raw->data());
+			return std::vector<uint16_t>(p, p + columns * h);
+		};
+		std::vector<uint16_t> expected = decompress(NULL, false);
+
+		DecodeIndex index;
+		index.setInterval(16);
+		BOOST_CHECK(decompress(&index, true) == expected);
+		BOOST_CHECK(!index.empty());
+		std::vector<uint8_t> saved = index.serialize();
+		DecodeIndex loaded;
+		BOOST_CHECK(loaded.deserialize(saved.data(), saved.size()));
+		BOOST_CHECK(loaded.checkpoints().size() == index.checkpoints().size());
+		for (unsigned workers : { 1, 4 }) {
+			setParallelWorkers(workers);
+			BOOST_CHECK(decompress(&loaded, false) == expected);
+		}
+		setParallelWorkers(0);
+	}
+	return 0;
+}
+
+int test_main(int, char *[])
+{
+	test_uncompressed();
+	test_quantized();
+	test_huffman();
+	test_index();
+	return 0;
+}
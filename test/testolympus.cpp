@@ -0,0 +1,218 @@
+/* -*- tab-width:4; indent-tabs-mode:'t c-file-style:"stroustrup" -*- */
+/*
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <boost/test/minimal.hpp>
+
+#include "rawdata.hpp"
+#include "bititerator.hpp"
+#include "olympusdecompressor.hpp"
+#include "decodeindex.hpp"
+#include "parallel.hpp"
+
+using OpenRaw::RawData;
+using OpenRaw::Internals::BitIterator;
+using OpenRaw::Internals::DecodeIndex;
+using OpenRaw::Internals::OlympusDecompressor;
+using OpenRaw::Internals::setParallelWorkers;
+
+// The decoding before it was made faster, for the even widths: the
+// same code for the even and the odd columns.
+struct Column
+{
+	int carry[3];
+	int wo;
+	int nw;
+};
+
+static void reference_pixel(BitIterator & bits, const char *bittable,
+							Column & c, uint16_t *dest, int pitch,
+							uint32_t x, uint32_t y)
+{
+	int i = 2 * (c.carry[2] < 3);
+	int nbits;
+	for (nbits = 2 + i; (uint16_t)c.carry[0] >> (nbits + i); nbits++) {
+	}
+
+	uint32_t b = bits.peek(15);
+	int sign = (b >> 14) * -1;
+	int low = (b >> 12) & 3;
+	int high = bittable[b & 4095];
+	bits.skip(std::min(12 + 3, high + 1 + 3));
+	if (high == 12) {
+		high = bits.get(16 - nbits) >> 1;
+	}
+
+	c.carry[0] = (high << nbits) | bits.get(nbits);
+	int diff = (c.carry[0] ^ sign) + c.carry[1];
+	c.carry[1] = (diff * 3 + c.carry[1]) >> 5;
+	c.carry[2] = c.carry[0] > 16 ? 0 : c.carry[2] + 1;
+
+	int pred;
+	if (y < 2 || x < 2) {
+		if (y < 2 && x < 2) {
+			pred = 0;
+		}
+		else if (y < 2) {
+			pred = c.wo;
+		}
+		else {
+			pred = dest[-pitch + (int)x];
+			c.nw = pred;
+		}
+		dest[x] = pred + ((diff << 2) | low);
+		c.wo = dest[x];
+	}
+	else {
+		int n = dest[-pitch + (int)x];
+		if (((c.wo < c.nw) & (c.nw < n)) | ((n < c.nw) & (c.nw < c.wo))) {
+			if (abs(c.wo - c.nw) > 32 || abs(n - c.nw) > 32) {
+				pred = c.wo + n - c.nw;
+			}
+			else {
+				pred = (c.wo + n) >> 1;
+			}
+		}
+		else {
+			pred = abs(c.wo - c.nw) > abs(n - c.nw) ? c.wo : n;
+		}
+		dest[x] = pred + ((diff << 2) | low);
+		c.wo = dest[x];
+		c.nw = n;
+	}
+}
+
+static std::vector<uint16_t> reference(const std::vector<uint8_t> & data,
+									   uint32_t w, uint32_t h)
+{
+	char bittable[4096];
+	for (int i = 0; i < 4096; i++) {
+		int high;
+		for (high = 0; high < 12; high++) {
+			if ((i >> (11 - high)) & 1) {
+				break;
+			}
+		}
+		bittable[i] = high;
+	}
+
+	std::vector<uint16_t> out(w * h);
+	BitIterator bits(data.data() + 7, data.size() - 7);
+	Column even, odd;
+	memset(&even, 0, sizeof(even));
+	memset(&odd, 0, sizeof(odd));
+	for (uint32_t y = 0; y < h; y++) {
+		memset(even.carry, 0, sizeof(even.carry));
+		memset(odd.carry, 0, sizeof(odd.carry));
+		uint16_t *dest = out.data() + y * w;
+		for (uint32_t x = 0; x < w; x += 2) {
+			reference_pixel(bits, bittable, even, dest, 2 * w, x, y);
+			reference_pixel(bits, bittable, odd, dest, 2 * w, x + 1, y);
+		}
+	}
+	return out;
+}
+
+static std::vector<uint16_t> decompress(const std::vector<uint8_t> & data,
+										uint32_t w, uint32_t h,
+										DecodeIndex *index = NULL,
+										bool record = false)
+{
+	OlympusDecompressor decomp(data.data(), data.size(), NULL, w, h);
+	decomp.setDecodeIndex(index, record);
+	std::unique_ptr<RawData> raw(decomp.decompress(NULL));
+	const uint16_t *p = static_cast<const uint16_t *>(raw->data());
+	return std::vector<uint16_t>(p, p + w * h);
+}
+
+int test_decompress()
+{
+	const uint32_t sizes[][2] = {
+		{ 2, 1 }, { 2, 5 }, { 64, 2 }, { 130, 37 }, { 642, 20 }
+	};
+	uint32_t seed = 7;
+	for (const auto & size : sizes) {
+		const uint32_t w = size[0];
+		const uint32_t h = size[1];
+		// enough data, or the end of the data before the last rows.
+		for (size_t length : { (size_t)w * h * 4, (size_t)w * h / 2 + 9 }) {
+			std::vector<uint8_t> data(length);
+			for (size_t i = 0; i < data.size(); i++) {
+				seed = seed * 1103515245 + 12345;
+				// mostly small differences, for a steady image.
+				data[i] = (seed >> 16) & ((i % 3) ? 0x3f : 0xff);
+			}
+			BOOST_CHECK(decompress(data, w, h) == reference(data, w, h));
+		}
+	}
+
+	// no data but the header: the bits are 0.
+	std::vector<uint8_t> header(7, 0xff);
+	BOOST_CHECK(decompress(header, 4, 3) == reference(header, 4, 3));
+	return 0;
+}
+
+// Record a decode index, and decode from it once saved and loaded.
+int test_index()
+{
+	const uint32_t sizes[][2] = { { 130, 37 }, { 37, 50 } };
+	uint32_t seed = 11;
+	for (const auto & size : sizes) {
+		const uint32_t w = size[0];
+		const uint32_t h = size[1];
+		// enough data, or the end of the data before the last rows.
+		for (size_t length : { (size_t)w * h * 4, (size_t)w * h / 2 + 9 }) {
+			std::vector<uint8_t> data(length);
+			for (size_t i = 0; i < data.size(); i++) {
+				seed = seed * 1103515245 + 12345;
+				data[i] = (seed >> 16) & ((i % 3) ? 0x3f : 0xff);
+			}
+			std::vector<uint16_t> expected = reference(data, w, h);
+
+			DecodeIndex index;
+			index.setInterval(4);
+			BOOST_CHECK(decompress(data, w, h, &index, true) == expected);
+			BOOST_CHECK(!index.empty());
+			std::vector<uint8_t> saved = index.serialize();
+			DecodeIndex loaded;
+			BOOST_CHECK(loaded.deserialize(saved.data(), saved.size()));
+			for (unsigned workers : { 1, 4 }) {
+				setParallelWorkers(workers);
+				BOOST_CHECK(decompress(data, w, h, &loaded, false)
+							== expected);
+			}
+			setParallelWorkers(0);
+		}
+	}
+	return 0;
+}
+
+int test_main(int, char *[])
+{
+	test_decompress();
+	test_index();
+	return 0;
+}
@@ -0,0 +1,201 @@
+/* -*- tab-width:4; indent-tabs-mode:'t c-file-style:"stroustrup" -*- */
+/*
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <boost/test/minimal.hpp>
+
+#include "rawdata.hpp"
+#include "panasonicdecompressor.hpp"
+
+#include "testhelpers.hpp"
+
+using OpenRaw::RawData;
+using OpenRaw::Internals::PanasonicDecompressor;
+
+#define BLOCK_SIZE 0x4000
+#define BLOCK_SPLIT 0x2008
+
+static Random s_random;
+
+// Write the bits where the decoder reads them, and store the blocks
+// rotated like in the file.
+class PanaWriter
+{
+public:
+	PanaWriter()
+		: m_vbits(0)
+		{
+			memset(m_buf, 0, sizeof(m_buf));
+		}
+	void put(unsigned v, unsigned nbits)
+		{
+			m_vbits = (m_vbits - nbits) & 0x1ffff;
+			unsigned byte = (m_vbits >> 3) ^ 0x3ff0;
+			unsigned word = v << (m_vbits & 7);
+			m_buf[byte] |= word & 0xff;
+			m_buf[byte + 1] |= word >> 8;
+			if (!m_vbits) {
+				flush();
+			}
+		}
+	std::vector<uint8_t> & data()
+		{
+			if (m_vbits) {
+				flush();
+			}
+			return m_data;
+		}
+private:
+	void flush()
+		{
+			m_data.insert(m_data.end(), m_buf + BLOCK_SPLIT,
+						  m_buf + BLOCK_SIZE);
+			m_data.insert(m_data.end(), m_buf, m_buf + BLOCK_SPLIT);
+			memset(m_buf, 0, sizeof(m_buf));
+			m_vbits = 0;
+		}
+
+	std::vector<uint8_t> m_data;
+	unsigned m_vbits;
+	uint8_t m_buf[BLOCK_SIZE + 1];
+};
+
+// The decoding of dcraw.
+static std::vector<uint16_t> reference(const std::vector<uint8_t> & data,
+									   uint32_t w, uint32_t h)
+{
+	std::vector<uint8_t> buf(BLOCK_SIZE + 1, 0);
+	size_t next = 0;
+	unsigned vbits = 0;
+	auto pana_bits = [&] (int nbits) -> unsigned {
+		if (!vbits) {
+			for (size_t i = 0; i < BLOCK_SIZE; i++) {
+				size_t pos = next + i;
+				buf[(i + BLOCK_SPLIT) % BLOCK_SIZE]
+					= pos < data.size() ? data[pos] : 0;
+			}
+			next += BLOCK_SIZE;
+		}
+		vbits = (vbits - nbits) & 0x1ffff;
+		int byte = (vbits >> 3) ^ 0x3ff0;
+		return ((buf[byte] | (buf[byte + 1] << 8)) >> (vbits & 7))
+			& ((1 << nbits) - 1);
+	};
+
+	std::vector<uint16_t> out(w * h);
+	int sh = 0;
+	int pred[2];
+	int nonz[2];
+	for (uint32_t row = 0; row < h; row++) {
+		for (uint32_t col = 0; col < w; col++) {
+			int i = col % 14;
+			if (i == 0) {
+				pred[0] = pred[1] = nonz[0] = nonz[1] = 0;
+			}
+			if (i % 3 == 2) {
+				sh = 4 >> (3 - pana_bits(2));
+			}
+			if (nonz[i & 1]) {
+				int j = pana_bits(8);
+				if (j) {
+					if ((pred[i & 1] -= 0x80 << sh) < 0 || sh == 4) {
+						pred[i & 1] &= (1 << sh) - 1;
+					}
+					pred[i & 1] += j << sh;
+				}
+			}
+			else if ((nonz[i & 1] = pana_bits(8)) || i > 11) {
+				pred[i & 1] = nonz[i & 1] << 4 | pana_bits(4);
+			}
+			out[row * w + col] = pred[col & 1];
+		}
+	}
+	return out;
+}
+
+static std::vector<uint16_t> decompress(const std::vector<uint8_t> & data,
+										uint32_t w, uint32_t h)
+{
+	PanasonicDecompressor decomp(data.data(), data.size(), NULL, w, h);
+	std::unique_ptr<RawData> raw(decomp.decompress(NULL));
+	const uint16_t *p = static_cast<const uint16_t *>(raw->data());
+	return std::vector<uint16_t>(p, p + w * h);
+}
+
+// Groups of 128 bits, like the cameras write: the blocks are decoded
+// in parallel.
+int test_groups()
+{
+	const uint32_t w = 14 * 20;
+	const uint32_t h = 120;
+	PanaWriter writer;
+	for (size_t group = 0; group < w * h / 14; group++) {
+		for (int i = 0; i < 14; i++) {
+			if (i % 3 == 2) {
+				writer.put(s_random.bits(2), 2);
+			}
+			if (i < 2) {
+				// the first pixels of each colour.
+				writer.put(1 + s_random.bits(7), 8);
+				writer.put(s_random.bits(4), 4);
+			}
+			else {
+				writer.put(s_random.bits(8), 8);
+			}
+		}
+	}
+	std::vector<uint8_t> data = writer.data();
+	BOOST_CHECK(data.size() > 2 * BLOCK_SIZE);
+	std::vector<uint16_t> out = decompress(data, w, h);
+	BOOST_CHECK(out == reference(data, w, h));
+
+	// the first pixel is nonz << 4 | 4 bits.
+	unsigned first = (data[BLOCK_SIZE - BLOCK_SPLIT + 15] << 4)
+		| (data[BLOCK_SIZE - BLOCK_SPLIT + 14] >> 4);
+	BOOST_CHECK(out[0] == first);
+	return 0;
+}
+
+// Other data is decoded from the start.
+int test_irregular()
+{
+	const uint32_t sizes[][2] = { { 100, 50 }, { 14 * 20, 40 } };
+	for (const auto & size : sizes) {
+		std::vector<uint8_t> data(BLOCK_SIZE * 4);
+		for (size_t i = 0; i < data.size(); i++) {
+			data[i] = s_random.bits(8);
+		}
+		BOOST_CHECK(decompress(data, size[0], size[1])
+					== reference(data, size[0], size[1]));
+	}
+	return 0;
+}
+
+int test_main(int, char *[])
+{
+	test_groups();
+	test_irregular();
+	return 0;
+}
@@ -0,0 +1,137 @@
+/* -*- tab-width:4; indent-tabs-mode:'t c-file-style:"stroustrup" -*- */
+/*
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include <boost/test/minimal.hpp>
+
+#include "rawdata.hpp"
+#include "pentaxdecompressor.hpp"
+
+#include "testhelpers.hpp"
+
+using OpenRaw::RawData;
+using OpenRaw::Internals::PentaxDecompressor;
+
+// The codes of the default table, for each difference length.
+static const struct {
+	unsigned code;
+	unsigned len;
+} s_codes[13] = {
+	{ 0x1e, 5 }, { 0x6, 3 }, { 0x4, 3 }, { 0x0, 2 }, { 0x1, 2 },
+	{ 0x5, 3 }, { 0xe, 4 }, { 0x3e, 6 }, { 0x7e, 7 }, { 0xfe, 8 },
+	{ 0x1fe, 9 }, { 0x3fe, 10 }, { 0x3ff, 10 }
+};
+
+// Code the pixels like the camera: a code for the length of the
+// difference, then the difference.
+static std::vector<uint8_t> encode(const std::vector<uint16_t> & pixels,
+								   uint32_t w, uint32_t h)
+{
+	BitWriter bits;
+	int vpred[2][2] = { { 0, 0 }, { 0, 0 } };
+	for (uint32_t row = 0; row < h; row++) {
+		int hpred[2] = { 0, 0 };
+		for (uint32_t col = 0; col < w; col++) {
+			int pred = col < 2 ? vpred[row & 1][col] : hpred[col & 1];
+			int value = pixels[row * w + col];
+			int diff = value - pred;
+			unsigned len = 0;
+			while ((std::abs(diff) >> len) != 0) {
+				len++;
+			}
+			bits.put(s_codes[len].code, s_codes[len].len);
+			if (len) {
+				bits.put(diff < 0 ? diff + (1 << len) - 1 : diff, len);
+			}
+			if (col < 2) {
+				vpred[row & 1][col] = value;
+			}
+			hpred[col & 1] = value;
+		}
+	}
+	// the decoder peeks past the end.
+	bits.put(0, 32);
+	return bits.data();
+}
+
+int test_table()
+{
+	// the MakerNote table: the number of codes - 12, 12 bytes, the
+	// left aligned codes then their lengths.
+	std::vector<uint8_t> data(14 + 13 * 3, 0);
+	data[1] = 1;
+	for (int c = 0; c < 13; c++) {
+		unsigned code = s_codes[c].code << (12 - s_codes[c].len);
+		data[14 + c * 2] = code >> 8;
+		data[15 + c * 2] = code & 0xff;
+		data[14 + 26 + c] = s_codes[c].len;
+	}
+	BOOST_CHECK(PentaxDecompressor::makeTable(data.data(), data.size(), true)
+				== PentaxDecompressor::defaultTable());
+	// too short, or a code of 13 bits.
+	BOOST_CHECK(PentaxDecompressor::makeTable(data.data(), data.size() - 1,
+											  true).empty());
+	data[14 + 26 + 12] = 13;
+	BOOST_CHECK(PentaxDecompressor::makeTable(data.data(), data.size(),
+											  true).empty());
+	return 0;
+}
+
+int test_decompress()
+{
+	const uint32_t w = 24;
+	const uint32_t h = 7;
+	std::vector<uint16_t> pixels(w * h);
+	uint32_t seed = 42;
+	for (size_t i = 0; i < pixels.size(); i++) {
+		seed = seed * 1103515245 + 12345;
+		// big and small differences.
+		pixels[i] = (i % 5) ? 2000 + ((seed >> 16) & 0x3f)
+			: (seed >> 16) & 0xfff;
+	}
+	std::vector<uint8_t> data = encode(pixels, w, h);
+
+	PentaxDecompressor::HuffmanTable table
+		= PentaxDecompressor::defaultTable();
+	PentaxDecompressor decomp(data.data(), data.size(), NULL, w, h, 12,
+							  table);
+	std::unique_ptr<RawData> raw(decomp.decompress(NULL));
+	BOOST_CHECK(raw);
+	const uint16_t *out = static_cast<const uint16_t *>(raw->data());
+	BOOST_CHECK(std::vector<uint16_t>(out, out + w * h) == pixels);
+	BOOST_CHECK(raw->whiteLevel() == 0xfff);
+
+	// no table, no decoding.
+	PentaxDecompressor::HuffmanTable empty;
+	PentaxDecompressor invalid(data.data(), data.size(), NULL, w, h, 12,
+							   empty);
+	BOOST_CHECK(invalid.decompress(NULL) == NULL);
+	return 0;
+}
+
+int test_main(int, char *[])
+{
+	test_table();
+	test_decompress();
+	return 0;
+}
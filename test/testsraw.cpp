@@ -0,0 +1,241 @@
+/* -*- tab-width:4; indent-tabs-mode:'t c-file-style:"stroustrup" -*- */
+/*
+ * Copyright (C) 2016 Hubert Figuiere
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <boost/test/minimal.hpp>
+
+#include "bitmapdata.hpp"
+#include "rawdata.hpp"
+#include "srawinterpolator.hpp"
+
+using OpenRaw::BitmapData;
+using OpenRaw::RawData;
+using OpenRaw::Internals::SRawInterpolator;
+
+static const uint32_t MCUS = 37;
+static const uint32_t MCU_ROWS = 23;
+
+// The MCUs, as decoded by the LJpegDecompressor: 2 or 2x2 luma
+// samples, then Cb and Cr.
+static void make_frame(uint32_t v, RawData & frame)
+{
+	const uint32_t blocks = 2 * v + 2;
+	uint16_t *p = (uint16_t*)frame.allocData(MCUS * blocks * MCU_ROWS * 2);
+	frame.setDimensions(MCUS * blocks, MCU_ROWS);
+	uint32_t seed = v;
+	for (uint32_t i = 0; i < MCUS * blocks * MCU_ROWS; i++) {
+		seed = seed * 1103515245 + 12345;
+		uint32_t r = seed >> 8;
+		bool luma = i % blocks < 2 * v;
+		p[i] = luma ? r % 32768 : 16384 + r % 8000 - 4000;
+		if (r % 50 == 0) {
+			// to clip.
+			p[i] = luma ? 32767 : 0;
+		}
+	}
+}
+
+// The interpolation and conversion of dcraw.
+static std::vector<uint16_t> reference(const RawData & frame, uint32_t v,
+									   uint32_t model,
+									   const std::string & firmware)
+{
+	const uint32_t blocks = 2 * v + 2;
+	const uint32_t w = MCUS * 2;
+	const uint32_t h = MCU_ROWS * v;
+	std::vector<int> img(w * h * 3);
+	auto ip = [&] (int row, int col, int c) -> int & {
+		return img[(row * w + col) * 3 + c];
+	};
+	const uint16_t *data = static_cast<const uint16_t *>(frame.data());
+	for (uint32_t r = 0; r < MCU_ROWS; r++) {
+		for (uint32_t m = 0; m < MCUS; m++) {
+			const uint16_t *f = data + (r * MCUS + m) * blocks;
+			int row = r * v;
+			int col = m * 2;
+			for (uint32_t c = 0; c < 2 * v; c++) {
+				ip(row + (c >> 1), col + (c & 1), 0) = f[c];
+			}
+			ip(row, col, 1) = f[blocks - 2] - 16384;
+			ip(row, col, 2) = f[blocks - 1] - 16384;
+		}
+	}
+	int sraw = 2 * v - 1;
+	for (int row = 0; row < (int)h; row++) {
+		if (row & (sraw >> 1)) {
+			for (int col = 0; col < (int)w; col += 2) {
+				for (int c = 1; c < 3; c++) {
+					ip(row, col, c) = row == (int)h - 1 ? ip(row - 1, col, c)
+						: (ip(row - 1, col, c) + ip(row + 1, col, c) + 1) >> 1;
+				}
+			}
+		}
+		for (int col = 1; col < (int)w; col += 2) {
+			for (int c = 1; c < 3; c++) {
+				ip(row, col, c) = col == (int)w - 1 ? ip(row, col - 1, c)
+					: (ip(row, col - 1, c) + ip(row, col + 1, c) + 1) >> 1;
+			}
+		}
+	}
+
+	int ver[3] = { 0, 0, 0 };
+	const char *cp = firmware.c_str();
+	while (*cp && !isdigit(*cp)) {
+		cp++;
+	}
+	sscanf(cp, "%d.%d.%d", ver, ver + 1, ver + 2);
+	int version = (ver[0] * 1000 + ver[1]) * 1000 + ver[2];
+	int hue = (sraw + 1) << 2;
+	if (model >= 0x80000281 || (model == 0x80000218 && version > 1000006)) {
+		hue = sraw << 1;
+	}
+
+	std::vector<uint16_t> out(w * h * 3);
+	for (uint32_t i = 0; i < w * h; i++) {
+		int *rp = &img[i * 3];
+		int pix[3];
+		if (model == 0x80000218 || model == 0x80000250 || model == 0x80000261
+			|| model == 0x80000281 || model == 0x80000287) {
+			rp[1] = rp[1] * 4 + hue;
+			rp[2] = rp[2] * 4 + hue;
+			pix[0] = rp[0] + ((50 * rp[1] + 22929 * rp[2]) >> 14);
+			pix[1] = rp[0] + ((-5640 * rp[1] - 11751 * rp[2]) >> 14);
+			pix[2] = rp[0] + ((29040 * rp[1] - 101 * rp[2]) >> 14);
+		}
+		else {
+			if (model < 0x80000218) {
+				rp[0] -= 512;
+			}
+			pix[0] = rp[0] + rp[2];
+			pix[2] = rp[0] + rp[1];
+			pix[1] = rp[0] + ((-778 * rp[1] - (rp[2] * 2048)) >> 12);
+		}
+		for (int c = 0; c < 3; c++) {
+			out[i * 3 + c] = pix[c] < 0 ? 0 : pix[c] > 65535 ? 65535 : pix[c];
+		}
+	}
+	return out;
+}
+
+int test_interpolate()
+{
+	const struct {
+		uint32_t model;
+		const char *firmware;
+	} cameras[] = {
+		{ 0x80000176, "Firmware Version 1.1.0" },  // 450D
+		{ 0x80000236, "Firmware Version 1.0.0" },  // 1000D
+		{ 0x80000218, "Firmware Version 1.0.6" },  // 5D Mark II
+		{ 0x80000218, "Firmware Version 1.0.7" },
+		{ 0x80000250, "Firmware Version 1.0.0" },  // 7D
+		{ 0x80000281, "Firmware Version 1.0.0" },  // 1D Mark IV
+	};
+	for (uint32_t v = 1; v <= 2; v++) {
+		RawData frame;
+		make_frame(v, frame);
+		const uint32_t w = MCUS * 2;
+		const uint32_t h = MCU_ROWS * v;
+		for (const auto & camera : cameras) {
+			SRawInterpolator interpolator(camera.model, camera.firmware, 2, v);
+			std::vector<uint16_t> expected = reference(frame, v, camera.model,
+													   camera.firmware);
+			RawData rgb;
+			BOOST_CHECK(interpolator.interpolate(frame, 0, 0, 0, 0, rgb));
+			BOOST_CHECK(rgb.samplesPerPixel() == 3);
+			BOOST_CHECK(rgb.size() == expected.size() * 2);
+			BOOST_CHECK(memcmp(rgb.data(), expected.data(),
+							   expected.size() * 2) == 0);
+
+			// a region, starting on an odd column and row.
+			const uint32_t x = 5, y = 3, width = 41, height = 9;
+			RawData region;
+			BOOST_CHECK(interpolator.interpolate(frame, x, y, width, height,
+												 region));
+			const uint16_t *p = static_cast<const uint16_t *>(region.data());
+			bool same = true;
+			for (uint32_t row = 0; row < height; row++) {
+				same = same && memcmp(p + row * width * 3,
+									  &expected[((y + row) * w + x) * 3],
+									  width * 6) == 0;
+			}
+			BOOST_CHECK(same);
+
+			RawData bad;
+			BOOST_CHECK(!interpolator.interpolate(frame, w - 2, 0, 3, 1, bad));
+			BOOST_CHECK(!interpolator.interpolate(frame, 0, h, 1, 1, bad));
+		}
+	}
+
+	// only 2 horizontally is supported.
+	RawData frame;
+	make_frame(1, frame);
+	SRawInterpolator interpolator(0x80000250, "", 1, 1);
+	RawData rgb;
+	BOOST_CHECK(!interpolator.interpolate(frame, 0, 0, 0, 0, rgb));
+	return 0;
+}
+
+// The RGB is rendered as is, but only when it is RGB.
+int test_render()
+{
+	RawData frame;
+	make_frame(1, frame);
+	SRawInterpolator interpolator(0x80000250, "", 2, 1);
+	RawData rgb;
+	BOOST_CHECK(interpolator.interpolate(frame, 0, 0, 0, 0, rgb));
+	BitmapData bitmap;
+	BOOST_CHECK(rgb.getRenderedImage(bitmap, 0) == OR_ERROR_NONE);
+	BOOST_CHECK(bitmap.dataType() == OR_DATA_TYPE_PIXMAP_16RGB);
+	BOOST_CHECK(bitmap.size() == rgb.size());
+	BOOST_CHECK(memcmp(bitmap.data(), rgb.data(), rgb.size()) == 0);
+
+	// a larger grayscale buffer is still grayscale.
+	const uint32_t w = 4;
+	const uint32_t h = 2;
+	RawData gray;
+	uint16_t *p = (uint16_t*)gray.allocData(w * h * 3 * 2);
+	for (uint32_t i = 0; i < w * h * 3; i++) {
+		p[i] = i;
+	}
+	gray.setDimensions(w, h);
+	gray.setDataType(OR_DATA_TYPE_RAW);
+	gray.setPhotometricInterpretation(EV_PI_LINEAR_RAW);
+	BOOST_CHECK(gray.getRenderedImage(bitmap, 0) == OR_ERROR_NONE);
+	const uint16_t *out = static_cast<const uint16_t *>(bitmap.data());
+	bool same = true;
+	for (uint32_t i = 0; i < w * h * 3; i++) {
+		same = same && out[i] == i / 3;
+	}
+	BOOST_CHECK(same);
+	return 0;
+}
+
+int test_main(int, char *[])
+{
+	test_interpolate();
+	test_render();
+	return 0;
+}
@@ -19,10 +19,15 @@
  */
 
 
+#include <algorithm>
+#include <vector>
+
 #include <boost/test/minimal.hpp>
 
 #include "unpack.hpp"
 #include "ifd.hpp"
+#include "rawcontainer.hpp"
+#include "io/memstream.hpp"
 
 
 int test_unpack()
@@ -74,9 +79,228 @@ int test_unpack2()
 	return 0;
 }
 
+// Compare against a plain loop, for rows of many sizes so that
+// the SIMD kernels and the scalar tail are all run.
+int test_unpack_rows()
+{
+	std::vector<uint8_t> packed(16 * 64);
+	for (size_t i = 0; i < packed.size(); i++) {
+		packed[i] = (i * 167 + 13) ^ (i >> 3);
+	}
+
+	for (int nikon = 0; nikon < 2; nikon++) {
+		const size_t block = nikon ? 16 : 3;
+		for (size_t size = 0; size <= packed.size(); size += block) {
+			OpenRaw::Internals::Unpack
+				unpack(32, nikon ? OpenRaw::Internals::IFD::COMPRESS_NIKON_PACK
+					   : OpenRaw::Internals::IFD::COMPRESS_NONE);
+			std::vector<uint16_t> expected;
+			for (size_t i = 0; i + 3 <= size; i += 3) {
+				if (nikon && i % 16 == 15) {
+					i -= 2;
+					continue;
+				}
+				expected.push_back((packed[i] << 4) | (packed[i + 1] >> 4));
+				expected.push_back(((packed[i + 1] & 0xf) << 8) | packed[i + 2]);
+			}
+			std::vector<uint16_t> unpacked(expected.size() + 1, 0xffff);
+			size_t s;
+			or_error err = unpack.unpack_be12to16((uint8_t*)unpacked.data(),
+												  expected.size() * 2,
+												  packed.data(), size, s);
+			BOOST_CHECK(err == OR_ERROR_NONE);
+			BOOST_CHECK(s == expected.size() * 2);
+			BOOST_CHECK(std::equal(expected.begin(), expected.end(),
+								   unpacked.begin()));
+			BOOST_CHECK(unpacked.back() == 0xffff);
+		}
+	}
+	return 0;
+}
+
+// The sample i of a row, reading the bits one at a time.
+static uint16_t packed_sample(const uint8_t *row, size_t i, unsigned bits,
+							  bool big_endian)
+{
+	uint16_t v = 0;
+	for (unsigned b = 0; b < bits; b++) {
+		size_t bit = i * bits + b;
+		if (big_endian) {
+			v = (v << 1) | ((row[bit / 8] >> (7 - bit % 8)) & 1);
+		}
+		else {
+			v |= ((row[bit / 8] >> (bit % 8)) & 1) << b;
+		}
+	}
+	return v;
+}
+
+int test_unpack_packed()
+{
+	const size_t rows = 3;
+	for (unsigned bits = 8; bits <= 14; bits += 2) {
+		for (int big_endian = 0; big_endian < 2; big_endian++) {
+			for (size_t padding = 0; padding < 8; padding += 5) {
+				for (uint32_t w = 1; w < 200; w += (w < 40 ? 1 : 37)) {
+					if (bits == 12 && big_endian && !padding && (w & 1)) {
+						// the row size is rounded down.
+						continue;
+					}
+					size_t row_bytes = (w * bits + 7) / 8;
+					size_t row_size = padding ? row_bytes + padding : 0;
+					size_t stride = row_bytes + padding;
+					std::vector<uint8_t> packed(stride * rows);
+					for (size_t i = 0; i < packed.size(); i++) {
+						packed[i] = (i * 167 + bits) ^ (i >> 3);
+					}
+
+					OpenRaw::Internals::Unpack
+						unpack(w, OpenRaw::Internals::IFD::COMPRESS_NONE,
+							   bits, big_endian, row_size);
+					BOOST_CHECK(unpack.block_size() == stride);
+					std::vector<uint16_t> unpacked(w * rows + 1, 0xffff);
+					size_t s;
+					or_error err = unpack.unpack((uint8_t*)unpacked.data(),
+												 w * rows * 2, packed.data(),
+												 packed.size(), s);
+					BOOST_CHECK(err == OR_ERROR_NONE);
+					BOOST_CHECK(s == w * rows * 2);
+					bool same = true;
+					for (size_t y = 0; y < rows; y++) {
+						for (size_t x = 0; x < w; x++) {
+							same = same && unpacked[y * w + x]
+								== packed_sample(&packed[y * stride], x, bits,
+												 big_endian);
+						}
+					}
+					BOOST_CHECK(same);
+					BOOST_CHECK(unpacked.back() == 0xffff);
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+int test_unpack_strip()
+{
+	struct {
+		uint32_t w;
+		uint32_t type;
+		uint16_t bits;
+		bool big_endian;
+		size_t row_size;
+	} cases[] = {
+		{ 40, OpenRaw::Internals::IFD::COMPRESS_NIKON_PACK, 12, true, 0 },
+		{ 30, OpenRaw::Internals::IFD::COMPRESS_NONE, 12, true, 0 },
+		{ 37, OpenRaw::Internals::IFD::COMPRESS_NONE, 14, false, 70 },
+	};
+	const size_t rows = 61;
+	for (const auto & c : cases) {
+		OpenRaw::Internals::Unpack unpack(c.w, c.type, c.bits, c.big_endian,
+										  c.row_size);
+		std::vector<uint8_t> packed(unpack.block_size() * rows);
+		for (size_t i = 0; i < packed.size(); i++) {
+			packed[i] = (i * 131) ^ (i >> 5);
+		}
+		std::vector<uint16_t> expected(c.w * rows);
+		std::vector<uint16_t> unpacked(c.w * rows);
+		size_t s;
+		or_error err = unpack.unpack((uint8_t*)expected.data(),
+									 expected.size() * 2, packed.data(),
+									 packed.size(), s);
+		BOOST_CHECK(err == OR_ERROR_NONE);
+
+		// the strip starts after a header.
+		std::vector<uint8_t> file(packed.size() + 100);
+		std::copy(packed.begin(), packed.end(), file.begin() + 100);
+		auto stream = OpenRaw::IO::Stream::Ptr(
+			new OpenRaw::IO::MemStream(file.data(), file.size()));
+		stream->open();
+		OpenRaw::Internals::RawContainer container(stream, 0);
+		size_t fetched;
+		err = unpack.unpack_strip(&container, 100, packed.size(),
+								  (uint8_t*)unpacked.data(),
+								  unpacked.size() * 2, fetched);
+		BOOST_CHECK(err == OR_ERROR_NONE);
+		BOOST_CHECK(fetched == packed.size());
+		BOOST_CHECK(unpacked == expected);
+	}
+	return 0;
+}
+
+int test_copy_swap16()
+{
+	for (size_t size = 0; size < 200; size += (size < 70 ? 1 : 29)) {
+		std::vector<uint8_t> src(size);
+		for (size_t i = 0; i < size; i++) {
+			src[i] = i * 7 + 1;
+		}
+		std::vector<uint8_t> expected(src);
+		for (size_t i = 0; i + 1 < size; i += 2) {
+			std::swap(expected[i], expected[i + 1]);
+		}
+		std::vector<uint8_t> dest(size);
+		OpenRaw::Internals::copy_swap16(dest.data(), src.data(), size);
+		BOOST_CHECK(dest == expected);
+		// in place
+		OpenRaw::Internals::copy_swap16(src.data(), src.data(), size);
+		BOOST_CHECK(src == expected);
+	}
+	return 0;
+}
+
+int test_copy_swap32()
+{
+	for (size_t size = 0; size < 200; size += (size < 70 ? 1 : 29)) {
+		std::vector<uint8_t> src(size);
+		for (size_t i = 0; i < size; i++) {
+			src[i] = i * 7 + 1;
+		}
+		std::vector<uint8_t> expected(src);
+		for (size_t i = 0; i + 3 < size; i += 4) {
+			std::reverse(expected.begin() + i, expected.begin() + i + 4);
+		}
+		std::vector<uint8_t> dest(size);
+		OpenRaw::Internals::copy_swap32(dest.data(), src.data(), size);
+		BOOST_CHECK(dest == expected);
+		// in place
+		OpenRaw::Internals::copy_swap32(src.data(), src.data(), size);
+		BOOST_CHECK(src == expected);
+	}
+	return 0;
+}
+
+int test_merge_lowbits2()
+{
+	for (size_t size = 0; size < 200; size += (size < 70 ? 1 : 29)) {
+		std::vector<uint8_t> src(size);
+		std::vector<uint16_t> dest(size * 4);
+		for (size_t i = 0; i < size; i++) {
+			src[i] = i * 37 + 5;
+		}
+		for (size_t i = 0; i < dest.size(); i++) {
+			dest[i] = i * 13 + 0x3ff;
+		}
+		std::vector<uint16_t> expected(dest);
+		for (size_t i = 0; i < expected.size(); i++) {
+			expected[i] = (expected[i] << 2) | ((src[i / 4] >> (i % 4 * 2)) & 3);
+		}
+		OpenRaw::Internals::merge_lowbits2(dest.data(), src.data(), size);
+		BOOST_CHECK(dest == expected);
+	}
+	return 0;
+}
+
 int test_main( int /*argc*/, char * /*argv*/[] ) 
 {
 	test_unpack();
 	test_unpack2();
+	test_unpack_rows();
+	test_unpack_packed();
+	test_unpack_strip();
+	test_copy_swap16();
+	test_copy_swap32();
+	test_merge_lowbits2();
 	return 0;
 }